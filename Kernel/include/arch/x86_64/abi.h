@@ -44,4 +44,11 @@ constexpr uint8_t SYSCALL_SET_FSTAT_FLAGS   = 25;
 constexpr uint8_t SYSCALL_PIPE              = 26;
 constexpr uint8_t SYSCALL_FSTAT             = 27;
 constexpr uint8_t SYSCALL_STAT              = 28;
-constexpr uint8_t NUM_SYSCALLS              = 29;
\ No newline at end of file
+constexpr uint8_t SYSCALL_MADVISE           = 29;
+constexpr uint8_t SYSCALL_FADVISE           = 30;
+constexpr uint8_t SYSCALL_READAHEAD         = 31;
+constexpr uint8_t SYSCALL_FSYNC             = 32;
+constexpr uint8_t SYSCALL_SYNC              = 33;
+constexpr uint8_t SYSCALL_GETDENTS          = 34;
+constexpr uint8_t SYSCALL_UNLINK            = 35;
+constexpr uint8_t NUM_SYSCALLS              = 36;
\ No newline at end of file
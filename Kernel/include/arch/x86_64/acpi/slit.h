@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <acpi/common.h>
+
+// The System Locality Information Table holds the relative distance between every pair
+// of proximity domains.  Entry [i * locality_count + j] is the distance from i to j, 10
+// means local and 255 means unreachable.
+// ACPI 6.4 5.2.17
+typedef struct {
+    acpi_desc_header_t h;
+    uint64_t locality_count;
+    uint8_t entries[0];
+} __attribute__((packed)) slit_t;
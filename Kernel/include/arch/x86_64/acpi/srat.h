@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <acpi/common.h>
+
+namespace srat {
+    // Static Resource Affinity Structure Types (ACPI 6.4 5.2.16)
+    constexpr uint8_t TYPE_PROCESSOR_LOCAL_APIC_AFFINITY    = 0x0;
+    constexpr uint8_t TYPE_MEMORY_AFFINITY                  = 0x1;
+    constexpr uint8_t TYPE_PROCESSOR_LOCAL_X2APIC_AFFINITY  = 0x2;
+    constexpr uint8_t TYPE_GICC_AFFINITY                    = 0x3;
+    constexpr uint8_t TYPE_GIC_ITS_AFFINITY                 = 0x4;
+    constexpr uint8_t TYPE_GENERIC_INITIATOR_AFFINITY       = 0x5;
+
+    constexpr uint32_t FLAG_ENABLED                         = 1 << 0;
+    constexpr uint32_t MEMORY_FLAG_HOT_PLUGGABLE            = 1 << 1;
+    constexpr uint32_t MEMORY_FLAG_NON_VOLATILE             = 1 << 2;
+}
+
+// The header for each entry in the SRAT, same layout as the MADT ones
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} srat_entry_t;
+
+// Associates a processor (by local APIC ID) with a proximity domain
+// ACPI 6.4 5.2.16.1
+typedef struct {
+    srat_entry_t h;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t local_sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) srat_local_apic_affinity_t;
+
+// Associates a range of physical memory with a proximity domain
+// ACPI 6.4 5.2.16.2
+typedef struct {
+    srat_entry_t h;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) srat_memory_affinity_t;
+
+// Same as the local APIC one but for processors with an x2APIC ID
+// ACPI 6.4 5.2.16.3
+typedef struct {
+    srat_entry_t h;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) srat_local_x2apic_affinity_t;
+
+// The System Resource Affinity Table describes which proximity domain (NUMA node)
+// each processor and range of memory belongs to
+// ACPI 6.4 5.2.16
+typedef struct {
+    acpi_desc_header_t h;
+    uint32_t reserved1;     // Always 1
+    uint64_t reserved2;
+    uint8_t entries[0];
+} __attribute__((packed)) srat_t;
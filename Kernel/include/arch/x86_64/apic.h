@@ -30,6 +30,7 @@ namespace apic {
     namespace io {
         void set_base(uintptr_t new_base);
         void map_legacy_irq(uint8_t irq);
+        void map_pci_irq(uint8_t gsi, uint8_t vector);
     }
 
     int initialize();
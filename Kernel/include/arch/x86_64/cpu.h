@@ -6,6 +6,7 @@
 #include <idt.h>
 #include <spinlock.h>
 #include <thread.h>
+#include <topology.h>
 
 #include <frg/list.hpp>
 
@@ -22,6 +23,7 @@ using run_queue_t = frg::intrusive_list<threading::thread, frg::locate_member<th
 struct cpu {
     cpu* self;
     uint64_t id;
+    topology::cpu_topology_t topology;
 
     void* gdt;
     gdt_t gdt_ptr;
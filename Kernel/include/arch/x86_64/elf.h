@@ -13,6 +13,10 @@ typedef int64_t  Elf64_Sxword;
 
 typedef struct proc process_t;
 
+namespace fs {
+    class fs_node;
+}
+
 typedef struct {
     uint64_t entry;
     uint64_t phdr_segment;
@@ -74,7 +78,10 @@ namespace elf {
     constexpr uint8_t ELFCLASS64    = 2;
 
     bool verify(void* elf);
-    elf_info_t load_elf_segments(process_t* proc, void* elf, uintptr_t base);
+    bool verify(fs::fs_node* elf);
+
+    // Maps the PT_LOAD segments of elf into proc, nothing is read until it is touched
+    elf_info_t load_elf_segments(process_t* proc, fs::fs_node* elf, uintptr_t base);
 }
 
 // ELF File Header - ELF-64 Object File Format 1.5d2 p. 3
@@ -12,6 +12,7 @@ namespace hal {
     
     bool is_debug_mode();
     bool smp_disabled();
+    bool ksm_enabled();
     const boot_module_t* get_boot_modules();
 
     void init_stivale2(stivale2_info_header_t* st2_info);
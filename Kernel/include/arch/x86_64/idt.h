@@ -18,6 +18,7 @@ constexpr uint8_t IRQ0              = 32;
 
 constexpr uint8_t IPI_HALT          = 0xFE;
 constexpr uint8_t IPI_SCHEDULE      = 0xFD;
+constexpr uint8_t IPI_TLB_SHOOTDOWN = 0xFC;
 
 typedef struct idt_descriptor {
     uint16_t base_low;  ///< The interrupt handler's address (bits 0 - 15)
@@ -45,6 +46,9 @@ namespace idt {
 
     void register_interrupt_handler(uint8_t interrupt, isr_t handler, void* data = nullptr);
 
+    // Hands out a vector for a device interrupt (MSI or I/O APIC), or 0 once they run out
+    uint8_t allocate_interrupt_vector();
+
     void disable_pic();
 
     int get_err_code();
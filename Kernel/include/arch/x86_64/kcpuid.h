@@ -5,6 +5,11 @@
 
 extern "C" void _cpuid(uint64_t* a, uint64_t* b, uint64_t* c, uint64_t* d);
 
+// Same as _cpuid, but with a subleaf in ECX for the leaves that have them (4, 0xB, ...)
+static inline void cpuid_count(uint32_t leaf, uint32_t subleaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf));
+}
+
 class CPUIDFeatures {
 public:
     CPUIDFeatures();
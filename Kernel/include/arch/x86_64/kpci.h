@@ -27,12 +27,13 @@ typedef struct
     uint16_t subsystem_id;
     uint32_t expansion_rom_base;
     uint8_t capabilities_ptr;
-    uint64_t reserved;
+    uint8_t reserved[7];
     uint8_t interrupt_line;
     uint8_t interrupt_pin;
     uint8_t min_grant;
     uint8_t max_latency;
 } __attribute__((packed)) pci_device_t;
+static_assert(sizeof(pci_device_t) == 0x40);
 
 
 typedef struct {
@@ -63,7 +64,19 @@ typedef struct {
 } __attribute__((packed)) pci_to_pci_bridge_t;
 
 namespace pci {
+    constexpr uint16_t COMMAND_INTERRUPT_DISABLE    = 1 << 10;
+    constexpr uint16_t STATUS_CAPABILITIES_LIST     = 1 << 4;
+
+    constexpr uint8_t CAPABILITY_MSI                = 0x05;
+
     void initialize();
 
     const pci_header_t* get_generic_device(uint16_t class_code, uint16_t subclass, int index);
+
+    // Returns the config space offset of the capability, or 0 if the device doesn't have it
+    uint8_t find_capability(const pci_device_t* device, uint8_t id);
+
+    // Points the device's MSI at vector on the given local APIC and turns off its INTx
+    // line.  Returns false if the device can't do MSI.
+    bool enable_msi(const pci_device_t* device, uint8_t vector, uint8_t apic_id);
 }
\ No newline at end of file
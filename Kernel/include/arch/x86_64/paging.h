@@ -34,6 +34,7 @@ namespace memory {
     constexpr uint8_t  PAGE_USER            = 1 << 2;
     constexpr uint8_t  PAGE_WRITETHROUGH    = 1 << 3;
     constexpr uint8_t  PAGE_CACHE_DISABLED  = 1 << 4;
+    constexpr uint8_t  PAGE_ACCESSED        = 1 << 5;
     constexpr uint64_t PAGE_FRAME           = 0xFFFFFFFFFF000;
     constexpr uint16_t PAGE_PAT             = 1 << 7;
     constexpr uint8_t  PAGE_PAT_WRITE_COMB  = PAGE_PAT | PAGE_CACHE_DISABLED | PAGE_WRITETHROUGH;
@@ -91,6 +92,8 @@ namespace memory {
     bool check_kernel_pointer(uintptr_t addr, uint64_t len);
     bool check_usermode_pointer(uintptr_t addr, uint64_t len, mm::address_space* addr_space);
 
+    // Only address space, mapping it is up to the caller.  Whatever is freed has to be a
+    // whole allocation, with the same address and amount it was allocated with.
     void* kernel_allocate_4k_pages(uint64_t amount);
     void kernel_free_4k_pages(void* addr, uint64_t amount);
 
@@ -102,6 +105,17 @@ namespace memory {
 
     uintptr_t get_io_mapping(uintptr_t addr);
 
+    // Flush the TLB on every CPU, for when a mapping loses permissions that other
+    // CPUs might still have cached
+    void tlb_shootdown();
+
+    // Answer a shootdown another CPU is waiting on.  Anything that spins with interrupts
+    // off while a shootdown could be in progress should call this in its loop.
+    void tlb_shootdown_poll();
+
+    // The page table entry for virt, or nullptr if there is no page table for it yet
+    page_t* get_page_entry(uint64_t virt, page_map_t* map);
+
     inline void set_page_frame(uint64_t* page, uint64_t addr) {
         *page = (*page & ~PAGE_FRAME) | (addr & PAGE_FRAME);
     }
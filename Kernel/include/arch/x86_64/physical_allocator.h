@@ -10,6 +10,10 @@ namespace memory {
     constexpr uint8_t  PHYS_BLOCK_SHIFT         = 12;
     constexpr uint8_t  PHYS_BLOCKS_PER_BYTE     = 8;
     constexpr uint32_t PHYS_BITMAP_SIZE_DWORDS  = 524488; // 64 GB
+    constexpr uint32_t ZERO_POOL_SIZE           = 256;    // 1 MB of pre-zeroed blocks
+    constexpr uint32_t LOW_WATERMARK_MIN        = 256;    // Never less than 1 MB, otherwise 1/64 of RAM
+    constexpr uint32_t PAGEBLOCK_BLOCKS         = 512;    // 2 MB, the unit compaction works in
+    constexpr uint32_t MAX_NODE_RANGES          = 32;
 
     void initialize_physical_allocator();
 
@@ -17,9 +21,44 @@ namespace memory {
     uint64_t get_used_blocks();
     void reset_used_blocks();
 
+    uint64_t get_total_blocks();
+    uint64_t get_free_blocks();
+    uint64_t get_max_blocks();
+
+    // Below this many free blocks the allocator starts asking caches to give memory back,
+    // and caches should stop growing
+    uint64_t get_low_watermark();
+    inline bool memory_low() { return get_free_blocks() < get_low_watermark(); }
+
     void mark_memory_region_free(uint64_t base, size_t size);
 
+    // The SRAT says which NUMA node each range of memory is on.  After enable_numa() blocks come
+    // from the allocating CPU's node first, and then from the nearest node that has any left.
+    void add_node_memory(unsigned node, uint64_t base, uint64_t length);
+    void enable_numa();
+    uint64_t get_node_free_blocks(unsigned node);
+
     uint64_t allocate_physical_block();
 
     void free_physical_block(uint64_t addr);
+
+    // count blocks in a row, starting on a multiple of align blocks.  If there is no such run free
+    // then a pageblock gets compacted for it (so up to PAGEBLOCK_BLOCKS only, with an alignment that
+    // divides it).  Unlike the single block version this returns 0 when it fails instead of panicking.
+    uint64_t allocate_physical_blocks(size_t count, size_t align = 1);
+    void free_physical_blocks(uint64_t addr, size_t count);
+
+    // For compaction: takes the block out of circulation if it is free, returns false if it isn't
+    bool claim_physical_block(uint64_t index);
+
+    // How many of the blocks in [first, first + count) are in use, first and count are multiples of 32
+    uint32_t count_used_blocks(uint64_t first, size_t count);
+
+    // Takes an already zeroed block from the pool, or returns 0 if the pool is empty
+    uint64_t allocate_zeroed_block();
+
+    // Zeroes one more block for the pool using the scratch page mapping, returns false
+    // once the pool is full or memory is low.  Meant to be called when a CPU has nothing
+    // better to do.
+    bool refill_zero_pool(void* mapping);
 }
\ No newline at end of file
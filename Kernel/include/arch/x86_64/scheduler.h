@@ -31,6 +31,7 @@ typedef struct proc {
 
     timeval creation_time;
     uint64_t active_ticks {0};
+    unsigned pins {0};  // Taken by next_process, gc leaves the process alone until they're all back
 
     ~proc() {
         for(auto fd : _file_descriptors) {
@@ -134,7 +135,17 @@ namespace scheduler {
 
     void gc();
 
-    process_t* create_elf_process(void* elf, int argc = 0, char** argv = nullptr, 
+    // The live process with the lowest pid that is >= pid, or nullptr if none.  It and its
+    // address space stay around until release_process, even if it exits in the meantime.
+    // Anything that can run inside an allocation passes wait = false, and gets nullptr if
+    // the list is busy (whoever has it could be the one allocating).
+    process_t* next_process(pid_t pid, bool wait = true);
+    void release_process(process_t* proc);
+
+    // A kernel process with a single thread starting at entry, which can never return
+    process_t* create_process(void* entry, bool no_queue = false);
+
+    process_t* create_elf_process(fs::fs_node* elf, int argc = 0, char** argv = nullptr, 
         int envc = 0, char** envp = nullptr, const char* exec_path = nullptr);
 
     inline static process_t* get_current_process() {
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Where each CPU sits (NUMA node, package, core, SMT thread, last level cache) and how far
+// apart the nodes are.  Nodes come from the ACPI SRAT and SLIT, everything else from CPUID.
+// Without an SRAT there is just node 0.
+namespace topology {
+    constexpr unsigned MAX_NODES = 8;
+    constexpr uint8_t LOCAL_DISTANCE = 10;
+    constexpr uint8_t REMOTE_DISTANCE = 20;     // When there is no SLIT
+
+    typedef struct {
+        uint8_t node;
+        uint32_t package;
+        uint32_t core;      // Within the package
+        uint32_t thread;    // SMT thread within the core
+        uint32_t llc;       // CPUs with the same value share the last level cache
+    } cpu_topology_t;
+
+    // Called while reading the SRAT and SLIT.  Proximity domains are turned into node
+    // numbers in the order they are found, returns -1 once there are too many.
+    int node_for_domain(uint32_t domain);
+    void add_processor(uint32_t apic_id, uint32_t domain);
+    void set_distance(uint32_t from_domain, uint32_t to_domain, uint8_t distance);
+
+    // Reads the CPUID topology, after ACPI and before the other CPUs are started
+    void initialize();
+
+    cpu_topology_t get_cpu_topology(uint32_t apic_id);
+
+    unsigned node_count();
+    uint8_t distance(unsigned from, unsigned to);
+
+    // All the nodes, nearest to node first (starting with node itself)
+    const uint8_t* nodes_by_distance(unsigned node);
+}
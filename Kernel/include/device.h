@@ -4,6 +4,7 @@
 #include <kassert.h>
 #include <klist.hpp>
 #include <kguid.h>
+#include <storage/block_queue.h>
 
 namespace devices {
     enum device_type {
@@ -43,6 +44,7 @@ namespace devices {
 
     class disk_device : public device {
         friend class partition_device;
+        friend class storage::block_queue;
     public:
         disk_device();
         virtual ~disk_device();
@@ -50,16 +52,41 @@ namespace devices {
         int initialize_partitions();
         inline void add_partition(partition_device* partition) { _partitions.add(partition); }
 
-        virtual int read_disk_block(uint64_t lba, uint32_t count, void* buffer) = 0;
-        virtual int write_disk_block(uint64_t lba, uint32_t count, void* buffer) = 0;
+        // Go through the request queue and wait, return count or a negative error
+        int read_disk_block(uint64_t lba, uint32_t count, void* buffer);
+        int write_disk_block(uint64_t lba, uint32_t count, void* buffer);
+
+        // Queues the request and returns straight away.  Only worth it if the device is
+        // interrupt driven, otherwise nothing finishes until somebody waits synchronously.
+        inline void submit(storage::block_request* request) { _queue.submit(request); }
+        inline storage::block_queue& queue() { return _queue; }
+        inline bool interrupt_driven() const { return completes_by_interrupt(); }
+
+        // Waits until every finished write is on the medium
+        inline int flush() { return _queue.flush(); }
 
         ssize_t read(size_t, size_t, uint8_t*) override;
         ssize_t write(size_t, size_t, uint8_t*) override;
 
         inline unsigned block_size() const { return _block_size; }
     protected:
+        // Driver side.  start_request gets the first segment of a (maybe merged) request and
+        // returns straight away, then calls _queue.complete() when it finishes.  Returns -EAGAIN
+        // if it can't take another one yet, the queue tries again after the next completion.
+        virtual int start_request(storage::block_request* request) = 0;
+
+        // Checks for finished requests by hand, for when nobody can wait for the interrupt
+        virtual void poll_requests() {}
+        virtual bool completes_by_interrupt() const { return false; }
+
+        // Limits on one request, merged segments and all
+        virtual uint32_t max_request_sectors() const = 0;
+        virtual unsigned max_request_segments() const = 0;   // In pages
+
         static unsigned next_device_num;
 
+        storage::block_queue _queue {this};
+
         unsigned _next_partition_num {0};
         list<partition_device *> _partitions;
         unsigned _block_size {512};
@@ -76,9 +103,20 @@ namespace devices {
         virtual int read_block(uint64_t lba, uint32_t count, void* buffer);
         virtual int write_block(uint64_t lba, uint32_t count, void* buffer);
 
+        // Same as disk_device::submit, with lba relative to the partition.  It gets moved
+        // to where it is on the disk on the way through.
+        void submit(storage::block_request* request);
+        int execute(storage::block_request* requests, unsigned count);
+        inline int flush() { return _parent->flush(); }
+        inline void plug() { _parent->queue().plug(); }
+        inline void unplug() { _parent->queue().unplug(); }
+
         const disk_device* parent() const { return _parent; }
+        inline uint64_t block_count() const { return _end_lba - _start_lba + 1; } // GPT end LBAs are inclusive
         inline const guid_t& type() const { return _partition_type; }
     private:
+        bool in_range(uint64_t lba, uint32_t count) const;
+
         uint64_t _start_lba;
         uint64_t _end_lba;
         guid_t _partition_type {nullguid};
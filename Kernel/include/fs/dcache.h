@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <frg/list.hpp>
+
+namespace fs {
+    class fs_node;
+
+    // Remembers what each name in a directory turned out to be, including names that weren't
+    // there, so resolving a path doesn't go to the filesystem for every component.  Entries
+    // live in a fixed table, readers go through it without taking a lock and fall back to the
+    // filesystem if it changed under them.  Reclaim is CLOCK, like the page cache.
+    //
+    // Filesystems that add or remove names have to invalidate them once they have, and
+    // anything a directory's contents can change under without that (devfs, the root) has to
+    // invalidate the whole directory.  Entries for a node go with it when it's destroyed.
+    namespace dcache {
+        constexpr size_t MIN_ENTRIES = 1024;
+        constexpr size_t MAX_ENTRIES = 0x10000;
+        constexpr size_t RAM_SHARE = 512;           // Otherwise up to this share of RAM
+        constexpr uint8_t INLINE_NAME = 38;         // Longer names are never cached
+        constexpr uint32_t NO_ENTRY = ~0U;
+
+        struct dentry {
+            fs_node* parent;
+            fs_node* node;          // nullptr if the name doesn't exist
+            uint32_t hash;
+            uint32_t next;          // Next in the bucket, or in the free list
+            uint8_t name_len;       // 0 while unused
+            bool referenced;
+            char name[INLINE_NAME];
+            frg::default_list_hook<dentry> parent_hook;
+            frg::default_list_hook<dentry> node_hook;
+        };
+
+        using child_list_t = frg::intrusive_list<dentry, frg::locate_member<dentry, frg::default_list_hook<dentry>, &dentry::parent_hook>>;
+        using alias_list_t = frg::intrusive_list<dentry, frg::locate_member<dentry, frg::default_list_hook<dentry>, &dentry::node_hook>>;
+
+        typedef struct {
+            uint64_t hits;
+            uint64_t negative_hits;
+            uint64_t misses;
+            uint64_t entries;       // In use right now
+            uint64_t capacity;
+        } stats_t;
+
+        void initialize();
+
+        // Returns whether the name is cached, with node set to nullptr if it's known not to
+        // exist.  On a miss ticket has to be handed to insert along with whatever the
+        // filesystem said, so it can tell if that could already be out of date.
+        bool lookup(fs_node* parent, const char* name, size_t name_len, fs_node*& node, uint64_t& ticket);
+        void insert(fs_node* parent, const char* name, size_t name_len, fs_node* node, uint64_t ticket);
+
+        // The name was added or removed (or couldn't be looked up, so nothing that was just
+        // found out about it should be kept either)
+        void invalidate(fs_node* parent, const char* name);
+
+        // Everything cached under the directory
+        void invalidate_dir(fs_node* parent);
+
+        // The node is going away, as a directory and as what names point to
+        void forget(fs_node* node);
+
+        stats_t get_stats();
+    }
+}
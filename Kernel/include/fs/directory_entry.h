@@ -5,9 +5,41 @@
 #include <kstring.h>
 
 namespace fs {
+    // What getdents fills its buffer with, one after another (same layout as Linux's dirent64)
+    typedef struct {
+        ino_t d_ino;
+        off_t d_off;            // Cookie to carry on from after this entry
+        uint16_t d_reclen;
+        uint8_t d_type;
+        char d_name[];
+    } dirent_t;
+
+    // Collects entries for getdents.  Cookies are up to the filesystem, the only thing that
+    // matters is that handing one back carries on after the entry it came with.
+    class dir_buffer {
+    public:
+        dir_buffer(uint8_t* buffer, size_t size)
+            :_buffer(buffer)
+            ,_size(size)
+        {
+
+        }
+
+        // Returns false (and adds nothing) once there's no room left
+        bool add(const char* name, size_t name_len, ino_t inode, uint8_t type, off_t next);
+
+        size_t used() const { return _used; }
+        bool full() const { return _full; }
+    private:
+        uint8_t* _buffer;
+        size_t _size;
+        size_t _used {0};
+        bool _full {false};
+    };
+
     class directory_entry {
     public:
-        mode_t flags {0};
+        mode_t flags {0};       // Always a DT_ type, read_dir converts whatever the filesystem has
         fs_node* node {nullptr};
 
         directory_entry() {}
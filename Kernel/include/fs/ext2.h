@@ -5,6 +5,7 @@
 #include <fs/fs_node.h>
 #include <device.h>
 #include <lru_cache.hpp>
+#include <mm/shrinker.h>
 #include <frg/std_compat.hpp>
 
 typedef struct {
@@ -205,6 +206,9 @@ namespace fs {
         constexpr uint16_t SUPER_MAGIC          = 0xEF53;
         constexpr uint8_t  MAX_NAME_LEN         = 255;
         constexpr uint8_t  ROOT_DIR_INODE       = 2;
+        constexpr uint8_t  GOOD_OLD_FIRST_INODE = 11;
+        constexpr uint16_t I_BLOCKS_UNIT        = 512;  // i_blocks counts these, whatever the sector size
+        constexpr uint32_t INDEX_FL             = 0x1000;
 
         const uint16_t S_IFMT   = 0xF000;
 
@@ -220,17 +224,62 @@ namespace fs {
         constexpr uint8_t FT_FIFO       = 5;
         constexpr uint8_t FT_SOCK       = 6;
         constexpr uint8_t FT_SYMLINK    = 7;
+
+        // Hashed directory indexes (dir_index).  The root of the tree hides in the first
+        // block behind the .. entry, interior blocks look like one empty entry, and the leaves
+        // are normal directory blocks, so a directory can always be read as a list too.
+        constexpr uint8_t DX_HASH_LEGACY            = 0;
+        constexpr uint8_t DX_HASH_HALF_MD4          = 1;
+        constexpr uint8_t DX_HASH_TEA               = 2;
+        constexpr uint8_t DX_HASH_LEGACY_UNSIGNED   = 3;
+        constexpr uint8_t DX_HASH_HALF_MD4_UNSIGNED = 4;
+        constexpr uint8_t DX_HASH_TEA_UNSIGNED      = 5;
+        constexpr uint32_t DX_HASH_EOF              = 0x7FFFFFFF;
+        constexpr uint8_t DX_MAX_LEVELS             = 3;    // Root plus two levels (largedir), ext2 only uses one
+
+        // The hash the index is sorted by, with the low bit clear
+        uint32_t dir_hash(const char* name, uint32_t name_len, uint8_t version, const uint32_t seed[4]);
     }
 
     class ext2_volume;
 
+    // Runs of logical to physical blocks already looked up through the indirect blocks, so
+    // going through a file doesn't walk them again for every block.  Holes are kept too,
+    // as runs with physical block 0.
+    class ext2_block_map {
+    public:
+        static constexpr unsigned EXTENTS = 8;
+
+        bool find(uint32_t logical, uint32_t& physical);
+        void add(uint32_t logical, uint32_t physical, uint32_t count);
+
+        // Once blocks get allocated or freed
+        void forget(uint32_t logical);
+        void clear();
+    private:
+        typedef struct {
+            uint32_t logical;
+            uint32_t physical;
+            uint32_t count;
+        } extent_t;
+
+        extent_t _extents[EXTENTS] {};
+        unsigned _next {0};     // Replaced next, round robin
+        lock_t _lock {0};
+    };
+
     class ext2_node : public fs::fs_node {
+        friend class ext2_volume;
+
     public:
         ext2_node(ext2_volume* volume, ext2_inode_t& ino, ino_t inode);
 
         ssize_t read(size_t, size_t, uint8_t*) override;
         ssize_t write(size_t, size_t, uint8_t*) override;
+        int read_pages(mm::page_cache::page**, unsigned) override;
+        int write_pages(mm::page_cache::page**, unsigned) override;
         int read_dir(directory_entry*, uint32_t) override;
+        int read_entries(off_t&, dir_buffer&) override;
         fs_node* find_dir(const char*) override;
 
         int create(directory_entry*, uint32_t) override;
@@ -242,23 +291,39 @@ namespace fs {
         int truncate(off_t) override;
 
         void close() override;
-        void sync() override;
+        int sync() override;
+
+        // Metadata is cached by block, file contents by page
+        bool uses_page_cache() const override { return is_file(); }
 
         inline const ext2_inode_t& ext2_inode() const { return _ext2_inode; }
+        inline ext2_block_map& block_map() { return _block_map; }
     private:
         ext2_volume* _vol;
         size_t _link_count;
         ext2_inode_t _ext2_inode;
+        ext2_block_map _block_map;
         fs_lock _flock;
     };
 
-    class ext2_volume : public fs::fs_volume {
+    class ext2_volume : public fs::fs_volume, public mm::shrinker {
+        // The inode cache never goes below this, and otherwise gets a share of RAM.  Blocks
+        // go in the page cache.
+        static constexpr size_t INODE_CACHE_MIN = 1600;
+        static constexpr size_t INODE_CACHE_RAM_SHARE = 64;
+
+        // Blocks looked up at a time when reading a file, each one can be a separate command
+        static constexpr uint32_t READ_CHUNK_BLOCKS = 256;
+
     public:
         ext2_volume(devices::partition_device* partition, ext2_super_block_t* sb, const char* name);
 
         ssize_t read(ext2_node*, size_t, size_t, uint8_t*);
         ssize_t write(ext2_node*, size_t, size_t, uint8_t*);
+        int read_pages(ext2_node*, mm::page_cache::page**, unsigned);
+        int write_pages(ext2_node*, mm::page_cache::page**, unsigned);
         int read_dir(ext2_node*, directory_entry*, uint32_t);
+        int read_entries(ext2_node*, off_t&, dir_buffer&);
         fs_node* find_dir(ext2_node*, const char*);
 
         int create(ext2_node*, directory_entry*, uint32_t);
@@ -269,33 +334,77 @@ namespace fs {
         int unlink(ext2_node*, directory_entry*, bool = false);
         int truncate(ext2_node*, off_t);
 
-        void sync_node(ext2_node*);
+        int sync_node(ext2_node*);
         void clean_node(ext2_node*);
 
         int error() const override { return _error; }
+
+        size_t count_pages() override;
+        size_t shrink(size_t count) override;
     private:
-        using block_cache_t = kstd::lru_cache<ino_t, uint8_t*, frg::hash<ino_t>, frg::stl_allocator>;
         using inode_cache_t = kstd::lru_cache<ino_t, ext2_node*, frg::hash<ino_t>, frg::stl_allocator>;
 
         int read_inode(ino_t num, ext2_inode_t& inode);
         int read_block(uint32_t block, void* buffer, bool cache = false);
+
+        // Metadata blocks are read straight out of the page cache.  Returns the block, which
+        // stays put until page is unpinned, or nullptr on error.  Anything changed in it has
+        // to be passed to dirty before unpinning.
+        uint8_t* pin_block(uint32_t block, mm::page_cache::page*& page);
+        void dirty(mm::page_cache::page* page, const void* at, size_t size);
+
+        // Metadata that isn't a whole block (superblock and group descriptors) goes through this
+        int write_metadata(uint64_t offset, const void* data, size_t size);
+        int write_superblock();
+        int write_group(uint32_t group);
+
+        // Bitmaps are searched from the goal on, and counts kept up to date in the group
+        // descriptors and the superblock
+        int64_t allocate_block(uint32_t goal);
+        void free_block(uint32_t block);
+        int64_t allocate_inode(uint32_t group, bool directory);
+        void free_inode(uint32_t inode, bool directory);
+        int zero_block(uint32_t block);
         
-        int64_t find_data_blocks(const ext2_inode_t& inode, uint32_t start, uint32_t end, uint32_t* block_list);
-        int64_t find_data_block(const ext2_inode_t& inode, uint32_t index);
-        void sync_inode(const ext2_inode_t& ext2_inode, uint32_t inode);
+        int64_t find_data_blocks(ext2_node* node, uint32_t start, uint32_t end, uint32_t* block_list);
+        int64_t find_data_block(ext2_node* node, uint32_t index);
+
+        // Like find_data_block, but fills in a hole (and any indirect blocks above it) first
+        int64_t map_block(ext2_node* node, uint32_t index);
+        int free_data_blocks(ext2_node* node, uint32_t first);
+        int free_tree(uint32_t block, unsigned depth, uint64_t first, uint32_t& freed);
+
+        // The inode a name in the directory points to, 0 if it isn't there.  Goes through the
+        // hash index if there's a usable one, otherwise through every block.
+        int64_t find_entry(ext2_node* dir, const char* name, uint32_t name_len);
+        bool find_indexed(ext2_node* dir, const char* name, uint32_t name_len, int64_t& result);
+        int64_t find_in_block(ext2_node* dir, uint32_t index, const char* name, uint32_t name_len);
+
+        int add_dir_entry(ext2_node* dir, const char* name, uint32_t inode, uint8_t file_type);
+        int remove_dir_entry(ext2_node* dir, const char* name);
+        bool dir_empty(ext2_node* dir);
+        ext2_node* new_node(ext2_node* dir, uint16_t mode);
+        void release_node(ext2_node* node);
+
+        int sync_inode(const ext2_inode_t& ext2_inode, uint32_t inode);
         uint64_t inode_lba(uint32_t inode);
 
         devices::partition_device* _partition;
         bool _file_type {false};
         bool _sparse {false};
         bool _large_files {false};
+        bool _dir_index {false};
+        bool _unsigned_hash {false};
+        uint32_t _hash_seed[4] {};
         ext2_super_block_t* _sb;
         uint32_t _block_group_count;
         ext2_block_group_desc_t* _block_groups;
         uint32_t _block_size;
         uint32_t _inode_size;
-        block_cache_t _block_cache {50, LRU_CACHE_C_FREE};
-        inode_cache_t _inode_cache {1600, LRU_CACHE_CPP_DELETE};
+        uint32_t _first_inode;
+        lock_t _alloc_lock {0};
+        inode_cache_t _inode_cache {INODE_CACHE_MIN, LRU_CACHE_CPP_DELETE,
+            [](ext2_node* const& node) { return node->handle_count() == 0; }};
         int _error {0};
     };
 
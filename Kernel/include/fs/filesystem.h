@@ -3,6 +3,7 @@
 #include <klist.hpp>
 #include <lock.h>
 #include <types.h>
+#include <mm/page_cache.h>
 
 typedef int64_t ino_t;
 typedef uint64_t dev_t;
@@ -73,6 +74,14 @@ namespace fs {
     constexpr uint8_t POLLNVAL      = 0x40;
     constexpr uint8_t POLLWRNORM    = 0x80;
 
+    // posix_fadvise advice
+    constexpr int FADV_NORMAL       = 0;
+    constexpr int FADV_RANDOM       = 1;
+    constexpr int FADV_SEQUENTIAL   = 2;
+    constexpr int FADV_WILLNEED     = 3;
+    constexpr int FADV_DONTNEED     = 4;
+    constexpr int FADV_NOREUSE      = 5;
+
     class fs_node;
     class fs_volume;
 
@@ -80,6 +89,7 @@ namespace fs {
         fs_node* node;
         off_t pos;
         mode_t mode;
+        mm::page_cache::readahead_t readahead;
     } fs_fd_t;
 
     void initialize();
@@ -99,4 +109,15 @@ namespace fs {
     void close(fs_node* node);
     void close(fs_fd_t* fd);
     int ioctl(fs_fd_t* handle, uint64_t cmd, uint64_t arg);
+
+    // getdents: fills buffer with as many dirent_t as fit, from where the last call left off.
+    // Returns the bytes used, 0 at the end of the directory.
+    ssize_t read_entries(fs_fd_t* handle, uint8_t* buffer, size_t size);
+
+    // Writes back what's cached for the node (or everything) and flushes the disks after
+    int fsync(fs_node* node);
+    int sync();
+
+    // posix_fadvise, only means anything for files in the page cache
+    int advise(fs_fd_t* handle, off_t offset, off_t length, int advice);
 }
\ No newline at end of file
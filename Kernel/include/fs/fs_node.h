@@ -3,15 +3,22 @@
 #include <spinlock.h>
 #include <stddef.h>
 #include <fs/filesystem.h>
+#include <fs/dcache.h>
 
 #include <abi-bits/abi.h>
 #include <abi-bits/fcntl.h>
 #include <types.h>
+#include <abi-bits/errno.h>
 
 #include <type_traits>
 
+namespace mm {
+    class file_vm_object;
+}
+
 namespace fs {
     class directory_entry;
+    class dir_buffer;
     class fs_watcher;
     class fs_blocker;
 
@@ -25,7 +32,14 @@ namespace fs {
         uint32_t flags {0};
         fs_node* parent {nullptr};
 
-        virtual ~fs_node() {}
+        // Only touched by the dentry cache, under its lock
+        dcache::child_list_t child_dentries;   // Names looked up in this directory
+        dcache::alias_list_t dentries;         // Names that led to this node
+
+        // Only touched by mm::file_vm_object, under its registry lock
+        mm::file_vm_object* file_mappings {nullptr};
+
+        virtual ~fs_node();
 
         virtual ssize_t read(size_t off, size_t size, uint8_t* buf);
         virtual ssize_t write(size_t off, size_t size, uint8_t* buf);
@@ -33,6 +47,11 @@ namespace fs {
         virtual void close();
 
         virtual int read_dir(directory_entry*, uint32_t);
+
+        // Adds entries from the cookie in pos on until out is full or the directory ends,
+        // moving pos past each one added.  Returns 0 or an error.  By default the cookie is
+        // just the read_dir index.
+        virtual int read_entries(off_t& pos, dir_buffer& out);
         virtual fs_node* find_dir(const char* name);
 
         virtual int create(directory_entry* ent, uint32_t mode);
@@ -45,16 +64,36 @@ namespace fs {
         virtual int truncate(off_t length);
 
         virtual int ioctl(uint64_t cmd, uint64_t arg);
-        virtual void sync();
+        // Whatever has been written to the node is on the medium once this returns
+        virtual int sync();
 
         virtual bool can_read() const { return true; }
         virtual bool can_write() const { return true; }
 
+        // Whether fs::read should go through the page cache (only worth it for data that
+        // isn't already in memory, and only safe if inode is unique on the volume)
+        virtual bool uses_page_cache() const { return false; }
+
+        // Start reading whole pages into the cache without waiting, each one is handed back
+        // through page_cache::finish_read.  Returns 0 once it has all of them, or an error
+        // (and takes none) if it can't do that.
+        virtual int read_pages(mm::page_cache::page** pages, unsigned count) { return -ENOSYS; }
+
+        // Write dirty pages from the cache back to where they belong, sorted by index, and
+        // wait for it.  Returns 0 or an error.
+        virtual int write_pages(mm::page_cache::page** pages, unsigned count) { return -ENOSYS; }
+
+        // Lets a file mapping use the node's own frame for a page instead of a copy of it.  The
+        // frame stays put until the matching unmap_page.  -ENOSYS if the node can't do that.
+        virtual int map_page(uint64_t index, uintptr_t& phys) { return -ENOSYS; }
+        virtual void unmap_page(uint64_t index) {}
+
         virtual void watch(fs_watcher& watcher, int events);
         virtual void unwatch(fs_watcher& watcher);
 
         void add_handle() { _handle_count++; }
         void remove_handle() { _handle_count--; }
+        unsigned handle_count() const { return _handle_count; }
 
         inline void lock() { acquire_lock(&_blocked_lock); }
         inline bool try_lock() { return acquire_test_lock(&_blocked_lock); }
@@ -11,7 +11,7 @@ namespace fs {
     public:
         virtual ~fs_volume() = default;
 
-        inline void set_volume_id(volume_id_t id) { _volume_id = id; }
+        virtual void set_volume_id(volume_id_t id) { _volume_id = id; }
         inline volume_id_t get_volume_id() const { return _volume_id; }
 
         fs_node* mount_point() const { return _mount_point; }
@@ -24,7 +24,7 @@ namespace fs {
         void set_mount_point_entry(directory_entry&& de) { _mount_point_entry = std::move(de); }
     protected:
         volume_id_t _volume_id;
-        fs_node* _mount_point;
+        fs_node* _mount_point {nullptr};
         directory_entry _mount_point_entry;
     };
 
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <fs/filesystem.h>
 #include <fs/fs_volume.h>
+#include <lz4.h>
 
 // TAR v1.34
 // https://www.gnu.org/software/tar/manual/html_node/Standard.html
@@ -32,45 +33,93 @@ typedef struct tar_header tar_header_t;
 
 namespace fs::tar {
     constexpr uint16_t BYTES_PER_BLOCK = 512;
+    constexpr unsigned CACHED_FRAME_BLOCKS = 4;
 
     class tar_volume;
 
     class tar_node : public fs_node {
     public:
-        char name[256];
-        tar_header_t* header;
-        ino_t parent;
-        int entry_count;
-        ino_t* children;
         tar_volume* vol;
 
         ssize_t read(size_t off, size_t size, uint8_t* buf) override;
         ssize_t write(size_t off, size_t size, uint8_t* buf) override;
         void close() override;
 
+        bool uses_page_cache() const override;
+        int read_pages(mm::page_cache::page** pages, unsigned count) override;
+
         int read_dir(directory_entry* dirent, uint32_t index) override;
         fs_node* find_dir(const char* name) override;
     };
 
+    // The archive is scanned once when it's mounted.  Everything needed after that is kept
+    // per inode in one compact array, names are looked up through a hash table keyed by
+    // directory and name, and each directory's children are listed next to each other.
+    //
+    // The archive can also be an LZ4 frame, in which case it stays compressed and only the
+    // blocks something actually reads get decompressed.  File contents then go through the
+    // page cache so each block is only decompressed again once its pages are reclaimed.
     class tar_volume : public fs_volume {
     public:
         tar_volume(uintptr_t base, size_t size, const char* name);
 
+        void set_volume_id(volume_id_t id) override;
+        bool compressed() const { return _frame != nullptr; }
+
         ssize_t read(tar_node* node, size_t offset, size_t size, uint8_t* buffer);
         ssize_t write(tar_node* node, size_t offset, size_t size, uint8_t* buffer);
         void open(tar_node* node, uint32_t flags);
         void close(tar_node* node);
         int read_dir(tar_node* node, directory_entry*, uint32_t);
         fs_node* find_dir(tar_node* node, const char* name);
+        int read_pages(tar_node* node, mm::page_cache::page** pages, unsigned count);
 
     private:
-        int read_directory(int index, ino_t parent);
-        void make_node(tar_header_t* header, tar_node* n, ino_t inode, ino_t parent, tar_header_t* dir_header = nullptr);
+        typedef struct {
+            uint64_t data;          // Where the contents start in the archive
+            uint64_t size;
+            ino_t parent;
+            uint32_t name;          // Offset in _names
+            uint32_t hash;          // Of the name alone
+            uint32_t uid;
+            uint16_t flags;
+            uint8_t name_len;
+        } entry_t;
+
+        typedef struct {
+            uint8_t* data;
+            int64_t index;          // Of the frame block in it, -1 if none
+            uint64_t last_used;
+        } cached_block_t;
+
+        static constexpr uint32_t NO_NODE = ~0U;
+
+        static uint32_t hash_name(const char* name, size_t len);
+        uint32_t index_slot(ino_t parent, uint32_t hash) const;
+        ino_t lookup(ino_t parent, const char* name, size_t len, uint32_t hash) const;
+        ino_t add_entry(ino_t parent, const char* name, size_t len, uint32_t hash);
+        void add_to_index(ino_t inode);
+        void scan();
+        void list_children();
+        int read_archive(uint64_t offset, size_t size, void* buffer);
 
-        tar_header_t* _blocks {nullptr};
+        uintptr_t _base {0};
+        uint64_t _archive_size {0};     // Uncompressed
         uint64_t _block_count {0};
-        uint64_t _node_count {1};
-        ino_t _next_node {1};
+        lz4::frame_reader* _frame {nullptr};
+        cached_block_t _frame_cache[CACHED_FRAME_BLOCKS];
+        uint64_t _frame_clock {0};
+        lock_t _frame_lock {0};
+        entry_t* _entries {nullptr};
+        uint64_t _node_count {0};
+        uint64_t _entry_capacity {0};
+        char* _names {nullptr};
+        uint32_t _names_size {0};
+        uint32_t _names_capacity {0};
+        uint32_t* _index {nullptr};     // Inodes, open addressing
+        uint32_t _index_mask {0};
+        uint32_t* _children {nullptr};
+        uint32_t* _first_child {nullptr};    // Where each directory's are in _children, one past the last node for the end
         tar_node* _nodes {nullptr};
     };
 }
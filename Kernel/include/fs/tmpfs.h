@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include <fs/filesystem.h>
+#include <fs/fs_node.h>
+#include <fs/fs_volume.h>
+
+namespace fs::tmpfs {
+    // With no size given a volume can grow to this share of RAM, up to DEFAULT_MAX_SIZE.  Every
+    // page of every file stays mapped in the kernel heap, which only has 1 GiB of address space.
+    constexpr size_t DEFAULT_RAM_SHARE = 4;
+    constexpr size_t DEFAULT_MAX_SIZE = 256 * 1024 * 1024;
+
+    class tmpfs_volume;
+
+    class tmpfs_node : public fs_node {
+        friend class tmpfs_volume;
+
+    public:
+        tmpfs_node(tmpfs_volume* vol, ino_t inode, uint32_t flags);
+        ~tmpfs_node();
+
+        ssize_t read(size_t off, size_t size, uint8_t* buf) override;
+        ssize_t write(size_t off, size_t size, uint8_t* buf) override;
+        void close() override;
+
+        int read_dir(directory_entry* dirent, uint32_t index) override;
+        fs_node* find_dir(const char* name) override;
+
+        int create(directory_entry* ent, uint32_t mode) override;
+        int create_dir(directory_entry* ent, uint32_t mode) override;
+        int link(fs_node* node, directory_entry* ent) override;
+        int unlink(directory_entry* ent, bool unlink_directories = false) override;
+        int truncate(off_t length) override;
+
+        int map_page(uint64_t index, uintptr_t& phys) override;
+        void unmap_page(uint64_t index) override;
+
+    private:
+        typedef struct {
+            tmpfs_node* node;
+            char* name;
+            uint32_t hash;
+            uint8_t name_len;
+        } child_t;
+
+        tmpfs_volume* _vol;
+        fs_lock _flock;
+
+        // Files: one kernel mapping per page, nullptr for a hole that reads as zero
+        uint8_t** _pages {nullptr};
+        size_t _page_slots {0};
+        size_t _mapped_pages {0};   // Handed out by map_page, none can be freed while there are any
+
+        // Directories
+        child_t* _children {nullptr};
+        uint32_t _child_count {0};
+        uint32_t _child_capacity {0};
+    };
+
+    // Files that only ever live in memory, each page of data in a frame of its own that's
+    // handed back as soon as nothing can reach it any more.  Nothing is ever reclaimed from
+    // it otherwise, so the volume has a size limit instead.  Mapping a file maps those same
+    // frames, so writes show up in the mapping and nothing is copied.
+    class tmpfs_volume : public fs_volume {
+        friend class tmpfs_node;
+
+    public:
+        // A max_size of 0 picks one from the amount of RAM
+        tmpfs_volume(const char* name, size_t max_size = 0);
+
+        void set_volume_id(volume_id_t id) override;
+
+        size_t max_pages() const { return _max_pages; }
+        size_t used_pages() const { return __atomic_load_n(&_used_pages, __ATOMIC_RELAXED); }
+
+        ssize_t read(tmpfs_node* node, size_t off, size_t size, uint8_t* buf);
+        ssize_t write(tmpfs_node* node, size_t off, size_t size, uint8_t* buf);
+        int read_dir(tmpfs_node* node, directory_entry* dirent, uint32_t index);
+        fs_node* find_dir(tmpfs_node* node, const char* name);
+        int create(tmpfs_node* node, directory_entry* ent, uint32_t flags);
+        int link(tmpfs_node* node, fs_node* file, directory_entry* ent);
+        int unlink(tmpfs_node* node, directory_entry* ent, bool unlink_dirs);
+        int truncate(tmpfs_node* node, off_t length);
+        int map_page(tmpfs_node* node, uint64_t index, uintptr_t& phys);
+        void unmap_page(tmpfs_node* node, uint64_t index);
+
+        // The last name and handle are gone
+        void release_node(tmpfs_node* node);
+
+    private:
+        static uint32_t hash_name(const char* name, size_t len);
+        static int64_t find_child(tmpfs_node* dir, const char* name, size_t len, uint32_t hash);
+        static int add_child(tmpfs_node* dir, const char* name, size_t len, uint32_t hash, tmpfs_node* node);
+
+        static int grow_slots(tmpfs_node* node, size_t slots);
+        uint8_t* allocate_page();
+        void free_pages(tmpfs_node* node, size_t first);
+
+        tmpfs_node* _root;
+        ino_t _next_inode {1};
+        size_t _max_pages;
+        size_t _used_pages {0};
+    };
+}
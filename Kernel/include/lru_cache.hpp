@@ -3,6 +3,8 @@
 #include <frg/list.hpp>
 #include <frg/hash_map.hpp>
 #include <lock.h>
+#include <kmath.h>
+#include <physical_allocator.h>
 
 #define LRU_CACHE_CPP_DELETE [](auto& val) { delete val; }
 #define LRU_CACHE_C_FREE [](auto& val) { free(val); }
@@ -13,10 +15,12 @@ namespace kstd {
     class lru_cache {
     public:
         typedef void(*destructor_t)(Value& val);
+        typedef bool(*evictable_t)(const Value& val);
 
-        lru_cache(size_t capacity, destructor_t destructor = LRU_CACHE_NO_FREE) 
+        lru_cache(size_t capacity, destructor_t destructor = LRU_CACHE_NO_FREE, evictable_t evictable = nullptr) 
             :_capacity(capacity)
             ,_destructor(destructor)
+            ,_evictable(evictable)
         {
 
         }
@@ -43,14 +47,14 @@ namespace kstd {
                 return;
             }
 
-            while(_hash_map.size() >= _capacity) {
-                auto back = _list.pop_back();
-                _hash_map.remove(back->key);
-                if(_destructor) {
-                    _destructor(back->value);
-                }
+            size_t limit = _capacity;
+            if(memory::memory_low()) {
+                // Don't grow while memory is tight
+                limit = kstd::min(limit, kstd::max(_hash_map.size(), (size_t)1));
+            }
 
-                delete back;
+            if(_hash_map.size() >= limit) {
+                evict(_hash_map.size() - limit + 1);
             }
 
             auto new_item = new lru_cache_node {
@@ -62,7 +66,68 @@ namespace kstd {
             _hash_map.insert(key, val);
             _lock.release_write();
         }
+
+        // Throw out up to count entries from the back, returns how many actually went
+        size_t shrink(size_t count) {
+            if(!_lock.try_acquire_write()) {
+                // Whoever has it might be the one that is short on memory
+                return 0;
+            }
+
+            size_t evicted = evict(count);
+            _lock.release_write();
+            return evicted;
+        }
+
+        // Takes the entry out without destroying it, returns whether it was there
+        bool erase(const Key& key) {
+            _lock.acquire_write();
+            if(_hash_map.find(key) == _hash_map.end()) {
+                _lock.release_write();
+                return false;
+            }
+
+            _hash_map.remove(key);
+            for(auto it = _list.begin(); it != _list.end(); ++it) {
+                if((*it)->key == key) {
+                    auto item = *it;
+                    _list.erase(it);
+                    delete item;
+                    break;
+                }
+            }
+
+            _lock.release_write();
+            return true;
+        }
+
+        size_t size() { return _hash_map.size(); }
+        size_t capacity() const { return _capacity; }
+        void set_capacity(size_t capacity) { _capacity = capacity; }
     private:
+        size_t evict(size_t count) {
+            size_t evicted = 0;
+            size_t remaining = _hash_map.size(); // Look at everything once at most
+            while(evicted < count && remaining--) {
+                auto back = _list.pop_back();
+                if(_evictable && !_evictable(back->value)) {
+                    // Still in use, send it round again
+                    _list.push_front(back);
+                    continue;
+                }
+
+                _hash_map.remove(back->key);
+                if(_destructor) {
+                    _destructor(back->value);
+                }
+
+                delete back;
+                evicted++;
+            }
+
+            return evicted;
+        }
+
         struct lru_cache_node {
             Key key;
             Value value;
@@ -75,5 +140,6 @@ namespace kstd {
         kstd::read_write_lock _lock;
         size_t _capacity;
         destructor_t _destructor;
+        evictable_t _evictable;
     };
 }
\ No newline at end of file
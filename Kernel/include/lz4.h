@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <types.h>
+
+// LZ4 block format (no frame header), enough for compressing pages in memory, and a reader
+// for frames that are already sitting in memory
+namespace lz4 {
+    constexpr unsigned HASH_BITS = 12;
+    constexpr size_t MAX_INPUT_SIZE = 0x10000; // Match positions are stored as 16 bits
+
+    constexpr size_t compress_bound(size_t size) { return size + size / 255 + 16; }
+
+    // Scratch space for compress_block, too big to go on a kernel stack
+    typedef struct {
+        uint16_t table[1 << HASH_BITS];
+    } compress_state_t;
+
+    // Returns the compressed size, or 0 if it didn't fit into dest_size bytes
+    size_t compress_block(const void* src, size_t size, void* dest, size_t dest_size, compress_state_t* state);
+
+    // Returns the decompressed size, or -1 if the input is malformed or doesn't fit
+    ssize_t decompress_block(const void* src, size_t size, void* dest, size_t dest_size);
+
+    constexpr uint32_t FRAME_MAGIC = 0x184D2204;
+
+    // Any block of an LZ4 frame can be decompressed on its own, as long as it was made with
+    // independent blocks (lz4 -BI, which is the default).  Checksums are skipped, not checked.
+    class frame_reader {
+    public:
+        ~frame_reader();
+
+        static bool is_frame(const void* data, size_t size);
+
+        // Walks the block headers, the data has to stay where it is.  Returns 0 or -EINVAL
+        int open(const void* data, size_t size);
+
+        size_t block_size() const { return _block_size; }
+        size_t block_count() const { return _block_count; }
+        uint64_t content_size() const { return _content_size; }
+
+        // Decompresses one block into block_size() bytes at dest.  Returns its size, or -1
+        ssize_t read_block(size_t index, void* dest) const;
+
+    private:
+        typedef struct {
+            uint64_t offset;
+            uint32_t size;      // Top bit set if it's stored as is
+        } block_t;
+
+        const uint8_t* _data {nullptr};
+        block_t* _blocks {nullptr};
+        size_t _block_count {0};
+        size_t _block_size {0};
+        uint64_t _content_size {0};
+    };
+}
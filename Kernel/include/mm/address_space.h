@@ -7,7 +7,23 @@
 #include <mm/vm_object.h>
 
 namespace mm {
+    namespace ksm {
+        class scanner;
+    }
+
+    namespace zswap {
+        class reclaimer;
+    }
+
+    namespace compaction {
+        class migrator;
+    }
+
     class address_space final {
+        friend class ksm::scanner;
+        friend class zswap::reclaimer;
+        friend class compaction::migrator;
+
     public:
         address_space(page_map_t* pm);
         ~address_space();
@@ -22,6 +38,9 @@ namespace mm {
         mapped_region* find_available_region(size_t size);
 
         long unmap_memory(uintptr_t base, size_t size);
+
+        // madvise(2) style hints for the given range
+        long advise(uintptr_t base, size_t size, int advice);
         void unmap_all();
 
         size_t used_physical_mem() const;
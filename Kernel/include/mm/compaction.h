@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <paging.h>
+
+namespace mm {
+    class address_space;
+    class physical_vm_object;
+
+    // Physical memory compaction.  Blocks are handed out first fit, so after a while free memory
+    // is scattered all over and nothing contiguous can be found even with plenty of it free.
+    // Private anonymous blocks can be moved though (copy them and point the page table at the
+    // copy), so compaction picks a pageblock made up of nothing but free and movable blocks and
+    // empties it out.
+    namespace compaction {
+        constexpr unsigned MIGRATE_BATCH = 32;            // Pages unmapped at once (one TLB shootdown per batch)
+        constexpr unsigned BACKGROUND_FREE_PAGEBLOCKS = 4; // Free pageblocks to keep around if possible
+        constexpr unsigned BACKGROUND_BACKOFF = 30;       // Calls to skip after a background pass gets nowhere
+
+        typedef struct {
+            uint64_t attempts;
+            uint64_t successes;
+            uint64_t failures;      // Something in the pageblock couldn't be moved after all
+            uint64_t migrated;      // Pages moved so far
+        } stats_t;
+
+        // Empty out a pageblock for a contiguous allocation.  The whole pageblock comes back
+        // claimed, returns its first block number or 0 if there was nothing suitable.
+        uint64_t compact_pageblock();
+
+        // Keeps a few pageblocks free ahead of time, called from the kernel process loop
+        void background();
+
+        stats_t get_stats();
+
+        class migrator {
+        public:
+            static void count_space(address_space* space);
+            static void migrate_space(address_space* space);
+        private:
+            static void migrate(physical_vm_object* vmo, uintptr_t base, page_map_t* map, const unsigned* candidates, unsigned count);
+        };
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <paging.h>
+
+namespace mm {
+    class address_space;
+    class physical_vm_object;
+
+    // Same page merging.  When enabled ("ksm" on the kernel command line) the kernel process
+    // slowly walks the anonymous memory of every process, and pages that stay the same across
+    // two scans and have the same contents as another page get folded into one read only
+    // block.  Writing to one of them gets a private copy again via the page fault handler.
+    namespace ksm {
+        // How many pages one call to scan() looks at
+        constexpr unsigned PAGES_PER_SCAN = 1024;
+
+        // How many candidate pages get write protected at once (one TLB shootdown per batch)
+        constexpr unsigned MERGE_BATCH_SIZE = 32;
+
+        typedef struct {
+            uint64_t full_scans;
+            uint64_t pages_scanned;
+            uint64_t pages_per_second;  // Over the last full scan
+            uint64_t shared_blocks;     // Blocks currently owned by the merger
+            uint64_t sharing_pages;     // Pages currently mapped to one of those
+            uint64_t zero_pages;        // Pages folded into the zero block (total so far)
+        } stats_t;
+
+        void scan();
+
+        // Drop one reference to a merged block, freeing it after the last one
+        void release_block(uintptr_t phys);
+
+        stats_t get_stats();
+
+        class scanner {
+        public:
+            static bool scan_space(address_space* space, uintptr_t& address, unsigned budget, unsigned& scanned);
+        private:
+            static unsigned scan_object(physical_vm_object* vmo, uintptr_t base, page_map_t* map, unsigned& block_index, unsigned budget);
+            static void merge(physical_vm_object* vmo, uintptr_t base, page_map_t* map, const unsigned* candidates, unsigned count);
+        };
+    }
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <types.h>
+#include <frg/list.hpp>
+
+namespace fs {
+    class fs_node;
+}
+
+namespace devices {
+    class partition_device;
+}
+
+namespace mm {
+    // One cache of whole pages for both files (keyed by volume and inode) and block devices
+    // (keyed by the device), used by fs::read, file mappings and filesystem metadata alike.
+    // Every cached page stays mapped at its own slot in a window of the kernel heap, so
+    // reading from it is just a copy and mapping it is just its frame.  Reclaim is CLOCK:
+    // pages touched since the hand last went past get another lap, pinned pages are skipped.
+    namespace page_cache {
+        constexpr size_t MIN_PAGES = 256;
+        constexpr size_t MAX_PAGES = 0x8000;        // 128 MB, the window has to fit in the kernel heap
+        constexpr size_t RAM_SHARE = 4;             // Otherwise up to a quarter of RAM
+        constexpr unsigned EVICT_BATCH = 32;
+
+        // Readahead windows start at a few pages and double every time the reader catches up
+        // with the last one, up to the max
+        constexpr uint32_t READAHEAD_MIN_PAGES = 4;
+        constexpr uint32_t READAHEAD_SEQUENTIAL_PAGES = 16;    // First window once told it's sequential
+        constexpr uint32_t READAHEAD_MAX_PAGES = 64;
+        constexpr unsigned READAHEAD_BATCH = 16;                // Pages handed to the filesystem at once
+
+        // Writes go into the cache and are written back later by the flusher, oldest first and
+        // in batches sorted by position.  Past the background share of the cache being dirty it
+        // starts early, and past the dirty share writers have to write back themselves.
+        constexpr unsigned WRITEBACK_BATCH = 256;
+        constexpr uint64_t DIRTY_EXPIRE_MS = 5000;
+        constexpr long FLUSHER_INTERVAL_US = 500000;
+        constexpr size_t DIRTY_BACKGROUND_SHARE = 10;
+        constexpr size_t DIRTY_SHARE = 4;
+
+        // Device pages are written back only where they changed, a piece this big at a time,
+        // so a block sharing a page with one that's written some other way can't go back stale
+        constexpr uint32_t DIRTY_UNIT = 512;
+        constexpr uint8_t ALL_DIRTY = 0xFF;
+
+        // Block devices go under this volume, with the device as the object
+        constexpr uint64_t DEVICE_VOLUME = ~0ULL;
+
+        typedef struct {
+            uint64_t volume;
+            uint64_t object;
+            uint64_t index;     // Page number within the file or device
+        } cache_key_t;
+
+        inline bool operator==(const cache_key_t& l, const cache_key_t& r) {
+            return l.volume == r.volume && l.object == r.object && l.index == r.index;
+        }
+
+        enum class page_state : uint8_t {
+            free,
+            loading,
+            valid,
+            failed
+        };
+
+        struct page {
+            cache_key_t key;
+            uint8_t* data;          // Its slot in the window, always mapped while in use
+            uintptr_t phys;
+            unsigned pins;
+            volatile page_state state;
+            bool referenced;
+            bool cached;            // Still findable, otherwise it goes on the last unpin
+            uint8_t dirty;          // Which DIRTY_UNIT pieces are newer than what's on disk
+            uint8_t writing;        // Which ones writeback has taken
+            void* io;               // The filesystem's state for an async read, freed (with free) once it finishes
+            page* next_finished;
+            fs::fs_node* owner;     // Writes a dirty file page back, and has a handle held on it until then
+            uint64_t dirtied;       // Uptime in ms when it went dirty
+            frg::default_list_hook<page> hook;
+            frg::default_list_hook<page> dirty_hook;
+        };
+
+        enum class access_advice : uint8_t {
+            normal,
+            sequential,
+            random
+        };
+
+        // Kept per open file
+        typedef struct {
+            uint64_t next;          // The page a sequential reader would start at next
+            uint64_t start;         // Current window
+            uint32_t size;
+            uint32_t async_size;    // Reading into the last this many pages of the window starts the next one
+            access_advice advice;
+        } readahead_t;
+
+        typedef struct {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+            uint64_t pages;         // In the cache right now
+            uint64_t dirty;
+            uint64_t written;       // Pages written back
+            uint64_t capacity;
+        } stats_t;
+
+        // Sizes the cache from the amount of RAM, before any filesystem is mounted
+        void initialize();
+
+        // Look the page up, reading it in on a miss.  Comes back pinned (unpin it once done)
+        // or nullptr if it couldn't be read or there was no room.
+        page* get_file_page(fs::fs_node* node, uint64_t index);
+        page* get_device_page(devices::partition_device* device, uint64_t index);
+        void unpin(page* p);
+
+        // For filesystems writing through the cache.  Like get_file_page, except a page that
+        // wasn't cached comes back still loading (created is set) for the caller to fill in
+        // and hand to filled(), which drops and unpins it on an error.
+        page* grab_file_page(fs::fs_node* node, uint64_t index, bool& created);
+        void filled(page* p, int result);
+
+        // The page has been written to.  File pages go back whole through owner->write_pages,
+        // device pages straight to the device, only the part that changed.
+        void mark_dirty(page* p, fs::fs_node* owner);
+        void mark_dirty(page* p, uint32_t offset, uint32_t size);
+
+        // Forget changes to part of a device that don't need to be written any more (i.e. a
+        // freed block, which could be written some other way next).  Doesn't read anything in.
+        void mark_clean(devices::partition_device* device, uint64_t offset, uint32_t size);
+
+        // Writes dirty pages back and waits for them, only node's (and the device pages, which
+        // is where its metadata is) if it's given.  Pages that fail stay dirty.  Returns 0 or
+        // the first error.
+        int writeback(fs::fs_node* node = nullptr);
+
+        // After writing through the cache, once too much of it is dirty the writer has to
+        // write some back before going on.  Can't be called holding the node's lock.
+        void balance_dirty();
+
+        // writeback, and then waits for whatever the flusher already had on its way out too.
+        // It's up to the filesystem to flush the disk's own cache after.
+        int sync(fs::fs_node* node = nullptr);
+
+        // Starts the thread that writes back in the background
+        void start_flusher();
+
+        // fs::read for nodes that use the cache
+        ssize_t read(fs::fs_node* node, size_t offset, size_t size, uint8_t* buffer);
+
+        // Called before each read through a file handle.  Spots sequential reading and keeps
+        // a window of pages being read in ahead of it.
+        void readahead(fs::fs_node* node, readahead_t& state, size_t offset, size_t size);
+
+        // Start reading pages of the file in without waiting for them
+        void prefetch(fs::fs_node* node, uint64_t first, uint64_t count);
+
+        // For filesystems, once an async read from fs_node::read_pages is done.  Safe from
+        // an interrupt handler.
+        void finish_read(page* p, int result);
+
+        // Forget what's cached for a file or device (or some pages of it), pinned pages go
+        // once they're unpinned.  Dirty pages are thrown away, not written.
+        void invalidate(uint64_t volume, uint64_t object, uint64_t first = 0, uint64_t last = ~0ULL);
+
+        // Like invalidate, except only pages nobody needs go: anything dirty, being written
+        // or pinned (i.e. mapped) stays cached
+        void drop_clean(uint64_t volume, uint64_t object, uint64_t first = 0, uint64_t last = ~0ULL);
+
+        stats_t get_stats();
+    }
+}
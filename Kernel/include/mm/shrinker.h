@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace mm {
+    // Something holding on to memory it could give back (a cache, mostly).  Once free memory
+    // drops below the low watermark every registered shrinker is asked for a share of what
+    // is needed, in proportion to how much it says it could free.
+    class shrinker {
+    public:
+        virtual ~shrinker() = default;
+
+        // Roughly how many pages could be given back right now
+        virtual size_t count_pages() = 0;
+
+        // Give back around count pages, returns how many actually went.  This can be called
+        // from inside the physical allocator, so never block here (try locks only).
+        virtual size_t shrink(size_t count) = 0;
+    };
+
+    void register_shrinker(shrinker* s);
+    void unregister_shrinker(shrinker* s);
+
+    // Run the shrinkers until free memory is back above twice the low watermark, returns
+    // the number of pages freed (0 if it was not safe to run them right now)
+    size_t shrink_caches();
+}
@@ -6,10 +6,48 @@
 #include <ref_counted.hpp>
 #include <lock.h>
 #include <kmove.h>
+#include <fs/filesystem.h>
+
+namespace fs {
+    class fs_node;
+}
 
 namespace mm {
+    namespace ksm {
+        class scanner;
+    }
+
+    namespace zswap {
+        class reclaimer;
+    }
+
+    namespace compaction {
+        class migrator;
+    }
+
+    namespace page_cache {
+        struct page;
+    }
+
     constexpr uint64_t PHYS_BLOCK_MAX = (0xffffffff << memory::PAGE_SHIFT_4K);
 
+    // Set on a block number when the block is owned by the same page merger (ksm) and
+    // shared read only with whoever else had the same contents
+    constexpr uint32_t BLOCK_MERGED = 1U << 31;
+
+    // Set when the block has been compressed out to zswap, the rest is the pool handle
+    constexpr uint32_t BLOCK_SWAPPED = 1U << 30;
+    constexpr uint32_t BLOCK_FLAGS = BLOCK_MERGED | BLOCK_SWAPPED;
+    constexpr uint32_t BLOCK_FRAME_MASK = ~BLOCK_FLAGS;
+
+    // Max extra pages mapped on an anonymous fault that looks sequential
+    constexpr unsigned FAULT_AROUND_PAGES = 16;
+    constexpr unsigned FAULT_AROUND_SEQUENTIAL_PAGES = 64;
+
+    // A single read only block of zeroes that untouched anonymous memory is mapped to
+    // until it gets written to
+    uintptr_t get_zero_block();
+
     class vm_object {
         friend class address_space;
 
@@ -17,11 +55,18 @@ namespace mm {
         vm_object(size_t size, bool anonymous, bool shared, bool cow);
         virtual ~vm_object() = default;
 
-        virtual int hit(uintptr_t base, uintptr_t offset, page_map_t* map);
+        virtual int hit(uintptr_t base, uintptr_t offset, page_map_t* map, bool write);
         virtual void map_allocated_blocks(uintptr_t base, page_map_t* map) = 0;
 
         virtual vm_object* clone() = 0;
 
+        // Fault in size bytes starting at offset ahead of time
+        virtual int populate(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map);
+
+        // Give back the memory backing the given range, it reads as new next time it is touched.
+        // Returns 0 or an error if the range can't be thrown away.
+        virtual int discard(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) { return 0; }
+
         ALWAYS_INLINE size_t size() const { return _size; }
         virtual size_t used_physical_memory() const { return 0; }
 
@@ -29,31 +74,130 @@ namespace mm {
         ALWAYS_INLINE bool is_shared() const { return _shared; }
         ALWAYS_INLINE bool is_copy_on_write() const { return _cow; }
         ALWAYS_INLINE void set_copy_on_write(bool cow) { _cow = cow; }
+        ALWAYS_INLINE bool is_sequential() const { return _sequential; }
+        ALWAYS_INLINE void set_sequential(bool sequential) { _sequential = sequential; }
         ALWAYS_INLINE int use_count() const { return _use_count; }
-        ALWAYS_INLINE void add_use() { _use_count++; }
-        ALWAYS_INLINE void remove_use() { _use_count--; }
+        ALWAYS_INLINE void add_use() { __atomic_add_fetch(&_use_count, 1, __ATOMIC_ACQ_REL); }
+        ALWAYS_INLINE void remove_use() {
+            if(__atomic_sub_fetch(&_use_count, 1, __ATOMIC_ACQ_REL) == 0) {
+                last_use_removed();
+            }
+        }
     protected:
+        // Whoever removed the last use still holds a reference, so this is still alive
+        virtual void last_use_removed() {}
+
         size_t _size;
         int _use_count;     // The number of objects currently using this (not the same as ref count)
 
         bool _anonymous:1;
         bool _shared:1;
         bool _cow:1;
+        bool _sequential:1;
     };
 
     class physical_vm_object : public vm_object {
+        friend class ksm::scanner;
+        friend class zswap::reclaimer;
+        friend class compaction::migrator;
+
     public:
         physical_vm_object(size_t size, bool anonymous, bool shared, bool cow);
         virtual ~physical_vm_object();
 
-        int hit(uintptr_t base, uintptr_t offset, page_map_t* map) override;
+        int hit(uintptr_t base, uintptr_t offset, page_map_t* map, bool write) override;
         void map_allocated_blocks(uintptr_t base, page_map_t* map) override;
 
         vm_object* clone() override;
 
+        int populate(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) override;
+        int discard(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) override;
+
         size_t used_physical_memory() const override;
     protected:
+        int allocate_block(uintptr_t base, unsigned block_index, page_map_t* map);
+        int map_zero_block(uintptr_t base, unsigned block_index, page_map_t* map);
+        // Whether a block that was never allocated reads as zeroes
+        virtual bool absent_reads_zero(unsigned block_index) const { return true; }
+
+        int map_block(uintptr_t base, unsigned block_index, page_map_t* map, bool write);
+        void free_block(unsigned block_index);
+        void copy_blocks_to(physical_vm_object* dest) const;
+
         uint32_t* _physical_blocks {nullptr};
+        uint64_t* _ksm_checksums {nullptr}; // Checksum of each block on the last merge scan
+        unsigned _fault_around {0};
+        unsigned _next_fault {0};
+    };
+
+    // Read only view of a range of a file.  There is only ever one of these per
+    // (file, range) so every process mapping the same executable shares the same
+    // frames.  Pages are read from the file the first time something touches them.
+    // Nothing hands it out again once the last mapping is gone or the file changes.
+    class file_vm_object final : public vm_object {
+    public:
+        static kstd::ref_counted<vm_object> get(fs::fs_node* node, off_t offset, size_t size);
+
+        // The file was written, truncated or unlinked, so the next get() starts over.  What
+        // is already mapped keeps the pages it has.
+        static void forget(fs::fs_node* node);
+
+        ~file_vm_object();
+
+        int hit(uintptr_t base, uintptr_t offset, page_map_t* map, bool write) override;
+        void map_allocated_blocks(uintptr_t base, page_map_t* map) override;
+
+        vm_object* clone() override;
+
+        size_t used_physical_memory() const override;
+
+        // Returns the physical address of the given page, reading it in if needed (0 on failure)
+        uintptr_t get_page(unsigned index);
+    protected:
+        void last_use_removed() override;
+    private:
+        file_vm_object(fs::fs_node* node, off_t offset, size_t size);
+
+        uintptr_t get_cached_page(unsigned index);
+        uintptr_t get_node_page(unsigned index);
+        kstd::ref_counted<vm_object> unregister();
+
+        fs::fs_node* _node;
+        volume_id_t _volume_id;
+        ino_t _inode;
+        off_t _offset;
+        uint32_t* _physical_blocks;
+        page_cache::page** _cache_pages {nullptr};    // Only for nodes that use the page cache
+        bool _node_frames {false};                      // The node hands over its own frames (fs_node::map_page)
+        lock_t _lock {0};
+
+        // The node's list of shared ranges holds this reference, both under the registry lock
+        file_vm_object* _next_mapping {nullptr};
+        kstd::ref_counted<vm_object> _registered;
+    };
+
+    // Private mapping of a file range (i.e. a writable ELF segment).  Reads share the
+    // frames of the backing file_vm_object and the first write to a page gives this
+    // object its own copy.  Anything past file_size reads as zero (.bss)
+    class private_file_vm_object final : public physical_vm_object {
+    public:
+        private_file_vm_object(kstd::ref_counted<vm_object> backing, size_t file_size, size_t size);
+        ~private_file_vm_object();
+
+        int hit(uintptr_t base, uintptr_t offset, page_map_t* map, bool write) override;
+
+        vm_object* clone() override;
+
+        int populate(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) override;
+    protected:
+        bool absent_reads_zero(unsigned block_index) const override {
+            return ((size_t)block_index << memory::PAGE_SHIFT_4K) >= _file_size;
+        }
+    private:
+        ALWAYS_INLINE file_vm_object* backing() const { return static_cast<file_vm_object *>(_backing.get()); }
+
+        kstd::ref_counted<vm_object> _backing;
+        size_t _file_size;
     };
 
     class process_image_vm_object final : public physical_vm_object {
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <spinlock.h>
+
+namespace mm {
+    // A vmem style resource arena (Bonwick & Adams, "Magazines and Vmem").  Every segment of the
+    // span gets a boundary tag kept in address order.  Free segments also sit on a power of two
+    // freelist and allocated ones in a hash table, so both allocating and freeing are constant
+    // time no matter how fragmented things are.  Small sizes go through the quantum caches
+    // first, which hand back recently freed ranges without touching the arena at all.
+    class vmem_arena {
+    public:
+        // Back [addr, addr + size) with memory so the arena can keep its boundary tags in it
+        typedef bool(*populate_t)(uintptr_t addr, size_t size);
+
+        static constexpr unsigned FREELIST_COUNT = 64;
+        static constexpr unsigned HASH_BUCKETS = 4096;
+        static constexpr unsigned QCACHE_MAX = 8;         // Largest cached size, in quanta
+        static constexpr unsigned QCACHE_DEPTH = 32;      // Ranges kept per cached size
+        static constexpr unsigned BOOTSTRAP_TAGS = 64;    // Enough to get going before populate works
+        static constexpr unsigned TAG_RESERVE = 16;       // Refill once the spare tags drop below this
+
+        // Needed long before global constructors run, so this does the work instead
+        void init(const char* name, uintptr_t base, size_t size, size_t quantum, populate_t populate);
+
+        // Sizes are rounded up to the quantum, alloc returns 0 if there is no room left.
+        // free takes back exactly what one alloc handed out, the same address and size.
+        // Giving back part of an allocation isn't supported (it asserts).
+        uintptr_t alloc(size_t size);
+        void free(uintptr_t addr, size_t size);
+
+        size_t free_size() const { return _free_size; }
+        const char* name() const { return _name; }
+    private:
+        struct segment {
+            uintptr_t base;
+            size_t size;
+            segment* prev;          // Address order
+            segment* next;
+            segment* list_prev;     // Freelist when free, hash chain when allocated
+            segment* list_next;
+            bool free;
+        };
+
+        segment* new_tag();
+        void release_tag(segment* seg);
+        void refill_tags();
+
+        unsigned freelist_index(size_t size) const;
+        void freelist_insert(segment* seg);
+        void freelist_remove(segment* seg);
+
+        segment*& hash_bucket(uintptr_t addr);
+        void hash_insert(segment* seg);
+        segment* hash_remove(uintptr_t addr);
+
+        uintptr_t alloc_segment(size_t size);
+        void free_segment(uintptr_t addr, size_t size);
+
+        const char* _name;
+        size_t _quantum;
+        unsigned _quantum_shift;
+        populate_t _populate;
+
+        segment* _freelists[FREELIST_COUNT];
+        uint64_t _freelist_bitmap;                 // Bit n set means _freelists[n] has something on it
+        segment* _hash[HASH_BUCKETS];
+
+        segment _bootstrap_tags[BOOTSTRAP_TAGS];
+        segment* _spare_tags;
+        unsigned _spare_tag_count;
+
+        uintptr_t _qcache[QCACHE_MAX][QCACHE_DEPTH];
+        unsigned _qcache_count[QCACHE_MAX];
+        lock_t _qcache_lock[QCACHE_MAX];
+
+        size_t _free_size;
+        lock_t _lock;
+        lock_t _refill_lock;
+    };
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <paging.h>
+
+namespace mm {
+    class address_space;
+    class physical_vm_object;
+
+    // Compressed swap in RAM.  When the physical allocator runs dry, cold anonymous pages get
+    // LZ4 compressed into a pool and their frames handed back.  The block then holds a pool
+    // handle (BLOCK_SWAPPED) and the next fault on it decompresses it into a new frame.
+    namespace zswap {
+        // Anything bigger than this isn't worth keeping (two have to fit in a pool page)
+        constexpr size_t MAX_COMPRESSED_SIZE = memory::PAGE_SIZE_4K / 2 - 16;
+        constexpr unsigned MAX_POOL_PAGES = 8192;     // 32 MB of compressed pages
+        constexpr unsigned RECLAIM_BATCH = 32;        // Pages evicted per call to reclaim()
+        constexpr unsigned RECLAIM_SCAN_LIMIT = 0x10000;
+
+        typedef struct {
+            uint64_t stored_pages;
+            uint64_t pool_pages;
+            uint64_t compressed_bytes;
+            uint64_t rejected;      // Didn't compress well enough
+        } stats_t;
+
+        // Compress some cold pages out of the way, returns false if nothing could be freed
+        bool reclaim();
+
+        // Decompress the page behind handle into dest, the handle stays valid
+        void load(uint32_t handle, void* dest);
+        void release(uint32_t handle);
+
+        stats_t get_stats();
+
+        class reclaimer {
+        public:
+            static bool reclaim_space(address_space* space, uintptr_t& address, unsigned& freed, unsigned& scanned);
+        private:
+            static unsigned evict(physical_vm_object* vmo, uintptr_t base, page_map_t* map, const unsigned* candidates, unsigned count);
+        };
+    }
+}
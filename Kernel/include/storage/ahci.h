@@ -11,8 +11,11 @@ namespace ahci {
     constexpr uint8_t IDE_COMMAND_DMA_READ_EX   = 0x25;
     constexpr uint8_t IDE_COMMAND_PIO_WRITE     = 0x30;
     constexpr uint8_t IDE_COMMAND_DMA_WRITE_EX  = 0x35;
+    constexpr uint8_t IDE_COMMAND_READ_FPDMA    = 0x60;
+    constexpr uint8_t IDE_COMMAND_WRITE_FPDMA   = 0x61;
     constexpr uint8_t IDE_COMMAND_PACKET        = 0xA1;
     constexpr uint8_t IDE_COMMAND_FLUSH         = 0xE7;
+    constexpr uint8_t IDE_COMMAND_FLUSH_EX      = 0xEA;
     constexpr uint8_t IDE_COMMAND_IDENTIFY      = 0xEC;
 
     // AHCI Capabilities Register (Serial ATA AHCI 1.3.1 p.15)
@@ -18,9 +18,12 @@ namespace ahci {
     private:
         bool register_achi_disk(ahci_hba_port_t* port, uint32_t index, uint8_t max_command_slots);
         bool identify_device(ahci_hba_port_t* port, uint32_t index, int slot_count);
+        bool setup_interrupts(const pci_device_t* device);
+        static void interrupt_handler(void* data, register_context* regs);
 
         ahci_hba_mem_t* _abar;
         list<ahci_port *> _ports;
+        ahci_port* _port_map[32] {};    // By HBA port number, for the interrupt handler
         page_entry _command_pages[32];
         char _version[6]; 
     };
@@ -2,30 +2,61 @@
 
 #include <device.h>
 #include <storage/ahci.h>
-#include <lock.h>
+#include <paging.h>
 
 namespace ahci {
+    // Each slot gets its own command table, four to a page
+    constexpr uint16_t MAX_PRDT_ENTRIES     = 56;
+    constexpr size_t COMMAND_TABLE_SIZE     = sizeof(hba_cmd_tbl_t) + MAX_PRDT_ENTRIES * sizeof(hba_prdt_entry_t);
+    constexpr size_t COMMAND_TABLES_PER_PAGE = memory::PAGE_SIZE_4K / COMMAND_TABLE_SIZE;
+    static_assert(COMMAND_TABLE_SIZE % 128 == 0);
+
+    constexpr uint32_t MAX_PRD_BYTES        = 0x400000;
+    constexpr uint32_t MAX_COMMAND_SECTORS  = 0xFFFF;   // 16-bit count (or feature) register
+
     class ahci_port : public devices::disk_device {
     public:
         ahci_port(int num, ahci_hba_port_t* port, ahci_hba_mem_t* mem, uint8_t slot_count);
         virtual ~ahci_port();
 
-        int read_disk_block(uint64_t lba, uint32_t count, void* buffer) override;
-        int write_disk_block(uint64_t lba, uint32_t count, void* buffer) override;
+        // Until the controller has its interrupt set up, commands are polled
+        void enable_interrupts();
+
+        // Called from the controller's interrupt handler with interrupts off
+        void handle_interrupt();
+
+    protected:
+        int start_request(storage::block_request* request) override;
+        void poll_requests() override;
+        inline bool completes_by_interrupt() const override { return _irq_enabled; }
+        inline uint32_t max_request_sectors() const override { return MAX_COMMAND_SECTORS; }
+        inline unsigned max_request_segments() const override { return MAX_PRDT_ENTRIES; }
 
     private:
-        achi_hba_cmd_header_t* prepare_cmd_header(int slot, uint64_t sector_count);
-        int acquire_buffer();
-        void release_buffer(int);
+        hba_cmd_tbl_t* prepare_command(int slot, uint16_t prdt_entries, bool write);
+        bool wait_idle();
+        int start_flush(storage::block_request* request);
+        void identify();
+        void restart();
+        void release_slot(int slot);
 
         ahci_hba_port_t* _registers;
+        ahci_hba_mem_t* _hba;
         achi_hba_cmd_header_t* _command_base;
         hba_received_fis_t* _fis;
         uint8_t _slot_count;
+        bool _ncq {false};
+        uint8_t _queue_depth {1};
+
+        page_entry _command_tables[32];
 
-        lock_t _buf_locks[8];
-        page_entry _buffers[8];
-        kstd::semaphore _buffer_semaphore {8};
-        kstd::semaphore _port_lock {1};
+        // Shared with the interrupt handler, only taken with interrupts off
+        lock_t _irq_lock {0};
+        uint32_t _slots_in_use {0};
+        uint32_t _pending {0};
+        uint32_t _failed {0};
+        storage::block_request* _requests[32] {};
+        bool _flushing {false};     // Can't be queued, so it goes out on its own in slot 0
+        bool _irq_enabled {false};
     };
 }
\ No newline at end of file
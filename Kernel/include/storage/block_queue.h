@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <frg/list.hpp>
+
+namespace devices {
+    class disk_device;
+}
+
+// The request queue that sits between disk_device / partition_device and the driver.  Requests
+// are kept sorted by LBA and handed out in one direction (C-SCAN), except that anything left
+// waiting past its deadline goes first.  Adjacent requests in the same direction are merged into
+// one command on the way in, and while the queue is plugged nothing is handed to the driver so
+// a batch of submissions has the chance to merge.
+namespace storage {
+    constexpr uint64_t READ_DEADLINE_MS     = 100;
+    constexpr uint64_t WRITE_DEADLINE_MS    = 1000;
+    constexpr unsigned SYNC_BATCH           = 8;        // Requests in flight at once for a synchronous transfer
+    constexpr size_t BOUNCE_SIZE            = 0x10000;  // For buffers the device can't DMA into
+
+    struct block_request;
+
+    // Called once the request is done with 0 or a negative error.  Often from the interrupt
+    // handler, so nothing in here can sleep.
+    using request_done_t = void(*)(block_request* request, int result);
+
+    struct block_request {
+        uint64_t lba;
+        uint32_t count;             // In device blocks
+        uint8_t* buffer;            // Kernel memory, word aligned
+        bool write;
+        bool flush;                 // Flush the device's write cache instead, no data (count is 0)
+        request_done_t done;
+        void* data;                 // Whatever done wants
+
+        // Everything from here down belongs to the queue
+        block_request* next_segment;    // Requests merged onto this one, in LBA order
+        block_request* last_segment;
+        uint32_t total_count;           // Across every segment
+        uint32_t total_pages;           // Pages the segments touch, an upper bound on scatter-gather entries
+        uint64_t deadline;
+        frg::default_list_hook<block_request> sort_hook;
+        frg::default_list_hook<block_request> fifo_hook;
+    };
+
+    // Something to sleep on until a request (or a batch of them) completes
+    class request_blocker : public threading::generic_thread_blocker {
+    public:
+        // This can run on the waiting thread's CPU while it holds _lock on its way into
+        // block(), so don't spin on it.  _should_block is checked again in there and the
+        // block timeout covers the last gap.
+        void complete() {
+            _completed = true;
+            _should_block = false;
+            if(acquire_test_lock(&_lock)) {
+                if(_thread) {
+                    _thread->unblock();
+                }
+
+                release_lock(&_lock);
+            }
+        }
+
+        inline bool completed() const { return _completed; }
+    private:
+        volatile bool _completed {false};
+    };
+
+    class block_queue {
+    public:
+        typedef struct {
+            uint64_t submitted;
+            uint64_t merged;        // Submitted requests that joined another one
+            uint64_t dispatched;    // Commands handed to the driver
+        } stats_t;
+
+        block_queue(devices::disk_device* device);
+
+        // Queues the request and returns straight away, done gets called later
+        void submit(block_request* request);
+
+        // Reads or writes and waits for it, splitting it up and bouncing the buffer as needed.
+        // Returns count or a negative error.
+        int transfer(uint64_t lba, uint32_t count, void* buffer, bool write);
+
+        // Submits a batch together (so neighbours merge) and waits for all of it.  Each one has
+        // to fit in a command and be DMA capable already, done and data get overwritten.
+        // Returns 0 or the first error.
+        int execute(block_request* requests, unsigned count);
+
+        // Waits until every write that has finished so far is on the medium (a write still in
+        // the queue isn't covered, it could go after)
+        int flush();
+
+        // Nests, nothing goes to the driver until the last unplug
+        void plug();
+        void unplug();
+
+        // The driver calls this once a request from start_request() is done.  Calls done for
+        // every merged segment and starts whatever is next.
+        void complete(block_request* request, int result);
+
+        stats_t get_stats();
+    private:
+        bool try_merge(block_request* request);
+        void insert_sorted(block_request* request);
+        void remove(block_request* request);
+        block_request* pick();
+        void run();
+        int transfer_direct(uint64_t lba, uint32_t count, uint8_t* buffer, bool write);
+
+        using sort_list_t = frg::intrusive_list<block_request, frg::locate_member<block_request, frg::default_list_hook<block_request>, &block_request::sort_hook>>;
+        using fifo_list_t = frg::intrusive_list<block_request, frg::locate_member<block_request, frg::default_list_hook<block_request>, &block_request::fifo_hook>>;
+
+        devices::disk_device* _device;
+        lock_t _lock {0};
+        sort_list_t _sorted;
+        fifo_list_t _fifo;
+        block_request* _dispatching {nullptr};  // Being handed to the driver, can't be merged into
+        uint64_t _position {0};                 // Where the last dispatched request ended
+        unsigned _plugged {0};
+        bool _running {false};
+        bool _rerun {false};
+        stats_t _stats {};
+    };
+
+    class plug_guard {
+    public:
+        plug_guard(block_queue& queue)
+            :_queue(queue)
+        {
+            _queue.plug();
+        }
+
+        ~plug_guard() {
+            _queue.unplug();
+        }
+    private:
+        block_queue& _queue;
+    };
+}
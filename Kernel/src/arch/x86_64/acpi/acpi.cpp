@@ -1,6 +1,8 @@
 #include <acpi/acpi.h>
 #include <acpi/madt.h>
 #include <acpi/mcfg.h>
+#include <acpi/srat.h>
+#include <acpi/slit.h>
 #include <panic.h>
 #include <paging.h>
 #include <kstring.h>
@@ -12,12 +14,16 @@
 #include <timer.h>
 #include <kcpuid.h>
 #include <apic.h>
+#include <topology.h>
+#include <physical_allocator.h>
 
 namespace acpi {
     constexpr const char* FADT_SIGNATURE = "FACP";
     constexpr const char* DSDT_SIGNATURE = "DSDT";
     constexpr const char* MADT_SIGNATURE = "APIC";
     constexpr const char* MCFG_SIGNATURE = "MCFG";
+    constexpr const char* SRAT_SIGNATURE = "SRAT";
+    constexpr const char* SLIT_SIGNATURE = "SLIT";
 
     uint8_t processors[256];
     int processor_count = 1;
@@ -121,6 +127,84 @@ namespace acpi {
         return 0;
     }
 
+    static void read_srat() {
+        srat_t* srat_header = reinterpret_cast<srat_t *>(find_sdt(SRAT_SIGNATURE, 0));
+        if(!srat_header) {
+            // Not NUMA, everything is node 0
+            return;
+        }
+
+        uint8_t* srat_end = reinterpret_cast<uint8_t *>(srat_header) + srat_header->h.length;
+        uint8_t* srat_entry = srat_header->entries;
+        while(srat_entry < srat_end) {
+            srat_entry_t* entry = reinterpret_cast<srat_entry_t *>(srat_entry);
+            if(!entry->length) {
+                log::warning("[ACPI] Malformed SRAT entry, ignoring the rest");
+                break;
+            }
+
+            switch(entry->type) {
+                case srat::TYPE_PROCESSOR_LOCAL_APIC_AFFINITY: {
+                    srat_local_apic_affinity_t* affinity = reinterpret_cast<srat_local_apic_affinity_t *>(entry);
+                    if(affinity->flags & srat::FLAG_ENABLED) {
+                        uint32_t domain = affinity->proximity_domain_low
+                            | (affinity->proximity_domain_high[0] << 8)
+                            | (affinity->proximity_domain_high[1] << 16)
+                            | (affinity->proximity_domain_high[2] << 24);
+                        topology::add_processor(affinity->apic_id, domain);
+                        log::debug(debug_level_acpi, debug::LEVEL_VERBOSE, "[ACPI] APIC ID %d is in proximity domain %u",
+                            affinity->apic_id, domain);
+                    }
+
+                    break;
+                } case srat::TYPE_PROCESSOR_LOCAL_X2APIC_AFFINITY: {
+                    srat_local_x2apic_affinity_t* affinity = reinterpret_cast<srat_local_x2apic_affinity_t *>(entry);
+                    if(affinity->flags & srat::FLAG_ENABLED) {
+                        topology::add_processor(affinity->x2apic_id, affinity->proximity_domain);
+                    }
+
+                    break;
+                } case srat::TYPE_MEMORY_AFFINITY: {
+                    srat_memory_affinity_t* affinity = reinterpret_cast<srat_memory_affinity_t *>(entry);
+                    if(affinity->flags & srat::FLAG_ENABLED && affinity->length) {
+                        int node = topology::node_for_domain(affinity->proximity_domain);
+                        if(node >= 0) {
+                            memory::add_node_memory(node, affinity->base_address, affinity->length);
+                        }
+
+                        log::debug(debug_level_acpi, debug::LEVEL_VERBOSE, "[ACPI] Memory [0x%llx-0x%llx] is in proximity domain %u",
+                            affinity->base_address, affinity->base_address + affinity->length, affinity->proximity_domain);
+                    }
+
+                    break;
+                } default: {
+                    break;
+                }
+            }
+
+            srat_entry += entry->length;
+        }
+    }
+
+    static void read_slit() {
+        slit_t* slit_header = reinterpret_cast<slit_t *>(find_sdt(SLIT_SIGNATURE, 0));
+        if(!slit_header) {
+            return;
+        }
+
+        uint64_t count = slit_header->locality_count;
+        if(sizeof(slit_t) + count * count > slit_header->h.length) {
+            log::warning("[ACPI] SLIT is too short for %llu localities, ignoring it", count);
+            return;
+        }
+
+        for(uint64_t i = 0; i < count; i++) {
+            for(uint64_t j = 0; j < count; j++) {
+                topology::set_distance(i, j, slit_header->entries[i * count + j]);
+            }
+        }
+    }
+
     void set_rsdp(acpi_xsdp_t* p) {
         desc = p;
     }
@@ -153,6 +237,8 @@ namespace acpi {
         lai_create_namespace();
 
         read_madt();
+        read_srat();
+        read_slit();
         mcfg_header = reinterpret_cast<mcfg_t *>(find_sdt(MCFG_SIGNATURE, 0));
 
         asm("sti");
@@ -77,6 +77,9 @@ namespace apic {
         constexpr uint8_t IO_APIC_REGISTER_ID   = 0x00; // ID Register
         constexpr uint8_t IO_APIC_REGISTER_VER  = 0x01; // Version Register
 
+        constexpr uint32_t IO_APIC_ACTIVE_LOW   = 1 << 13;
+        constexpr uint32_t IO_APIC_LEVEL        = 1 << 15;
+
         uintptr_t base = 0;
         uintptr_t virtual_base;
 
@@ -159,6 +162,15 @@ namespace apic {
 
             redirect(irq, irq + 0x20, ICR_MESSAGE_TYPE_LOW_PRIORITY);
         }
+
+        void map_pci_irq(uint8_t gsi, uint8_t vector) {
+            if(debug_level_interrupts >= debug::LEVEL_VERBOSE) {
+                log::info("[apic] mapping PCI GSI %u to vector 0x%x", gsi, vector);
+            }
+
+            // PCI INTx lines are shared, level triggered and active low
+            redirect(gsi, vector, ICR_MESSAGE_TYPE_LOW_PRIORITY | IO_APIC_ACTIVE_LOW | IO_APIC_LEVEL);
+        }
     }
 
     int initialize() {
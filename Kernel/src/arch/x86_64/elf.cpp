@@ -1,8 +1,9 @@
 #include <elf.h>
 #include <kstring.h>
 #include <logging.h>
-#include <cpu.h>
 #include <scheduler.h>
+#include <ref_counted.hpp>
+#include <fs/filesystem.h>
 #include <mm/address_space.h>
 #include <mm/vm_object.h>
 
@@ -18,54 +19,78 @@ namespace elf {
         return true;
     }
 
-    elf_info_t load_elf_segments(process_t* proc, void* _elf, uintptr_t base) {
-        uint8_t* elf = reinterpret_cast<uint8_t *>(_elf);
-        cpu* c = get_cpu_local();
+    static bool read_header(fs::fs_node* elf, Elf64_Ehdr* elf_hdr) {
+        if(fs::read(elf, 0, sizeof(Elf64_Ehdr), elf_hdr) != sizeof(Elf64_Ehdr)) {
+            log::warning("Failed to read ELF header");
+            return false;
+        }
+
+        return verify(elf_hdr);
+    }
 
+    bool verify(fs::fs_node* elf) {
+        Elf64_Ehdr elf_hdr;
+        return read_header(elf, &elf_hdr);
+    }
+
+    elf_info_t load_elf_segments(process_t* proc, fs::fs_node* elf, uintptr_t base) {
         elf_info_t elf_info{};
-        if(!verify(elf)) {
+        Elf64_Ehdr elf_hdr;
+        if(!read_header(elf, &elf_hdr)) {
             return elf_info;
         }
 
-        Elf64_Ehdr* elf_hdr = (Elf64_Ehdr *)elf;
-        elf_info.entry = base + elf_hdr->e_entry;
-        elf_info.phdr_entry_size = elf_hdr->e_phentsize;
-        elf_info.phdr_num = elf_hdr->e_phnum;
-
-        for(uint16_t i = 0; i < elf_hdr->e_phnum; i++) {
-            Elf64_Phdr* elf_phdr = (Elf64_Phdr *)(elf + elf_hdr->e_phoff + i * elf_hdr->e_phentsize);
-            if(elf_phdr->p_memsz == 0 || elf_phdr->p_type != PT_LOAD) {
-                continue;
-            }
-
-            uintptr_t used_mem_size = elf_phdr->p_memsz + (elf_phdr->p_vaddr & (memory::PAGE_SIZE_4K - 1)) + memory::PAGE_SIZE_4K - 1;
-            uintptr_t page_base = (base + elf_phdr->p_vaddr) & memory::PAGE_SIZE_4K_MASK;
-            proc->address_space->map_vmo(new mm::process_image_vm_object(page_base, (used_mem_size & memory::PAGE_SIZE_4K_MASK),
-                true), page_base, true);
+        size_t phdr_size = (size_t)elf_hdr.e_phnum * elf_hdr.e_phentsize;
+        kstd::auto_free<uint8_t> phdrs(phdr_size);
+        if(fs::read(elf, elf_hdr.e_phoff, phdr_size, phdrs) != (ssize_t)phdr_size) {
+            log::warning("Failed to read ELF program headers");
+            return elf_info;
         }
 
-        uintptr_t pml4_phys = scheduler::get_current_process()->get_page_map()->pml4_phys;
-        for(int i = 0; i < elf_hdr->e_phnum; i++) {
-            Elf64_Phdr* elf_phdr = (Elf64_Phdr *)(elf + elf_hdr->e_phoff + i * elf_hdr->e_phentsize);
+        for(uint16_t i = 0; i < elf_hdr.e_phnum; i++) {
+            Elf64_Phdr* elf_phdr = (Elf64_Phdr *)(phdrs + i * elf_hdr.e_phentsize);
             if(elf_phdr->p_type == PT_LOAD && elf_phdr->p_memsz > 0) {
-                acquire_lock(&c->run_queue_lock);
-                asm("cli");
-                asm volatile("mov %%rax, %%cr3" :: "a"(proc->get_page_map()->pml4_phys));
-                memset((void *)(base + elf_phdr->p_vaddr), 0, elf_phdr->p_memsz);
-                memcpy((void *)(base + elf_phdr->p_vaddr), (void *)(elf + elf_phdr->p_offset), elf_phdr->p_filesz);
-                asm volatile("mov %%rax, %%cr3" :: "a"(pml4_phys));
-                asm("sti");
-                release_lock(&c->run_queue_lock);
+                uintptr_t page_offset = elf_phdr->p_vaddr & (memory::PAGE_SIZE_4K - 1);
+                if((elf_phdr->p_offset & (memory::PAGE_SIZE_4K - 1)) != page_offset) {
+                    log::warning("ELF segment at 0x%llx is not page aligned in the file", elf_phdr->p_vaddr);
+                    return {};
+                }
+
+                uintptr_t page_base = (base + elf_phdr->p_vaddr) & memory::PAGE_SIZE_4K_MASK;
+                size_t mem_size = (page_offset + elf_phdr->p_memsz + memory::PAGE_SIZE_4K - 1) & memory::PAGE_SIZE_4K_MASK;
+                off_t file_base = elf_phdr->p_offset - page_offset;
+                size_t file_size = elf_phdr->p_filesz ? page_offset + elf_phdr->p_filesz : 0;
+                if(!(elf_phdr->p_flags & PF_W) && elf_phdr->p_memsz == elf_phdr->p_filesz) {
+                    // Read only, so every process can use the same pages
+                    proc->address_space->map_vmo(mm::file_vm_object::get(elf, file_base, mem_size), page_base, true);
+                } else {
+                    kstd::ref_counted<mm::vm_object> backing;
+                    if(file_size) {
+                        backing = mm::file_vm_object::get(elf, file_base, 
+                            (file_size + memory::PAGE_SIZE_4K - 1) & memory::PAGE_SIZE_4K_MASK);
+                    }
+
+                    proc->address_space->map_vmo(new mm::private_file_vm_object(backing, file_size, mem_size), page_base, true);
+                }
             } else if(elf_phdr->p_type == PT_PHDR) {
                 elf_info.phdr_segment = base + elf_phdr->p_vaddr;
             } else if(elf_phdr->p_type == PT_INTERP) {
                 char* link_path = (char *)malloc(elf_phdr->p_filesz + 1);
-                strncpy(link_path, (const char *)elf + elf_phdr->p_offset, elf_phdr->p_filesz);
+                if(fs::read(elf, elf_phdr->p_offset, elf_phdr->p_filesz, link_path) != (ssize_t)elf_phdr->p_filesz) {
+                    log::warning("Failed to read ELF interpreter path");
+                    free(link_path);
+                    return {};
+                }
+
                 link_path[elf_phdr->p_filesz] = 0;
                 elf_info.linker_path = link_path;
             }
         }
 
+        elf_info.entry = base + elf_hdr.e_entry;
+        elf_info.phdr_entry_size = elf_hdr.e_phentsize;
+        elf_info.phdr_num = elf_hdr.e_phnum;
+
         return elf_info;
     }
-}
\ No newline at end of file
+}
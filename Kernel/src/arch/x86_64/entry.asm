@@ -146,6 +146,7 @@ entryst2:
     mov rax, cr0
     and ax, 0xFFB   ; Clear coprocessor emulation
     or ax, 0x2      ; Set coprocessor monitoring
+    or rax, 1 << 16 ; Write protect, file pages are mapped read only into user space
     mov cr0, rax
 
     ; Enable SSE
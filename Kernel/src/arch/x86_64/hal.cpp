@@ -23,6 +23,7 @@ namespace hal {
     int boot_module_count;
     bool debug_mode = false;
     bool disable_smp = false;
+    bool enable_ksm = false;
 }
 
 static void init_core() {
@@ -163,9 +164,11 @@ void hal::init_stivale2(stivale2_info_header_t* st2_info) {
                 debug_mode = true;
             } else if(strcmp(cmd_line, "nosmp") == 0) {
                 disable_smp = true;
+            } else if(strcmp(cmd_line, "ksm") == 0) {
+                enable_ksm = true;
             }
 
-            cmd_line = strtok(cmd_line, " ");
+            cmd_line = strtok(nullptr, " ");
         }
     }
 
@@ -191,6 +194,10 @@ bool hal::smp_disabled() {
     return disable_smp;
 }
 
+bool hal::ksm_enabled() {
+    return enable_ksm;
+}
+
 const boot_module_t* hal::get_boot_modules() {
     return boot_modules;
 }
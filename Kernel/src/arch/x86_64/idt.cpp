@@ -247,6 +247,18 @@ void idt::register_interrupt_handler(uint8_t interrupt, isr_t handler, void* dat
     interrupt_handlers[interrupt] = { .handler = handler, .data = data };
 }
 
+uint8_t idt::allocate_interrupt_vector() {
+    // Everything from 48 up goes through ipi_handler, which sends the EOI first the
+    // same as irq_handler.  The IPIs live at the top.
+    static uint8_t next_vector = 48;
+    static lock_t vector_lock = 0;
+
+    acquire_lock(&vector_lock);
+    uint8_t vector = next_vector < IPI_TLB_SHOOTDOWN ? next_vector++ : 0;
+    release_lock(&vector_lock);
+    return vector;
+}
+
 void idt::disable_pic() {
     // Same as init, but remap to 0xF0 - 0xF8 for both, then mask everything
 
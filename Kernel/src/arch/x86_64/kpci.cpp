@@ -74,4 +74,54 @@ namespace pci {
 
         return nullptr;
     }
+
+    uint8_t find_capability(const pci_device_t* device, uint8_t id) {
+        if(!(device->common.status & STATUS_CAPABILITIES_LIST)) {
+            return 0;
+        }
+
+        const volatile uint8_t* config = (const volatile uint8_t *)device;
+        uint8_t offset = device->capabilities_ptr & 0xFC;
+        for(int i = 0; offset && i < 48; i++) {
+            // Bounded in case the list loops back on itself
+            if(config[offset] == id) {
+                return offset;
+            }
+
+            offset = config[offset + 1] & 0xFC;
+        }
+
+        return 0;
+    }
+
+    bool enable_msi(const pci_device_t* device, uint8_t vector, uint8_t apic_id) {
+        constexpr uint16_t MSI_ENABLE       = 1 << 0;
+        constexpr uint16_t MSI_MME_MASK     = 0x7 << 4;
+        constexpr uint16_t MSI_64BIT        = 1 << 7;
+        constexpr uint32_t MSI_ADDRESS_BASE = 0xFEE00000;
+
+        uint8_t offset = find_capability(device, CAPABILITY_MSI);
+        if(!offset) {
+            return false;
+        }
+
+        // Message control, address, (upper address,) data
+        volatile uint8_t* cap = (volatile uint8_t *)device + offset;
+        volatile uint16_t* control = (volatile uint16_t *)(cap + 2);
+        volatile uint32_t* address = (volatile uint32_t *)(cap + 4);
+        volatile uint16_t* data = (volatile uint16_t *)(cap + ((*control & MSI_64BIT) ? 12 : 8));
+
+        *control = *control & ~(MSI_ENABLE | MSI_MME_MASK);
+        *address = MSI_ADDRESS_BASE | ((uint32_t)apic_id << 12);
+        if(*control & MSI_64BIT) {
+            address[1] = 0;
+        }
+
+        *data = vector; // Fixed delivery, edge triggered
+        *control = *control | MSI_ENABLE;
+
+        volatile uint16_t* command = (volatile uint16_t *)&device->common.command;
+        *command = *command | COMMAND_INTERRUPT_DISABLE;
+        return true;
+    }
 }
\ No newline at end of file
@@ -7,9 +7,12 @@
 #include <stacktrace.h>
 #include <scheduler.h>
 #include <apic.h>
+#include <smp.h>
+#include <cpu.h>
 #include <physical_allocator.h>
 #include <liballoc/liballoc.h>
 #include <mm/address_space.h>
+#include <mm/vmem.h>
 
 constexpr uint16_t KERNEL_HEAP_PDPT_INDEX = 511;
 constexpr uint16_t KERNEL_HEAP_PML4_INDEX = 511;
@@ -66,7 +69,7 @@ static void page_fault_handler(void*, register_context* regs) {
                 if(vmo->use_count() <= 1) {
                     vmo->set_copy_on_write(false);
                     vmo->map_allocated_blocks(fault_region->base(), addr_space->get_page_map());
-                    vmo->hit(fault_region->base(), fault_address - fault_region->base(), addr_space->get_page_map());
+                    vmo->hit(fault_region->base(), fault_address - fault_region->base(), addr_space->get_page_map(), true);
                     fault_region->lock().release_read();
                     asm("sti");
                     return;
@@ -79,14 +82,15 @@ static void page_fault_handler(void*, register_context* regs) {
                 asm("cli");
 
                 clone->map_allocated_blocks(fault_region->base(), addr_space->get_page_map());
-                clone->hit(fault_region->base(), fault_address - fault_region->base(), addr_space->get_page_map());
+                clone->hit(fault_region->base(), fault_address - fault_region->base(), addr_space->get_page_map(), true);
                 fault_region->lock().release_read();
                 asm("sti");
                 return;
             }
 
-            // Attempt to map the page
-            int status = fault_region->vm_object()->hit(fault_region->base(), fault_address - fault_region->base(), addr_space->get_page_map());
+            // Attempt to map the page.  Writes to pages that are only mapped read only for sharing
+            // (the zero block, file pages) also end up here, and the object makes its private copy
+            int status = fault_region->vm_object()->hit(fault_region->base(), fault_address - fault_region->base(), addr_space->get_page_map(), read_only);
             fault_region->lock().release_read();
             if(status == 0) {
                 // mapping successful
@@ -145,6 +149,26 @@ namespace memory {
     page_t kernel_heap_dir_tables[TABLES_PER_DIR][PAGES_PER_TABLE] __attribute__((aligned(4096)));
     page_dir_t io_dirs[4] __attribute__((aligned(4096)));
 
+    static lock_t tlb_shootdown_lock {0};
+    static volatile unsigned tlb_shootdown_pending = 0;
+    static volatile uint64_t tlb_shootdown_generation = 0;
+    static uint64_t tlb_flushed_generation[256]; // By APIC ID
+
+    static void tlb_shootdown_handler(void*, register_context*) {
+        tlb_shootdown_poll();
+    }
+
+    // Hands out kernel heap address space, the pages themselves are up to the caller
+    static mm::vmem_arena kernel_heap_arena;
+
+    static bool populate_heap(uintptr_t addr, size_t size) {
+        for(size_t offset = 0; offset < size; offset += PAGE_SIZE_4K) {
+            kernel_map_virtual_memory_4k(allocate_physical_block(), addr + offset, 1);
+        }
+
+        return true;
+    }
+
     static page_table_t allocate_page_table() {
         void* virt = kernel_allocate_4k_pages(1);
         uint64_t phys = allocate_physical_block();
@@ -249,6 +273,7 @@ namespace memory {
 
     void initialize_virtual_memory() {
         idt::register_interrupt_handler(14, page_fault_handler);
+        idt::register_interrupt_handler(IPI_TLB_SHOOTDOWN, tlb_shootdown_handler);
 
         memset(kernel_pml4, 0, sizeof(pml4_t));
         memset(kernel_pdpt, 0, sizeof(pdpt_t));
@@ -275,100 +300,41 @@ namespace memory {
         kernel_pdpt[0] = kernel_pdpt[PDPT_GET_INDEX(KERNEL_VIRTUAL_BASE)]; // Map low memory for SMP
         for(int i = 0; i < TABLES_PER_DIR; i++) {
             memset(&(kernel_heap_dir_tables[i]), 0, sizeof(page_t)*PAGES_PER_TABLE);
+
+            // The tables are static anyway, so hook them all up now and let the arena
+            // worry about which parts are in use
+            set_page_frame(&(kernel_heap_dir[i]), ((uintptr_t)&(kernel_heap_dir_tables[i]) - KERNEL_VIRTUAL_BASE));
+            kernel_heap_dir[i] |= (TABLE_WRITEABLE | TABLE_PRESENT);
         }
 
+        uintptr_t heap_base = 0xFFFF000000000000 | (PDPT_SIZE * KERNEL_HEAP_PML4_INDEX) | (PAGE_SIZE_1G * (uint64_t)KERNEL_HEAP_PDPT_INDEX);
+        kernel_heap_arena.init("kernel heap", heap_base, PAGE_SIZE_1G, PAGE_SIZE_4K, populate_heap);
+
         kernel_pml4_phys = (uint64_t)kernel_pml4 - KERNEL_VIRTUAL_BASE;
         asm("mov %%rax, %%cr3" :: "a"(kernel_pml4_phys));
     }
     
     void* kernel_allocate_4k_pages(uint64_t amount) {
-        uint64_t offset = 0, page_dir_offset = 0, counter = 0, address = 0;
-
-        uint64_t pml4_index = KERNEL_HEAP_PML4_INDEX;
-        uint64_t pdpt_index = KERNEL_HEAP_PDPT_INDEX;
-
-        // First pass through already allocated tables
-        for(int i = 0; i < TABLES_PER_DIR; i++) {
-            if(kernel_heap_dir[i] & TABLE_PRESENT && !(kernel_heap_dir[i] & PDE_2M)) {
-                for(int j = 0; j < TABLES_PER_DIR; j++) {
-                    if(kernel_heap_dir_tables[i][j] & TABLE_PRESENT) {
-                        page_dir_offset = i;
-                        offset = j + 1;
-                        counter = 0;
-                        continue;
-                    }
-
-                    counter++;
-                    if(counter >= amount) {
-                        address = (PDPT_SIZE * pml4_index) + (pdpt_index * PAGE_SIZE_1G) + (page_dir_offset * PAGE_SIZE_2M) + (offset * PAGE_SIZE_4K);
-                        address |= 0xFFFF000000000000;
-                        while(counter--) {
-                            if(offset >= 512) {
-                                page_dir_offset++;
-                                offset = 0;
-                            }
-
-                            kernel_heap_dir_tables[page_dir_offset][offset] = TABLE_WRITEABLE | TABLE_PRESENT;
-                            offset++;
-                        }
-
-                        return (void *)address;
-                    }
-                }
-            } else {
-                page_dir_offset = i + 1;
-                offset = 0;
-                counter = 0;
-            }
-        }
-
-        page_dir_offset = 0;
-        offset = 0;
-        counter = 0;
-
-        // First pass failed, allocate new tables
-        for(int i = 0; i < TABLES_PER_DIR; i++) {
-            if(!(kernel_heap_dir[i] & TABLE_PRESENT)) {
-                counter += 512;
-                if(counter >= amount) {
-                    address = (PDPT_SIZE * pml4_index) + (pdpt_index * PAGE_SIZE_1G) + (page_dir_offset * PAGE_SIZE_2M) + (offset * PAGE_SIZE_4K);
-                    address |= 0xFFFF000000000000;
-                    set_page_frame(&(kernel_heap_dir[page_dir_offset]), ((uintptr_t)&(kernel_heap_dir_tables[page_dir_offset]) - KERNEL_VIRTUAL_BASE));
-                    kernel_heap_dir[page_dir_offset] |= (TABLE_WRITEABLE | TABLE_PRESENT);
-                    while(amount--) {
-                        if(offset >= 512) {
-                            page_dir_offset++;
-                            offset = 0;
-                            set_page_frame(&(kernel_heap_dir[page_dir_offset]), ((uintptr_t)&(kernel_heap_dir_tables[page_dir_offset]) - KERNEL_VIRTUAL_BASE));
-                            kernel_heap_dir[page_dir_offset] |= (TABLE_WRITEABLE | TABLE_PRESENT);
-                        }
-
-                        kernel_heap_dir_tables[page_dir_offset][offset] = TABLE_WRITEABLE | TABLE_PRESENT;
-                        offset++;
-                    }
-
-                    return (void *)address;
-                } 
-            } else {
-                page_dir_offset = i + 1;
-                offset = 0;
-                counter = 0;
-            }
+        uintptr_t address = kernel_heap_arena.alloc(amount * PAGE_SIZE_4K);
+        if(!address) {
+            assert(!"Kernel Out of Virtual Memory");
         }
 
-        assert(!"Kernel Out of Virtual Memory");
+        return (void *)address;
     }
 
     void kernel_free_4k_pages(void* addr, uint64_t amount) {
         uint64_t page_dir_index, page_index;
         uint64_t virt = (uint64_t)addr;
-        while(amount--) {
+        for(uint64_t i = 0; i < amount; i++) {
             page_dir_index = PDE_GET_INDEX(virt);
             page_index = PT_GET_INDEX(virt);
             kernel_heap_dir_tables[page_dir_index][page_index] = 0;
             invlpg(virt);
             virt += PAGE_SIZE_4K;
         }
+
+        kernel_heap_arena.free((uintptr_t)addr, amount * PAGE_SIZE_4K);
     }
 
     void kernel_map_virtual_memory_4k(uint64_t phys, uint64_t virt, uint64_t amount, uint64_t flags) {
@@ -413,22 +379,36 @@ namespace memory {
     }
 
     uint64_t virtual_to_physical_addr(uint64_t addr) {
-        uint64_t address = 0;
-        uint32_t pml4_index = PML4_GET_INDEX(addr);
+        // Kernel addresses only, anything else (or not mapped) is 0
+        if(PML4_GET_INDEX(addr) != KERNEL_HEAP_PML4_INDEX) {
+            return 0;
+        }
+
         uint32_t page_dir_index = PDE_GET_INDEX(addr);
         uint32_t page_table_index = PT_GET_INDEX(addr);
+        if(PDPT_GET_INDEX(addr) == KERNEL_HEAP_PDPT_INDEX) {
+            if(!(kernel_heap_dir[page_dir_index] & TABLE_PRESENT)) {
+                return 0;
+            }
 
-        if(pml4_index < 511) {
-
-        } else {
             if(kernel_heap_dir[page_dir_index] & PDE_2M) {
-                address = (get_page_frame(kernel_heap_dir[page_dir_index])) << 12;
-            } else {
-                address = (get_page_frame(kernel_heap_dir_tables[page_dir_index][page_table_index])) << 12;
+                return ((uint64_t)get_page_frame(kernel_heap_dir[page_dir_index]) << 12) + (addr & (PAGE_SIZE_2M - 1));
+            }
+
+            page_t entry = kernel_heap_dir_tables[page_dir_index][page_table_index];
+            if(!(entry & TABLE_PRESENT)) {
+                return 0;
             }
+
+            return ((uint64_t)get_page_frame(entry) << 12) + (addr & (PAGE_SIZE_4K - 1));
+        }
+
+        if(PDPT_GET_INDEX(addr) == PDPT_GET_INDEX(KERNEL_VIRTUAL_BASE)) {
+            // The kernel image, a straight offset from the first 1 GiB
+            return addr - KERNEL_VIRTUAL_BASE;
         }
 
-        return address;
+        return 0;
     }
 
     uintptr_t get_io_mapping(uintptr_t addr) {
@@ -441,6 +421,57 @@ namespace memory {
         return addr + IO_VIRTUAL_BASE;
     }
 
+    void tlb_shootdown() {
+        asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+
+        unsigned others = smp::get_proc_count() - 1;
+        if(!others) {
+            return;
+        }
+
+        // Whoever holds the lock might be waiting on us, and we might have interrupts off
+        while(!acquire_test_lock(&tlb_shootdown_lock)) {
+            tlb_shootdown_poll();
+            asm("pause");
+        }
+
+        uint64_t generation = tlb_shootdown_generation + 1;
+        tlb_flushed_generation[get_cpu_local()->id] = generation;
+        tlb_shootdown_pending = others;
+        __sync_synchronize();
+        tlb_shootdown_generation = generation;
+
+        apic::local::send_ipi(0, apic::ICR_DSH_OTHER, apic::ICR_MESSAGE_TYPE_FIXED, IPI_TLB_SHOOTDOWN);
+        while(tlb_shootdown_pending) {
+            asm("pause");
+        }
+
+        release_lock(&tlb_shootdown_lock);
+    }
+
+    void tlb_shootdown_poll() {
+        // Either the IPI or a spinning CPU gets here first, only one of them flushes and answers
+        uint64_t generation = tlb_shootdown_generation;
+        uint64_t& flushed = tlb_flushed_generation[get_cpu_local()->id];
+        uint64_t last = flushed;
+        if(last == generation || !__sync_bool_compare_and_swap(&flushed, last, generation)) {
+            return;
+        }
+
+        asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
+        __sync_fetch_and_sub(&tlb_shootdown_pending, 1);
+    }
+
+    page_t* get_page_entry(uint64_t virt, page_map_t* map) {
+        uint64_t pdpt_index = PDPT_GET_INDEX(virt);
+        uint64_t page_dir_index = PDE_GET_INDEX(virt);
+        if(PML4_GET_INDEX(virt) || !map->page_dirs[pdpt_index] || !(map->page_dirs[pdpt_index][page_dir_index] & TABLE_PRESENT)) {
+            return nullptr;
+        }
+
+        return &map->page_tables[pdpt_index][page_dir_index][PT_GET_INDEX(virt)];
+    }
+
     bool check_kernel_pointer(uintptr_t addr, uint64_t len) {
         if(PML4_GET_INDEX(addr) != PML4_GET_INDEX(KERNEL_VIRTUAL_BASE)) {
             return false;
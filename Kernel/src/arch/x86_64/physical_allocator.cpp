@@ -4,15 +4,42 @@
 #include <spinlock.h>
 #include <logging.h>
 #include <panic.h>
+#include <paging.h>
+#include <mm/zswap.h>
+#include <mm/shrinker.h>
+#include <mm/compaction.h>
+#include <kmath.h>
+#include <topology.h>
+#include <cpu.h>
 
 namespace memory {
     uint32_t phys_mem_bitmap[PHYS_BITMAP_SIZE_DWORDS];
     uint64_t used_blocks = PHYS_BITMAP_SIZE_DWORDS * 32;
     uint64_t max_blocks = PHYS_BITMAP_SIZE_DWORDS * 32;
+    uint64_t total_blocks = 0;
 
     uint64_t next_chunk = 1;
 
     lock_t allocator_lock = 0;
+
+    uint64_t zero_pool[ZERO_POOL_SIZE];
+    volatile uint32_t zero_pool_count = 0;
+
+    typedef struct {
+        uint64_t first;
+        uint64_t end;
+        unsigned node;
+    } node_range_t;
+
+    typedef struct {
+        uint64_t next_block;            // Same idea as next_chunk, but per node
+        volatile int64_t free_blocks;
+    } node_state_t;
+
+    node_range_t node_ranges[MAX_NODE_RANGES]; // Sorted by address
+    unsigned node_range_count = 0;
+    node_state_t node_states[topology::MAX_NODES];
+    bool numa_enabled = false;
     
     __attribute__((always_inline)) inline void clear_bit(uint64_t bit) {
         phys_mem_bitmap[bit >> 5] &= (~ (1 << (bit & 31)));
@@ -22,12 +49,156 @@ namespace memory {
         phys_mem_bitmap[bit >> 5] |= (1 << (bit & 31));
     }
 
+    __attribute__((always_inline)) inline bool test_bit(uint64_t bit) {
+        return phys_mem_bitmap[bit >> 5] & (1 << (bit & 31));
+    }
+
     void initialize_physical_allocator() {
         memset(phys_mem_bitmap, 0xFFFFFFFF, PHYS_BITMAP_SIZE_DWORDS * sizeof(uint32_t));
         max_blocks = PHYS_BITMAP_SIZE_DWORDS;
         used_blocks = max_blocks;
     }
 
+    static int node_of_block(uint64_t index) {
+        for(unsigned i = 0; i < node_range_count; i++) {
+            if(index >= node_ranges[i].first && index < node_ranges[i].end) {
+                return node_ranges[i].node;
+            }
+        }
+
+        return -1;
+    }
+
+    static void account_block(uint64_t index, int64_t free_delta) {
+        if(!numa_enabled) {
+            return;
+        }
+
+        int node = node_of_block(index);
+        if(node < 0) {
+            return;
+        }
+
+        __atomic_add_fetch(&node_states[node].free_blocks, free_delta, __ATOMIC_RELAXED);
+        if(free_delta > 0 && index < node_states[node].next_block) {
+            node_states[node].next_block = index;
+        }
+    }
+
+    static uint64_t find_free_in_range(uint64_t first, uint64_t end) {
+        uint64_t i = first;
+        while(i < end) {
+            if(!(i & 31) && phys_mem_bitmap[i >> 5] == 0xFFFFFFFF) {
+                i += 32;
+            } else if(!test_bit(i)) {
+                return i;
+            } else {
+                i++;
+            }
+        }
+
+        return 0;
+    }
+
+    static uint64_t find_free_in_node(unsigned node) {
+        node_state_t& state = node_states[node];
+        if(state.free_blocks <= 0) {
+            return 0;
+        }
+
+        // From where the last one was found to the end first, then wrap around
+        for(int pass = 0; pass < 2; pass++) {
+            for(unsigned i = 0; i < node_range_count; i++) {
+                const node_range_t& range = node_ranges[i];
+                if(range.node != node) {
+                    continue;
+                }
+
+                uint64_t first = pass ? range.first : kstd::max(range.first, state.next_block);
+                uint64_t end = pass ? kstd::min(range.end, state.next_block) : range.end;
+                uint64_t found = find_free_in_range(first, end);
+                if(found) {
+                    state.next_block = found;
+                    return found;
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    static uint64_t get_first_free_local_block() {
+        unsigned local = get_cpu_local()->topology.node;
+        const uint8_t* order = topology::nodes_by_distance(local);
+        for(unsigned i = 0; i < topology::node_count(); i++) {
+            uint64_t found = find_free_in_node(order[i]);
+            if(found) {
+                return found;
+            }
+        }
+
+        // Anything the SRAT didn't mention
+        return get_first_free_block();
+    }
+
+    void add_node_memory(unsigned node, uint64_t base, uint64_t length) {
+        if(node_range_count == MAX_NODE_RANGES) {
+            log::warning("[NUMA] Too many memory ranges, treating [0x%llx-0x%llx] as remote", base, base + length);
+            return;
+        }
+
+        node_range_t range = {
+            .first = kstd::max((base + PHYS_BLOCK_SIZE - 1) >> PHYS_BLOCK_SHIFT, (uint64_t)1),
+            .end = (base + length) >> PHYS_BLOCK_SHIFT,
+            .node = node
+        };
+
+        unsigned pos = node_range_count++;
+        while(pos && node_ranges[pos - 1].first > range.first) {
+            node_ranges[pos] = node_ranges[pos - 1];
+            pos--;
+        }
+
+        node_ranges[pos] = range;
+    }
+
+    void enable_numa() {
+        if(topology::node_count() < 2 || !node_range_count) {
+            return;
+        }
+
+        acquire_lock(&allocator_lock);
+        for(unsigned i = 0; i < node_range_count; i++) {
+            node_range_t& range = node_ranges[i];
+            range.end = kstd::min(range.end, max_blocks);
+            node_state_t& state = node_states[range.node];
+            if(!state.next_block || range.first < state.next_block) {
+                state.next_block = range.first;
+            }
+
+            for(uint64_t block = range.first; block < range.end; block++) {
+                if(!test_bit(block)) {
+                    state.free_blocks++;
+                }
+            }
+        }
+
+        numa_enabled = true;
+        release_lock(&allocator_lock);
+
+        for(unsigned i = 0; i < topology::node_count(); i++) {
+            log::info("[NUMA] Node %u: %lld MiB free", i, node_states[i].free_blocks * PHYS_BLOCK_SIZE / (1024 * 1024));
+        }
+    }
+
+    uint64_t get_node_free_blocks(unsigned node) {
+        if(!numa_enabled) {
+            return node ? 0 : get_free_blocks();
+        }
+
+        return node < topology::MAX_NODES ? kstd::max(node_states[node].free_blocks, (int64_t)0) : 0;
+    }
+
     uint64_t get_first_free_block() {
         if(next_chunk == 0) {
             next_chunk = 1;
@@ -80,9 +251,26 @@ namespace memory {
         used_blocks = 0;
     }
 
+    uint64_t get_total_blocks() {
+        return total_blocks;
+    }
+
+    uint64_t get_free_blocks() {
+        return used_blocks < total_blocks ? total_blocks - used_blocks : 0;
+    }
+
+    uint64_t get_max_blocks() {
+        return max_blocks;
+    }
+
+    uint64_t get_low_watermark() {
+        return kstd::max(total_blocks / 64, (uint64_t)LOW_WATERMARK_MIN);
+    }
+
     void mark_memory_region_free(uint64_t base, size_t size) {
         uint32_t blocks_to_clear = (size + (PHYS_BLOCK_SIZE - 1)) / PHYS_BLOCK_SIZE;
         uint32_t align = base / PHYS_BLOCK_SIZE;
+        total_blocks += blocks_to_clear;
         while(blocks_to_clear-- > 0) {
             clear_bit(align++);
             used_blocks--;
@@ -92,8 +280,22 @@ namespace memory {
     uint64_t allocate_physical_block() {
         acquire_lock(&allocator_lock);
 
-        uint64_t index = get_first_free_block();
+        uint64_t index = numa_enabled ? get_first_free_local_block() : get_first_free_block();
+        if(!index && zero_pool_count) {
+            // Last resort, the pool is still perfectly good memory
+            uint64_t block = zero_pool[--zero_pool_count];
+            release_lock(&allocator_lock);
+            return block;
+        }
+
         if(!index) {
+            release_lock(&allocator_lock);
+
+            // Caches first, then squeeze some cold anonymous memory into the compressed pool
+            if(mm::shrink_caches() || mm::zswap::reclaim()) {
+                return allocate_physical_block();
+            }
+
             asm("cli");
             log::error("Out of memory");
             kernel_panic((const char**)(&"Out of memory!"),1);
@@ -102,7 +304,14 @@ namespace memory {
 
         set_bit(index);
         used_blocks++;
+        account_block(index, -1);
         release_lock(&allocator_lock);
+
+        if(memory_low()) {
+            // Get some back from the caches before it runs out completely
+            mm::shrink_caches();
+        }
+
         return index << PHYS_BLOCK_SHIFT;
     }
 
@@ -114,9 +323,168 @@ namespace memory {
 
         phys_mem_bitmap[chunk] = phys_mem_bitmap[chunk] & (~(1U << (index & 31)));
         used_blocks--;
+        account_block(index, 1);
 
         if(chunk < next_chunk) {
             next_chunk = chunk;
         }
     }
-}
\ No newline at end of file
+
+    static uint64_t find_free_run(size_t count, size_t align) {
+        // Block 0 is never handed out, so start from the first aligned one after it
+        uint64_t start = align;
+        uint64_t i = start;
+        while(start + count <= max_blocks) {
+            if(i == start + count) {
+                return start;
+            }
+
+            if(phys_mem_bitmap[i >> 5] == 0xFFFFFFFF) {
+                // Skip over full chunks in one go
+                start = (((i | 31) + 1) + align - 1) / align * align;
+                i = start;
+            } else if(test_bit(i)) {
+                start = (i + align) / align * align;
+                i = start;
+            } else {
+                i++;
+            }
+        }
+
+        return 0;
+    }
+
+    uint64_t allocate_physical_blocks(size_t count, size_t align) {
+        assert(count && align);
+        if(count == 1 && align == 1) {
+            return allocate_physical_block();
+        }
+
+        acquire_lock(&allocator_lock);
+        uint64_t index = find_free_run(count, align);
+        if(index) {
+            for(uint64_t i = index; i < index + count; i++) {
+                set_bit(i);
+                account_block(i, -1);
+            }
+
+            used_blocks += count;
+            release_lock(&allocator_lock);
+            return index << PHYS_BLOCK_SHIFT;
+        }
+
+        release_lock(&allocator_lock);
+        if(count > PAGEBLOCK_BLOCKS || PAGEBLOCK_BLOCKS % align) {
+            return 0;
+        }
+
+        index = mm::compaction::compact_pageblock();
+        if(!index) {
+            return 0;
+        }
+
+        // The whole pageblock comes back claimed, only keep what was asked for
+        free_physical_blocks((index + count) << PHYS_BLOCK_SHIFT, PAGEBLOCK_BLOCKS - count);
+        return index << PHYS_BLOCK_SHIFT;
+    }
+
+    void free_physical_blocks(uint64_t addr, size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            free_physical_block(addr + i * PHYS_BLOCK_SIZE);
+        }
+    }
+
+    bool claim_physical_block(uint64_t index) {
+        acquire_lock(&allocator_lock);
+        bool claimed = !test_bit(index);
+        if(claimed) {
+            set_bit(index);
+            used_blocks++;
+            account_block(index, -1);
+        }
+
+        release_lock(&allocator_lock);
+        return claimed;
+    }
+
+    uint32_t count_used_blocks(uint64_t first, size_t count) {
+        assert(!(first & 31) && !(count & 31));
+
+        uint32_t used = 0;
+        for(uint64_t i = first >> 5; i < (first + count) >> 5; i++) {
+            used += __builtin_popcount(phys_mem_bitmap[i]);
+        }
+
+        return used;
+    }
+
+    uint64_t allocate_zeroed_block() {
+        if(!zero_pool_count) {
+            return 0;
+        }
+
+        uint64_t block = 0;
+        acquire_lock(&allocator_lock);
+        if(zero_pool_count) {
+            block = zero_pool[--zero_pool_count];
+        }
+
+        release_lock(&allocator_lock);
+        return block;
+    }
+
+    static void zero_block_nt(void* mapping) {
+        // Non-temporal so that zeroing a page nobody is going to look at for 
+        // a while doesn't evict anything useful from the cache
+        uint64_t* p = (uint64_t *)mapping;
+        for(unsigned i = 0; i < PHYS_BLOCK_SIZE / sizeof(uint64_t); i += 4) {
+            asm volatile("movnti %1, (%0);"
+                         "movnti %1, 8(%0);"
+                         "movnti %1, 16(%0);"
+                         "movnti %1, 24(%0);"
+                         :: "r"(p + i), "r"(0UL) : "memory");
+        }
+
+        asm volatile("sfence" ::: "memory");
+    }
+
+    bool refill_zero_pool(void* mapping) {
+        if(zero_pool_count >= ZERO_POOL_SIZE || memory_low()) {
+            // Not worth squeezing anything else for
+            return false;
+        }
+
+        // Straight from the bitmap, taking from the pool (or reclaiming) to fill the pool
+        // would never end
+        acquire_lock(&allocator_lock);
+        uint64_t index = numa_enabled ? get_first_free_local_block() : get_first_free_block();
+        if(!index) {
+            release_lock(&allocator_lock);
+            return false;
+        }
+
+        set_bit(index);
+        used_blocks++;
+        account_block(index, -1);
+        release_lock(&allocator_lock);
+
+        uint64_t block = index << PHYS_BLOCK_SHIFT;
+        kernel_map_virtual_memory_4k(block, (uintptr_t)mapping, 1);
+        zero_block_nt(mapping);
+
+        acquire_lock(&allocator_lock);
+        if(zero_pool_count < ZERO_POOL_SIZE) {
+            zero_pool[zero_pool_count++] = block;
+            block = 0;
+        }
+
+        release_lock(&allocator_lock);
+        if(block) {
+            // Someone else filled it up in the meantime
+            free_physical_block(block);
+            return false;
+        }
+
+        return true;
+    }
+}
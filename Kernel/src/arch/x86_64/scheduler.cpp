@@ -15,6 +15,7 @@
 #include <logging.h>
 #include <abi.h>
 #include <debug.h>
+#include <topology.h>
 
 extern "C" void idle_process();
 void kernel_process();
@@ -25,11 +26,19 @@ using thread_state = threading::thread::thread_state;
 
 constexpr uint64_t LINKER_BASE_ADDR = 0x7FC0000000;
 
+// How much each thing counts against a CPU when placing a new thread, see placement_cost
+constexpr unsigned PLACEMENT_LOAD_COST = 4;             // Per thread already queued
+constexpr unsigned PLACEMENT_REMOTE_NODE_COST = 3;      // Scaled by the node distance (x2 for a typical remote node)
+constexpr unsigned PLACEMENT_OTHER_PACKAGE_COST = 3;
+constexpr unsigned PLACEMENT_OTHER_LLC_COST = 2;
+constexpr unsigned PLACEMENT_BUSY_SIBLING_COST = 1;
+
 namespace scheduler {
     lock_t scheduler_lock;
     bool scheduler_ready = false;
 
     list<process_t *>* processes;
+    lock_t process_list_lock = 0;
     list<process_t *>* dead_processes;
     lock_t dead_process_lock = 0;
 
@@ -37,16 +46,48 @@ namespace scheduler {
 
     void schedule(void*, register_context*);
 
+    static bool sibling_busy(cpu* c) {
+        for(unsigned i = 0; i < smp::get_proc_count(); i++) {
+            cpu* other = smp::get_cpu(i);
+            if(other != c && other->topology.package == c->topology.package && other->topology.core == c->topology.core
+                && other->run_queue_count) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static unsigned placement_cost(cpu* origin, cpu* c) {
+        // Load comes first, but a thread only leaves the creator's node (or package, or cache)
+        // if it gets a noticeably shorter queue for it
+        unsigned cost = c->run_queue_count * PLACEMENT_LOAD_COST;
+        if(c->topology.node != origin->topology.node) {
+            cost += PLACEMENT_REMOTE_NODE_COST * topology::distance(origin->topology.node, c->topology.node) / topology::LOCAL_DISTANCE;
+        } else if(c->topology.package != origin->topology.package) {
+            cost += PLACEMENT_OTHER_PACKAGE_COST;
+        } else if(c->topology.llc != origin->topology.llc) {
+            cost += PLACEMENT_OTHER_LLC_COST;
+        }
+
+        // An idle core beats sharing one with something that is running
+        if(sibling_busy(c)) {
+            cost += PLACEMENT_BUSY_SIBLING_COST;
+        }
+
+        return cost;
+    }
+
     static void insert_new_thread(threading::thread* thread) {
+        cpu* origin = get_cpu_local();
         cpu* c = smp::get_cpu(0);
+        unsigned best_cost = placement_cost(origin, c);
         for(unsigned i = 1; i < smp::get_proc_count(); i++) {
             cpu* next = smp::get_cpu(i);
-            if(next->run_queue_count < c->run_queue_count) {
+            unsigned cost = placement_cost(origin, next);
+            if(cost < best_cost) {
                 c = next;
-            }
-
-            if(!c->run_queue_count) {
-                break;
+                best_cost = cost;
             }
         }
 
@@ -115,26 +156,26 @@ namespace scheduler {
         return proc;
     }
 
-    uintptr_t load_elf(process_t* proc, uintptr_t* stack_pointer, void* elf, int argc, char** argv, int envc, char** envp, const char* exec_path) {
+    uintptr_t load_elf(process_t* proc, uintptr_t* stack_pointer, fs::fs_node* elf, int argc, char** argv, int envc, char** envp, const char* exec_path) {
         elf_info_t elf_info = elf::load_elf_segments(proc, elf, 0);
         uintptr_t rip = elf_info.entry;
+        if(!rip) {
+            return 0;
+        }
+
         if(elf_info.linker_path) {
             uintptr_t linker_base_addr = LINKER_BASE_ADDR;
             fs::fs_node* node = fs::resolve_path("/lib/ld.so");
             assert(node);
 
-            void* linker_elf = malloc(node->size);
-            fs::read(node, 0, node->size, linker_elf);
-            if(!elf::verify(linker_elf)) {
+            free((void *)elf_info.linker_path);
+            elf_info_t linker_elf_info = elf::load_elf_segments(proc, node, linker_base_addr);
+            if(!linker_elf_info.entry) {
                 log::warning("Invalid dynamic linker!");
-                asm volatile("mov %%rax, %%cr3" :: "a"(get_current_process()->get_page_map()->pml4_phys));
-                asm("sti");
                 return 0;
             }
 
-            elf_info_t linker_elf_info = elf::load_elf_segments(proc, linker_elf, linker_base_addr);
             rip = linker_elf_info.entry;
-            free(linker_elf);
         }
 
         char* temp_argv[argc];
@@ -219,7 +260,7 @@ namespace scheduler {
         return rip;
     }
 
-    process_t* create_process(void* entry, bool no_queue = false) {
+    process_t* create_process(void* entry, bool no_queue) {
         process_t* proc = initialize_process();
         proc->address_space = new mm::address_space(memory::create_page_map());
 
@@ -240,11 +281,13 @@ namespace scheduler {
             insert_new_thread(proc->threads.get(0));
         }
 
+        acquire_lock(&process_list_lock);
         processes->add(proc);
+        release_lock(&process_list_lock);
         return proc;
     }
 
-    process_t* create_elf_process(void* elf, int argc, char** argv, int envc, char** envp, const char* exec_path) {
+    process_t* create_elf_process(fs::fs_node* elf, int argc, char** argv, int envc, char** envp, const char* exec_path) {
         if(!elf::verify(elf)) {
             return nullptr;
         }
@@ -265,8 +308,8 @@ namespace scheduler {
         thread->registers.rbp = thread->registers.rsp;
 
         // Pre-allocate 8 KiB
-        stack_region->vm_object()->hit(stack_region->base(), 0x200000 - 0x1000, proc->get_page_map());
-        stack_region->vm_object()->hit(stack_region->base(), 0x200000 - 0x2000, proc->get_page_map());
+        stack_region->vm_object()->hit(stack_region->base(), 0x200000 - 0x1000, proc->get_page_map(), true);
+        stack_region->vm_object()->hit(stack_region->base(), 0x200000 - 0x2000, proc->get_page_map(), true);
 
         thread->registers.rip = load_elf(proc, &thread->registers.rsp, elf, argc, argv, envc, envp, exec_path);
         if(!thread->registers.rip) {
@@ -298,7 +341,9 @@ namespace scheduler {
             log::warning("Failed to find /dev/klog");
         }
 
+        acquire_lock(&process_list_lock);
         processes->add(proc);
+        release_lock(&process_list_lock);
         return proc;
     }
 
@@ -514,6 +559,7 @@ namespace scheduler {
             log::info("Removing process...");
         })
 
+        acquire_lock(&process_list_lock);
         for(int i = 0; i < processes->size(); i++) {
             if(processes->get(i)->pid == proc->pid) {
                 processes->remove_at(i);
@@ -521,7 +567,11 @@ namespace scheduler {
             }
         }
 
+        release_lock(&process_list_lock);
+
+        acquire_lock(&dead_process_lock);
         dead_processes->add(proc);
+        release_lock(&dead_process_lock);
         bool is_process_to_kill = c->current_thread->parent == proc;
         if(is_process_to_kill) {
             asm("cli");
@@ -542,10 +592,46 @@ namespace scheduler {
         asm("int $0xFD");
     }
 
+    process_t* next_process(pid_t pid, bool wait) {
+        if(!processes) {
+            return nullptr;
+        }
+
+        if(wait) {
+            acquire_lock(&process_list_lock);
+        } else if(!acquire_test_lock(&process_list_lock)) {
+            return nullptr;
+        }
+
+        // Processes are added in pid order, so the first match is the lowest
+        process_t* found = nullptr;
+        for(int i = 0; i < processes->size(); i++) {
+            process_t* proc = processes->get(i);
+            if(proc->pid >= pid) {
+                // Pinned before it can leave the list, so gc can't have it yet
+                __atomic_add_fetch(&proc->pins, 1, __ATOMIC_ACQUIRE);
+                found = proc;
+                break;
+            }
+        }
+
+        release_lock(&process_list_lock);
+        return found;
+    }
+
+    void release_process(process_t* proc) {
+        __atomic_sub_fetch(&proc->pins, 1, __ATOMIC_RELEASE);
+    }
+
     void gc() {
         kstd::lock l(dead_process_lock);
         for(int i = dead_processes->size() - 1; i >= 0; i--) {
             process_t* p = dead_processes->get(i);
+            if(__atomic_load_n(&p->pins, __ATOMIC_ACQUIRE)) {
+                // Still being walked, it goes next time
+                continue;
+            }
+
             delete p->address_space;
             delete p;
             dead_processes->remove_at(i);
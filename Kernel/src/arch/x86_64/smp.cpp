@@ -11,6 +11,7 @@
 #include <apic.h>
 #include <logging.h>
 #include <idt.h>
+#include <topology.h>
 
 #include "smpdefines.inc"
 
@@ -62,6 +63,7 @@ namespace smp {
     static void initialize_cpu(uint16_t id) {
         cpu* c = new cpu();
         c->id = id;
+        c->topology = topology::get_cpu_topology(id);
         cpus[id] = c;
 
         *smp_magic = 0;
@@ -102,8 +104,11 @@ namespace smp {
         _cpuid(&rax, &rbx, &rcx, &rdx);
         uint8_t bspid = (rbx >> 24) & 0xFF;
 
+        topology::initialize();
+
         cpus[0] = new cpu();
         cpus[0]->id = bspid;
+        cpus[0]->topology = topology::get_cpu_topology(bspid);
         cpus[0]->gdt = (void *)GDT64Pointer64.base;
         cpus[0]->gdt_ptr = GDT64Pointer64;
         set_cpu_local(cpus[0]);
@@ -112,6 +117,7 @@ namespace smp {
             tss::initialize_tss(&cpus[0]->tss, cpus[0]->gdt);
             acpi::disable_smp();
             processor_count = 1;
+            memory::enable_numa();
             return;
         }
 
@@ -128,6 +134,9 @@ namespace smp {
 
         tss::initialize_tss(&cpus[0]->tss, cpus[0]->gdt);
         log::info("[SMP] %u processors initialized!", processor_count);
+
+        // Every CPU knows its node now
+        memory::enable_numa();
     }
 
     unsigned get_proc_count() {
@@ -8,10 +8,52 @@
 #include <frg/allocation.hpp>
 #include <frg/std_compat.hpp>
 #include <frg/string.hpp>
+#include <mm/shrinker.h>
+#include <liballoc/liballoc.h>
+#include <paging.h>
 
-static frg::hash_map<frg::string_view, kernel_symbol, frg::hash<frg::string_view>, frg::stl_allocator> symbol_map(frg::hash<frg::string_view>{});
+using symbol_map_t = frg::hash_map<frg::string_view, kernel_symbol, frg::hash<frg::string_view>, frg::stl_allocator>;
+
+// Loaded from the symbol file on demand, and dropped again if memory gets tight
+static symbol_map_t* symbol_map;
+static fs::fs_node* symbol_file;
+static size_t symbol_bytes;
+static unsigned added_symbols; // Can't be read back from the file, so they pin the table
+static lock_t symbol_lock;
+
+class symbol_shrinker final : public mm::shrinker {
+public:
+    size_t count_pages() override {
+        return added_symbols ? 0 : symbol_bytes >> memory::PAGE_SHIFT_4K;
+    }
+
+    size_t shrink(size_t) override {
+        if(!acquire_test_lock(&symbol_lock)) {
+            return 0;
+        }
+
+        size_t freed = 0;
+        if(symbol_map && !added_symbols) {
+            for(auto entry : *symbol_map) {
+                free((void *)entry.template get<1>().mangled_name);
+            }
+
+            delete symbol_map;
+            symbol_map = nullptr;
+            freed = symbol_bytes >> memory::PAGE_SHIFT_4K;
+            symbol_bytes = 0;
+        }
+
+        release_lock(&symbol_lock);
+        return freed;
+    }
+};
+
+static symbol_shrinker shrinker;
+
+static void read_symbols(fs::fs_node* node) {
+    symbol_map = new symbol_map_t(frg::hash<frg::string_view>{});
 
-void load_symbols(fs::fs_node* node) {
     constexpr unsigned buffer_size = 4096;
     char buffer[buffer_size];
     unsigned buffer_pos = 0;
@@ -45,7 +87,10 @@ void load_symbols(fs::fs_node* node) {
             sym.mangled_name = strdup(address_end + 3);
             log::debug(debug_level_symbols, debug::LEVEL_VERBOSE, "Found kernel symbol: %llx, name: '%s'",
                 sym.address, sym.mangled_name);
-            symbol_map.insert(frg::string_view(sym.mangled_name), sym);
+            symbol_map->insert(frg::string_view(sym.mangled_name), sym);
+
+            // Rough cost of the entry and the name
+            symbol_bytes += sizeof(kernel_symbol) + sizeof(frg::string_view) + strnlen(sym.mangled_name, 1024) + 1;
 
         end:
             buffer_pos += saved - line;
@@ -59,9 +104,33 @@ void load_symbols(fs::fs_node* node) {
     assert(read >= 0);
 }
 
+static void ensure_symbols() {
+    if(!symbol_map) {
+        if(symbol_file) {
+            read_symbols(symbol_file);
+        } else {
+            symbol_map = new symbol_map_t(frg::hash<frg::string_view>{});
+        }
+    }
+}
+
+void load_symbols(fs::fs_node* node) {
+    acquire_lock(&symbol_lock);
+    symbol_file = node;
+    symbol_file->add_handle();
+    if(!symbol_map) {
+        read_symbols(symbol_file);
+    }
+
+    release_lock(&symbol_lock);
+    mm::register_shrinker(&shrinker);
+}
+
 int resolve_kernel_symbol(const char* mangled_name, kernel_symbol* sym) {
-    auto existing = symbol_map.find(mangled_name);
-    if(existing == symbol_map.end()) {
+    kstd::lock l(symbol_lock);
+    ensure_symbols();
+    auto existing = symbol_map->find(mangled_name);
+    if(existing == symbol_map->end()) {
         return -1;
     }
     
@@ -70,11 +139,19 @@ int resolve_kernel_symbol(const char* mangled_name, kernel_symbol* sym) {
 }
 
 void add_kernel_symbol(kernel_symbol* sym) {
-    assert(!symbol_map.find(sym->mangled_name));
+    kstd::lock l(symbol_lock);
+    ensure_symbols();
+    assert(symbol_map->find(sym->mangled_name) == symbol_map->end());
 
-    symbol_map.insert(frg::string_view(sym->mangled_name), *sym);
+    symbol_map->insert(frg::string_view(sym->mangled_name), *sym);
+    added_symbols++;
 }
 
 void remove_kernel_symbol(const char* mangled_name) {
-    symbol_map.remove(frg::string_view(mangled_name));
+    kstd::lock l(symbol_lock);
+    ensure_symbols();
+    if(symbol_map->find(mangled_name) != symbol_map->end()) {
+        symbol_map->remove(frg::string_view(mangled_name));
+        added_symbols--;
+    }
 }
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include <kstring.h>
 #include <fs/fs_node.h>
 #include <fs/filesystem.h>
+#include <fs/directory_entry.h>
 #include <fs/pipe.h>
 #include <video/video.h>
 #include <borrrdex/core/framebuffer.h>
@@ -79,6 +80,59 @@ long sys_exit(register_context* regs) {
     return 0;
 }
 
+// The directory the last component of path is in, which has to exist already
+static int resolve_parent(char* path, const char* working_dir, fs::fs_node*& dir, const char*& name) {
+    char* slash = nullptr;
+    for(char* c = path; *c; c++) {
+        if(*c == '/') {
+            slash = c;
+        }
+    }
+
+    name = slash ? slash + 1 : path;
+    if(!*name) {
+        return -EISDIR;
+    }
+
+    if(!slash) {
+        dir = fs::resolve_path(working_dir);
+    } else if(slash == path) {
+        dir = fs::get_root();
+    } else {
+        *slash = 0;
+        dir = fs::resolve_path(path, working_dir);
+        *slash = '/';
+    }
+
+    if(!dir) {
+        return -ENOENT;
+    }
+
+    if(!dir->is_dir()) {
+        return -ENOTDIR;
+    }
+
+    return 0;
+}
+
+// Makes a new file at path, in a directory that has to exist already
+static int create_file(char* path, const char* working_dir, mode_t mode, fs::fs_node*& node) {
+    fs::fs_node* dir;
+    const char* name;
+    if(int e = resolve_parent(path, working_dir, dir, name)) {
+        return e;
+    }
+
+    fs::directory_entry ent;
+    ent.set_name(name);
+    if(int e = dir->create(&ent, mode & 07777)) {
+        return e;
+    }
+
+    node = ent.node;
+    return node ? 0 : -EIO;
+}
+
 long sys_open(register_context* regs) {
     const char* arg0 = (const char*)SC_ARG0(regs);
     size_t arg0_len = strnlen(arg0, fs::PATH_MAX) + 1;
@@ -100,7 +154,9 @@ open:
     fs::fs_node* node = fs::resolve_path(filepath, proc->working_dir, !(flags & O_NOFOLLOW));
     if(!node) {
         if(flags & O_CREAT) {
-            return -EROFS; // Take care of writing later
+            if(int e = create_file(filepath, proc->working_dir, SC_ARG2(regs), node)) {
+                return e;
+            }
         } else {
             IF_DEBUG(debug_level_syscalls >= debug::LEVEL_NORMAL, {
                 log::warning("sys_open (flags: 0x%llx): Failed to open file %s", flags, filepath);
@@ -108,14 +164,20 @@ open:
 
             return -ENOENT;
         }
+    } else if((flags & O_CREAT) && (flags & O_EXCL)) {
+        return -EEXIST;
     }
 
     if((flags & O_DIRECTORY) && !node->is_dir()) {
         return -ENOTDIR;
     }
 
-    if((flags & O_TRUNC) && ((flags & O_ACCMODE) == O_RDWR || (flags & O_ACCMODE) == O_WRONLY)) {
-        return -EROFS; // Take care of writing later
+    if((flags & O_TRUNC) && node->is_file() && ((flags & O_ACCMODE) == O_RDWR || (flags & O_ACCMODE) == O_WRONLY)) {
+        if(int e = node->truncate(0)) {
+            return e;
+        }
+
+        mm::file_vm_object::forget(node);
     }
 
     fs::fs_fd_t* handle = fs::open(node, flags);
@@ -151,7 +213,7 @@ long sys_mmap(register_context* regs) {
     bool fixed = flags & MAP_FIXED;
     bool anon = flags & MAP_ANONYMOUS;
 
-    uint64_t unknown_flags = flags & ~static_cast<uint64_t>(MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED);
+    uint64_t unknown_flags = flags & ~static_cast<uint64_t>(MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_POPULATE);
     if(unknown_flags || !anon) {
         log::warning("sys_mmap: Unsupported mmap flags 0x%llx", flags);
         return -EINVAL;
@@ -163,10 +225,118 @@ long sys_mmap(register_context* regs) {
         return -1;
     }
 
+    if(flags & MAP_POPULATE) {
+        // Not fatal, anything missed will just fault in later
+        region->vm_object()->populate(region->base(), 0, region->size(), proc->get_page_map());
+    }
+
     *address = region->base();
     return 0;
 }
 
+long sys_madvise(register_context* regs) {
+    uintptr_t address = SC_ARG0(regs);
+    size_t size = SC_ARG1(regs);
+    int advice = SC_ARG2(regs);
+
+    if(address & (memory::PAGE_SIZE_4K - 1)) {
+        return -EINVAL;
+    }
+
+    if(size > UINTPTR_MAX - address - (memory::PAGE_SIZE_4K - 1)) {
+        // Rounding up would wrap around the end of the address space
+        return -EINVAL;
+    }
+
+    size = (size + memory::PAGE_SIZE_4K - 1) & memory::PAGE_SIZE_4K_MASK;
+    process_t* proc = scheduler::get_current_process();
+    return proc->address_space->advise(address, size, advice);
+}
+
+long sys_fadvise(register_context* regs) {
+    process_t* proc = scheduler::get_current_process();
+    fs::fs_fd_t* handle = proc->get_file_desc(SC_ARG0(regs));
+    if(!handle) {
+        log::warning("sys_fadvise: Invalid file descriptor: %d", SC_ARG0(regs));
+        return -EBADF;
+    }
+
+    return fs::advise(handle, SC_ARG1(regs), SC_ARG2(regs), SC_ARG3(regs));
+}
+
+long sys_readahead(register_context* regs) {
+    process_t* proc = scheduler::get_current_process();
+    fs::fs_fd_t* handle = proc->get_file_desc(SC_ARG0(regs));
+    if(!handle) {
+        log::warning("sys_readahead: Invalid file descriptor: %d", SC_ARG0(regs));
+        return -EBADF;
+    }
+
+    if(!handle->node->is_file()) {
+        return -EINVAL;
+    }
+
+    return fs::advise(handle, SC_ARG1(regs), SC_ARG2(regs), fs::FADV_WILLNEED);
+}
+
+long sys_fsync(register_context* regs) {
+    process_t* proc = scheduler::get_current_process();
+    fs::fs_fd_t* handle = proc->get_file_desc(SC_ARG0(regs));
+    if(!handle) {
+        log::warning("sys_fsync: Invalid file descriptor: %d", SC_ARG0(regs));
+        return -EBADF;
+    }
+
+    return fs::fsync(handle->node);
+}
+
+long sys_sync(register_context* regs) {
+    return fs::sync();
+}
+
+long sys_getdents(register_context* regs) {
+    process_t* proc = scheduler::get_current_process();
+    fs::fs_fd_t* handle = proc->get_file_desc(SC_ARG0(regs));
+    if(!handle) {
+        log::warning("sys_getdents: Invalid file descriptor: %d", SC_ARG0(regs));
+        return -EBADF;
+    }
+
+    uint64_t count = SC_ARG2(regs);
+    if(!memory::check_usermode_pointer(SC_ARG1(regs), count, proc->address_space)) {
+        log::warning("sys_getdents: invalid memory buffer: 0x%llx", SC_ARG1(regs));
+        return -EFAULT;
+    }
+
+    return fs::read_entries(handle, (uint8_t *)SC_ARG1(regs), count);
+}
+
+long sys_unlink(register_context* regs) {
+    process_t* proc = scheduler::get_current_process();
+    const char* arg0 = (const char*)SC_ARG0(regs);
+    uint64_t flags = SC_ARG1(regs);
+    if(!memory::check_usermode_pointer(SC_ARG0(regs), 1, proc->address_space)) {
+        log::warning("sys_unlink: invalid path: 0x%llx", SC_ARG0(regs));
+        return -EFAULT;
+    }
+
+    size_t path_len = strnlen(arg0, fs::PATH_MAX) + 1;
+    char* path = (char *)malloc(path_len);
+    strncpy(path, arg0, path_len);
+
+    fs::fs_node* dir;
+    const char* name;
+    int ret = resolve_parent(path, proc->working_dir, dir, name);
+    if(!ret) {
+        fs::directory_entry ent;
+        ent.set_name(name);
+        ret = dir->unlink(&ent, flags & AT_REMOVEDIR);
+    }
+
+    free(path);
+    return ret;
+}
+
 long sys_seek(register_context* regs) {
     process_t* proc = scheduler::get_current_process();
     fs::fs_fd_t* handle = proc->get_file_desc(SC_ARG0(regs));
@@ -177,7 +347,8 @@ long sys_seek(register_context* regs) {
 
     switch(SC_ARG2(regs)) {
         case SEEK_SET: {
-            if(SC_ARG1(regs) > handle->node->size) {
+            // A directory's position is a getdents cookie, which only the filesystem can check
+            if(SC_ARG1(regs) > handle->node->size && !handle->node->is_dir()) {
                 return -EINVAL;
             }
 
@@ -576,7 +747,14 @@ syscall_t syscalls[NUM_SYSCALLS] = {
     sys_set_fstat_flags,
     sys_pipe,
     sys_fstat,
-    sys_stat
+    sys_stat,
+    sys_madvise,
+    sys_fadvise,
+    sys_readahead,
+    sys_fsync,
+    sys_sync,
+    sys_getdents,
+    sys_unlink
 };
 
 extern "C" void syscall_handler(register_context* regs) {
@@ -0,0 +1,196 @@
+#include <topology.h>
+#include <kcpuid.h>
+#include <logging.h>
+
+namespace topology {
+    constexpr unsigned MAX_APIC_ID = 256;
+
+    static uint32_t domains[MAX_NODES];
+    static unsigned domain_count;
+    static uint8_t apic_nodes[MAX_APIC_ID];
+    static uint8_t distances[MAX_NODES][MAX_NODES]; // 0 until the SLIT says otherwise
+    static uint8_t node_order[MAX_NODES][MAX_NODES];
+
+    // APIC ID layout, from the bottom: SMT thread, core, package.  CPUs sharing the
+    // last level cache have the same APIC ID above llc_bits.
+    static unsigned smt_bits;
+    static unsigned core_bits;
+    static unsigned llc_bits;
+
+    static unsigned bits_for(uint32_t count) {
+        unsigned bits = 0;
+        while((1U << bits) < count) {
+            bits++;
+        }
+
+        return bits;
+    }
+
+    static int find_node(uint32_t domain) {
+        for(unsigned i = 0; i < domain_count; i++) {
+            if(domains[i] == domain) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    int node_for_domain(uint32_t domain) {
+        int node = find_node(domain);
+        if(node >= 0) {
+            return node;
+        }
+
+        if(domain_count == MAX_NODES) {
+            log::warning("[Topology] More than %u proximity domains, ignoring %u", MAX_NODES, domain);
+            return -1;
+        }
+
+        domains[domain_count] = domain;
+        return domain_count++;
+    }
+
+    void add_processor(uint32_t apic_id, uint32_t domain) {
+        int node = node_for_domain(domain);
+        if(apic_id < MAX_APIC_ID && node >= 0) {
+            apic_nodes[apic_id] = node;
+        }
+    }
+
+    void set_distance(uint32_t from_domain, uint32_t to_domain, uint8_t distance) {
+        // The SLIT can mention domains that have nothing in them, don't make nodes for those
+        int from = find_node(from_domain);
+        int to = find_node(to_domain);
+        if(from >= 0 && to >= 0) {
+            distances[from][to] = distance;
+        }
+    }
+
+    static uint32_t read_cache_sharing(uint32_t leaf) {
+        // Deterministic cache parameters, the last level listed is the last level cache
+        uint32_t a, b, c, d;
+        uint32_t sharing = 0;
+        for(uint32_t sub = 0; sub < 8; sub++) {
+            cpuid_count(leaf, sub, &a, &b, &c, &d);
+            if(!(a & 0x1F)) {
+                break;
+            }
+
+            sharing = ((a >> 14) & 0xFFF) + 1;
+        }
+
+        return sharing;
+    }
+
+    static void read_cpuid_topology() {
+        uint32_t a, b, c, d;
+        cpuid_count(0, 0, &a, &b, &c, &d);
+        uint32_t max_leaf = a;
+        cpuid_count(0x80000000, 0, &a, &b, &c, &d);
+        uint32_t max_extended_leaf = a;
+
+        bool found = false;
+        if(max_leaf >= 0xB) {
+            // Extended topology enumeration (Intel SDM Vol. 2A CPUID leaf 0BH)
+            for(uint32_t level = 0; level < 8; level++) {
+                cpuid_count(0xB, level, &a, &b, &c, &d);
+                uint32_t type = (c >> 8) & 0xFF;
+                if(!type || !b) {
+                    break;
+                }
+
+                found = true;
+                if(type == 1) {
+                    smt_bits = a & 0x1F;
+                } else if(type == 2) {
+                    core_bits = (a & 0x1F) - smt_bits;
+                }
+            }
+        }
+
+        if(!found) {
+            // Older CPUs only give a count of logical processors per package, and
+            // (Intel only) how many cores that is
+            cpuid_count(1, 0, &a, &b, &c, &d);
+            if(d & (1 << 28)) {
+                uint32_t logical = (b >> 16) & 0xFF;
+                uint32_t cores = 1;
+                if(max_leaf >= 4) {
+                    cpuid_count(4, 0, &a, &b, &c, &d);
+                    cores = ((a >> 26) & 0x3F) + 1;
+                }
+
+                core_bits = bits_for(cores);
+                smt_bits = bits_for(logical) > core_bits ? bits_for(logical) - core_bits : 0;
+            }
+        }
+
+        uint32_t sharing = max_leaf >= 4 ? read_cache_sharing(4) : 0;
+        if(!sharing && max_extended_leaf >= 0x8000001D) {
+            // AMD keeps the same information here instead
+            sharing = read_cache_sharing(0x8000001D);
+        }
+
+        // Otherwise assume one per package
+        llc_bits = sharing ? bits_for(sharing) : smt_bits + core_bits;
+    }
+
+    void initialize() {
+        read_cpuid_topology();
+
+        if(!domain_count) {
+            domain_count = 1;
+        }
+
+        for(unsigned i = 0; i < domain_count; i++) {
+            for(unsigned j = 0; j < domain_count; j++) {
+                if(!distances[i][j]) {
+                    distances[i][j] = i == j ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+                }
+            }
+
+            // Insertion sort, there are only a handful
+            unsigned count = 0;
+            for(unsigned j = 0; j < domain_count; j++) {
+                unsigned pos = count++;
+                while(pos && (distances[i][node_order[i][pos - 1]] > distances[i][j]
+                    || (distances[i][node_order[i][pos - 1]] == distances[i][j] && j == i))) {
+                    node_order[i][pos] = node_order[i][pos - 1];
+                    pos--;
+                }
+
+                node_order[i][pos] = j;
+            }
+        }
+
+        log::info("[Topology] %u NUMA node(s), %u SMT thread(s) per core, %u core(s) per package, %u thread(s) per LLC",
+            domain_count, 1U << smt_bits, 1U << core_bits, 1U << llc_bits);
+    }
+
+    cpu_topology_t get_cpu_topology(uint32_t apic_id) {
+        return {
+            .node = apic_id < MAX_APIC_ID ? apic_nodes[apic_id] : (uint8_t)0,
+            .package = apic_id >> (smt_bits + core_bits),
+            .core = (apic_id >> smt_bits) & ((1U << core_bits) - 1),
+            .thread = apic_id & ((1U << smt_bits) - 1),
+            .llc = apic_id >> llc_bits
+        };
+    }
+
+    unsigned node_count() {
+        return domain_count ? domain_count : 1;
+    }
+
+    uint8_t distance(unsigned from, unsigned to) {
+        if(from >= node_count() || to >= node_count()) {
+            return REMOTE_DISTANCE;
+        }
+
+        return distances[from][to];
+    }
+
+    const uint8_t* nodes_by_distance(unsigned node) {
+        return node_order[node < node_count() ? node : 0];
+    }
+}
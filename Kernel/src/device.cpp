@@ -1,5 +1,6 @@
 #include <device.h>
 #include <fs/fs_volume.h>
+#include <fs/dcache.h>
 
 #include <frg/list.hpp>
 #include <frg/std_compat.hpp>
@@ -77,13 +78,13 @@ namespace device_manager {
 
             if(index == 0) {
                 dir_ent->set_name(".");
-                dir_ent->flags = fs::FS_NODE_DIRECTORY;
+                dir_ent->flags = fs::DT_DIR;
                 return 1;
             }
 
             if(index == 1) {
                 dir_ent->set_name("..");
-                dir_ent->flags = fs::FS_NODE_DIRECTORY;
+                dir_ent->flags = fs::DT_DIR;
                 return 1;
             }
 
@@ -91,9 +92,15 @@ namespace device_manager {
             int i = 2;
             while(i < index) {
                 item = item->hook.next;
+                i++;
             }
 
             dir_ent->set_name(item->entry->instance_name());
+            dir_ent->node = item->entry;
+            if(item->entry->flags & fs::FS_NODE_TYPE) {
+                dir_ent->flags = fs::directory_entry::file_to_dirent_flags(item->entry->flags);
+            }
+
             return 1;
         }
 
@@ -133,6 +140,9 @@ namespace device_manager {
             root_devices.push_back(new device_node{d});
             root_device_count++;
         }
+
+        // Anything that was looked up under /dev and wasn't there might be now
+        fs::dcache::invalidate_dir(dfs);
     }
 
     void unregister_device(devices::device* d) {
@@ -147,6 +157,7 @@ namespace device_manager {
         auto i = all_devices.iterator_to(&tmp);
         all_devices.erase(i);
         delete *i;
+        fs::dcache::invalidate_dir(dfs);
     }
 
     fs::fs_node* get_devfs() {
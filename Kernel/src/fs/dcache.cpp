@@ -0,0 +1,272 @@
+#include <fs/dcache.h>
+#include <fs/fs_node.h>
+#include <physical_allocator.h>
+#include <kstring.h>
+#include <kmath.h>
+#include <lock.h>
+#include <logging.h>
+
+namespace fs::dcache {
+    static dentry* entries;
+    static size_t capacity;
+    static uint32_t* buckets;
+    static uint32_t bucket_mask;
+    static uint32_t free_head {NO_ENTRY};
+    static uint32_t hand;
+    static lock_t cache_lock {0};
+
+    // Odd while a writer is changing the table.  Readers check it didn't move while they
+    // were looking, and just go to the filesystem if it did.
+    static uint32_t sequence;
+
+    // Moves on every invalidation, anything the filesystem said before that might be stale
+    static uint64_t generation;
+    static stats_t stats;
+
+    static uint32_t hash_name(const fs_node* parent, const char* name, size_t name_len) {
+        // FNV-1a, starting from the directory
+        uint64_t hash = 0xCBF29CE484222325ULL ^ ((uintptr_t)parent >> 4);
+        for(size_t i = 0; i < name_len; i++) {
+            hash ^= (uint8_t)name[i];
+            hash *= 0x100000001B3ULL;
+        }
+
+        return (uint32_t)(hash ^ (hash >> 32));
+    }
+
+    static inline void write_begin() {
+        __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    static inline void write_end() {
+        __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+    }
+
+    static dentry* find(fs_node* parent, const char* name, size_t name_len, uint32_t hash) {
+        for(uint32_t i = buckets[hash & bucket_mask]; i != NO_ENTRY; i = entries[i].next) {
+            dentry* d = &entries[i];
+            if(d->hash == hash && d->parent == parent && d->name_len == name_len && memcmp(d->name, name, name_len) == 0) {
+                return d;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Has to be inside write_begin / write_end
+    static void remove(dentry* d) {
+        uint32_t index = d - entries;
+        uint32_t* link = &buckets[d->hash & bucket_mask];
+        while(*link != index) {
+            link = &entries[*link].next;
+        }
+
+        *link = d->next;
+        d->parent->child_dentries.erase(d->parent->child_dentries.iterator_to(d));
+        if(d->node) {
+            d->node->dentries.erase(d->node->dentries.iterator_to(d));
+        }
+
+        d->parent = nullptr;
+        d->node = nullptr;
+        d->name_len = 0;
+        d->next = free_head;
+        free_head = index;
+        stats.entries--;
+    }
+
+    static void invalidated() {
+        __atomic_store_n(&generation, generation + 1, __ATOMIC_RELEASE);
+    }
+
+    // A free entry, or the first one the hand finds that hasn't been used since it last went past
+    static dentry* take() {
+        if(free_head == NO_ENTRY) {
+            for(size_t i = 0; i < capacity * 2; i++) {
+                dentry* d = &entries[hand];
+                hand = (hand + 1) % capacity;
+                if(d->referenced) {
+                    d->referenced = false;
+                    continue;
+                }
+
+                remove(d);
+                break;
+            }
+        }
+
+        uint32_t index = free_head;
+        free_head = entries[index].next;
+        return &entries[index];
+    }
+
+    void initialize() {
+        uint64_t ram = memory::get_total_blocks() * memory::PHYS_BLOCK_SIZE;
+        capacity = kstd::min(kstd::max(ram / RAM_SHARE / sizeof(dentry), (uint64_t)MIN_ENTRIES), (uint64_t)MAX_ENTRIES);
+
+        size_t bucket_count = 1;
+        while(bucket_count < capacity) {
+            bucket_count <<= 1;
+        }
+
+        bucket_mask = bucket_count - 1;
+        buckets = new uint32_t[bucket_count];
+        for(size_t i = 0; i < bucket_count; i++) {
+            buckets[i] = NO_ENTRY;
+        }
+
+        entries = new dentry[capacity];
+        for(size_t i = 0; i < capacity; i++) {
+            entries[i].parent = nullptr;
+            entries[i].node = nullptr;
+            entries[i].name_len = 0;
+            entries[i].referenced = false;
+            entries[i].next = i + 1 < capacity ? i + 1 : NO_ENTRY;
+        }
+
+        free_head = 0;
+        stats.capacity = capacity;
+        log::info("[dcache] Up to %llu entries", capacity);
+    }
+
+    bool lookup(fs_node* parent, const char* name, size_t name_len, fs_node*& node, uint64_t& ticket) {
+        ticket = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+        if(!entries || !name_len || name_len > INLINE_NAME) {
+            return false;
+        }
+
+        uint32_t hash = hash_name(parent, name, name_len);
+        uint32_t seq = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            // Rather than wait for the writer, whoever it is
+            __atomic_add_fetch(&stats.misses, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        // Whatever this reads can be torn or reused under it, it only counts if the sequence
+        // hasn't moved by the end.  A chain can't be longer than the table.
+        dentry* hit = nullptr;
+        fs_node* found = nullptr;
+        uint32_t i = __atomic_load_n(&buckets[hash & bucket_mask], __ATOMIC_RELAXED);
+        for(size_t steps = 0; i < capacity && steps < capacity; steps++) {
+            dentry* d = &entries[i];
+            uint8_t len = __atomic_load_n(&d->name_len, __ATOMIC_RELAXED);
+            if(d->hash == hash && d->parent == parent && len == name_len && memcmp(d->name, name, name_len) == 0) {
+                hit = d;
+                found = d->node;
+                break;
+            }
+
+            i = __atomic_load_n(&d->next, __ATOMIC_RELAXED);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(!hit || __atomic_load_n(&sequence, __ATOMIC_RELAXED) != seq) {
+            __atomic_add_fetch(&stats.misses, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        hit->referenced = true;
+        __atomic_add_fetch(found ? &stats.hits : &stats.negative_hits, 1, __ATOMIC_RELAXED);
+        node = found;
+        return true;
+    }
+
+    void insert(fs_node* parent, const char* name, size_t name_len, fs_node* node, uint64_t ticket) {
+        if(!entries || !name_len || name_len > INLINE_NAME) {
+            return;
+        }
+
+        uint32_t hash = hash_name(parent, name, name_len);
+        kstd::lock l(cache_lock);
+        if(generation != ticket || find(parent, name, name_len, hash)) {
+            // Changed since the filesystem was asked, or someone else already put it in
+            return;
+        }
+
+        write_begin();
+        dentry* d = take();
+        d->parent = parent;
+        d->node = node;
+        d->hash = hash;
+        d->referenced = false;
+        memcpy(d->name, name, name_len);
+        d->name_len = name_len;
+        d->next = buckets[hash & bucket_mask];
+        buckets[hash & bucket_mask] = d - entries;
+        parent->child_dentries.push_back(d);
+        if(node) {
+            node->dentries.push_back(d);
+        }
+
+        stats.entries++;
+        write_end();
+    }
+
+    void invalidate(fs_node* parent, const char* name) {
+        if(!entries) {
+            return;
+        }
+
+        size_t name_len = strnlen(name, INLINE_NAME + 1);
+        kstd::lock l(cache_lock);
+        invalidated();
+        if(name_len > INLINE_NAME) {
+            return;
+        }
+
+        if(dentry* d = find(parent, name, name_len, hash_name(parent, name, name_len))) {
+            write_begin();
+            remove(d);
+            write_end();
+        }
+    }
+
+    void invalidate_dir(fs_node* parent) {
+        if(!entries || !parent) {
+            return;
+        }
+
+        kstd::lock l(cache_lock);
+        invalidated();
+        if(parent->child_dentries.empty()) {
+            return;
+        }
+
+        write_begin();
+        while(!parent->child_dentries.empty()) {
+            remove(parent->child_dentries.front());
+        }
+
+        write_end();
+    }
+
+    void forget(fs_node* node) {
+        if(!entries) {
+            return;
+        }
+
+        kstd::lock l(cache_lock);
+        invalidated();
+        if(node->child_dentries.empty() && node->dentries.empty()) {
+            return;
+        }
+
+        write_begin();
+        while(!node->child_dentries.empty()) {
+            remove(node->child_dentries.front());
+        }
+
+        while(!node->dentries.empty()) {
+            remove(node->dentries.front());
+        }
+
+        write_end();
+    }
+
+    stats_t get_stats() {
+        kstd::lock l(cache_lock);
+        return stats;
+    }
+}
@@ -2,6 +2,7 @@
 #include <fs/fs_node.h>
 #include <kstring.h>
 #include <kassert.h>
+#include <stddef.h>
 
 namespace fs {
     directory_entry::directory_entry(fs_node* node, const char* name)
@@ -39,4 +40,22 @@ namespace fs {
 
         return flags;
     }
+
+    bool dir_buffer::add(const char* name, size_t name_len, ino_t inode, uint8_t type, off_t next) {
+        size_t record = (offsetof(dirent_t, d_name) + name_len + 1 + 7) & ~7ULL;
+        if(_full || _used + record > _size) {
+            _full = true;
+            return false;
+        }
+
+        dirent_t* dirent = (dirent_t *)(_buffer + _used);
+        dirent->d_ino = inode;
+        dirent->d_off = next;
+        dirent->d_reclen = record;
+        dirent->d_type = type;
+        memcpy(dirent->d_name, name, name_len);
+        dirent->d_name[name_len] = 0;
+        _used += record;
+        return true;
+    }
 }
\ No newline at end of file
@@ -6,6 +6,11 @@
 #include <ref_counted.hpp>
 #include <debug.h>
 #include <lru_cache.hpp>
+#include <paging.h>
+#include <physical_allocator.h>
+#include <mm/page_cache.h>
+#include <mm/vm_object.h>
+#include <stddef.h>
 
 constexpr uint16_t EXT2_VALID_FS = 1;
 constexpr uint16_t EXT2_ERROR_FS = 2;
@@ -38,6 +43,13 @@ constexpr uint32_t EXT2_RO_SPARSE               = 0x1;
 constexpr uint32_t EXT2_RO_LARGE_FILES          = 0x2;
 constexpr uint32_t EXT2_RO_BINARY_TREE          = 0x4;
 
+constexpr uint32_t EXT2_FLAGS_SIGNED_HASH       = 0x1;
+constexpr uint32_t EXT2_FLAGS_UNSIGNED_HASH     = 0x2;
+
+constexpr uint32_t EXT2_DX_ROOT_INFO_OFFSET     = 24;   // After the 12 bytes each of . and ..
+constexpr uint32_t EXT2_DX_NODE_OFFSET          = 8;    // After the empty entry
+constexpr uint32_t EXT2_DX_BLOCK_MASK           = 0x0FFFFFFF;
+
 constexpr uint32_t EXT2_INCOMPAT_FEATURE_SUPPORT    = EXT2_INCOMPAT_FILETYPE;
 constexpr uint32_t EXT2_RO_FEATURE_SUPPORT          = EXT2_RO_SPARSE | EXT2_RO_LARGE_FILES;
 
@@ -93,8 +105,83 @@ typedef struct {
     16 bytes volume name, mostly unusued. A valid volume name would consist of only ISO-Latin-1 characters and be 0 terminated. 
     */
     char volume_name[16];
+
+    /*
+    64 bytes directory path where the file system was last mounted. 
+    */
+    char last_mounted[64];
+
+    /*
+    32bit value used by compression algorithms to determine the compression method(s) used. 
+    */
+    uint32_t algo_bitmap;
+
+    /*
+    Blocks to try to preallocate for files and directories, and blocks reserved for growing
+    the group descriptor table. 
+    */
+    uint8_t prealloc_blocks;
+    uint8_t prealloc_dir_blocks;
+    uint16_t reserved_gdt_blocks;
+
+    /*
+    Journaling support (ext3), unused here. 
+    */
+    guid_t journal_uuid;
+    uint32_t journal_inum;
+    uint32_t journal_dev;
+    uint32_t last_orphan;
+
+    /*
+    4 x 32bit values used as the seed for the directory indexing hashes, all zero means the default. 
+    */
+    uint32_t hash_seed[4];
+
+    /*
+    8bit value with the hash version directories are indexed with by default. 
+    */
+    uint8_t def_hash_version;
+    uint8_t jnl_backup_type;
+    uint16_t desc_size;
+    uint32_t default_mount_opts;
+    uint32_t first_meta_bg;
+    uint32_t mkfs_time;
+    uint32_t jnl_blocks[17];
+    uint32_t blocks_count_hi;
+    uint32_t r_blocks_count_hi;
+    uint32_t free_blocks_count_hi;
+    uint16_t min_extra_isize;
+    uint16_t want_extra_isize;
+
+    /*
+    32bit miscellaneous flags, including whether the directory hashes take names as signed 
+    or unsigned chars. 
+    */
+    uint32_t flags;
 } ext2_super_block_ext_t;
 
+static_assert(sizeof(ext2_super_block_t) + offsetof(ext2_super_block_ext_t, flags) == 0x160, "Incorrect superblock layout");
+
+// The root of a directory index, right after the . and .. entries of its first block
+typedef struct {
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+} ext2_dx_root_info_t;
+
+// Starts the entries of every index block, standing in for the hash of the first one
+typedef struct {
+    uint16_t limit;
+    uint16_t count;
+} ext2_dx_countlimit_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t block;         // Within the directory
+} ext2_dx_entry_t;
+
 typedef struct {
     uint32_t inode;
     uint16_t rec_len;
@@ -105,7 +192,28 @@ typedef struct {
 
 namespace fs {
     inline static uint32_t location_to_block(uint64_t l, uint32_t log_block_size) {
-        return (1 >> log_block_size) >> 10;
+        return l >> (10 + log_block_size);
+    }
+
+    inline static uint8_t file_type_to_dirent(uint8_t file_type) {
+        switch(file_type) {
+            case ext2::FT_REG_FILE:
+                return DT_REG;
+            case ext2::FT_DIR:
+                return DT_DIR;
+            case ext2::FT_CHRDEV:
+                return DT_CHR;
+            case ext2::FT_BLKDEV:
+                return DT_BLK;
+            case ext2::FT_FIFO:
+                return DT_FIFO;
+            case ext2::FT_SOCK:
+                return DT_SOCK;
+            case ext2::FT_SYMLINK:
+                return DT_LNK;
+            default:
+                return DT_UNKNOWN;
+        }
     }
 
     inline static uint64_t block_to_lba(uint64_t block, uint32_t block_size, uint32_t sector_size) {
@@ -133,6 +241,9 @@ namespace fs {
             _file_type = (sbe->feature_incompat & EXT2_INCOMPAT_FILETYPE) != 0;
             _large_files = (sbe->feature_ro_compat & EXT2_RO_LARGE_FILES) != 0;
             _sparse = (sbe->feature_ro_compat & EXT2_RO_SPARSE) != 0;
+            _dir_index = (sbe->feature_compat & EXT2_COMPAT_DIR_INDEXING) != 0;
+            _unsigned_hash = (sbe->flags & EXT2_FLAGS_UNSIGNED_HASH) != 0;
+            memcpy(_hash_seed, sbe->hash_seed, sizeof(_hash_seed));
         } else {
             memset(sbe, 0, sizeof(ext2_super_block_ext_t));
         }
@@ -140,6 +251,13 @@ namespace fs {
         _block_group_count = (sb->block_count + sb->blocks_per_group - 1) / sb->blocks_per_group;
         _block_size = 1024 << sb->log_block_size;
         _inode_size = sb->rev_level > 0 ? sbe->inode_size : 128;
+        _first_inode = sb->rev_level > 0 ? sbe->first_ino : fs::ext2::GOOD_OLD_FIRST_INODE;
+        if(_block_size > memory::PAGE_SIZE_4K) {
+            // Metadata is read out of the page cache a block at a time
+            log::error("[ext2] Block size %u is bigger than a page", _block_size);
+            _error = INCOMPATIBLE_ERROR;
+            return;
+        }
 
         // Block groups start at the next block after the superblock
         uint64_t block_group_lba = block_to_lba(location_to_block(fs::ext2::SUPERBLOCK_LOCATION, sb->log_block_size) + 1, 
@@ -165,36 +283,329 @@ namespace fs {
         _mount_point_entry.node = _mount_point;
         _mount_point_entry.flags = DT_DIR;
         _mount_point_entry.set_name(name);
+
+        // Let the inode cache use a slice of RAM, the shrinker takes it back if it's needed
+        uint64_t ram = memory::get_total_blocks() * memory::PHYS_BLOCK_SIZE;
+        _inode_cache.set_capacity(kstd::max(ram / INODE_CACHE_RAM_SHARE / sizeof(ext2_node), INODE_CACHE_MIN));
+        mm::register_shrinker(this);
     }
 
-    int ext2_volume::read_block(uint32_t block_num, void* buffer, bool cache) {
-        if(block_num > _sb->block_count) {
-            return -1;
+    size_t ext2_volume::count_pages() {
+        return (_inode_cache.size() * sizeof(ext2_node)) >> memory::PAGE_SHIFT_4K;
+    }
+
+    size_t ext2_volume::shrink(size_t count) {
+        size_t bytes = count << memory::PAGE_SHIFT_4K;
+        size_t freed = _inode_cache.shrink((bytes + sizeof(ext2_node) - 1) / sizeof(ext2_node)) * sizeof(ext2_node);
+        return freed >> memory::PAGE_SHIFT_4K;
+    }
+
+    bool ext2_block_map::find(uint32_t logical, uint32_t& physical) {
+        kstd::lock l(_lock);
+        for(const extent_t& extent : _extents) {
+            if(extent.count && logical >= extent.logical && logical - extent.logical < extent.count) {
+                physical = extent.physical ? extent.physical + (logical - extent.logical) : 0;
+                return true;
+            }
         }
 
-        auto do_disk_read = [&](void* b) {
-            uint32_t sectors_per_block = _block_size / _partition->parent()->block_size();
-            return _partition->read_block(block_num * sectors_per_block, sectors_per_block, b);
-        };
+        return false;
+    }
 
-        
-        if(cache) {
-            uint8_t* cached_block;
-            if(!_block_cache.get(block_num, cached_block)) {
-                cached_block = (uint8_t *)malloc(_block_size);
-                if(int e = do_disk_read(cached_block) < 0) {
-                    free(cached_block);
-                    return e;
-                }
+    void ext2_block_map::add(uint32_t logical, uint32_t physical, uint32_t count) {
+        kstd::lock l(_lock);
+        _extents[_next] = { logical, physical, count };
+        _next = (_next + 1) % EXTENTS;
+    }
 
-                _block_cache.set(block_num, cached_block);
+    void ext2_block_map::forget(uint32_t logical) {
+        kstd::lock l(_lock);
+        for(extent_t& extent : _extents) {
+            if(extent.count && logical >= extent.logical && logical - extent.logical < extent.count) {
+                extent.count = 0;
             }
+        }
+    }
 
-            memcpy(buffer, cached_block, _block_size);
-            return 1;
-        } 
-        
-        return do_disk_read(buffer);
+    void ext2_block_map::clear() {
+        kstd::lock l(_lock);
+        for(extent_t& extent : _extents) {
+            extent.count = 0;
+        }
+    }
+
+    uint8_t* ext2_volume::pin_block(uint32_t block, mm::page_cache::page*& page) {
+        if(block >= _sb->block_count) {
+            return nullptr;
+        }
+
+        uint64_t byte_offset = (uint64_t)block * _block_size;
+        page = mm::page_cache::get_device_page(_partition, byte_offset >> memory::PAGE_SHIFT_4K);
+        if(!page) {
+            return nullptr;
+        }
+
+        return page->data + (byte_offset & (memory::PAGE_SIZE_4K - 1));
+    }
+
+    void ext2_volume::dirty(mm::page_cache::page* page, const void* at, size_t size) {
+        mm::page_cache::mark_dirty(page, (const uint8_t *)at - page->data, size);
+    }
+
+    int ext2_volume::write_metadata(uint64_t offset, const void* data, size_t size) {
+        const uint8_t* source = (const uint8_t *)data;
+        while(size) {
+            mm::page_cache::page* page = mm::page_cache::get_device_page(_partition, offset >> memory::PAGE_SHIFT_4K);
+            if(!page) {
+                return -EIO;
+            }
+
+            uint32_t in_page = offset & (memory::PAGE_SIZE_4K - 1);
+            size_t count = kstd::min(size, (size_t)memory::PAGE_SIZE_4K - in_page);
+            memcpy(page->data + in_page, source, count);
+            dirty(page, page->data + in_page, count);
+            mm::page_cache::unpin(page);
+            source += count;
+            offset += count;
+            size -= count;
+        }
+
+        return 0;
+    }
+
+    int ext2_volume::write_superblock() {
+        // Only the part of it there's a struct for, the rest never changes
+        return write_metadata(fs::ext2::SUPERBLOCK_LOCATION, _sb, sizeof(ext2_super_block_t));
+    }
+
+    int ext2_volume::write_group(uint32_t group) {
+        // The table starts in the block after the superblock
+        uint64_t table = (uint64_t)(location_to_block(fs::ext2::SUPERBLOCK_LOCATION, _sb->log_block_size) + 1) * _block_size;
+        return write_metadata(table + group * sizeof(ext2_block_group_desc_t), _block_groups + group, sizeof(ext2_block_group_desc_t));
+    }
+
+    // The first clear bit from start on, wrapping around, or -1 if there isn't one
+    static int64_t find_clear_bit(const uint8_t* bitmap, uint32_t count, uint32_t start) {
+        uint32_t n = 0;
+        while(n < count) {
+            uint32_t bit = (start + n) % count;
+            if(!(bit & 7) && bit + 8 <= count && bitmap[bit / 8] == 0xFF) {
+                n += 8;
+                continue;
+            }
+
+            if(!(bitmap[bit / 8] & (1 << (bit & 7)))) {
+                return bit;
+            }
+
+            n++;
+        }
+
+        return -1;
+    }
+
+    int64_t ext2_volume::allocate_block(uint32_t goal) {
+        kstd::lock l(_alloc_lock);
+        if(!_sb->free_block_count) {
+            return -ENOSPC;
+        }
+
+        if(goal < _sb->first_data_block || goal >= _sb->block_count) {
+            goal = _sb->first_data_block;
+        }
+
+        uint32_t goal_group = (goal - _sb->first_data_block) / _sb->blocks_per_group;
+        for(uint32_t i = 0; i < _block_group_count; i++) {
+            uint32_t group = (goal_group + i) % _block_group_count;
+            ext2_block_group_desc_t& desc = _block_groups[group];
+            if(!desc.bg_free_blocks_count) {
+                continue;
+            }
+
+            uint32_t group_start = _sb->first_data_block + group * _sb->blocks_per_group;
+            uint32_t group_blocks = kstd::min(_sb->blocks_per_group, _sb->block_count - group_start);
+            mm::page_cache::page* page;
+            uint8_t* bitmap = pin_block(desc.bg_block_bitmap, page);
+            if(!bitmap) {
+                return -EIO;
+            }
+
+            int64_t bit = find_clear_bit(bitmap, group_blocks, i == 0 ? goal - group_start : 0);
+            if(bit < 0) {
+                // The count was off
+                mm::page_cache::unpin(page);
+                continue;
+            }
+
+            bitmap[bit / 8] |= 1 << (bit & 7);
+            dirty(page, bitmap + bit / 8, 1);
+            mm::page_cache::unpin(page);
+
+            desc.bg_free_blocks_count--;
+            _sb->free_block_count--;
+            write_group(group);
+            write_superblock();
+            return group_start + bit;
+        }
+
+        return -ENOSPC;
+    }
+
+    void ext2_volume::free_block(uint32_t block) {
+        if(block < _sb->first_data_block || block >= _sb->block_count) {
+            log::warning("[ext2] Tried to free invalid block %u", block);
+            return;
+        }
+
+        // Whatever was waiting to be written there isn't wanted now
+        mm::page_cache::mark_clean(_partition, (uint64_t)block * _block_size, _block_size);
+
+        kstd::lock l(_alloc_lock);
+        uint32_t group = (block - _sb->first_data_block) / _sb->blocks_per_group;
+        uint32_t bit = (block - _sb->first_data_block) % _sb->blocks_per_group;
+        ext2_block_group_desc_t& desc = _block_groups[group];
+        mm::page_cache::page* page;
+        uint8_t* bitmap = pin_block(desc.bg_block_bitmap, page);
+        if(!bitmap) {
+            log::error("[ext2] Disk error freeing block %u", block);
+            return;
+        }
+
+        if(!(bitmap[bit / 8] & (1 << (bit & 7)))) {
+            log::warning("[ext2] Block %u freed twice", block);
+            mm::page_cache::unpin(page);
+            return;
+        }
+
+        bitmap[bit / 8] &= ~(1 << (bit & 7));
+        dirty(page, bitmap + bit / 8, 1);
+        mm::page_cache::unpin(page);
+
+        desc.bg_free_blocks_count++;
+        _sb->free_block_count++;
+        write_group(group);
+        write_superblock();
+    }
+
+    int64_t ext2_volume::allocate_inode(uint32_t goal_group, bool directory) {
+        kstd::lock l(_alloc_lock);
+        if(!_sb->free_inode_count) {
+            return -ENOSPC;
+        }
+
+        for(uint32_t i = 0; i < _block_group_count; i++) {
+            uint32_t group = (goal_group + i) % _block_group_count;
+            ext2_block_group_desc_t& desc = _block_groups[group];
+            if(!desc.bg_free_inodes_count) {
+                continue;
+            }
+
+            // The reserved ones at the start are marked used anyway, but don't trust that
+            uint32_t group_first = group * _sb->inodes_per_group + 1;
+            uint32_t start = group_first < _first_inode ? _first_inode - group_first : 0;
+            if(start >= _sb->inodes_per_group) {
+                continue;
+            }
+
+            mm::page_cache::page* page;
+            uint8_t* bitmap = pin_block(desc.bg_inode_bitmap, page);
+            if(!bitmap) {
+                return -EIO;
+            }
+
+            int64_t bit = find_clear_bit(bitmap, _sb->inodes_per_group, start);
+            if(bit < 0 || bit < start) {
+                mm::page_cache::unpin(page);
+                continue;
+            }
+
+            bitmap[bit / 8] |= 1 << (bit & 7);
+            dirty(page, bitmap + bit / 8, 1);
+            mm::page_cache::unpin(page);
+
+            desc.bg_free_inodes_count--;
+            if(directory) {
+                desc.bg_used_dirs_count++;
+            }
+
+            _sb->free_inode_count--;
+            write_group(group);
+            write_superblock();
+
+            // Whatever a deleted inode left in there (i.e. past the fields there's a struct for)
+            // shouldn't carry over
+            uint32_t inode = group_first + bit;
+            uint32_t block = desc.bg_inode_table + (uint64_t)bit * _inode_size / _block_size;
+            uint8_t* table = pin_block(block, page);
+            if(!table) {
+                return -EIO;
+            }
+
+            uint8_t* record = table + (bit % (_block_size / _inode_size)) * _inode_size;
+            memset(record, 0, _inode_size);
+            dirty(page, record, _inode_size);
+            mm::page_cache::unpin(page);
+            return inode;
+        }
+
+        return -ENOSPC;
+    }
+
+    void ext2_volume::free_inode(uint32_t inode, bool directory) {
+        kstd::lock l(_alloc_lock);
+        uint32_t group = (inode - 1) / _sb->inodes_per_group;
+        uint32_t bit = (inode - 1) % _sb->inodes_per_group;
+        ext2_block_group_desc_t& desc = _block_groups[group];
+        mm::page_cache::page* page;
+        uint8_t* bitmap = pin_block(desc.bg_inode_bitmap, page);
+        if(!bitmap) {
+            log::error("[ext2] Disk error freeing inode %u", inode);
+            return;
+        }
+
+        bitmap[bit / 8] &= ~(1 << (bit & 7));
+        dirty(page, bitmap + bit / 8, 1);
+        mm::page_cache::unpin(page);
+
+        desc.bg_free_inodes_count++;
+        if(directory) {
+            desc.bg_used_dirs_count--;
+        }
+
+        _sb->free_inode_count++;
+        write_group(group);
+        write_superblock();
+    }
+
+    int ext2_volume::zero_block(uint32_t block) {
+        mm::page_cache::page* page;
+        uint8_t* data = pin_block(block, page);
+        if(!data) {
+            return -EIO;
+        }
+
+        memset(data, 0, _block_size);
+        dirty(page, data, _block_size);
+        mm::page_cache::unpin(page);
+        return 0;
+    }
+
+    int ext2_volume::read_block(uint32_t block_num, void* buffer, bool cache) {
+        if(block_num >= _sb->block_count) {
+            return -EINVAL;
+        }
+
+        if(cache) {
+            mm::page_cache::page* page;
+            if(const uint8_t* block = pin_block(block_num, page)) {
+                memcpy(buffer, block, _block_size);
+                mm::page_cache::unpin(page);
+                return 1;
+            }
+        }
+
+        uint32_t sectors_per_block = _block_size / _partition->parent()->block_size();
+        return _partition->read_block(block_num * sectors_per_block, sectors_per_block, buffer);
     }
 
     int ext2_volume::read_inode(ino_t num, ext2_inode_t& inode) {
@@ -207,22 +618,22 @@ namespace fs {
         uint32_t inode_block_offset = bg_offset % (_block_size / _inode_size);
         uint32_t block_number = inode_table_block + inode_block_num;
 
-        void* val = malloc(_block_size);
-        if(int e = read_block(block_number, val) < 0) {
-            free(val);
-            log::error("[ext2] Disk error (%d) reading inode %d", e, num);
-            return e;
+        // Just the inode, out of the cached inode table block
+        mm::page_cache::page* page;
+        const uint8_t* block = pin_block(block_number, page);
+        if(!block) {
+            log::error("[ext2] Disk error reading inode %d", num + 1);
+            return -EIO;
         }
 
-        ext2_inode_t* indexed = (ext2_inode_t *)kstd::offset_by(val, _inode_size * inode_block_offset);
-        inode = *indexed;
-        free(val);
+        memcpy(&inode, block + _inode_size * inode_block_offset, sizeof(ext2_inode_t));
+        mm::page_cache::unpin(page);
         return 0;
     }
 
-    int64_t ext2_volume::find_data_blocks(const ext2_inode_t& inode, uint32_t start, uint32_t end, uint32_t* block_list) {
+    int64_t ext2_volume::find_data_blocks(ext2_node* node, uint32_t start, uint32_t end, uint32_t* block_list) {
         while(start < end) {
-            auto found_block = find_data_block(inode, start++);
+            auto found_block = find_data_block(node, start++);
             if(found_block < 0) {
                 return found_block;
             }
@@ -233,70 +644,243 @@ namespace fs {
         return 0;
     }
 
-    int64_t ext2_volume::find_data_block(const ext2_inode_t& inode, uint32_t index) {
-        uint32_t max = ext2::INODE_IND_BLOCK;
-        if(index < max) {
+    int64_t ext2_volume::find_data_block(ext2_node* node, uint32_t index) {
+        const ext2_inode_t& inode = node->ext2_inode();
+        if(index < ext2::INODE_IND_BLOCK) {
             return inode.i_block[index];
         }
 
-        kstd::auto_free<uint32_t> block_buffer(_block_size / sizeof(uint32_t));
-        uint32_t entries_per_block = _block_size / sizeof(uint32_t);
-        max += entries_per_block;
-        if(index < max) {
-            // Single indirect lookup
-            index -= ext2::INODE_IND_BLOCK;
-            if(int e = read_block(inode.i_block[ext2::INODE_IND_BLOCK], block_buffer, true) < 0) {
-                return e;
+        uint32_t physical;
+        if(node->block_map().find(index, physical)) {
+            return physical;
+        }
+
+        // Which tree it's in, and where in it
+        uint64_t entries_per_block = _block_size / sizeof(uint32_t);
+        uint64_t relative = index - ext2::INODE_IND_BLOCK;
+        uint64_t span = 1;
+        uint32_t pointer;
+        if(relative < entries_per_block) {
+            pointer = inode.i_block[ext2::INODE_IND_BLOCK];
+        } else if((relative -= entries_per_block) < entries_per_block * entries_per_block) {
+            pointer = inode.i_block[ext2::INODE_DIND_BLOCK];
+            span = entries_per_block;
+        } else if((relative -= entries_per_block * entries_per_block) < entries_per_block * entries_per_block * entries_per_block) {
+            pointer = inode.i_block[ext2::INODE_TIND_BLOCK];
+            span = entries_per_block * entries_per_block;
+        } else {
+            return -EINVAL;
+        }
+
+        // Down to the block of pointers that has this one in it
+        mm::page_cache::page* page;
+        for(; span > 1 && pointer; span /= entries_per_block) {
+            const uint32_t* entries = (const uint32_t *)pin_block(pointer, page);
+            if(!entries) {
+                return -EIO;
             }
 
-            return (int64_t)*(block_buffer + index);
+            pointer = entries[relative / span];
+            relative %= span;
+            mm::page_cache::unpin(page);
         }
 
-        max = ext2::INODE_IND_BLOCK + entries_per_block * entries_per_block;
-        if(index < max) {
-            // Double indirect lookup
-            index -= ext2::INODE_IND_BLOCK;
-            if(int e = read_block(inode.i_block[ext2::INODE_DIND_BLOCK], block_buffer, true) < 0) {
-                return e;
+        if(!pointer) {
+            // A hole in the tree, everything under it is a hole too
+            uint32_t count = kstd::min(span * entries_per_block - relative, (uint64_t)UINT32_MAX);
+            node->block_map().add(index, 0, count);
+            return 0;
+        }
+
+        // Note down the run this is part of while the pointers are at hand
+        const uint32_t* entries = (const uint32_t *)pin_block(pointer, page);
+        if(!entries) {
+            return -EIO;
+        }
+
+        physical = entries[relative];
+        uint32_t count = 1;
+        while(relative + count < entries_per_block 
+            && entries[relative + count] == (physical ? physical + count : 0)) {
+            count++;
+        }
+
+        mm::page_cache::unpin(page);
+        node->block_map().add(index, physical, count);
+        return physical;
+    }
+
+    int64_t ext2_volume::map_block(ext2_node* node, uint32_t index) {
+        int64_t found = find_data_block(node, index);
+        if(found != 0) {
+            return found;
+        }
+
+        // Right after the block before it if possible, otherwise near the inode
+        int64_t goal = index ? find_data_block(node, index - 1) : 0;
+        goal = goal > 0 
+            ? goal + 1 
+            : _sb->first_data_block + (node->inode - 1) / _sb->inodes_per_group * _sb->blocks_per_group;
+
+        ext2_inode_t& inode = node->_ext2_inode;
+        uint64_t entries_per_block = _block_size / sizeof(uint32_t);
+        uint64_t relative = index;
+        unsigned depth;
+        uint32_t* slot;
+        if(index < ext2::INODE_IND_BLOCK) {
+            slot = &inode.i_block[index];
+            depth = 0;
+        } else if((relative -= ext2::INODE_IND_BLOCK) < entries_per_block) {
+            slot = &inode.i_block[ext2::INODE_IND_BLOCK];
+            depth = 1;
+        } else if((relative -= entries_per_block) < entries_per_block * entries_per_block) {
+            slot = &inode.i_block[ext2::INODE_DIND_BLOCK];
+            depth = 2;
+        } else if((relative -= entries_per_block * entries_per_block) < entries_per_block * entries_per_block * entries_per_block) {
+            slot = &inode.i_block[ext2::INODE_TIND_BLOCK];
+            depth = 3;
+        } else {
+            return -EFBIG;
+        }
+
+        // Down the tree, filling in whatever is missing on the way
+        mm::page_cache::page* page = nullptr;   // Holding slot, unless it's in the inode
+        while(true) {
+            if(!*slot) {
+                int64_t block = allocate_block(goal);
+                if(block >= 0 && depth) {
+                    // Pointers nobody has set yet have to read as holes
+                    if(int e = zero_block(block)) {
+                        free_block(block);
+                        block = e;
+                    }
+                }
+
+                if(block < 0) {
+                    if(page) {
+                        mm::page_cache::unpin(page);
+                    }
+
+                    return block;
+                }
+
+                *slot = block;
+                inode.i_blocks += _block_size / ext2::I_BLOCKS_UNIT;
+                if(page) {
+                    dirty(page, slot, sizeof(uint32_t));
+                }
+
+                goal = block + 1;
             }
 
-            uint32_t subindex = index / entries_per_block;
-            uint32_t suboffset = index % entries_per_block;
-            uint32_t* indirect = block_buffer + subindex;
+            uint32_t block = *slot;
+            if(page) {
+                mm::page_cache::unpin(page);
+            }
 
-            if(int e = read_block(*indirect, block_buffer) < 0) {
-                return e;
+            if(!depth) {
+                node->block_map().forget(index);
+                return block;
+            }
+
+            uint64_t span = 1;
+            for(unsigned i = 1; i < depth; i++) {
+                span *= entries_per_block;
             }
 
-            return (int64_t)*(block_buffer + suboffset);
+            uint32_t* entries = (uint32_t *)pin_block(block, page);
+            if(!entries) {
+                return -EIO;
+            }
+
+            slot = &entries[relative / span];
+            relative %= span;
+            depth--;
         }
+    }
 
-        max += (_block_size / sizeof(uint32_t)) * _block_size * _block_size;
-        if(index > max) {
-            return -EINVAL;
+    int ext2_volume::free_tree(uint32_t block, unsigned depth, uint64_t first, uint32_t& freed) {
+        uint64_t entries_per_block = _block_size / sizeof(uint32_t);
+        uint64_t span = 1;
+        for(unsigned i = 1; i < depth; i++) {
+            span *= entries_per_block;
         }
 
-        // Triple indirect lookup
-        index -= ext2::INODE_IND_BLOCK;
-        if(int e = read_block(inode.i_block[ext2::INODE_TIND_BLOCK], block_buffer, true) < 0) {
-            return e;
+        mm::page_cache::page* page;
+        uint32_t* entries = (uint32_t *)pin_block(block, page);
+        if(!entries) {
+            return -EIO;
         }
 
-        uint32_t subindex = index / (entries_per_block * entries_per_block);
-        uint32_t suboffset = index % (entries_per_block * entries_per_block);
-        uint32_t* indirect = block_buffer + subindex;
-        if(int e = read_block(*indirect, block_buffer, true) < 0) {
-            return e;
+        int result = 0;
+        for(uint64_t i = first / span; i < entries_per_block; i++) {
+            if(!entries[i]) {
+                continue;
+            }
+
+            // Only the first one can be partly kept
+            uint64_t from = i == first / span ? first % span : 0;
+            if(depth > 1) {
+                if(int e = free_tree(entries[i], depth - 1, from, freed)) {
+                    result = e;
+                    continue;
+                }
+
+                if(from) {
+                    continue;
+                }
+            }
+
+            free_block(entries[i]);
+            entries[i] = 0;
+            freed++;
         }
 
-        subindex = index / entries_per_block;
-        suboffset = index % entries_per_block;
-        indirect = block_buffer + subindex;
-        if(int e = read_block(*indirect, block_buffer, true) < 0) {
-            return e;
+        dirty(page, entries, _block_size);
+        mm::page_cache::unpin(page);
+        return result;
+    }
+
+    int ext2_volume::free_data_blocks(ext2_node* node, uint32_t first) {
+        ext2_inode_t& inode = node->_ext2_inode;
+        if(node->is_symlink() && !inode.i_blocks) {
+            // A short link keeps its target in i_block
+            return 0;
+        }
+
+        uint32_t freed = 0;
+        for(uint32_t i = first; i < ext2::INODE_IND_BLOCK; i++) {
+            if(inode.i_block[i]) {
+                free_block(inode.i_block[i]);
+                inode.i_block[i] = 0;
+                freed++;
+            }
+        }
+
+        int result = 0;
+        uint64_t entries_per_block = _block_size / sizeof(uint32_t);
+        uint64_t tree_start = ext2::INODE_IND_BLOCK;
+        uint64_t tree_size = entries_per_block;
+        for(unsigned depth = 1; depth <= 3; depth++) {
+            uint32_t& root = inode.i_block[ext2::INODE_IND_BLOCK + depth - 1];
+            if(root && first < tree_start + tree_size) {
+                uint64_t from = first > tree_start ? first - tree_start : 0;
+                if(int e = free_tree(root, depth, from, freed)) {
+                    result = e;
+                } else if(!from) {
+                    free_block(root);
+                    root = 0;
+                    freed++;
+                }
+            }
+
+            tree_start += tree_size;
+            tree_size *= entries_per_block;
         }
 
-        return (int64_t)*(block_buffer + suboffset);
+        inode.i_blocks -= kstd::min(inode.i_blocks, freed * (_block_size / ext2::I_BLOCKS_UNIT));
+        node->block_map().clear();
+        return result;
     }
 
     ssize_t ext2_volume::read(ext2_node* node, size_t offset, size_t size, uint8_t* buffer) {
@@ -308,78 +892,350 @@ namespace fs {
             size = node->size - offset;
         }
 
-        uint32_t start_block_num = offset / _block_size;
-        uint32_t start_block_offset = offset % _block_size;
+        // Whole blocks go straight into the buffer, a run of physically consecutive ones
+        // at a time.  Only the partial blocks at either end go through a temporary.
+        uint32_t sectors_per_block = _block_size / _partition->parent()->block_size();
         uint32_t end_block_num = kstd::intervals_needed(offset + size, (uint64_t)_block_size);
-        uint32_t end_block_size = (offset + size) % _block_size;
-        uint32_t block_count = end_block_num - start_block_num;
-        uint32_t block_list[block_count];
-        auto success = find_data_blocks(node->ext2_inode(), start_block_num, end_block_num, block_list);
-        if(success != 0) {
-            return success;
-        }
-
-        uint8_t* b = buffer;
-        kstd::auto_free<uint8_t> data(_block_size);
-        for(uint32_t i = 0; i < block_count; i++) {
-            if(int e = read_block(block_list[i], data, true) < 0) {
-                return e;
+        uint32_t block_list[READ_CHUNK_BLOCKS];
+        kstd::auto_free<uint8_t> partial(_block_size);
+        size_t position = offset;
+        while(position < offset + size) {
+            uint32_t first_block = position / _block_size;
+            uint32_t block_count = kstd::min(end_block_num - first_block, READ_CHUNK_BLOCKS);
+            auto success = find_data_blocks(node, first_block, first_block + block_count, block_list);
+            if(success != 0) {
+                return success;
             }
 
-            if(i == 0) {
-                uint32_t first_size = kstd::min(_block_size - start_block_offset, (unsigned)size);
-                memcpy(b, data + start_block_offset, first_size);
-                b += first_size;
-            } else if(i == block_count - 1) {
-                memcpy(b, data, end_block_size);
-            } else {
-                memcpy(b, data, _block_size);
-                b += _block_size;
+            uint32_t i = 0;
+            while(i < block_count) {
+                uint8_t* b = buffer + (position - offset);
+                uint32_t block_offset = position % _block_size;
+                uint32_t wanted = kstd::min((size_t)(_block_size - block_offset), offset + size - position);
+                if(!block_list[i]) {
+                    // A hole, nothing on disk to read
+                    memset(b, 0, wanted);
+                    position += wanted;
+                    i++;
+                    continue;
+                }
+
+                if(wanted < _block_size) {
+                    int result = read_block(block_list[i], partial);
+                    if(result < 0) {
+                        return result;
+                    }
+
+                    memcpy(b, partial + block_offset, wanted);
+                    position += wanted;
+                    i++;
+                    continue;
+                }
+
+                uint32_t run = 1;
+                while(i + run < block_count && block_list[i + run] == block_list[i] + run
+                    && position + (size_t)(run + 1) * _block_size <= offset + size) {
+                    run++;
+                }
+
+                if(block_list[i] + run > _sb->block_count) {
+                    return -EIO;
+                }
+
+                int result = _partition->read_block((uint64_t)block_list[i] * sectors_per_block, run * sectors_per_block, b);
+                if(result < 0) {
+                    return result;
+                }
+
+                position += (size_t)run * _block_size;
+                i += run;
             }
         }
 
         return size;
     }
 
-    ssize_t ext2_volume::write(ext2_node* node, size_t offset, size_t size, uint8_t* buffer) {
-        return -ENOSYS;
+    // 1K is the smallest block size there is
+    constexpr uint32_t MAX_BLOCKS_PER_PAGE = memory::PAGE_SIZE_4K / 1024;
+
+    // One page being read in the background, with a request for each run of contiguous blocks
+    struct page_read {
+        mm::page_cache::page* page;
+        unsigned outstanding;
+        volatile int result;
+        size_t valid;       // How much of the page is inside the file, the rest reads as zero
+        unsigned request_count;
+        storage::block_request requests[MAX_BLOCKS_PER_PAGE];
+    };
+
+    static void finish_page_read(page_read* read) {
+        // The last block can run past the end of the file
+        memset(read->page->data + read->valid, 0, memory::PAGE_SIZE_4K - read->valid);
+        mm::page_cache::finish_read(read->page, read->result);
     }
 
-    int ext2_volume::read_dir(ext2_node* node, directory_entry* ent, uint32_t index) {
-        if(!node->is_dir()) {
-            return -ENOTDIR;
-        }
-
-        if(!node->inode) {
-            log::warning("[ext2] ext2_volume::read_dir: Invalid inode");
-            return -EINVAL;
+    static void page_read_done(storage::block_request* request, int result) {
+        page_read* read = (page_read *)request->data;
+        if(result < 0) {
+            read->result = result;
         }
 
-        uint8_t buffer[_block_size];
-        uint32_t current_block = 0;
-        uint32_t block_offset = 0;
-        uint32_t total_offset = 0;
-        ext2_directory_entry_t* ext2_dirent = (ext2_directory_entry_t *)buffer;
-        int64_t block_num = find_data_block(node->ext2_inode(), current_block);
-        if(block_num < 1) {
-            log::warning("[ext2] Failed to read entry %d of inode %d", current_block, node->inode);
-            _error = DISK_READ_ERROR;
-            return -1;
+        if(__atomic_sub_fetch(&read->outstanding, 1, __ATOMIC_ACQ_REL) == 0) {
+            finish_page_read(read);
         }
+    }
 
-        if(int e = read_block((uint32_t)block_num, buffer) < 0) {
-            log::warning("[ext2] Failed to read block %d", block_num);
-            _error = DISK_READ_ERROR;
-            return -1;
+    int ext2_volume::read_pages(ext2_node* node, mm::page_cache::page** pages, unsigned count) {
+        if(!_partition->parent()->interrupt_driven()) {
+            return -ENOSYS;
         }
 
-        for(unsigned i = 0; i < index; i++) {
-            if(ext2_dirent->rec_len == 0) {
-                return 0;
+        // Look up every block first, that can mean reading indirect blocks and waiting for them
+        uint32_t sectors_per_block = _block_size / _partition->parent()->block_size();
+        page_read* reads[count];
+        for(unsigned i = 0; i < count; i++) {
+            mm::page_cache::page* p = pages[i];
+            size_t offset = p->key.index << memory::PAGE_SHIFT_4K;
+            size_t valid = offset < node->size ? kstd::min((size_t)memory::PAGE_SIZE_4K, node->size - offset) : 0;
+            uint32_t first_block = offset / _block_size;
+            uint32_t block_count = kstd::intervals_needed(valid, (size_t)_block_size);
+            uint32_t block_list[MAX_BLOCKS_PER_PAGE];
+            reads[i] = nullptr;
+            if(int64_t e = find_data_blocks(node, first_block, first_block + block_count, block_list)) {
+                mm::page_cache::finish_read(p, (int)e);
+                continue;
             }
 
-            block_offset += ext2_dirent->rec_len;
-            total_offset += ext2_dirent->rec_len;
+            page_read* read = new page_read();
+            read->page = p;
+            read->result = 0;
+            read->valid = valid;
+            read->request_count = 0;
+            for(uint32_t b = 0; b < block_count;) {
+                if(!block_list[b]) {
+                    // A hole
+                    memset(p->data + b * _block_size, 0, _block_size);
+                    b++;
+                    continue;
+                }
+
+                uint32_t run = 1;
+                while(b + run < block_count && block_list[b + run] == block_list[b] + run) {
+                    run++;
+                }
+
+                storage::block_request& request = read->requests[read->request_count++];
+                request.lba = (uint64_t)block_list[b] * sectors_per_block;
+                request.count = run * sectors_per_block;
+                request.buffer = p->data + b * _block_size;
+                request.write = false;
+                request.done = page_read_done;
+                request.data = read;
+                b += run;
+            }
+
+            read->outstanding = read->request_count;
+            p->io = read;
+            reads[i] = read;
+        }
+
+        // Then send them all together so neighbouring pages merge into bigger commands
+        _partition->plug();
+        for(unsigned i = 0; i < count; i++) {
+            page_read* read = reads[i];
+            if(!read) {
+                continue;
+            }
+
+            if(!read->request_count) {
+                // Nothing but holes
+                finish_page_read(read);
+                continue;
+            }
+
+            // It can be finished and freed as soon as the last one goes in
+            unsigned request_count = read->request_count;
+            storage::block_request* requests = read->requests;
+            for(unsigned r = 0; r < request_count; r++) {
+                _partition->submit(&requests[r]);
+            }
+        }
+
+        _partition->unplug();
+        return 0;
+    }
+
+    ssize_t ext2_volume::write(ext2_node* node, size_t offset, size_t size, uint8_t* buffer) {
+        if(!node->is_file()) {
+            return node->is_dir() ? -EISDIR : -EINVAL;
+        }
+
+        if(offset + size > UINT32_MAX) {
+            // Only i_size, no large file support here yet
+            return -EFBIG;
+        }
+
+        // Into the cache, blocks get allocated now but written back later
+        ext2_inode_t& inode = node->_ext2_inode;
+        uint32_t blocks_before = inode.i_blocks;
+        bool resized = false;
+        size_t done = 0;
+        ssize_t result = 0;
+        while(done < size) {
+            size_t position = offset + done;
+            uint64_t index = position >> memory::PAGE_SHIFT_4K;
+            size_t page_offset = position & (memory::PAGE_SIZE_4K - 1);
+            size_t count = kstd::min((size_t)memory::PAGE_SIZE_4K - page_offset, size - done);
+            bool created;
+            mm::page_cache::page* page = mm::page_cache::grab_file_page(node, index, created);
+            if(!page) {
+                result = -ENOMEM;
+                break;
+            }
+
+            if(created && count < memory::PAGE_SIZE_4K) {
+                // Only a page that's being overwritten completely doesn't need reading first
+                size_t page_start = index << memory::PAGE_SHIFT_4K;
+                ssize_t read_size = page_start < node->size ? read(node, page_start, memory::PAGE_SIZE_4K, page->data) : 0;
+                if(read_size >= 0) {
+                    memset(page->data + read_size, 0, memory::PAGE_SIZE_4K - read_size);
+                }
+
+                mm::page_cache::filled(page, read_size < 0 ? read_size : 0);
+                if(read_size < 0) {
+                    result = read_size;
+                    break;
+                }
+            }
+
+            uint32_t first_block = position / _block_size;
+            uint32_t last_block = (position + count - 1) / _block_size;
+            for(uint32_t b = first_block; b <= last_block && result >= 0; b++) {
+                int64_t block = map_block(node, b);
+                if(block < 0) {
+                    result = block;
+                }
+            }
+
+            if(result < 0) {
+                // Nothing went into this page, but a new one is still good as it is
+                if(created && count == memory::PAGE_SIZE_4K) {
+                    memset(page->data, 0, memory::PAGE_SIZE_4K);
+                    mm::page_cache::filled(page, result);
+                } else {
+                    mm::page_cache::unpin(page);
+                }
+
+                break;
+            }
+
+            memcpy(page->data + page_offset, buffer + done, count);
+            if(created && count == memory::PAGE_SIZE_4K) {
+                mm::page_cache::filled(page, 0);
+            }
+
+            mm::page_cache::mark_dirty(page, node);
+            mm::page_cache::unpin(page);
+            done += count;
+            if(position + count > node->size) {
+                node->size = position + count;
+                inode.i_size = node->size;
+                resized = true;
+            }
+        }
+
+        if(resized || inode.i_blocks != blocks_before) {
+            // The inode table is in the cache too, it goes back along with everything else
+            int e = sync_inode(inode, node->inode);
+            if(e < 0 && !done) {
+                return e;
+            }
+        }
+
+        return done ? done : result;
+    }
+
+    int ext2_volume::write_pages(ext2_node* node, mm::page_cache::page** pages, unsigned count) {
+        // Each page is a request per run of contiguous blocks, neighbouring pages merge in the queue
+        uint32_t sectors_per_block = _block_size / _partition->parent()->block_size();
+        kstd::auto_free<storage::block_request> requests(count * MAX_BLOCKS_PER_PAGE);
+        unsigned request_count = 0;
+        for(unsigned i = 0; i < count; i++) {
+            mm::page_cache::page* p = pages[i];
+            size_t offset = p->key.index << memory::PAGE_SHIFT_4K;
+            if(offset >= node->size) {
+                // Truncated since
+                continue;
+            }
+
+            size_t valid = kstd::min((size_t)memory::PAGE_SIZE_4K, node->size - offset);
+            uint32_t first_block = offset / _block_size;
+            uint32_t block_count = kstd::intervals_needed(valid, (size_t)_block_size);
+            uint32_t block_list[MAX_BLOCKS_PER_PAGE];
+            if(int64_t e = find_data_blocks(node, first_block, first_block + block_count, block_list)) {
+                return (int)e;
+            }
+
+            for(uint32_t b = 0; b < block_count;) {
+                if(!block_list[b]) {
+                    // Only zeroes from a truncate, the hole already reads that way
+                    b++;
+                    continue;
+                }
+
+                uint32_t run = 1;
+                while(b + run < block_count && block_list[b + run] == block_list[b] + run) {
+                    run++;
+                }
+
+                storage::block_request& request = requests[request_count++];
+                memset(&request, 0, sizeof(storage::block_request));
+                request.lba = (uint64_t)block_list[b] * sectors_per_block;
+                request.count = run * sectors_per_block;
+                request.buffer = p->data + b * _block_size;
+                request.write = true;
+                b += run;
+            }
+        }
+
+        return request_count ? _partition->execute(requests, request_count) : 0;
+    }
+
+    int ext2_volume::read_dir(ext2_node* node, directory_entry* ent, uint32_t index) {
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        if(!node->inode) {
+            log::warning("[ext2] ext2_volume::read_dir: Invalid inode");
+            return -EINVAL;
+        }
+
+        uint8_t buffer[_block_size];
+        uint32_t current_block = 0;
+        uint32_t block_offset = 0;
+        uint32_t total_offset = 0;
+        ext2_directory_entry_t* ext2_dirent = (ext2_directory_entry_t *)buffer;
+        int64_t block_num = find_data_block(node, current_block);
+        if(block_num < 1) {
+            log::warning("[ext2] Failed to read entry %d of inode %d", current_block, node->inode);
+            _error = DISK_READ_ERROR;
+            return -1;
+        }
+
+        if(int e = read_block((uint32_t)block_num, buffer, true) < 0) {
+            log::warning("[ext2] Failed to read block %d", block_num);
+            _error = DISK_READ_ERROR;
+            return -1;
+        }
+
+        for(unsigned i = 0; i < index; i++) {
+            if(ext2_dirent->rec_len == 0) {
+                return 0;
+            }
+
+            block_offset += ext2_dirent->rec_len;
+            total_offset += ext2_dirent->rec_len;
 
             if(ext2_dirent->rec_len < 8) {
                 IF_DEBUG(debug_level_ext2 >= debug::LEVEL_NORMAL, {
@@ -403,14 +1259,14 @@ namespace fs {
                 }
 
                 block_offset = 0;
-                block_num = find_data_block(node->ext2_inode(), current_block);
+                block_num = find_data_block(node, current_block);
                 if(block_num < 1) {
                     log::warning("[ext2] Failed to read entry %d of inode %d", current_block, node->inode);
                     _error = DISK_READ_ERROR;
                     return -1;
                 }
 
-                if(int e = read_block((uint32_t)block_num, buffer) < 0) {
+                if(int e = read_block((uint32_t)block_num, buffer, true) < 0) {
                     log::warning("[ext2] Failed to read block %d", block_num);
                     _error = DISK_READ_ERROR;
                     return -1;
@@ -421,160 +1277,626 @@ namespace fs {
         }
 
         ent->set_name(ext2_dirent->name, ext2_dirent->name_len);
-        switch(ext2_dirent->file_type) {
-            case ext2::FT_REG_FILE:
-                ent->flags = DT_REG;
-                break;
-            case ext2::FT_DIR:
-                ent->flags = DT_DIR;
-                break;
-            case ext2::FT_CHRDEV:
-                ent->flags = DT_CHR;
-                break;
-            case ext2::FT_BLKDEV:
-                ent->flags = DT_BLK;
-                break;
-            case ext2::FT_FIFO:
-                ent->flags = DT_FIFO;
-                break;
-            case ext2::FT_SOCK:
-                ent->flags = DT_SOCK;
-                break;
-            case ext2::FT_SYMLINK:
-                ent->flags = DT_LNK;
-                break;
+        if(uint8_t type = file_type_to_dirent(ext2_dirent->file_type)) {
+            ent->flags = type;
         }
 
         return 1;
     }
 
-    fs_node* ext2_volume::find_dir(ext2_node* node, const char* name) {
+    int ext2_volume::read_entries(ext2_node* node, off_t& pos, dir_buffer& out) {
         if(!node->is_dir()) {
-            return nullptr;
+            return -ENOTDIR;
         }
 
-        if(!node->inode) {
-            log::warning("[ext2] ext2_volume::find_dir: Invalid inode");
-            return nullptr;
+        // The cookie is just the offset in the directory, of the entry to carry on from
+        while(pos >= 0 && (uint64_t)pos < node->size) {
+            uint32_t index = pos / _block_size;
+            uint32_t start = pos % _block_size;
+            int64_t block_num = find_data_block(node, index);
+            if(block_num < 1) {
+                log::warning("[ext2] Failed to read entry %d of inode %d", index, node->inode);
+                _error = DISK_READ_ERROR;
+                return block_num < 0 ? block_num : -EIO;
+            }
+
+            mm::page_cache::page* page;
+            const uint8_t* block = pin_block(block_num, page);
+            if(!block) {
+                log::warning("[ext2] Failed to read block %d", block_num);
+                _error = DISK_READ_ERROR;
+                return -EIO;
+            }
+
+            // Entries can have moved since the cookie was handed out, so go from the start of
+            // the block to the first one that isn't before it
+            uint32_t offset = 0;
+            while(offset + 8 <= _block_size) {
+                const ext2_directory_entry_t* ent = (const ext2_directory_entry_t *)(block + offset);
+                if(ent->rec_len < 8 || offset + ent->rec_len > _block_size) {
+                    log::warning("[ext2] Corrupt entry in directory inode %d", node->inode);
+                    mm::page_cache::unpin(page);
+                    return -EIO;
+                }
+
+                uint32_t next = offset + ent->rec_len;
+                if(offset >= start && ent->inode) {
+                    uint64_t cookie = (uint64_t)index * _block_size + next;
+                    uint8_t type = _file_type ? file_type_to_dirent(ent->file_type) : DT_UNKNOWN;
+                    if(!out.add(ent->name, ent->name_len, ent->inode, type, cookie)) {
+                        pos = (uint64_t)index * _block_size + offset;
+                        mm::page_cache::unpin(page);
+                        return 0;
+                    }
+                }
+
+                offset = next;
+            }
+
+            mm::page_cache::unpin(page);
+            pos = (uint64_t)(index + 1) * _block_size;
         }
 
-        uint8_t buffer[_block_size];
-        uint32_t current_block = 0;
-        uint32_t block_offset = 0;
-        uint32_t total_offset = 0;
-        ext2_directory_entry_t* ext2_dirent = (ext2_directory_entry_t *)buffer;
-        int64_t block_num = find_data_block(node->ext2_inode(), current_block);
+        return 0;
+    }
+
+    int64_t ext2_volume::find_in_block(ext2_node* dir, uint32_t index, const char* name, uint32_t name_len) {
+        int64_t block_num = find_data_block(dir, index);
         if(block_num < 1) {
-            log::warning("[ext2] Failed to read entry %d of inode %d", current_block, node->inode);
+            log::warning("[ext2] Failed to read entry %d of inode %d", index, dir->inode);
             _error = DISK_READ_ERROR;
-            return nullptr;
+            return block_num < 0 ? block_num : -EIO;
         }
 
-        if(int e = read_block((uint32_t)block_num, buffer, true) < 0) {
+        mm::page_cache::page* page;
+        const uint8_t* block = pin_block(block_num, page);
+        if(!block) {
             log::warning("[ext2] Failed to read block %d", block_num);
             _error = DISK_READ_ERROR;
-            return nullptr;
+            return -EIO;
         }
 
-        while(current_block < node->ext2_inode().i_blocks / (_block_size / _partition->parent()->block_size())) {
-            if(ext2_dirent->rec_len < 8) {
+        int64_t found = 0;
+        uint32_t offset = 0;
+        while(offset + 8 <= _block_size) {
+            const ext2_directory_entry_t* ent = (const ext2_directory_entry_t *)(block + offset);
+            if(ent->rec_len < 8 || offset + ent->rec_len > _block_size) {
                 IF_DEBUG(debug_level_ext2 >= debug::LEVEL_NORMAL, {
                     log::warning("[ext2] Error (inode: %d) record length of directory entry has invalid length (%d)!", 
-                        node->inode, ext2_dirent->rec_len);
+                        dir->inode, ent->rec_len);
                 })
 
                 break;
             }
 
-            if(ext2_dirent->inode > 0) {
-                IF_DEBUG(debug_level_ext2 >= debug::LEVEL_VERBOSE, {
-                    char buf[ext2_dirent->name_len + 1];
-                    strncpy(buf, ext2_dirent->name, ext2_dirent->name_len);
-                    buf[ext2_dirent->name_len] = 0;
-                    log::info("Checking name '%s' (name len %d), inode %d, len %d (parent inode: %d)", 
-                        buf, ext2_dirent->name_len, ext2_dirent->inode, ext2_dirent->rec_len, node->inode);
-                })
+            if(ent->inode && ent->name_len == name_len && memcmp(ent->name, name, name_len) == 0) {
+                found = ent->inode;
+                break;
+            }
 
-                if(strnlen(name, fs::NAME_MAX) == ext2_dirent->name_len && strncmp(name, ext2_dirent->name, ext2_dirent->name_len) == 0) {
-                    break;
-                }
+            offset += ent->rec_len;
+        }
+
+        mm::page_cache::unpin(page);
+        return found;
+    }
+
+    bool ext2_volume::find_indexed(ext2_node* dir, const char* name, uint32_t name_len, int64_t& result) {
+        if(!_dir_index || !(dir->_ext2_inode.i_flags & ext2::INDEX_FL) || dir->size < _block_size * 2) {
+            return false;
+        }
+
+        // Where the lookup went at each level, to get to the next leaf if the name's hash
+        // carries on into it
+        typedef struct {
+            uint32_t block;
+            uint16_t at;
+            uint16_t count;
+        } dx_frame_t;
+
+        dx_frame_t frames[ext2::DX_MAX_LEVELS];
+        uint32_t entries_offset;
+        unsigned levels;
+        uint32_t hash;
+        {
+            int64_t block_num = find_data_block(dir, 0);
+            mm::page_cache::page* page;
+            const uint8_t* block = block_num > 0 ? pin_block(block_num, page) : nullptr;
+            if(!block) {
+                return false;
             }
 
-            block_offset += ext2_dirent->rec_len;
-            total_offset += ext2_dirent->rec_len;
+            const ext2_dx_root_info_t* info = (const ext2_dx_root_info_t *)(block + EXT2_DX_ROOT_INFO_OFFSET);
+            uint8_t version = info->hash_version;
+            if(info->reserved_zero || version > ext2::DX_HASH_TEA || info->info_length < sizeof(ext2_dx_root_info_t)
+                || info->indirect_levels >= ext2::DX_MAX_LEVELS) {
+                log::warning("[ext2] Unusable index in directory inode %d, searching all of it", dir->inode);
+                mm::page_cache::unpin(page);
+                return false;
+            }
 
-            if(total_offset > node->ext2_inode().i_size) {
-                return nullptr;
+            if(_unsigned_hash) {
+                version += ext2::DX_HASH_LEGACY_UNSIGNED;
             }
 
-            if(block_offset >= _block_size) {
-                current_block++;
-                if(current_block >= node->ext2_inode().i_blocks / (_block_size / _partition->parent()->block_size())) {
-                    // End of directory
-                    return nullptr;
+            entries_offset = EXT2_DX_ROOT_INFO_OFFSET + info->info_length;
+            levels = info->indirect_levels + 1;
+            hash = ext2::dir_hash(name, name_len, version, _hash_seed);
+            mm::page_cache::unpin(page);
+        }
+
+        // Goes from the index block at the given level down to a leaf, either searching each
+        // block for the hash or just taking its first entry.  Returns the leaf or -1 if the
+        // index is broken.
+        auto descend = [&](unsigned level, uint32_t logical, bool search) -> int64_t {
+            for(; level < levels; level++) {
+                uint32_t offset = level == 0 ? entries_offset : EXT2_DX_NODE_OFFSET;
+                int64_t block_num = find_data_block(dir, logical);
+                mm::page_cache::page* page;
+                const uint8_t* block = block_num > 0 ? pin_block(block_num, page) : nullptr;
+                if(!block) {
+                    return -1;
                 }
 
-                block_offset = 0;
-                block_num = find_data_block(node->ext2_inode(), current_block);
-                if(block_num < 1) {
-                    log::warning("[ext2] Failed to read entry %d of inode %d", current_block, node->inode);
-                    _error = DISK_READ_ERROR;
-                    return nullptr;
+                const ext2_dx_countlimit_t* countlimit = (const ext2_dx_countlimit_t *)(block + offset);
+                const ext2_dx_entry_t* entries = (const ext2_dx_entry_t *)countlimit;
+                if(!countlimit->count || countlimit->count > countlimit->limit 
+                    || countlimit->limit != (_block_size - offset) / sizeof(ext2_dx_entry_t)) {
+                    mm::page_cache::unpin(page);
+                    return -1;
                 }
 
-                if(int e = read_block((uint32_t)block_num, buffer, true) < 0) {
-                    log::warning("[ext2] Failed to read block %d", block_num);
-                    _error = DISK_READ_ERROR;
-                    return nullptr;
+                // The last entry whose hash isn't past the one wanted, the first one covers
+                // everything below the second
+                uint16_t at = 0;
+                if(search) {
+                    uint16_t low = 1, high = countlimit->count - 1;
+                    while(low <= high) {
+                        uint16_t mid = low + (high - low) / 2;
+                        if(entries[mid].hash > hash) {
+                            high = mid - 1;
+                        } else {
+                            low = mid + 1;
+                        }
+                    }
+
+                    at = low - 1;
+                }
+
+                frames[level] = { logical, at, countlimit->count };
+                logical = entries[at].block & EXT2_DX_BLOCK_MASK;
+                mm::page_cache::unpin(page);
+                if(logical >= dir->size / _block_size) {
+                    return -1;
                 }
             }
 
-            ext2_dirent = (ext2_directory_entry_t *)(buffer + block_offset);
+            return logical;
+        };
+
+        int64_t leaf = descend(0, 0, true);
+        while(leaf >= 0) {
+            int64_t found = find_in_block(dir, (uint32_t)leaf, name, name_len);
+            if(found) {
+                result = found;
+                return true;
+            }
+
+            // Names with the same hash can spill over into the next leaf, which is then
+            // entered with the low bit set.  Find the deepest level with an entry after the
+            // one taken, and go down from there if it's the same hash.
+            int level = levels - 1;
+            while(level >= 0 && frames[level].at + 1 >= frames[level].count) {
+                level--;
+            }
+
+            if(level < 0) {
+                break;
+            }
+
+            uint32_t offset = level == 0 ? entries_offset : EXT2_DX_NODE_OFFSET;
+            int64_t block_num = find_data_block(dir, frames[level].block);
+            mm::page_cache::page* page;
+            const uint8_t* block = block_num > 0 ? pin_block(block_num, page) : nullptr;
+            if(!block) {
+                leaf = -1;
+                break;
+            }
+
+            const ext2_dx_entry_t* next = (const ext2_dx_entry_t *)(block + offset) + frames[level].at + 1;
+            uint32_t next_hash = next->hash;
+            uint32_t next_block = next->block & EXT2_DX_BLOCK_MASK;
+            mm::page_cache::unpin(page);
+            if((next_hash & ~1U) != hash) {
+                break;
+            }
+
+            frames[level].at++;
+            leaf = (unsigned)level + 1 < levels ? descend(level + 1, next_block, false) : next_block;
+            if(leaf >= dir->size / _block_size) {
+                leaf = -1;
+            }
+        }
+
+        if(leaf < 0) {
+            log::warning("[ext2] Broken index in directory inode %d, searching all of it", dir->inode);
+            return false;
+        }
+
+        result = 0;
+        return true;
+    }
+
+    int64_t ext2_volume::find_entry(ext2_node* dir, const char* name, uint32_t name_len) {
+        int64_t found;
+        if(find_indexed(dir, name, name_len, found)) {
+            return found;
+        }
+
+        uint32_t block_count = dir->size / _block_size;
+        for(uint32_t b = 0; b < block_count; b++) {
+            found = find_in_block(dir, b, name, name_len);
+            if(found) {
+                return found;
+            }
         }
 
-        if(strnlen(name, fs::NAME_MAX) != ext2_dirent->name_len || strncmp(name, ext2_dirent->name, ext2_dirent->name_len) != 0) {
-            // Not found
+        return 0;
+    }
+
+    fs_node* ext2_volume::find_dir(ext2_node* node, const char* name) {
+        if(!node->is_dir()) {
+            return nullptr;
+        }
+
+        if(!node->inode) {
+            log::warning("[ext2] ext2_volume::find_dir: Invalid inode");
+            return nullptr;
+        }
+
+        int64_t inode = find_entry(node, name, strnlen(name, fs::NAME_MAX));
+        if(inode < 0) {
+            // Couldn't be read, which isn't the same as not being there
+            dcache::invalidate(node, name);
             return nullptr;
         }
 
-        if(!ext2_dirent->inode || ext2_dirent->inode > _sb->inode_count) {
-            log::error("[ext2] Directory entry %s contains invalid inode %d", name, ext2_dirent->inode);
+        if(!inode) {
+            return nullptr;
+        }
+
+        if(inode > _sb->inode_count) {
+            log::error("[ext2] Directory entry %s contains invalid inode %d", name, inode);
             return nullptr;
         }
 
         ext2_node* ret_node;
-        if(!_inode_cache.get(ext2_dirent->inode, ret_node)) {
+        if(!_inode_cache.get(inode, ret_node)) {
             ext2_inode_t dirent_inode;
-            if(read_inode(ext2_dirent->inode, dirent_inode) < 0) {
-                log::error("[ext2] Failed to read inode of directory (inode %d) entry %s", ext2_dirent->inode, name);
+            if(read_inode(inode, dirent_inode) < 0) {
+                log::error("[ext2] Failed to read inode of directory (inode %d) entry %s", inode, name);
+                dcache::invalidate(node, name);
                 return nullptr;
             }
 
             IF_DEBUG(debug_level_ext2 >= debug::LEVEL_VERBOSE, {
-                log::info("[ext2] Opening inode %d, size: %d", ext2_dirent->inode, dirent_inode.i_size);
+                log::info("[ext2] Opening inode %d, size: %d", inode, dirent_inode.i_size);
             })
 
-            ret_node = new ext2_node(this, dirent_inode, ext2_dirent->inode);
-            _inode_cache.set(ext2_dirent->inode, ret_node);
+            ret_node = new ext2_node(this, dirent_inode, inode);
+            _inode_cache.set(inode, ret_node);
         }
         
         return ret_node;
     }
 
-    void ext2_volume::sync_inode(const ext2_inode_t& ext2_inode, uint32_t inode) {
-        
+    int ext2_volume::sync_inode(const ext2_inode_t& ext2_inode, uint32_t inode) {
+        uint32_t bg_offset = (inode - 1) % _sb->inodes_per_group;
+        ext2_block_group_desc_t* gd = _block_groups + (inode - 1) / _sb->inodes_per_group;
+        uint32_t block_number = gd->bg_inode_table + bg_offset * _inode_size / _block_size;
+
+        // Into the cached inode table block, the flusher takes it from there
+        mm::page_cache::page* page;
+        uint8_t* block = pin_block(block_number, page);
+        if(!block) {
+            log::error("[ext2] Disk error writing inode %d", inode);
+            return -EIO;
+        }
+
+        uint8_t* record = block + _inode_size * (bg_offset % (_block_size / _inode_size));
+        memcpy(record, &ext2_inode, sizeof(ext2_inode_t));
+        dirty(page, record, sizeof(ext2_inode_t));
+        mm::page_cache::unpin(page);
+        return 0;
+    }
+
+    int ext2_volume::sync_node(ext2_node* node) {
+        // Everything is written through the cache as it changes, so by now it's only the
+        // disk's own cache left
+        return _partition->flush();
+    }
+
+    static uint32_t dir_entry_size(uint32_t name_len) {
+        return (8 + name_len + 3) & ~3U;
+    }
+
+    int ext2_volume::add_dir_entry(ext2_node* dir, const char* name, uint32_t inode, uint8_t file_type) {
+        uint32_t name_len = strnlen(name, fs::NAME_MAX);
+        if(!name_len) {
+            return -EINVAL;
+        }
+
+        // Any index is out of date once this is in, so the directory is just a list from now on
+        ext2_inode_t& dir_inode = dir->_ext2_inode;
+        dir_inode.i_flags &= ~ext2::INDEX_FL;
+
+        uint32_t needed = dir_entry_size(name_len);
+        uint32_t block_count = dir->size / _block_size;
+        for(uint32_t b = 0; b < block_count; b++) {
+            int64_t block_num = find_data_block(dir, b);
+            if(block_num <= 0) {
+                return block_num < 0 ? block_num : -EIO;
+            }
+
+            mm::page_cache::page* page;
+            uint8_t* block = pin_block(block_num, page);
+            if(!block) {
+                return -EIO;
+            }
+
+            // The first entry with enough room after it
+            uint32_t offset = 0;
+            while(offset < _block_size) {
+                ext2_directory_entry_t* ent = (ext2_directory_entry_t *)(block + offset);
+                if(ent->rec_len < 8 || offset + ent->rec_len > _block_size) {
+                    log::warning("[ext2] Corrupt entry in directory inode %d", dir->inode);
+                    mm::page_cache::unpin(page);
+                    return -EIO;
+                }
+
+                uint32_t used = ent->inode ? dir_entry_size(ent->name_len) : 0;
+                if(ent->rec_len - used >= needed) {
+                    if(used) {
+                        ext2_directory_entry_t* next = (ext2_directory_entry_t *)(block + offset + used);
+                        next->rec_len = ent->rec_len - used;
+                        ent->rec_len = used;
+                        ent = next;
+                    }
+
+                    ent->inode = inode;
+                    ent->name_len = name_len;
+                    ent->file_type = _file_type ? file_type : 0;
+                    memcpy(ent->name, name, name_len);
+                    dirty(page, block, _block_size);
+                    mm::page_cache::unpin(page);
+                    dcache::invalidate(dir, name);
+                    return sync_inode(dir_inode, dir->inode);
+                }
+
+                offset += ent->rec_len;
+            }
+
+            mm::page_cache::unpin(page);
+        }
+
+        // Full, add a block on the end
+        int64_t block_num = map_block(dir, block_count);
+        if(block_num < 0) {
+            return block_num;
+        }
+
+        mm::page_cache::page* page;
+        uint8_t* block = pin_block(block_num, page);
+        if(!block) {
+            return -EIO;
+        }
+
+        memset(block, 0, _block_size);
+        ext2_directory_entry_t* ent = (ext2_directory_entry_t *)block;
+        ent->inode = inode;
+        ent->rec_len = _block_size;
+        ent->name_len = name_len;
+        ent->file_type = _file_type ? file_type : 0;
+        memcpy(ent->name, name, name_len);
+        dirty(page, block, _block_size);
+        mm::page_cache::unpin(page);
+        dcache::invalidate(dir, name);
+
+        dir->size += _block_size;
+        dir_inode.i_size = dir->size;
+        return sync_inode(dir_inode, dir->inode);
+    }
+
+    int ext2_volume::remove_dir_entry(ext2_node* dir, const char* name) {
+        uint32_t name_len = strnlen(name, fs::NAME_MAX);
+        ext2_inode_t& dir_inode = dir->_ext2_inode;
+        uint32_t block_count = dir->size / _block_size;
+        for(uint32_t b = 0; b < block_count; b++) {
+            int64_t block_num = find_data_block(dir, b);
+            if(block_num <= 0) {
+                return block_num < 0 ? block_num : -EIO;
+            }
+
+            mm::page_cache::page* page;
+            uint8_t* block = pin_block(block_num, page);
+            if(!block) {
+                return -EIO;
+            }
+
+            ext2_directory_entry_t* previous = nullptr;
+            uint32_t offset = 0;
+            while(offset < _block_size) {
+                ext2_directory_entry_t* ent = (ext2_directory_entry_t *)(block + offset);
+                if(ent->rec_len < 8 || offset + ent->rec_len > _block_size) {
+                    log::warning("[ext2] Corrupt entry in directory inode %d", dir->inode);
+                    mm::page_cache::unpin(page);
+                    return -EIO;
+                }
+
+                if(ent->inode && ent->name_len == name_len && strncmp(ent->name, name, name_len) == 0) {
+                    // The one before takes its space, or if it's first it's just marked unused
+                    if(previous) {
+                        previous->rec_len += ent->rec_len;
+                    } else {
+                        ent->inode = 0;
+                    }
+
+                    dir_inode.i_flags &= ~ext2::INDEX_FL;
+                    dirty(page, block, _block_size);
+                    mm::page_cache::unpin(page);
+                    dcache::invalidate(dir, name);
+                    return sync_inode(dir_inode, dir->inode);
+                }
+
+                previous = ent;
+                offset += ent->rec_len;
+            }
+
+            mm::page_cache::unpin(page);
+        }
+
+        return -ENOENT;
+    }
+
+    bool ext2_volume::dir_empty(ext2_node* dir) {
+        uint32_t block_count = dir->size / _block_size;
+        for(uint32_t b = 0; b < block_count; b++) {
+            int64_t block_num = find_data_block(dir, b);
+            mm::page_cache::page* page;
+            const uint8_t* block = block_num > 0 ? pin_block(block_num, page) : nullptr;
+            if(!block) {
+                // Can't tell, so it isn't
+                return false;
+            }
+
+            uint32_t offset = 0;
+            while(offset + 8 <= _block_size) {
+                const ext2_directory_entry_t* ent = (const ext2_directory_entry_t *)(block + offset);
+                if(ent->rec_len < 8) {
+                    break;
+                }
+
+                bool dots = (ent->name_len == 1 && ent->name[0] == '.') 
+                    || (ent->name_len == 2 && ent->name[0] == '.' && ent->name[1] == '.');
+                if(ent->inode && !dots) {
+                    mm::page_cache::unpin(page);
+                    return false;
+                }
+
+                offset += ent->rec_len;
+            }
+
+            mm::page_cache::unpin(page);
+        }
+
+        return true;
+    }
+
+    ext2_node* ext2_volume::new_node(ext2_node* dir, uint16_t mode) {
+        bool directory = (mode & ext2::S_IFMT) == S_IFDIR;
+        int64_t inode_num = allocate_inode((dir->inode - 1) / _sb->inodes_per_group, directory);
+        if(inode_num < 0) {
+            return nullptr;
+        }
+
+        ext2_inode_t inode {};
+        inode.i_mode = mode;
+        inode.i_uid = dir->uid;
+        inode.i_links_count = 1;
+        if(sync_inode(inode, inode_num) < 0) {
+            free_inode(inode_num, directory);
+            return nullptr;
+        }
+
+        ext2_node* node = new ext2_node(this, inode, inode_num);
+        node->parent = dir;
+        _inode_cache.set(inode_num, node);
+        return node;
     }
 
-    void ext2_volume::sync_node(ext2_node* node) {
-        sync_inode(node->ext2_inode(), (uint32_t)node->inode);
+    void ext2_volume::release_node(ext2_node* node) {
+        // Nothing that was waiting to be written matters any more
+        mm::page_cache::invalidate(node->volume_id, node->inode);
+        if(node->handle_count()) {
+            // Whoever still has it open, clean_node gets it once they're done.  Shared mappings
+            // of it can't be looked up any more, so they go as soon as nothing maps them.
+            mm::file_vm_object::forget(node);
+            return;
+        }
+
+        ext2_inode_t& inode = node->_ext2_inode;
+        free_data_blocks(node, 0);
+        inode.i_size = 0;
+        inode.i_links_count = 0;
+        sync_inode(inode, node->inode);
+        free_inode(node->inode, node->is_dir());
+        _inode_cache.erase(node->inode);
+        delete node;
     }
 
     int ext2_volume::create(ext2_node* node, directory_entry* ent, uint32_t mode) {
-        return -ENOSYS;
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        if(find_dir(node, ent->name())) {
+            return -EEXIST;
+        }
+
+        ext2_node* created = new_node(node, S_IFREG | (mode & ~ext2::S_IFMT));
+        if(!created) {
+            return -ENOSPC;
+        }
+
+        if(int e = add_dir_entry(node, ent->name(), created->inode, ext2::FT_REG_FILE)) {
+            created->_ext2_inode.i_links_count = 0;
+            release_node(created);
+            return e;
+        }
+
+        ent->node = created;
+        ent->flags = DT_REG;
+        return 0;
     }
 
     int ext2_volume::create_dir(ext2_node* node, directory_entry* ent, uint32_t mode) {
-        return -ENOSYS;
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        if(find_dir(node, ent->name())) {
+            return -EEXIST;
+        }
+
+        ext2_node* created = new_node(node, S_IFDIR | (mode & ~ext2::S_IFMT));
+        if(!created) {
+            return -ENOSPC;
+        }
+
+        // Starts out with . and .., which count as links to it and to the parent
+        int e = add_dir_entry(created, ".", created->inode, ext2::FT_DIR);
+        if(!e) {
+            e = add_dir_entry(created, "..", node->inode, ext2::FT_DIR);
+        }
+
+        if(!e) {
+            e = add_dir_entry(node, ent->name(), created->inode, ext2::FT_DIR);
+        }
+
+        if(e) {
+            created->_ext2_inode.i_links_count = 0;
+            release_node(created);
+            return e;
+        }
+
+        created->_ext2_inode.i_links_count = 2;
+        sync_inode(created->_ext2_inode, created->inode);
+        node->_ext2_inode.i_links_count++;
+        sync_inode(node->_ext2_inode, node->inode);
+
+        ent->node = created;
+        ent->flags = DT_DIR;
+        return 0;
     }
 
     ssize_t ext2_volume::read_link(ext2_node* node, char* path_buffer, size_t size) {
@@ -592,19 +1914,152 @@ namespace fs {
     }
 
     int ext2_volume::link(ext2_node* node, fs_node* file, directory_entry *ent) {
-        return -ENOSYS;
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        if(file->volume_id != node->volume_id) {
+            return -EXDEV;
+        }
+
+        if(file->is_dir()) {
+            return -EPERM;
+        }
+
+        if(find_dir(node, ent->name())) {
+            return -EEXIST;
+        }
+
+        ext2_node* target = (ext2_node *)file;
+        uint8_t file_type = ext2::FT_REG_FILE;
+        switch(target->_ext2_inode.i_mode & ext2::S_IFMT) {
+            case S_IFLNK:
+                file_type = ext2::FT_SYMLINK;
+                break;
+            case S_IFCHR:
+                file_type = ext2::FT_CHRDEV;
+                break;
+            case S_IFBLK:
+                file_type = ext2::FT_BLKDEV;
+                break;
+            case S_IFIFO:
+                file_type = ext2::FT_FIFO;
+                break;
+            case S_IFSOCK:
+                file_type = ext2::FT_SOCK;
+                break;
+        }
+
+        if(int e = add_dir_entry(node, ent->name(), target->inode, file_type)) {
+            return e;
+        }
+
+        target->_ext2_inode.i_links_count++;
+        return sync_inode(target->_ext2_inode, target->inode);
     }
 
     int ext2_volume::unlink(ext2_node* node, directory_entry* ent, bool unlink_dirs) {
-        return -ENOSYS;
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        if(strcmp(ent->name(), ".") == 0 || strcmp(ent->name(), "..") == 0) {
+            return -EINVAL;
+        }
+
+        ext2_node* target = (ext2_node *)find_dir(node, ent->name());
+        if(!target) {
+            return -ENOENT;
+        }
+
+        if(target->is_dir()) {
+            if(!unlink_dirs) {
+                return -EISDIR;
+            }
+
+            if(!dir_empty(target)) {
+                return -ENOTEMPTY;
+            }
+        }
+
+        if(int e = remove_dir_entry(node, ent->name())) {
+            return e;
+        }
+
+        ext2_inode_t& inode = target->_ext2_inode;
+        if(target->is_dir()) {
+            // Its own . goes with it, and its .. doesn't point at the parent any more
+            inode.i_links_count = 0;
+            node->_ext2_inode.i_links_count--;
+            sync_inode(node->_ext2_inode, node->inode);
+        } else if(inode.i_links_count) {
+            inode.i_links_count--;
+        }
+
+        if(inode.i_links_count) {
+            return sync_inode(inode, target->inode);
+        }
+
+        release_node(target);
+        return 0;
     }
 
     int ext2_volume::truncate(ext2_node* node, off_t length) {
-        return -ENOSYS;
+        if(!node->is_file()) {
+            return node->is_dir() ? -EISDIR : -EINVAL;
+        }
+
+        if(length < 0) {
+            return -EINVAL;
+        }
+
+        if((uint64_t)length > UINT32_MAX) {
+            return -EFBIG;
+        }
+
+        ext2_inode_t& inode = node->_ext2_inode;
+        if((size_t)length < node->size) {
+            // Whatever is left in the last page past the new end has to read as zero again if
+            // the file grows back over it
+            size_t page_offset = length & (memory::PAGE_SIZE_4K - 1);
+            uint64_t kept_pages = memory::PAGE_COUNT_4K(length);
+            if(page_offset) {
+                bool created;
+                mm::page_cache::page* page = mm::page_cache::grab_file_page(node, length >> memory::PAGE_SHIFT_4K, created);
+                if(!page) {
+                    return -ENOMEM;
+                }
+
+                if(created) {
+                    size_t page_start = length & ~(size_t)(memory::PAGE_SIZE_4K - 1);
+                    ssize_t read_size = read(node, page_start, memory::PAGE_SIZE_4K, page->data);
+                    mm::page_cache::filled(page, read_size < 0 ? read_size : 0);
+                    if(read_size < 0) {
+                        return read_size;
+                    }
+                }
+
+                memset(page->data + page_offset, 0, memory::PAGE_SIZE_4K - page_offset);
+                mm::page_cache::mark_dirty(page, node);
+                mm::page_cache::unpin(page);
+            }
+
+            mm::page_cache::invalidate(node->volume_id, node->inode, kept_pages);
+            if(int e = free_data_blocks(node, kstd::intervals_needed((size_t)length, (size_t)_block_size))) {
+                log::warning("[ext2] Error freeing blocks of inode %d: %d", node->inode, e);
+            }
+        }
+
+        node->size = length;
+        inode.i_size = length;
+        return sync_inode(inode, node->inode);
     }
 
     void ext2_volume::clean_node(ext2_node* node) {
-
+        if(!node->_ext2_inode.i_links_count) {
+            // Unlinked while it was still open
+            release_node(node);
+        }
     }
 
     ext2_node::ext2_node(ext2_volume* vol, ext2_inode_t& ino, ino_t inode) 
@@ -646,6 +2101,13 @@ namespace fs {
         return ret;
     }
 
+    int ext2_node::read_entries(off_t& pos, dir_buffer& out) {
+        _flock.acquire_read();
+        auto ret = _vol->read_entries(this, pos, out);
+        _flock.release_read();
+        return ret;
+    }
+
     fs_node* ext2_node::find_dir(const char* name) {
         _flock.acquire_read();
         auto ret = _vol->find_dir(this, name);
@@ -660,24 +2122,38 @@ namespace fs {
         return ret;
     }
 
-    ssize_t ext2_node::write(size_t offset, size_t size, uint8_t* buffer) {
+    int ext2_node::read_pages(mm::page_cache::page** pages, unsigned count) {
         _flock.acquire_read();
-        auto ret = _vol->write(this, offset, size, buffer);
+        auto ret = _vol->read_pages(this, pages, count);
         _flock.release_read();
         return ret;
     }
 
+    int ext2_node::write_pages(mm::page_cache::page** pages, unsigned count) {
+        _flock.acquire_read();
+        auto ret = _vol->write_pages(this, pages, count);
+        _flock.release_read();
+        return ret;
+    }
+
+    ssize_t ext2_node::write(size_t offset, size_t size, uint8_t* buffer) {
+        _flock.acquire_write();
+        auto ret = _vol->write(this, offset, size, buffer);
+        _flock.release_write();
+        return ret;
+    }
+
     int ext2_node::create(directory_entry* ent, uint32_t mode) {
         _flock.acquire_write();
         auto ret = _vol->create(this, ent, mode);
-        _flock.acquire_write();
+        _flock.release_write();
         return ret;
     }
 
     int ext2_node::create_dir(directory_entry* ent, uint32_t mode) {
         _flock.acquire_write();
         auto ret = _vol->create_dir(this, ent, mode);
-        _flock.acquire_write();
+        _flock.release_write();
         return ret;
     }
 
@@ -695,27 +2171,27 @@ namespace fs {
         }
 
         _flock.acquire_write();
-        auto ret = _vol->link(this, (ext2_node *)node, entry);
-        _flock.acquire_write();
+        auto ret = _vol->link(this, node, entry);
+        _flock.release_write();
         return ret;
     }
 
     int ext2_node::unlink(directory_entry* ent, bool unlink_directories) {
         _flock.acquire_write();
         auto ret = _vol->unlink(this, ent, unlink_directories);
-        _flock.acquire_write();
+        _flock.release_write();
         return ret;
     }
 
     int ext2_node::truncate(off_t length) {
         _flock.acquire_write();
         auto ret = _vol->truncate(this, length);
-        _flock.acquire_write();
+        _flock.release_write();
         return ret;
     }
 
-    void ext2_node::sync() {
-        _vol->sync_node(this);
+    int ext2_node::sync() {
+        return _vol->sync_node(this);
     }
 
     void ext2_node::close() {
@@ -0,0 +1,166 @@
+#include <fs/ext2.h>
+#include <kstring.h>
+
+// The directory index hashes, these have to come out exactly like the ones Linux writes
+
+constexpr uint32_t TEA_DELTA = 0x9E3779B9;
+constexpr uint32_t MD4_K2 = 013240474631U;
+constexpr uint32_t MD4_K3 = 015666365641U;
+
+inline static uint32_t rotate_left(uint32_t x, unsigned bits) {
+    return (x << bits) | (x >> (32 - bits));
+}
+
+inline static uint32_t md4_f(uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); }
+inline static uint32_t md4_g(uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); }
+inline static uint32_t md4_h(uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; }
+
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rotate_left(a, s))
+
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    MD4_ROUND(md4_f, a, b, c, d, in[0],  3);
+    MD4_ROUND(md4_f, d, a, b, c, in[1],  7);
+    MD4_ROUND(md4_f, c, d, a, b, in[2], 11);
+    MD4_ROUND(md4_f, b, c, d, a, in[3], 19);
+    MD4_ROUND(md4_f, a, b, c, d, in[4],  3);
+    MD4_ROUND(md4_f, d, a, b, c, in[5],  7);
+    MD4_ROUND(md4_f, c, d, a, b, in[6], 11);
+    MD4_ROUND(md4_f, b, c, d, a, in[7], 19);
+
+    MD4_ROUND(md4_g, a, b, c, d, in[1] + MD4_K2,  3);
+    MD4_ROUND(md4_g, d, a, b, c, in[3] + MD4_K2,  5);
+    MD4_ROUND(md4_g, c, d, a, b, in[5] + MD4_K2,  9);
+    MD4_ROUND(md4_g, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(md4_g, a, b, c, d, in[0] + MD4_K2,  3);
+    MD4_ROUND(md4_g, d, a, b, c, in[2] + MD4_K2,  5);
+    MD4_ROUND(md4_g, c, d, a, b, in[4] + MD4_K2,  9);
+    MD4_ROUND(md4_g, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(md4_h, a, b, c, d, in[3] + MD4_K3,  3);
+    MD4_ROUND(md4_h, d, a, b, c, in[7] + MD4_K3,  9);
+    MD4_ROUND(md4_h, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(md4_h, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(md4_h, a, b, c, d, in[1] + MD4_K3,  3);
+    MD4_ROUND(md4_h, d, a, b, c, in[5] + MD4_K3,  9);
+    MD4_ROUND(md4_h, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(md4_h, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+#undef MD4_ROUND
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    for(int n = 0; n < 16; n++) {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// Whether the name's bytes are taken as signed depends on what the filesystem was made with
+inline static int name_char(const char* name, int i, bool is_unsigned) {
+    return is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+}
+
+static uint32_t legacy_hash(const char* name, int len, bool is_unsigned) {
+    uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+    for(int i = 0; i < len; i++) {
+        uint32_t hash = hash1 + (hash0 ^ ((uint32_t)name_char(name, i, is_unsigned) * 7152373U));
+        if(hash & 0x80000000) {
+            hash -= 0x7FFFFFFF;
+        }
+
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+// Packs up to num words worth of the name, padded out with its length
+static void name_to_words(const char* name, int len, uint32_t* words, int num, bool is_unsigned) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if(len > num * 4) {
+        len = num * 4;
+    }
+
+    for(int i = 0; i < len; i++) {
+        val = (uint32_t)name_char(name, i, is_unsigned) + (val << 8);
+        if((i % 4) == 3) {
+            *words++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if(--num >= 0) {
+        *words++ = val;
+    }
+
+    while(--num >= 0) {
+        *words++ = pad;
+    }
+}
+
+namespace fs::ext2 {
+    uint32_t dir_hash(const char* name, uint32_t name_len, uint8_t version, const uint32_t seed[4]) {
+        uint32_t buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+        if(seed && (seed[0] | seed[1] | seed[2] | seed[3])) {
+            memcpy(buf, seed, sizeof(buf));
+        }
+
+        bool is_unsigned = version >= DX_HASH_LEGACY_UNSIGNED;
+        int len = (int)name_len;
+        uint32_t hash;
+        uint32_t in[8];
+        switch(version) {
+            case DX_HASH_LEGACY:
+            case DX_HASH_LEGACY_UNSIGNED:
+                hash = legacy_hash(name, len, is_unsigned);
+                break;
+            case DX_HASH_HALF_MD4:
+            case DX_HASH_HALF_MD4_UNSIGNED:
+                for(const char* p = name; len > 0; len -= 32, p += 32) {
+                    name_to_words(p, len, in, 8, is_unsigned);
+                    half_md4_transform(buf, in);
+                }
+
+                hash = buf[1];
+                break;
+            case DX_HASH_TEA:
+            case DX_HASH_TEA_UNSIGNED:
+                for(const char* p = name; len > 0; len -= 16, p += 16) {
+                    name_to_words(p, len, in, 4, is_unsigned);
+                    tea_transform(buf, in);
+                }
+
+                hash = buf[0];
+                break;
+            default:
+                return 0;
+        }
+
+        // The low bit marks a collision continuing from the block before, and the top value
+        // is kept as an end of directory marker
+        hash &= ~1U;
+        if(hash == DX_HASH_EOF << 1) {
+            hash = (DX_HASH_EOF - 1) << 1;
+        }
+
+        return hash;
+    }
+}
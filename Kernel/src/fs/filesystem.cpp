@@ -1,6 +1,10 @@
 #include <fs/filesystem.h>
 #include <fs/fs_node.h>
 #include <fs/fs_volume.h>
+#include <fs/dcache.h>
+#include <mm/page_cache.h>
+#include <mm/vm_object.h>
+#include <paging.h>
 
 #include <logging.h>
 #include <abi-bits/errno.h>
@@ -39,6 +43,7 @@ namespace fs {
 
     void initialize() {
         volumes = new list<fs_volume *>();
+        dcache::initialize();
     }
 
     bool has_system_volume() {
@@ -63,6 +68,7 @@ namespace fs {
         }
         
         volumes->add(vol);
+        dcache::invalidate_dir(&root);
     }
 
     fs_node* follow_link(fs_node* link, fs_node* working_dir) {
@@ -85,34 +91,47 @@ namespace fs {
     }
 
     fs_node* resolve_path(const char* path, const char* working_dir, bool follow_symlinks) {
-        char* temp_path = nullptr;
+        fs_node* start = fs::get_root();
         if(working_dir && path[0] != '/') {
             // Relative directory
-            size_t path_len = strnlen(path, PATH_MAX);
-            size_t wd_len = strnlen(working_dir, PATH_MAX);
-            temp_path = (char *)malloc(path_len + wd_len + 2);
-            strncpy(temp_path, working_dir, wd_len);
-            strncpy(temp_path + wd_len, "/", 1);
-            strncpy(temp_path + wd_len + 1, path, path_len);
-        }
-
-        fs_node* ret_val = resolve_path(temp_path ?: path, fs::get_root(), follow_symlinks);
-        if(temp_path) {
-            free(temp_path);
+            start = resolve_path(working_dir, start, true);
+            if(!start) {
+                return nullptr;
+            }
         }
 
-        return ret_val;
+        return resolve_path(path, start, follow_symlinks);
     }
 
     fs_node* resolve_path(const char* path, fs_node* working_dir, bool follow_symlinks) {
         assert(path);
 
-        fs_node* root = fs::get_root();
-        fs_node* current_node = working_dir;
+        fs_node* current_node = path[0] == '/' ? fs::get_root() : working_dir;
+        char file[NAME_MAX + 1];
+        const char* next = path;
+        while(true) {
+            while(*next == '/') {
+                next++;
+            }
+
+            if(!*next) {
+                break;
+            }
+
+            size_t len = 0;
+            while(next[len] && next[len] != '/') {
+                len++;
+            }
+
+            if(len > NAME_MAX) {
+                log::warning("resolve_path: name too long");
+                return nullptr;
+            }
+
+            memcpy(file, next, len);
+            file[len] = 0;
+            next += len;
 
-        char* saved;
-        char* file = strtok_r((char *)path, "/", &saved);
-        while(file != nullptr) {
             fs_node* node = find_dir(current_node, file);
             if(!node) {
                 IF_DEBUG(debug_level_filesystem >= debug::LEVEL_NORMAL, {
@@ -138,11 +157,14 @@ namespace fs {
 
             if(node->is_dir()) {
                 current_node = node;
-                file = strtok_r(nullptr, "/", &saved);
                 continue;
             }
 
-            if((file = strtok_r(nullptr, "/", &saved))) {
+            while(*next == '/') {
+                next++;
+            }
+
+            if(*next) {
                 log::warning("%s is not a directory!", file);
                 return nullptr;
             }
@@ -169,16 +191,41 @@ namespace fs {
 
     fs_node* find_dir(fs_node* parent, const char* name) {
         assert(parent);
-        return parent->find_dir(name);
+
+        // . and .. are up to the filesystem (and cheap), everything else goes through the
+        // dentry cache first
+        size_t len = strnlen(name, NAME_MAX + 1);
+        bool dots = name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'));
+        if(dots || !parent->is_dir()) {
+            return parent->find_dir(name);
+        }
+
+        fs_node* node;
+        uint64_t ticket;
+        if(dcache::lookup(parent, name, len, node, ticket)) {
+            return node;
+        }
+
+        node = parent->find_dir(name);
+        dcache::insert(parent, name, len, node, ticket);
+        return node;
     }
 
     ssize_t read(fs_node* node, size_t off, size_t size, void* buf) {
         assert(node);
+        if(node->uses_page_cache()) {
+            return mm::page_cache::read(node, off, size, reinterpret_cast<uint8_t *>(buf));
+        }
+
         return node->read(off, size, reinterpret_cast<uint8_t *>(buf)); 
     }
 
     ssize_t read(fs_fd_t* handle, size_t size, uint8_t* buf) {
         assert(handle);
+        if(handle->node->uses_page_cache()) {
+            mm::page_cache::readahead(handle->node, handle->readahead, handle->pos, size);
+        }
+
         ssize_t ret = read(handle->node, handle->pos, size, buf);
         if(ret > 0) {
             handle->pos += ret;
@@ -189,7 +236,18 @@ namespace fs {
 
     ssize_t write(fs_node* node, size_t off, size_t size, void* buf) {
         assert(node);
-        return node->write(off, size, reinterpret_cast<uint8_t *>(buf)); 
+        ssize_t ret = node->write(off, size, reinterpret_cast<uint8_t *>(buf));
+        if(ret > 0) {
+            // Shared mappings made from here on have to see it
+            mm::file_vm_object::forget(node);
+        }
+
+        if(ret > 0 && node->uses_page_cache()) {
+            // It went into the cache, and may have to wait for some of that to get out again
+            mm::page_cache::balance_dirty();
+        }
+
+        return ret;
     }
 
     ssize_t write(fs_fd_t* handle, size_t size, uint8_t* buf) {
@@ -202,6 +260,26 @@ namespace fs {
         return ret;
     }
 
+    int fsync(fs_node* node) {
+        assert(node);
+        int result = node->uses_page_cache() ? mm::page_cache::sync(node) : 0;
+        int synced = node->sync();
+        return result < 0 ? result : synced;
+    }
+
+    int sync() {
+        int result = mm::page_cache::sync();
+        for(unsigned i = 0; i < volumes->size(); i++) {
+            fs_node* mount_point = volumes->get(i)->mount_point();
+            int synced = mount_point ? mount_point->sync() : 0;
+            if(!result) {
+                result = synced;
+            }
+        }
+
+        return result;
+    }
+
     fs_fd_t* open(fs_node* node, uint32_t flags) {
         return node->open(flags);
     }
@@ -220,12 +298,77 @@ namespace fs {
         fd->node = nullptr;
     }
 
+    ssize_t read_entries(fs_fd_t* handle, uint8_t* buffer, size_t size) {
+        assert(handle->node);
+        if(!handle->node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        dir_buffer out(buffer, size);
+        int result = handle->node->read_entries(handle->pos, out);
+        if(out.used()) {
+            // Whatever went wrong comes up again next time, once these are dealt with
+            return out.used();
+        }
+
+        if(result < 0) {
+            return result;
+        }
+
+        // Not even one entry fit
+        return out.full() ? -EINVAL : 0;
+    }
+
     int ioctl(fs_fd_t* handle, uint64_t cmd, uint64_t arg) {
         assert(handle->node);
 
         return handle->node->ioctl(cmd, arg);
     }
 
+    int advise(fs_fd_t* handle, off_t offset, off_t length, int advice) {
+        assert(handle->node);
+        if(offset < 0 || length < 0) {
+            return -EINVAL;
+        }
+
+        fs_node* node = handle->node;
+        uint64_t first = (uint64_t)offset >> memory::PAGE_SHIFT_4K;
+        uint64_t count = length ? memory::PAGE_COUNT_4K(offset + length) - first : ~0ULL;
+        switch(advice) {
+            case FADV_NORMAL:
+                handle->readahead.advice = mm::page_cache::access_advice::normal;
+                break;
+            case FADV_RANDOM:
+                handle->readahead.advice = mm::page_cache::access_advice::random;
+                break;
+            case FADV_SEQUENTIAL:
+                handle->readahead.advice = mm::page_cache::access_advice::sequential;
+                break;
+            case FADV_WILLNEED:
+                if(node->uses_page_cache()) {
+                    mm::page_cache::prefetch(node, first, count);
+                }
+
+                break;
+            case FADV_DONTNEED:
+                if(node->uses_page_cache() && count) {
+                    // Anything not written yet has to go out first, it's only the cached copy
+                    // that isn't needed.  Whatever is still dirty after that (or mapped) stays.
+                    mm::page_cache::writeback(node);
+                    uint64_t last = length ? first + count - 1 : ~0ULL;
+                    mm::page_cache::drop_clean(node->volume_id, node->inode, first, last);
+                }
+
+                break;
+            case FADV_NOREUSE:
+                break;
+            default:
+                return -EINVAL;
+        }
+
+        return 0;
+    }
+
     int root_node::read_dir(directory_entry* ent, uint32_t index) {
         if(index < fs::volumes->size()) {
             *ent = volumes->get(index)->mount_point_entry();
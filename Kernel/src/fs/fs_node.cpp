@@ -2,8 +2,15 @@
 #include <logging.h>
 #include <abi-bits/errno.h>
 #include <fs/fs_watcher.h>
+#include <fs/directory_entry.h>
+#include <kstring.h>
+#include <kassert.h>
 
 namespace fs {
+    fs_node::~fs_node() {
+        dcache::forget(this);
+    }
+
     ssize_t fs_node::read(size_t off, size_t size, uint8_t* buf) {
         log::warning("fs_node::read called");
         return -ENOSYS;
@@ -38,6 +45,30 @@ namespace fs {
         return -ENOSYS;
     }
 
+    int fs_node::read_entries(off_t& pos, dir_buffer& out) {
+        if(!is_dir()) {
+            return -ENOTDIR;
+        }
+
+        while(pos >= 0 && pos < UINT32_MAX) {
+            directory_entry ent;
+            int result = read_dir(&ent, (uint32_t)pos);
+            if(result <= 0) {
+                return result;
+            }
+
+            assert(ent.flags <= DT_WHT);
+            const char* name = ent.name();
+            if(!out.add(name, strnlen(name, NAME_MAX), ent.node ? ent.node->inode : 0, ent.flags, pos + 1)) {
+                return 0;
+            }
+
+            pos++;
+        }
+
+        return 0;
+    }
+
     fs_node* fs_node::find_dir(const char* name) {
         log::warning("fs_node::find_dir called");
         return nullptr;
@@ -90,8 +121,8 @@ namespace fs {
         return -ENOSYS;
     }
 
-    void fs_node::sync() {
-
+    int fs_node::sync() {
+        return 0;
     }
 
     void fs_node::watch(fs_watcher& watcher, int events) {
@@ -1,5 +1,10 @@
 #include <fs/tar.h>
 #include <kstring.h>
+#include <kmath.h>
+#include <logging.h>
+#include <liballoc/liballoc.h>
+#include <mm/page_cache.h>
+#include <paging.h>
 #include <abi-bits/errno.h>
 
 namespace fs::tar {
@@ -12,7 +17,11 @@ namespace fs::tar {
     constexpr char TAR_TYPE_FIFO                    = '6';
     constexpr char TAR_TYPE_FILE_CONTIGUOUS         = '7';
     constexpr char TAR_TYPE_GLOBAL_EXTENDED_HEADER  = 'g';
-    constexpr char TAR_TYPE_EXTENDED_HEADER         = 'g';
+    constexpr char TAR_TYPE_EXTENDED_HEADER         = 'x';
+    constexpr char TAR_TYPE_GNU_LONG_NAME           = 'L';
+    constexpr char TAR_TYPE_GNU_LONG_LINK           = 'K';
+
+    constexpr uint32_t MIN_ENTRIES              = 64;
 }
 
 inline static long oct_to_dec(const char* str, int size) {
@@ -26,11 +35,6 @@ inline static long oct_to_dec(const char* str, int size) {
     return n;
 }
 
-inline static long get_block_count(const char* size) {
-    long sz = oct_to_dec(size, 12);
-    return (sz + fs::tar::BYTES_PER_BLOCK - 1) / fs::tar::BYTES_PER_BLOCK;
-}
-
 inline static uint32_t tar_flags_to_fs(char type) {
     switch(type) {
         case fs::tar::TAR_TYPE_DIRECTORY:
@@ -58,6 +62,16 @@ namespace fs::tar {
         vol->close(this);
     }
 
+    bool tar_node::uses_page_cache() const {
+        // Uncompressed, the archive is already in memory
+        return vol && vol->compressed() && (flags & FS_NODE_TYPE) == FS_NODE_FILE;
+    }
+
+    int tar_node::read_pages(mm::page_cache::page** pages, unsigned count) {
+        if(!vol) return -ENOSYS;
+        return vol->read_pages(this, pages, count);
+    }
+
     int tar_node::read_dir(directory_entry* dirent, uint32_t index) {
         if(!vol) return -1;
         return vol->read_dir(this, dirent, index);
@@ -68,128 +82,343 @@ namespace fs::tar {
         return vol->find_dir(this, name);
     }
 
-    void tar_volume::make_node(tar_header_t* header, tar_node* n, ino_t inode, ino_t parent, tar_header_t* dir_header) {
-        n->parent = parent;
-        n->header = header;
-        n->inode = inode;
-        n->uid = oct_to_dec(header->ustar.uid, 8);
-        n->flags = tar_flags_to_fs(header->ustar.type);
-        n->vol = this;
-        n->volume_id = _volume_id;
-
-        const char* name = header->ustar.name;
-        char* saved;
-        char* name_part = strtok_r(header->ustar.name, "/", &saved);
-        while(name_part) {
-            name = name_part;
-            name_part = strtok_r(nullptr, "/", &saved);
+    uint32_t tar_volume::hash_name(const char* name, size_t len) {
+        // FNV-1a
+        uint32_t hash = 0x811C9DC5;
+        for(size_t i = 0; i < len; i++) {
+            hash ^= (uint8_t)name[i];
+            hash *= 0x01000193;
         }
 
-        strncpy(n->name, name, 256);
-        n->size = oct_to_dec(header->ustar.size, 12);
+        return hash;
+    }
+
+    uint32_t tar_volume::index_slot(ino_t parent, uint32_t hash) const {
+        return (hash ^ ((uint32_t)parent * 0x9E3779B9)) & _index_mask;
     }
 
-    int tar_volume::read_directory(int block_index, ino_t parent) {
-        ino_t dir_inode = _next_node++;
-        tar_header_t* dir_header = &_blocks[block_index];
-        tar_node* dir_node = &_nodes[dir_inode];
-        make_node(dir_header, dir_node, dir_inode, parent);
+    ino_t tar_volume::lookup(ino_t parent, const char* name, size_t len, uint32_t hash) const {
+        for(uint32_t slot = index_slot(parent, hash); _index[slot] != NO_NODE; slot = (slot + 1) & _index_mask) {
+            const entry_t& e = _entries[_index[slot]];
+            if(e.hash == hash && e.parent == parent && e.name_len == len && memcmp(_names + e.name, name, len) == 0) {
+                return _index[slot];
+            }
+        }
+
+        return -1;
+    }
+
+    void tar_volume::add_to_index(ino_t inode) {
+        uint32_t slot = index_slot(_entries[inode].parent, _entries[inode].hash);
+        while(_index[slot] != NO_NODE) {
+            slot = (slot + 1) & _index_mask;
+        }
+
+        _index[slot] = inode;
+    }
+
+    ino_t tar_volume::add_entry(ino_t parent, const char* name, size_t len, uint32_t hash) {
+        if(_node_count == _entry_capacity) {
+            _entry_capacity *= 2;
+            _entries = (entry_t *)realloc(_entries, _entry_capacity * sizeof(entry_t));
+        }
+
+        if(_names_size + len + 1 > _names_capacity) {
+            while(_names_size + len + 1 > _names_capacity) {
+                _names_capacity *= 2;
+            }
+
+            _names = (char *)realloc(_names, _names_capacity);
+        }
 
-        dir_node->entry_count = 0;
-        unsigned i = block_index + get_block_count(dir_header->ustar.size);
+        // Kept at most half full
+        if((_node_count + 1) * 2 > _index_mask + 1) {
+            uint32_t slots = (_index_mask + 1) * 2;
+            free(_index);
+            _index = (uint32_t *)malloc(slots * sizeof(uint32_t));
+            memset(_index, 0xFF, slots * sizeof(uint32_t));
+            _index_mask = slots - 1;
+            for(ino_t i = 1; i < (ino_t)_node_count; i++) {
+                add_to_index(i);
+            }
+        }
+
+        ino_t inode = _node_count++;
+        entry_t& e = _entries[inode];
+        memset(&e, 0, sizeof(entry_t));
+        e.parent = parent;
+        e.name = _names_size;
+        e.name_len = len;
+        e.hash = hash;
+        e.flags = FS_NODE_DIRECTORY;    // Until its own header turns up, if it does
+        memcpy(_names + _names_size, name, len);
+        _names[_names_size + len] = 0;
+        _names_size += len + 1;
+        add_to_index(inode);
+        return inode;
+    }
+
+    void tar_volume::scan() {
+        // Headers are copied out, the archive might not be sitting in memory as it is
+        tar_header_t block;
+        const tar_header_t* header = &block;
+        char path[PATH_MAX];
+        bool long_name = false;
+        size_t long_name_len = 0;
+        uint64_t i = 0;
         while(i < _block_count) {
-            if(strcmp(_blocks[i].ustar.name, dir_header->ustar.name) || !strnlen(_blocks[i].ustar.name, 1)) {
-                break; // End of directory
+            if(read_archive(i * BYTES_PER_BLOCK, BYTES_PER_BLOCK, &block) < 0) {
+                log::error("[tar] Archive is corrupt at block %llu", i);
+                break;
+            }
+
+            if(!header->ustar.name[0]) {
+                break; // End of archive
+            }
+
+            uint64_t size = oct_to_dec(header->ustar.size, 12);
+            uint64_t data = (i + 1) * BYTES_PER_BLOCK;
+            i += 1 + (size + BYTES_PER_BLOCK - 1) / BYTES_PER_BLOCK;
+
+            char type = header->ustar.type;
+            if(type == TAR_TYPE_GNU_LONG_NAME) {
+                // The name of the next entry, too long for its header
+                size_t len = kstd::min(size, (uint64_t)PATH_MAX - 1);
+                long_name = read_archive(data, len, path) == 0;
+                long_name_len = long_name ? strnlen(path, len) : 0;
+                continue;
+            }
+
+            if(type == TAR_TYPE_GNU_LONG_LINK || type == TAR_TYPE_EXTENDED_HEADER || type == TAR_TYPE_GLOBAL_EXTENDED_HEADER) {
+                continue;
+            }
+
+            // prefix/name, unless there was a long name before it (already in path)
+            size_t path_len = 0;
+            if(long_name) {
+                path_len = long_name_len;
+                long_name = false;
+            } else {
+                size_t prefix_len = strnlen(header->ustar.prefix, sizeof(header->ustar.prefix));
+                if(prefix_len && memcmp(header->ustar.magic, "ustar", 5) == 0) {
+                    memcpy(path, header->ustar.prefix, prefix_len);
+                    path[prefix_len] = '/';
+                    path_len = prefix_len + 1;
+                }
+
+                size_t name_len = strnlen(header->ustar.name, sizeof(header->ustar.name));
+                memcpy(path + path_len, header->ustar.name, name_len);
+                path_len += name_len;
             }
 
-            if(_blocks[i].ustar.name[strnlen(dir_header->ustar.name, 100)] != '/') {
-                break; // Found the leaf
+            path[path_len] = 0;
+
+            // Every directory on the way gets a node whether it has its own header or not
+            ino_t node = 0;
+            size_t start = 0;
+            while(start < path_len) {
+                size_t end = start;
+                while(end < path_len && path[end] != '/') {
+                    end++;
+                }
+
+                size_t len = end - start;
+                bool dot = len == 1 && path[start] == '.';
+                if(len && !dot) {
+                    if(len > NAME_MAX) {
+                        log::warning("[tar] Name too long in %s", path);
+                        node = -1;
+                        break;
+                    }
+
+                    uint32_t hash = hash_name(path + start, len);
+                    ino_t next = lookup(node, path + start, len, hash);
+                    node = next >= 0 ? next : add_entry(node, path + start, len, hash);
+                }
+
+                start = end + 1;
             }
 
-            dir_node->entry_count++;
-            i += get_block_count(_blocks[i].ustar.size) + 1;
+            if(node <= 0) {
+                continue;
+            }
+
+            entry_t& e = _entries[node];
+            e.data = data;
+            e.size = size;
+            e.flags = tar_flags_to_fs(type);
+            e.uid = oct_to_dec(header->ustar.uid, 8);
         }
+    }
 
-        dir_node->children = (ino_t *)malloc(sizeof(ino_t) * dir_node->entry_count);
-        i = block_index + get_block_count(dir_header->ustar.size) + 1;
-        for(int e = 0; i < _block_count && e < dir_node->entry_count; e++) {
-            ino_t inode = _next_node++;
-            tar_node* n = &_nodes[inode];
-            make_node(&_blocks[i], n, inode, dir_inode, dir_header);
-            dir_node->children[e] = inode;
-            i += get_block_count(_blocks[i].ustar.size) + 1;
+    void tar_volume::list_children() {
+        // Counted first, then each directory gets its run of slots
+        _first_child = (uint32_t *)calloc(_node_count + 1, sizeof(uint32_t));
+        for(uint64_t i = 1; i < _node_count; i++) {
+            _first_child[_entries[i].parent + 1]++;
         }
 
-        return i;
+        for(uint64_t i = 1; i <= _node_count; i++) {
+            _first_child[i] += _first_child[i - 1];
+        }
+
+        uint32_t* filled = (uint32_t *)calloc(_node_count, sizeof(uint32_t));
+        _children = (uint32_t *)malloc(kstd::max(_node_count - 1, (uint64_t)1) * sizeof(uint32_t));
+        for(uint64_t i = 1; i < _node_count; i++) {
+            ino_t parent = _entries[i].parent;
+            _children[_first_child[parent] + filled[parent]++] = i;
+        }
+
+        free(filled);
     }
 
-    tar_volume::tar_volume(uintptr_t base, size_t size, const char* name) {
-        _blocks = (tar_header_t *)base;
-        _block_count = size / BYTES_PER_BLOCK;
-
-        int entry_count = 0;
-        for(uint64_t i = 0; i < _block_count; i++, _node_count++) {
-            tar_header_t header = _blocks[i];
-            char* slash_pos = strchr(header.ustar.name, '/');
-            if(!slash_pos || (header.ustar.type == TAR_TYPE_DIRECTORY && slash_pos == header.ustar.name + strnlen(header.ustar.name, 100) - 1)) {
-                entry_count++;
+    int tar_volume::read_archive(uint64_t offset, size_t size, void* buffer) {
+        if(offset > _archive_size || size > _archive_size - offset) {
+            return -EIO;
+        }
+
+        if(!_frame) {
+            memcpy(buffer, (void *)(_base + offset), size);
+            return 0;
+        }
+
+        uint8_t* out = (uint8_t *)buffer;
+        size_t block_size = _frame->block_size();
+        kstd::lock l(_frame_lock);
+        while(size) {
+            int64_t index = offset / block_size;
+            cached_block_t* slot = nullptr;
+            for(unsigned j = 0; j < CACHED_FRAME_BLOCKS; j++) {
+                if(_frame_cache[j].index == index) {
+                    slot = &_frame_cache[j];
+                    break;
+                }
+            }
+
+            if(!slot) {
+                // Least recently used one goes
+                slot = &_frame_cache[0];
+                for(unsigned j = 1; j < CACHED_FRAME_BLOCKS; j++) {
+                    if(_frame_cache[j].last_used < slot->last_used) {
+                        slot = &_frame_cache[j];
+                    }
+                }
+
+                if(!slot->data) {
+                    slot->data = (uint8_t *)malloc(block_size);
+                }
+
+                slot->index = -1;
+                if(_frame->read_block(index, slot->data) < 0) {
+                    return -EIO;
+                }
+
+                slot->index = index;
             }
 
-            i += get_block_count(header.ustar.size);
+            slot->last_used = ++_frame_clock;
+            size_t in_block = offset % block_size;
+            size_t count = kstd::min(size, block_size - in_block);
+            memcpy(out, slot->data + in_block, count);
+            out += count;
+            offset += count;
+            size -= count;
+        }
+
+        return 0;
+    }
+
+    tar_volume::tar_volume(uintptr_t base, size_t size, const char* name) {
+        _base = base;
+        _archive_size = size;
+        for(unsigned i = 0; i < CACHED_FRAME_BLOCKS; i++) {
+            _frame_cache[i] = { nullptr, -1, 0 };
         }
 
+        if(lz4::frame_reader::is_frame((void *)base, size)) {
+            _frame = new lz4::frame_reader();
+            if(_frame->open((void *)base, size) == 0) {
+                _archive_size = _frame->content_size();
+                log::info("[tar] %s is LZ4, %llu KiB unpacked from %llu KiB", name, _archive_size / 1024, size / 1024);
+            } else {
+                log::error("[tar] %s looks like LZ4 but can't be read", name);
+                _archive_size = 0;
+            }
+        }
+
+        _block_count = _archive_size / BYTES_PER_BLOCK;
+
+        // Just the root to begin with, it grows as it goes
+        _entry_capacity = MIN_ENTRIES;
+        _entries = (entry_t *)calloc(_entry_capacity, sizeof(entry_t));
+        _names_capacity = BYTES_PER_BLOCK;
+        _names = (char *)malloc(_names_capacity);
+        _names[0] = 0;
+        _names_size = 1;
+        _index = (uint32_t *)malloc(MIN_ENTRIES * sizeof(uint32_t));
+        memset(_index, 0xFF, MIN_ENTRIES * sizeof(uint32_t));
+        _index_mask = MIN_ENTRIES - 1;
+        _entries[0].flags = FS_NODE_DIRECTORY;
+        _node_count = 1;
+
+        scan();
+        list_children();
+
         _nodes = new tar_node[_node_count];
+        for(uint64_t i = 0; i < _node_count; i++) {
+            tar_node* n = &_nodes[i];
+            n->inode = i;
+            n->uid = _entries[i].uid;
+            n->flags = _entries[i].flags;
+            n->size = _entries[i].size;
+            n->vol = this;
+            n->volume_id = _volume_id;
+        }
 
         tar_node* volume_node = &_nodes[0];
-        volume_node->header = nullptr;
         volume_node->flags = FS_NODE_DIRECTORY | FS_NODE_MOUNTPOINT;
-        volume_node->inode = 0;
-        volume_node->size = size;
-        volume_node->vol = this;
-        volume_node->parent = 0;
+        volume_node->size = _archive_size;
 
         _mount_point = volume_node;
         _mount_point_entry.set_name(name);
         _mount_point_entry.flags = DT_DIR;
         _mount_point_entry.node = volume_node;
-
-        volume_node->children = (ino_t *)malloc(sizeof(ino_t) * entry_count);
-        volume_node->entry_count = entry_count;
-        int e = 0;
-        for(unsigned i = 0; i < _block_count; i++, e++) {
-            tar_header_t header = _blocks[i];
-            if(!strnlen(header.ustar.name, 100)) {
-                break;
-            }
-
-            if(header.ustar.type == TAR_TYPE_DIRECTORY) {
-                volume_node->children[e] = _next_node;
-                i = read_directory(i, 0);
-            } else if(header.ustar.type == TAR_TYPE_FILE) {
-                ino_t inode = _next_node++;
-                tar_node* node = &_nodes[inode];
-                make_node(&_blocks[i], node, inode, 0);
-                volume_node->children[e] = inode;
-            }
-
-            i += get_block_count(header.ustar.size);
-        }
-
-        volume_node->entry_count = e;
     }
 
     ssize_t tar_volume::read(tar_node* node, size_t off, size_t size, uint8_t* buf) {
-        tar_node* tar_node = &_nodes[node->inode];
         if((node->is_dir())) {
             return -EISDIR;
         }
 
-        if(off > node->size || size == 0) {
+        if(off >= node->size || size == 0) {
             return 0;
         }
 
-        memcpy(buf, (void *)(((uintptr_t)tar_node->header) + BYTES_PER_BLOCK + off), size);
-        return size;
+        size = kstd::min(size, node->size - off);
+        int err = read_archive(_entries[node->inode].data + off, size, buf);
+        return err < 0 ? err : size;
+    }
+
+    int tar_volume::read_pages(tar_node* node, mm::page_cache::page** pages, unsigned count) {
+        // Nothing to wait for, each one is done by the time it's handed back
+        for(unsigned i = 0; i < count; i++) {
+            mm::page_cache::page* p = pages[i];
+            size_t offset = p->key.index << memory::PAGE_SHIFT_4K;
+            size_t valid = offset < node->size ? kstd::min((size_t)memory::PAGE_SIZE_4K, node->size - offset) : 0;
+            int err = valid ? read_archive(_entries[node->inode].data + offset, valid, p->data) : 0;
+            memset(p->data + valid, 0, memory::PAGE_SIZE_4K - valid);
+            mm::page_cache::finish_read(p, err);
+        }
+
+        return 0;
+    }
+
+    void tar_volume::set_volume_id(volume_id_t id) {
+        // The nodes carry it too, the page cache goes by theirs
+        fs_volume::set_volume_id(id);
+        for(uint64_t i = 0; i < _node_count; i++) {
+            _nodes[i].volume_id = id;
+        }
     }
 
     ssize_t tar_volume::write(tar_node* node, size_t off, size_t size, uint8_t* buf) {
@@ -209,10 +438,11 @@ namespace fs::tar {
     }
 
     int tar_volume::read_dir(tar_node* node, directory_entry* dirent, uint32_t index) {
-        tar_node* tnode = &_nodes[node->inode];
         if(!node->is_dir()) return -ENOTDIR;
 
-        if(index >= (unsigned)(tnode->entry_count + 2)) return 0;
+        ino_t inode = node->inode;
+        uint32_t child_count = _first_child[inode + 1] - _first_child[inode];
+        if(index >= child_count + 2) return 0;
 
         if(index == 0) {
             dirent->set_name(".");
@@ -224,53 +454,31 @@ namespace fs::tar {
             return 1;
         }
 
-        tar_node* dir = &_nodes[tnode->children[index - 2]];
-        dirent->set_name(dir->name);
-        dirent->flags = dir->flags;
-        dirent->node = dir;
-
-        switch(dir->flags & FS_NODE_TYPE) {
-            case FS_NODE_FILE:
-                dirent->flags = DT_REG;
-                break;
-            case FS_NODE_DIRECTORY:
-                dirent->flags = DT_DIR;
-                break;
-            case FS_NODE_CHARDEVICE:
-                dirent->flags = DT_CHR;
-                break;
-            case FS_NODE_BLKDEVICE:
-                dirent->flags = DT_BLK;
-                break;
-            case FS_NODE_SOCKET:
-                dirent->flags = DT_SOCK;
-                break;
-            case FS_NODE_SYMLINK:
-                dirent->flags = DT_LNK;
-                break;
-        }
-
+        tar_node* child = &_nodes[_children[_first_child[inode] + index - 2]];
+        const entry_t& e = _entries[child->inode];
+        dirent->set_name(_names + e.name, e.name_len);
+        dirent->node = child;
+        dirent->flags = directory_entry::file_to_dirent_flags(child->flags);
         return 1;
     }
 
     fs_node* tar_volume::find_dir(tar_node* node, const char* name) {
-        tar_node* tnode = &_nodes[node->inode];
-        if(!tnode->is_dir()) return nullptr;
+        if(!node->is_dir()) return nullptr;
 
-        if(strncmp(".", name, 1) == 0) {
+        size_t len = strnlen(name, NAME_MAX + 1);
+        if(len == 1 && name[0] == '.') {
             return node;
         }
 
-        if(strncmp("..", name, 1) == 0) {
-            return node->inode == 0 ? get_root() : &_nodes[tnode->parent];
+        if(len == 2 && name[0] == '.' && name[1] == '.') {
+            return node->inode == 0 ? get_root() : &_nodes[_entries[node->inode].parent];
         }
 
-        for(int i = 0; i < tnode->entry_count; i++) {
-            if(strncmp(_nodes[tnode->children[i]].name, name, 256) == 0) {
-                return &_nodes[tnode->children[i]];
-            }
+        if(len > NAME_MAX) {
+            return nullptr;
         }
 
-        return nullptr;
+        ino_t found = lookup(node->inode, name, len, hash_name(name, len));
+        return found > 0 ? &_nodes[found] : nullptr;
     }
-}
\ No newline at end of file
+}
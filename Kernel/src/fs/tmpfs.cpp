@@ -0,0 +1,590 @@
+#include <fs/tmpfs.h>
+#include <fs/directory_entry.h>
+#include <fs/dcache.h>
+#include <physical_allocator.h>
+#include <paging.h>
+#include <mm/vm_object.h>
+#include <kstring.h>
+#include <kmath.h>
+#include <kassert.h>
+#include <logging.h>
+#include <liballoc/liballoc.h>
+#include <abi-bits/errno.h>
+
+namespace fs::tmpfs {
+    constexpr uint32_t MIN_CHILDREN = 8;
+    constexpr unsigned FREE_BATCH = 64;     // Frames let go of per TLB shootdown
+
+    tmpfs_node::tmpfs_node(tmpfs_volume* vol, ino_t inode, uint32_t flags)
+        :_vol(vol)
+    {
+        this->inode = inode;
+        this->flags = flags;
+        this->volume_id = vol->get_volume_id();
+    }
+
+    tmpfs_node::~tmpfs_node() {
+        for(uint32_t i = 0; i < _child_count; i++) {
+            free(_children[i].name);
+        }
+
+        free(_children);
+        free(_pages);
+    }
+
+    ssize_t tmpfs_node::read(size_t off, size_t size, uint8_t* buf) {
+        _flock.acquire_read();
+        auto ret = _vol->read(this, off, size, buf);
+        _flock.release_read();
+        return ret;
+    }
+
+    ssize_t tmpfs_node::write(size_t off, size_t size, uint8_t* buf) {
+        _flock.acquire_write();
+        auto ret = _vol->write(this, off, size, buf);
+        _flock.release_write();
+        return ret;
+    }
+
+    void tmpfs_node::close() {
+        fs_node::close();
+
+        if(_handle_count == 0 && nlink == 0) {
+            _vol->release_node(this);
+        }
+    }
+
+    int tmpfs_node::read_dir(directory_entry* dirent, uint32_t index) {
+        _flock.acquire_read();
+        auto ret = _vol->read_dir(this, dirent, index);
+        _flock.release_read();
+        return ret;
+    }
+
+    fs_node* tmpfs_node::find_dir(const char* name) {
+        _flock.acquire_read();
+        auto ret = _vol->find_dir(this, name);
+        _flock.release_read();
+        return ret;
+    }
+
+    int tmpfs_node::create(directory_entry* ent, uint32_t mode) {
+        _flock.acquire_write();
+        auto ret = _vol->create(this, ent, FS_NODE_FILE);
+        _flock.release_write();
+        return ret;
+    }
+
+    int tmpfs_node::create_dir(directory_entry* ent, uint32_t mode) {
+        _flock.acquire_write();
+        auto ret = _vol->create(this, ent, FS_NODE_DIRECTORY);
+        _flock.release_write();
+        return ret;
+    }
+
+    int tmpfs_node::link(fs_node* node, directory_entry* ent) {
+        _flock.acquire_write();
+        auto ret = _vol->link(this, node, ent);
+        _flock.release_write();
+        return ret;
+    }
+
+    int tmpfs_node::unlink(directory_entry* ent, bool unlink_directories) {
+        _flock.acquire_write();
+        auto ret = _vol->unlink(this, ent, unlink_directories);
+        _flock.release_write();
+        return ret;
+    }
+
+    int tmpfs_node::truncate(off_t length) {
+        _flock.acquire_write();
+        auto ret = _vol->truncate(this, length);
+        _flock.release_write();
+        return ret;
+    }
+
+    int tmpfs_node::map_page(uint64_t index, uintptr_t& phys) {
+        _flock.acquire_write();
+        auto ret = _vol->map_page(this, index, phys);
+        _flock.release_write();
+        return ret;
+    }
+
+    void tmpfs_node::unmap_page(uint64_t index) {
+        _flock.acquire_write();
+        _vol->unmap_page(this, index);
+        _flock.release_write();
+    }
+
+    tmpfs_volume::tmpfs_volume(const char* name, size_t max_size) {
+        if(!max_size) {
+            uint64_t ram = memory::get_total_blocks() * memory::PHYS_BLOCK_SIZE;
+            max_size = kstd::min(ram / DEFAULT_RAM_SHARE, (uint64_t)DEFAULT_MAX_SIZE);
+        }
+
+        _max_pages = memory::PAGE_COUNT_4K(max_size);
+
+        _root = new tmpfs_node(this, _next_inode++, FS_NODE_DIRECTORY | FS_NODE_MOUNTPOINT);
+        _root->nlink = 2;
+
+        _mount_point = _root;
+        _mount_point_entry.set_name(name);
+        _mount_point_entry.flags = DT_DIR;
+        _mount_point_entry.node = _root;
+
+        log::info("[tmpfs] %s can hold up to %llu KiB", name, (uint64_t)_max_pages * memory::PAGE_SIZE_4K / 1024);
+    }
+
+    void tmpfs_volume::set_volume_id(volume_id_t id) {
+        // Only the root exists before the volume is registered
+        fs_volume::set_volume_id(id);
+        _root->volume_id = id;
+    }
+
+    uint32_t tmpfs_volume::hash_name(const char* name, size_t len) {
+        // FNV-1a
+        uint32_t hash = 0x811C9DC5;
+        for(size_t i = 0; i < len; i++) {
+            hash ^= (uint8_t)name[i];
+            hash *= 0x01000193;
+        }
+
+        return hash;
+    }
+
+    int64_t tmpfs_volume::find_child(tmpfs_node* dir, const char* name, size_t len, uint32_t hash) {
+        for(uint32_t i = 0; i < dir->_child_count; i++) {
+            const tmpfs_node::child_t& c = dir->_children[i];
+            if(c.hash == hash && c.name_len == len && memcmp(c.name, name, len) == 0) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    int tmpfs_volume::add_child(tmpfs_node* dir, const char* name, size_t len, uint32_t hash, tmpfs_node* node) {
+        if(dir->_child_count == dir->_child_capacity) {
+            uint32_t capacity = kstd::max(dir->_child_capacity * 2, MIN_CHILDREN);
+            auto* children = (tmpfs_node::child_t *)realloc(dir->_children, capacity * sizeof(tmpfs_node::child_t));
+            if(!children) {
+                return -ENOMEM;
+            }
+
+            dir->_children = children;
+            dir->_child_capacity = capacity;
+        }
+
+        char* copy = (char *)malloc(len + 1);
+        if(!copy) {
+            return -ENOMEM;
+        }
+
+        memcpy(copy, name, len);
+        copy[len] = 0;
+        dir->_children[dir->_child_count++] = { node, copy, hash, (uint8_t)len };
+        dir->size = dir->_child_count;
+        dcache::invalidate(dir, copy);
+        return 0;
+    }
+
+    int tmpfs_volume::grow_slots(tmpfs_node* node, size_t slots) {
+        if(slots <= node->_page_slots) {
+            return 0;
+        }
+
+        slots = kstd::max(slots, node->_page_slots * 2);
+        auto* pages = (uint8_t **)realloc(node->_pages, slots * sizeof(uint8_t *));
+        if(!pages) {
+            return -ENOMEM;
+        }
+
+        memset(pages + node->_page_slots, 0, (slots - node->_page_slots) * sizeof(uint8_t *));
+        node->_pages = pages;
+        node->_page_slots = slots;
+        return 0;
+    }
+
+    uint8_t* tmpfs_volume::allocate_page() {
+        if(__atomic_add_fetch(&_used_pages, 1, __ATOMIC_RELAXED) > _max_pages) {
+            __atomic_sub_fetch(&_used_pages, 1, __ATOMIC_RELAXED);
+            return nullptr;
+        }
+
+        uint64_t phys = memory::allocate_zeroed_block();
+        bool zeroed = phys;
+        if(!zeroed) {
+            // Unlike allocate_physical_block this one gives up instead of panicking
+            phys = memory::allocate_physical_blocks(1);
+        }
+
+        if(!phys) {
+            __atomic_sub_fetch(&_used_pages, 1, __ATOMIC_RELAXED);
+            return nullptr;
+        }
+
+        uint8_t* data = (uint8_t *)memory::kernel_allocate_4k_pages(1);
+        memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)data, 1);
+        if(!zeroed) {
+            memset(data, 0, memory::PAGE_SIZE_4K);
+        }
+
+        return data;
+    }
+
+    static void free_batch(uint8_t** mappings, unsigned count) {
+        uint64_t frames[FREE_BATCH];
+        for(unsigned i = 0; i < count; i++) {
+            frames[i] = memory::virtual_to_physical_addr((uintptr_t)mappings[i]);
+            memory::kernel_map_virtual_memory_4k(0, (uintptr_t)mappings[i], 1, 0);
+        }
+
+        memory::tlb_shootdown();
+        for(unsigned i = 0; i < count; i++) {
+            memory::kernel_free_4k_pages(mappings[i], 1);
+            memory::free_physical_block(frames[i]);
+        }
+    }
+
+    void tmpfs_volume::free_pages(tmpfs_node* node, size_t first) {
+        // Unmapped first, and neither the frames nor the addresses can go back until no CPU
+        // has the old mappings cached any more
+        uint8_t* batch[FREE_BATCH];
+        unsigned count = 0;
+        size_t freed = 0;
+        for(size_t i = first; i < node->_page_slots; i++) {
+            uint8_t* data = node->_pages[i];
+            if(!data) {
+                continue;
+            }
+
+            node->_pages[i] = nullptr;
+            batch[count++] = data;
+            if(count == FREE_BATCH) {
+                free_batch(batch, count);
+                freed += count;
+                count = 0;
+            }
+        }
+
+        if(count) {
+            free_batch(batch, count);
+            freed += count;
+        }
+
+        __atomic_sub_fetch(&_used_pages, freed, __ATOMIC_RELAXED);
+    }
+
+    void tmpfs_volume::release_node(tmpfs_node* node) {
+        if(node->handle_count()) {
+            // Whoever still has it open, it goes on their last close.  Shared mappings of it
+            // can't be looked up any more, so they go as soon as nothing maps them.
+            mm::file_vm_object::forget(node);
+            return;
+        }
+
+        free_pages(node, 0);
+        delete node;
+    }
+
+    ssize_t tmpfs_volume::read(tmpfs_node* node, size_t off, size_t size, uint8_t* buf) {
+        if(node->is_dir()) {
+            return -EISDIR;
+        }
+
+        if(off >= node->size || size == 0) {
+            return 0;
+        }
+
+        size = kstd::min(size, node->size - off);
+        size_t done = 0;
+        while(done < size) {
+            size_t pos = off + done;
+            size_t index = pos >> memory::PAGE_SHIFT_4K;
+            size_t in_page = pos & (memory::PAGE_SIZE_4K - 1);
+            size_t count = kstd::min(size - done, memory::PAGE_SIZE_4K - in_page);
+            uint8_t* data = index < node->_page_slots ? node->_pages[index] : nullptr;
+            if(data) {
+                memcpy(buf + done, data + in_page, count);
+            } else {
+                memset(buf + done, 0, count);
+            }
+
+            done += count;
+        }
+
+        return size;
+    }
+
+    ssize_t tmpfs_volume::write(tmpfs_node* node, size_t off, size_t size, uint8_t* buf) {
+        if(!node->is_file()) {
+            return node->is_dir() ? -EISDIR : -EINVAL;
+        }
+
+        if(size == 0) {
+            return 0;
+        }
+
+        // Holes don't take up anything, but the page table for them would
+        size_t limit = _max_pages << memory::PAGE_SHIFT_4K;
+        if(off >= limit || size > limit - off) {
+            return -EFBIG;
+        }
+
+        if(int e = grow_slots(node, memory::PAGE_COUNT_4K(off + size))) {
+            return e;
+        }
+
+        size_t done = 0;
+        while(done < size) {
+            size_t pos = off + done;
+            size_t index = pos >> memory::PAGE_SHIFT_4K;
+            size_t in_page = pos & (memory::PAGE_SIZE_4K - 1);
+            size_t count = kstd::min(size - done, memory::PAGE_SIZE_4K - in_page);
+            if(!node->_pages[index] && !(node->_pages[index] = allocate_page())) {
+                break;
+            }
+
+            memcpy(node->_pages[index] + in_page, buf + done, count);
+            done += count;
+        }
+
+        if(!done) {
+            return -ENOSPC;
+        }
+
+        node->size = kstd::max(node->size, off + done);
+        return done;
+    }
+
+    int tmpfs_volume::truncate(tmpfs_node* node, off_t length) {
+        if(!node->is_file()) {
+            return node->is_dir() ? -EISDIR : -EINVAL;
+        }
+
+        if(length < 0) {
+            return -EINVAL;
+        }
+
+        if((size_t)length > (_max_pages << memory::PAGE_SHIFT_4K)) {
+            return -EFBIG;
+        }
+
+        if((size_t)length < node->size) {
+            if(node->_mapped_pages) {
+                // Something still maps them, so they read as zero until the last unmap_page
+                for(size_t i = memory::PAGE_COUNT_4K(length); i < node->_page_slots; i++) {
+                    if(node->_pages[i]) {
+                        memset(node->_pages[i], 0, memory::PAGE_SIZE_4K);
+                    }
+                }
+            } else {
+                free_pages(node, memory::PAGE_COUNT_4K(length));
+            }
+
+            // What's left of the last page past the end has to read as zero if it grows again
+            size_t index = length >> memory::PAGE_SHIFT_4K;
+            size_t in_page = length & (memory::PAGE_SIZE_4K - 1);
+            if(in_page && index < node->_page_slots && node->_pages[index]) {
+                memset(node->_pages[index] + in_page, 0, memory::PAGE_SIZE_4K - in_page);
+            }
+        }
+
+        node->size = length;
+        return 0;
+    }
+
+    int tmpfs_volume::map_page(tmpfs_node* node, uint64_t index, uintptr_t& phys) {
+        if(!node->is_file()) {
+            return -EINVAL;
+        }
+
+        if(index >= _max_pages) {
+            return -ENOSPC;
+        }
+
+        if(int e = grow_slots(node, index + 1)) {
+            return e;
+        }
+
+        // A hole gets a page now, or a later write would land somewhere the mapping can't see
+        if(!node->_pages[index] && !(node->_pages[index] = allocate_page())) {
+            return -ENOSPC;
+        }
+
+        node->_mapped_pages++;
+        phys = memory::virtual_to_physical_addr((uintptr_t)node->_pages[index]);
+        return 0;
+    }
+
+    void tmpfs_volume::unmap_page(tmpfs_node* node, uint64_t index) {
+        assert(node->_mapped_pages && index < node->_page_slots && node->_pages[index]);
+        if(--node->_mapped_pages == 0) {
+            // Whatever truncate had to leave behind (or a mapping had past the end) can go now
+            free_pages(node, memory::PAGE_COUNT_4K(node->size));
+        }
+    }
+
+    int tmpfs_volume::read_dir(tmpfs_node* node, directory_entry* dirent, uint32_t index) {
+        if(!node->is_dir()) return -ENOTDIR;
+
+        if(index == 0) {
+            dirent->set_name(".");
+            dirent->flags = DT_DIR;
+            dirent->node = node;
+            return 1;
+        } else if(index == 1) {
+            dirent->set_name("..");
+            dirent->flags = DT_DIR;
+            return 1;
+        }
+
+        if(index - 2 >= node->_child_count) return 0;
+
+        const tmpfs_node::child_t& c = node->_children[index - 2];
+        dirent->set_name(c.name, c.name_len);
+        dirent->node = c.node;
+        dirent->flags = directory_entry::file_to_dirent_flags(c.node->flags);
+        return 1;
+    }
+
+    fs_node* tmpfs_volume::find_dir(tmpfs_node* node, const char* name) {
+        if(!node->is_dir()) return nullptr;
+
+        size_t len = strnlen(name, NAME_MAX + 1);
+        if(len == 1 && name[0] == '.') {
+            return node;
+        }
+
+        if(len == 2 && name[0] == '.' && name[1] == '.') {
+            return node == _root ? get_root() : node->parent;
+        }
+
+        if(len > NAME_MAX) {
+            return nullptr;
+        }
+
+        int64_t i = find_child(node, name, len, hash_name(name, len));
+        return i >= 0 ? node->_children[i].node : nullptr;
+    }
+
+    int tmpfs_volume::create(tmpfs_node* node, directory_entry* ent, uint32_t flags) {
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        if(node->nlink == 0) {
+            // Removed already, nothing can go in it any more
+            return -ENOENT;
+        }
+
+        const char* name = ent->name();
+        size_t len = strnlen(name, NAME_MAX + 1);
+        if(len == 0 || len > NAME_MAX) {
+            return len ? -ENAMETOOLONG : -ENOENT;
+        }
+
+        uint32_t hash = hash_name(name, len);
+        if((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')
+            || find_child(node, name, len, hash) >= 0) {
+            return -EEXIST;
+        }
+
+        ino_t inode = __atomic_fetch_add(&_next_inode, 1, __ATOMIC_RELAXED);
+        tmpfs_node* created = new tmpfs_node(this, inode, flags);
+        created->uid = node->uid;
+        created->parent = node;
+        bool directory = (flags & FS_NODE_TYPE) == FS_NODE_DIRECTORY;
+        created->nlink = directory ? 2 : 1;   // A directory's own . counts
+        if(int e = add_child(node, name, len, hash, created)) {
+            delete created;
+            return e;
+        }
+
+        if(directory) {
+            node->nlink++;
+        }
+
+        ent->node = created;
+        ent->flags = directory ? DT_DIR : DT_REG;
+        return 0;
+    }
+
+    int tmpfs_volume::link(tmpfs_node* node, fs_node* file, directory_entry* ent) {
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        if(file->volume_id != node->volume_id) {
+            return -EXDEV;
+        }
+
+        if(file->is_dir()) {
+            return -EPERM;
+        }
+
+        const char* name = ent->name();
+        size_t len = strnlen(name, NAME_MAX + 1);
+        if(len == 0 || len > NAME_MAX) {
+            return len ? -ENAMETOOLONG : -ENOENT;
+        }
+
+        uint32_t hash = hash_name(name, len);
+        if(find_child(node, name, len, hash) >= 0) {
+            return -EEXIST;
+        }
+
+        tmpfs_node* target = (tmpfs_node *)file;
+        if(int e = add_child(node, name, len, hash, target)) {
+            return e;
+        }
+
+        __atomic_add_fetch(&target->nlink, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    int tmpfs_volume::unlink(tmpfs_node* node, directory_entry* ent, bool unlink_dirs) {
+        if(!node->is_dir()) {
+            return -ENOTDIR;
+        }
+
+        const char* name = ent->name();
+        size_t len = strnlen(name, NAME_MAX + 1);
+        if((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+            return -EINVAL;
+        }
+
+        int64_t i = len <= NAME_MAX ? find_child(node, name, len, hash_name(name, len)) : -1;
+        if(i < 0) {
+            return -ENOENT;
+        }
+
+        tmpfs_node* target = node->_children[i].node;
+        if(target->is_dir()) {
+            if(!unlink_dirs) {
+                return -EISDIR;
+            }
+
+            if(target->_child_count) {
+                return -ENOTEMPTY;
+            }
+        }
+
+        // The last one takes its place, the order doesn't mean anything
+        dcache::invalidate(node, name);
+        free(node->_children[i].name);
+        node->_children[i] = node->_children[--node->_child_count];
+        node->size = node->_child_count;
+
+        if(target->is_dir()) {
+            // Its own . goes with it, and its .. doesn't point at the parent any more
+            target->nlink = 0;
+            node->nlink--;
+        } else if(__atomic_sub_fetch(&target->nlink, 1, __ATOMIC_RELAXED) > 0) {
+            return 0;
+        }
+
+        release_node(target);
+        return 0;
+    }
+}
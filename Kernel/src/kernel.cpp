@@ -1,5 +1,6 @@
 #include <fs/filesystem.h>
 #include <fs/tar.h>
+#include <fs/tmpfs.h>
 #include <fs/fs_node.h>
 #include <video/video.h>
 #include <debug.h>
@@ -14,6 +15,10 @@
 #include <device.h>
 #include <storage/ahci.h>
 #include <keyboard.h>
+#include <mm/ksm.h>
+#include <mm/shrinker.h>
+#include <mm/compaction.h>
+#include <mm/page_cache.h>
 
 const char* version = "Borrrdex x86_64";
 
@@ -25,14 +30,19 @@ extern "C" void _init();
 video_mode_t video_mode;
 
 extern "C" [[noreturn]] void idle_process() {
+    // Scratch mapping for zeroing blocks while there is nothing else to do
+    void* zero_mapping = memory::kernel_allocate_4k_pages(1);
     while(true) {
         asm("sti");
-        asm("hlt");
+        if(!memory::refill_zero_pool(zero_mapping)) {
+            asm("hlt");
+        }
     }
 }
 
 [[noreturn]] void kernel_process() {
     ahci::initialize();
+    mm::page_cache::start_flusher();
 
     if(fs::fs_node* node = fs::resolve_path("/system/lib")) {
         fs::register_volume(new fs::link_volume(node, "lib"), false);
@@ -58,15 +68,25 @@ extern "C" [[noreturn]] void idle_process() {
     }
 
     log::write("OK");
-    void* init_elf = malloc(initfs_node->size);
-    fs::read(initfs_node, 0, initfs_node->size, init_elf);
-    process_t* init_proc = scheduler::create_elf_process(init_elf, 1, (char **)argv, envc, (char **)envp);
+    process_t* init_proc = scheduler::create_elf_process(initfs_node, 1, (char **)argv, envc, (char **)envp);
     strncpy(init_proc->working_dir, "/", 1);
     strncpy(init_proc->name, "init", 5);
     scheduler::start_process(init_proc);
 
+    bool ksm = hal::ksm_enabled();
     while(true) {
         scheduler::gc();
+        if(memory::memory_low()) {
+            // In case the allocator couldn't do it itself at the time
+            mm::shrink_caches();
+        }
+
+        if(ksm) {
+            mm::ksm::scan();
+        }
+
+        mm::compaction::background();
+
         scheduler::get_current_thread()->sleep(1000000);
     }
 }
@@ -84,6 +104,7 @@ extern "C" [[noreturn]] void kmain() {
     log::late_initialize();
 
     initialize_constructors();
+    mm::page_cache::initialize();
 
     log::enable_klog();
 
@@ -111,6 +132,10 @@ extern "C" [[noreturn]] void kmain() {
     fs::register_volume(tar);
     log::write("OK");
 
+    log::info("Initializing /tmp...");
+    fs::register_volume(new fs::tmpfs::tmpfs_volume("tmp"));
+    log::write("OK");
+
     fs::fs_node* initrd = fs::find_dir(fs::get_root(), "initrd");
     if(!initrd) {
         kernel_panic((const char*[]){"initrd not mounted!"}, 1);
@@ -0,0 +1,320 @@
+#include <lz4.h>
+#include <kstring.h>
+#include <kassert.h>
+#include <kmath.h>
+#include <liballoc/liballoc.h>
+#include <abi-bits/errno.h>
+
+namespace lz4 {
+    constexpr size_t MIN_MATCH = 4;
+    constexpr size_t LAST_LITERALS = 5;  // The format says the last 5 bytes are always literals
+    constexpr size_t MF_LIMIT = 12;      // ...and the last match starts at least 12 bytes from the end
+    constexpr size_t MAX_OFFSET = 0xFFFF;
+
+    constexpr uint8_t FLG_VERSION_MASK      = 0xC0;
+    constexpr uint8_t FLG_VERSION           = 0x40;
+    constexpr uint8_t FLG_BLOCK_INDEPENDENT = 0x20;
+    constexpr uint8_t FLG_BLOCK_CHECKSUM    = 0x10;
+    constexpr uint8_t FLG_CONTENT_SIZE      = 0x08;
+    constexpr uint8_t FLG_DICT_ID           = 0x01;
+    constexpr uint32_t BLOCK_UNCOMPRESSED   = 0x80000000;
+
+    static inline uint32_t read32(const uint8_t* p) {
+        uint32_t val;
+        __builtin_memcpy(&val, p, sizeof(uint32_t));
+        return val;
+    }
+
+    static inline unsigned hash(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    static uint8_t* write_length(uint8_t* out, const uint8_t* out_end, size_t length) {
+        while(length >= 255) {
+            if(out >= out_end) {
+                return nullptr;
+            }
+
+            *out++ = 255;
+            length -= 255;
+        }
+
+        if(out >= out_end) {
+            return nullptr;
+        }
+
+        *out++ = length;
+        return out;
+    }
+
+    static uint8_t* write_sequence(uint8_t* out, const uint8_t* out_end, const uint8_t* literals, size_t literal_length,
+        size_t offset, size_t match_length) {
+        if(out >= out_end) {
+            return nullptr;
+        }
+
+        uint8_t* token = out++;
+        *token = (literal_length >= 15 ? 15 : literal_length) << 4;
+        if(literal_length >= 15 && !(out = write_length(out, out_end, literal_length - 15))) {
+            return nullptr;
+        }
+
+        if(literal_length > (size_t)(out_end - out)) {
+            return nullptr;
+        }
+
+        memcpy(out, literals, literal_length);
+        out += literal_length;
+        if(!offset) {
+            // Last sequence, literals only
+            return out;
+        }
+
+        if(out_end - out < 2) {
+            return nullptr;
+        }
+
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+
+        match_length -= MIN_MATCH;
+        *token |= match_length >= 15 ? 15 : match_length;
+        if(match_length >= 15) {
+            out = write_length(out, out_end, match_length - 15);
+        }
+
+        return out;
+    }
+
+    size_t compress_block(const void* src, size_t size, void* dest, size_t dest_size, compress_state_t* state) {
+        assert(size <= MAX_INPUT_SIZE);
+
+        const uint8_t* const start = (const uint8_t *)src;
+        const uint8_t* const end = start + size;
+        const uint8_t* ip = start;
+        const uint8_t* anchor = start;
+        uint8_t* out = (uint8_t *)dest;
+        const uint8_t* const out_end = out + dest_size;
+
+        if(size > MF_LIMIT) {
+            const uint8_t* const match_limit = end - MF_LIMIT;
+            const uint8_t* const match_end_limit = end - LAST_LITERALS;
+            memset(state->table, 0, sizeof(state->table));
+
+            ip++;
+            while(ip < match_limit) {
+                uint32_t sequence = read32(ip);
+                uint16_t& entry = state->table[hash(sequence)];
+                const uint8_t* ref = start + entry;
+                entry = ip - start;
+                if(ref >= ip || (size_t)(ip - ref) > MAX_OFFSET || read32(ref) != sequence) {
+                    ip++;
+                    continue;
+                }
+
+                // Extend the match backwards into the pending literals...
+                while(ip > anchor && ref > start && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+
+                // ...and then forwards as far as it goes
+                size_t offset = ip - ref;
+                const uint8_t* match_end = ip + MIN_MATCH;
+                while(match_end < match_end_limit && *match_end == match_end[-offset]) {
+                    match_end++;
+                }
+
+                out = write_sequence(out, out_end, anchor, ip - anchor, offset, match_end - ip);
+                if(!out) {
+                    return 0;
+                }
+
+                ip = anchor = match_end;
+            }
+        }
+
+        out = write_sequence(out, out_end, anchor, end - anchor, 0, 0);
+        if(!out) {
+            return 0;
+        }
+
+        return out - (uint8_t *)dest;
+    }
+
+    ssize_t decompress_block(const void* src, size_t size, void* dest, size_t dest_size) {
+        const uint8_t* ip = (const uint8_t *)src;
+        const uint8_t* const ip_end = ip + size;
+        uint8_t* const out_start = (uint8_t *)dest;
+        uint8_t* out = out_start;
+        uint8_t* const out_end = out + dest_size;
+
+        auto read_length = [&](size_t& length) {
+            uint8_t byte;
+            do {
+                if(ip >= ip_end) {
+                    return false;
+                }
+
+                byte = *ip++;
+                length += byte;
+            } while(byte == 255);
+
+            return true;
+        };
+
+        while(ip < ip_end) {
+            uint8_t token = *ip++;
+            size_t literal_length = token >> 4;
+            if(literal_length == 15 && !read_length(literal_length)) {
+                return -1;
+            }
+
+            if(literal_length > (size_t)(ip_end - ip) || literal_length > (size_t)(out_end - out)) {
+                return -1;
+            }
+
+            memcpy(out, ip, literal_length);
+            ip += literal_length;
+            out += literal_length;
+            if(ip == ip_end) {
+                // The last sequence has no match
+                break;
+            }
+
+            if(ip_end - ip < 2) {
+                return -1;
+            }
+
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if(!offset || offset > (size_t)(out - out_start)) {
+                return -1;
+            }
+
+            size_t match_length = token & 15;
+            if(match_length == 15 && !read_length(match_length)) {
+                return -1;
+            }
+
+            match_length += MIN_MATCH;
+            if(match_length > (size_t)(out_end - out)) {
+                return -1;
+            }
+
+            // Byte at a time, the match is allowed to overlap what it is producing
+            const uint8_t* match = out - offset;
+            while(match_length--) {
+                *out++ = *match++;
+            }
+        }
+
+        return out - out_start;
+    }
+
+    frame_reader::~frame_reader() {
+        free(_blocks);
+    }
+
+    bool frame_reader::is_frame(const void* data, size_t size) {
+        return size >= 7 && read32((const uint8_t *)data) == FRAME_MAGIC;
+    }
+
+    int frame_reader::open(const void* data, size_t size) {
+        if(!is_frame(data, size)) {
+            return -EINVAL;
+        }
+
+        const uint8_t* const start = (const uint8_t *)data;
+        const uint8_t* const end = start + size;
+        uint8_t flg = start[4];
+        uint8_t bd = start[5];
+        unsigned block_size_id = (bd >> 4) & 7;
+        if((flg & FLG_VERSION_MASK) != FLG_VERSION || !(flg & FLG_BLOCK_INDEPENDENT) || (flg & FLG_DICT_ID) || block_size_id < 4) {
+            // Linked blocks would have to be read in order, and nothing here has a dictionary
+            return -EINVAL;
+        }
+
+        // 64K, 256K, 1M or 4M
+        _block_size = (size_t)1 << (8 + 2 * block_size_id);
+        const uint8_t* p = start + 6;
+        bool has_size = flg & FLG_CONTENT_SIZE;
+        if(has_size) {
+            if(end - p < 9) {
+                return -EINVAL;
+            }
+
+            __builtin_memcpy(&_content_size, p, sizeof(uint64_t));
+            p += sizeof(uint64_t);
+        }
+
+        p++; // Header checksum
+        const uint8_t* const first_block = p;
+        size_t block_extra = (flg & FLG_BLOCK_CHECKSUM) ? sizeof(uint32_t) : 0;
+
+        // Counted first so the table can be allocated once
+        size_t count = 0;
+        while(true) {
+            if(end - p < 4) {
+                return -EINVAL;
+            }
+
+            uint32_t block = read32(p);
+            uint32_t length = block & ~BLOCK_UNCOMPRESSED;
+            if(!block) {
+                break;
+            }
+
+            if(length > _block_size || (size_t)(end - p) < 4 + length + block_extra) {
+                return -EINVAL;
+            }
+
+            p += 4 + length + block_extra;
+            count++;
+        }
+
+        free(_blocks);
+        _blocks = (block_t *)malloc(kstd::max(count, (size_t)1) * sizeof(block_t));
+        _block_count = count;
+        _data = start;
+        p = first_block;
+        for(size_t i = 0; i < count; i++) {
+            uint32_t block = read32(p);
+            _blocks[i].offset = (p + 4) - start;
+            _blocks[i].size = block;
+            p += 4 + (block & ~BLOCK_UNCOMPRESSED) + block_extra;
+        }
+
+        if(!has_size) {
+            // Every block but the last is full, so only that one has to be looked at
+            _content_size = 0;
+            if(count) {
+                uint8_t* last = (uint8_t *)malloc(_block_size);
+                ssize_t last_size = read_block(count - 1, last);
+                free(last);
+                if(last_size < 0) {
+                    return -EINVAL;
+                }
+
+                _content_size = (uint64_t)(count - 1) * _block_size + last_size;
+            }
+        }
+
+        return 0;
+    }
+
+    ssize_t frame_reader::read_block(size_t index, void* dest) const {
+        if(index >= _block_count) {
+            return -1;
+        }
+
+        const block_t& b = _blocks[index];
+        uint32_t length = b.size & ~BLOCK_UNCOMPRESSED;
+        if(b.size & BLOCK_UNCOMPRESSED) {
+            memcpy(dest, _data + b.offset, length);
+            return length;
+        }
+
+        return decompress_block(_data + b.offset, length, dest, _block_size);
+    }
+}
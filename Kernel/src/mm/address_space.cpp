@@ -4,6 +4,9 @@
 #include <logging.h>
 #include <lock.h>
 #include <kassert.h>
+#include <kmath.h>
+#include <abi-bits/errno.h>
+#include <abi-bits/vm-flags.h>
 
 namespace mm {
     address_space::address_space(page_map_t* pm) 
@@ -61,6 +64,55 @@ namespace mm {
         return false;
     }
 
+    long address_space::advise(uintptr_t base, size_t size, int advice) {
+        uintptr_t end = base + size;
+        while(base < end) {
+            mapped_region* region = address_to_region(base);
+            if(!region) {
+                return -ENOMEM;
+            }
+
+            kstd::ref_counted<vm_object> vmo = region->vm_object();
+            uintptr_t offset = base - region->base();
+            size_t count = kstd::min(end, region->end()) - base;
+            long status = 0;
+            switch(advice) {
+                case MADV_NORMAL:
+                case MADV_RANDOM:
+                    vmo->set_sequential(false);
+                    break;
+                case MADV_SEQUENTIAL:
+                    vmo->set_sequential(true);
+                    break;
+                case MADV_WILLNEED:
+                    if(vmo->populate(region->base(), offset, count, _page_map)) {
+                        status = -ENOMEM;
+                    }
+
+                    break;
+                case MADV_DONTNEED:
+                    // Nothing can fault the range back in while the frames are going away
+                    region->lock().release_read();
+                    region->lock().acquire_write();
+                    status = region->vm_object()->discard(region->base(), offset, count, _page_map);
+                    region->lock().release_write();
+                    region->lock().acquire_read();
+                    break;
+                default:
+                    status = -EINVAL;
+                    break;
+            }
+
+            base = region->end();
+            region->lock().release_read();
+            if(status) {
+                return status;
+            }
+        }
+
+        return 0;
+    }
+
     mapped_region* address_space::map_vmo(kstd::ref_counted<vm_object> obj, uintptr_t base, bool fixed) {
         assert(!(obj->size() & (memory::PAGE_SIZE_4K - 1)));
         assert(!(base & (memory::PAGE_SIZE_4K - 1)));
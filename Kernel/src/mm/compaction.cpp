@@ -0,0 +1,266 @@
+#include <mm/compaction.h>
+#include <mm/address_space.h>
+#include <mm/vm_object.h>
+#include <physical_allocator.h>
+#include <scheduler.h>
+#include <kstring.h>
+#include <kassert.h>
+#include <kmath.h>
+#include <logging.h>
+#include <debug.h>
+
+namespace mm::compaction {
+    constexpr unsigned MAX_PAGEBLOCKS = memory::PHYS_BITMAP_SIZE_DWORDS * 32 / memory::PAGEBLOCK_BLOCKS;
+
+    static uint16_t movable_blocks[MAX_PAGEBLOCKS]; // Per pageblock, from the last count
+    static uint32_t owned[memory::PAGEBLOCK_BLOCKS / 32];
+    static uint64_t target;                          // First block of the pageblock being emptied
+    static uint8_t* window;
+    static lock_t compaction_lock {0};
+    static stats_t stats;
+
+    template<typename F>
+    static void for_each_space(F f) {
+        pid_t pid = 0;
+        // Called from allocations, so it doesn't wait for a busy process list either
+        while(process_t* proc = scheduler::next_process(pid, false)) {
+            f(proc->address_space);
+            pid = proc->pid + 1;
+            scheduler::release_process(proc);
+        }
+    }
+
+    static bool movable(const kstd::ref_counted<vm_object>& vmo) {
+        // Private anonymous memory only, anything else could be mapped somewhere that
+        // doesn't get walked
+        return vmo && vmo->is_anonymous() && !vmo->is_shared() && !vmo->is_copy_on_write() && vmo->use_count() <= 1;
+    }
+
+    static uint64_t pageblock_count() {
+        return kstd::min(memory::get_max_blocks() / memory::PAGEBLOCK_BLOCKS, (uint64_t)MAX_PAGEBLOCKS);
+    }
+
+    void migrator::count_space(address_space* space) {
+        if(!acquire_test_lock(&space->_lock)) {
+            return;
+        }
+
+        for(mapped_region& region : space->_regions) {
+            kstd::ref_counted<vm_object> vmo_ref = region.vm_object();
+            if(!movable(vmo_ref)) {
+                continue;
+            }
+
+            // Only a guess, whatever changes before migrating gets caught then
+            physical_vm_object* vmo = static_cast<physical_vm_object *>(vmo_ref.get());
+            unsigned block_count = vmo->_size >> memory::PAGE_SHIFT_4K;
+            for(unsigned i = 0; i < block_count; i++) {
+                uint32_t block = vmo->_physical_blocks[i];
+                if(block && !(block & BLOCK_FLAGS) && block / memory::PAGEBLOCK_BLOCKS < MAX_PAGEBLOCKS) {
+                    movable_blocks[block / memory::PAGEBLOCK_BLOCKS]++;
+                }
+            }
+        }
+
+        release_lock(&space->_lock);
+    }
+
+    void migrator::migrate(physical_vm_object* vmo, uintptr_t base, page_map_t* map, const unsigned* candidates, unsigned count) {
+        uint32_t new_frames[MIGRATE_BATCH];
+        uint64_t flags[MIGRATE_BATCH];
+        for(unsigned i = 0; i < count; i++) {
+            // The target pageblock is all claimed, so these always come from somewhere else
+            new_frames[i] = memory::allocate_physical_block() >> memory::PAGE_SHIFT_4K;
+        }
+
+        // Unmap first so nothing can be written to the old copy halfway through
+        for(unsigned i = 0; i < count; i++) {
+            uintptr_t virt = base + ((uintptr_t)candidates[i] << memory::PAGE_SHIFT_4K);
+            page_t* entry = memory::get_page_entry(virt, map);
+            flags[i] = (entry && (*entry & memory::TABLE_PRESENT)) ? *entry & ~memory::PAGE_FRAME : 0;
+            if(flags[i]) {
+                memory::map_virtual_memory_4k(0, virt, 1, map, memory::PAGE_USER);
+            }
+        }
+
+        memory::tlb_shootdown();
+
+        for(unsigned i = 0; i < count; i++) {
+            unsigned index = candidates[i];
+            uintptr_t virt = base + ((uintptr_t)index << memory::PAGE_SHIFT_4K);
+            uint32_t old_frame = vmo->_physical_blocks[index];
+
+            memory::kernel_map_virtual_memory_4k((uintptr_t)old_frame << memory::PAGE_SHIFT_4K, (uintptr_t)window, 1);
+            memory::kernel_map_virtual_memory_4k((uintptr_t)new_frames[i] << memory::PAGE_SHIFT_4K,
+                (uintptr_t)window + memory::PAGE_SIZE_4K, 1);
+            memcpy(window + memory::PAGE_SIZE_4K, window, memory::PAGE_SIZE_4K);
+
+            vmo->_physical_blocks[index] = new_frames[i];
+            if(flags[i]) {
+                memory::map_virtual_memory_4k((uintptr_t)new_frames[i] << memory::PAGE_SHIFT_4K, virt, 1, map, flags[i]);
+            }
+
+            // The old block stays claimed, it is part of the pageblock now
+            unsigned offset = old_frame - target;
+            owned[offset >> 5] |= 1U << (offset & 31);
+            stats.migrated++;
+        }
+    }
+
+    void migrator::migrate_space(address_space* space) {
+        if(!acquire_test_lock(&space->_lock)) {
+            return;
+        }
+
+        for(mapped_region& region : space->_regions) {
+            kstd::ref_counted<vm_object> vmo_ref = region.vm_object();
+            if(!movable(vmo_ref)) {
+                continue;
+            }
+
+            if(!region.lock().try_acquire_write()) {
+                // Busy, and most likely with a fault in this very region
+                continue;
+            }
+
+            physical_vm_object* vmo = static_cast<physical_vm_object *>(vmo_ref.get());
+            unsigned block_count = vmo->_size >> memory::PAGE_SHIFT_4K;
+            unsigned candidates[MIGRATE_BATCH];
+            unsigned candidate_count = 0;
+            for(unsigned i = 0; i < block_count; i++) {
+                uint32_t block = vmo->_physical_blocks[i];
+                if(!block || (block & BLOCK_FLAGS) || block < target || block >= target + memory::PAGEBLOCK_BLOCKS) {
+                    continue;
+                }
+
+                candidates[candidate_count++] = i;
+                if(candidate_count == MIGRATE_BATCH) {
+                    migrate(vmo, region.base(), space->get_page_map(), candidates, candidate_count);
+                    candidate_count = 0;
+                }
+            }
+
+            if(candidate_count) {
+                migrate(vmo, region.base(), space->get_page_map(), candidates, candidate_count);
+            }
+
+            region.lock().release_write();
+        }
+
+        release_lock(&space->_lock);
+    }
+
+    // Returns the pageblock to empty or -1 if none of them look like they can be.  Nearly free
+    // ones are cheapest for allocations, background work goes from the top down so what it
+    // frees lasts (blocks are handed out lowest first).
+    static int64_t pick_pageblock(bool highest) {
+        int64_t best = -1;
+        uint32_t best_used = memory::PAGEBLOCK_BLOCKS;
+        for(uint64_t i = 0; i < pageblock_count(); i++) {
+            uint32_t used = memory::count_used_blocks(i * memory::PAGEBLOCK_BLOCKS, memory::PAGEBLOCK_BLOCKS);
+            if(!used || used > movable_blocks[i]) {
+                // Already free, or has something in it that can't be moved
+                continue;
+            }
+
+            if(highest || used < best_used) {
+                best = i;
+                best_used = used;
+            }
+        }
+
+        return best;
+    }
+
+    static uint64_t compact(bool highest) {
+        if(!acquire_test_lock(&compaction_lock)) {
+            return 0;
+        }
+
+        if(!window) {
+            window = (uint8_t *)memory::kernel_allocate_4k_pages(2);
+        }
+
+        stats.attempts++;
+        memset(movable_blocks, 0, sizeof(movable_blocks));
+        for_each_space(migrator::count_space);
+
+        int64_t pageblock = pick_pageblock(highest);
+        if(pageblock < 0) {
+            release_lock(&compaction_lock);
+            return 0;
+        }
+
+        // Claim everything free first so none of it gets handed out again while the rest moves
+        target = pageblock * memory::PAGEBLOCK_BLOCKS;
+        memset(owned, 0, sizeof(owned));
+        for(unsigned i = 0; i < memory::PAGEBLOCK_BLOCKS; i++) {
+            if(memory::claim_physical_block(target + i)) {
+                owned[i >> 5] |= 1U << (i & 31);
+            }
+        }
+
+        for_each_space(migrator::migrate_space);
+
+        bool complete = true;
+        for(unsigned i = 0; i < memory::PAGEBLOCK_BLOCKS / 32; i++) {
+            complete &= owned[i] == 0xFFFFFFFF;
+        }
+
+        if(!complete) {
+            // Something was busy or pinned, the moved pages stay where they went
+            for(unsigned i = 0; i < memory::PAGEBLOCK_BLOCKS; i++) {
+                if(owned[i >> 5] & (1U << (i & 31))) {
+                    memory::free_physical_block((target + i) << memory::PAGE_SHIFT_4K);
+                }
+            }
+
+            stats.failures++;
+            release_lock(&compaction_lock);
+            return 0;
+        }
+
+        stats.successes++;
+        release_lock(&compaction_lock);
+        return target;
+    }
+
+    uint64_t compact_pageblock() {
+        return compact(false);
+    }
+
+    void background() {
+        static unsigned backoff = 0;
+        if(backoff) {
+            backoff--;
+            return;
+        }
+
+        unsigned free_pageblocks = 0;
+        for(uint64_t i = 0; i < pageblock_count(); i++) {
+            if(!memory::count_used_blocks(i * memory::PAGEBLOCK_BLOCKS, memory::PAGEBLOCK_BLOCKS)) {
+                free_pageblocks++;
+            }
+        }
+
+        // Not worth it if the memory isn't there to begin with
+        if(free_pageblocks >= BACKGROUND_FREE_PAGEBLOCKS
+            || memory::get_free_blocks() < memory::get_low_watermark() + BACKGROUND_FREE_PAGEBLOCKS * memory::PAGEBLOCK_BLOCKS) {
+            return;
+        }
+
+        uint64_t first = compact(true);
+        if(!first) {
+            backoff = BACKGROUND_BACKOFF;
+            return;
+        }
+
+        memory::free_physical_blocks(first << memory::PAGE_SHIFT_4K, memory::PAGEBLOCK_BLOCKS);
+        log::debug(debug_user_mm, debug::LEVEL_VERBOSE, "[compaction] Freed pageblock at %llx (%llu pages moved so far)",
+            first << memory::PAGE_SHIFT_4K, stats.migrated);
+    }
+
+    stats_t get_stats() {
+        return stats;
+    }
+}
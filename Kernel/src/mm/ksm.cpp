@@ -0,0 +1,335 @@
+#include <mm/ksm.h>
+#include <mm/address_space.h>
+#include <mm/vm_object.h>
+#include <physical_allocator.h>
+#include <scheduler.h>
+#include <kstring.h>
+#include <kassert.h>
+#include <kmath.h>
+#include <logging.h>
+#include <timer.h>
+#include <frg/hash_map.hpp>
+
+namespace mm::ksm {
+    typedef struct {
+        uint32_t frame;
+        unsigned refs;
+    } merged_block_t;
+
+    using merged_map_t = frg::hash_map<uint64_t, merged_block_t, frg::hash<uint64_t>, frg::stl_allocator>;
+    using frame_map_t = frg::hash_map<uint32_t, uint64_t, frg::hash<uint32_t>, frg::stl_allocator>;
+    using count_map_t = frg::hash_map<uint64_t, unsigned, frg::hash<uint64_t>, frg::stl_allocator>;
+
+    // Merged blocks by checksum, and the checksum of each merged block by frame.  Only one block
+    // is kept per checksum, anything that collides with it just stays unmerged
+    static merged_map_t merged_blocks(frg::hash<uint64_t>{});
+    static frame_map_t merged_frames(frg::hash<uint32_t>{});
+    static lock_t merged_lock {0};
+
+    // How many stable pages had each checksum on the last full scan, and on the current one.
+    // Only checksums that were seen more than once are worth write protecting for a merge
+    static count_map_t* last_counts = new count_map_t(frg::hash<uint64_t>{});
+    static count_map_t* current_counts = new count_map_t(frg::hash<uint64_t>{});
+
+    static stats_t stats;
+    static uint64_t zero_checksum;
+
+    // Two pages of kernel VA to look at blocks through, only the kernel process ever scans
+    static uint8_t* window;
+
+    static uint64_t checksum_block(const uint8_t* data) {
+        // FNV-1a, 8 bytes at a time.  Only used to find candidates, merges always memcmp first
+        const uint64_t* words = (const uint64_t *)data;
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for(unsigned i = 0; i < memory::PAGE_SIZE_4K / sizeof(uint64_t); i++) {
+            hash = (hash ^ words[i]) * 0x100000001b3ULL;
+        }
+
+        return hash;
+    }
+
+    static bool is_zero_block(const uint8_t* data) {
+        const uint64_t* words = (const uint64_t *)data;
+        for(unsigned i = 0; i < memory::PAGE_SIZE_4K / sizeof(uint64_t); i++) {
+            if(words[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static uint8_t* map_window(uint32_t frame, unsigned index = 0) {
+        uint8_t* virt = window + index * memory::PAGE_SIZE_4K;
+        memory::kernel_map_virtual_memory_4k((uintptr_t)frame << memory::PAGE_SHIFT_4K, (uintptr_t)virt, 1);
+        return virt;
+    }
+
+    static void count_checksum(uint64_t checksum) {
+        auto it = current_counts->find(checksum);
+        if(it == current_counts->end()) {
+            current_counts->insert(checksum, 1);
+        } else {
+            it->template get<1>()++;
+        }
+    }
+
+    static bool worth_merging(uint64_t checksum) {
+        if(checksum == zero_checksum) {
+            return true;
+        }
+
+        auto it = last_counts->find(checksum);
+        if(it != last_counts->end() && it->template get<1>() > 1) {
+            return true;
+        }
+
+        asm("cli");
+        acquire_lock(&merged_lock);
+        bool merged = merged_blocks.find(checksum) != merged_blocks.end();
+        release_lock(&merged_lock);
+        asm("sti");
+        return merged;
+    }
+
+    void release_block(uintptr_t phys) {
+        uint32_t frame = phys >> memory::PAGE_SHIFT_4K;
+
+        kstd::lock l(merged_lock);
+        auto frame_it = merged_frames.find(frame);
+        assert(frame_it != merged_frames.end());
+
+        uint64_t checksum = frame_it->template get<1>();
+        auto it = merged_blocks.find(checksum);
+        assert(it != merged_blocks.end());
+
+        merged_block_t& block = it->template get<1>();
+        stats.sharing_pages--;
+        if(--block.refs) {
+            return;
+        }
+
+        merged_blocks.remove(checksum);
+        merged_frames.remove(frame);
+        stats.shared_blocks--;
+        memory::free_physical_block(phys);
+    }
+
+    stats_t get_stats() {
+        return stats;
+    }
+
+    void scanner::merge(physical_vm_object* vmo, uintptr_t base, page_map_t* map, const unsigned* candidates, unsigned count) {
+        // Take write access away first, otherwise a page could change between being
+        // compared and being merged
+        for(unsigned i = 0; i < count; i++) {
+            unsigned index = candidates[i];
+            memory::map_virtual_memory_4k((uintptr_t)vmo->_physical_blocks[index] << memory::PAGE_SHIFT_4K,
+                base + ((uintptr_t)index << memory::PAGE_SHIFT_4K), 1, map, memory::PAGE_USER | memory::TABLE_PRESENT);
+        }
+
+        memory::tlb_shootdown();
+
+        uint32_t unused[MERGE_BATCH_SIZE];
+        unsigned unused_count = 0;
+        for(unsigned i = 0; i < count; i++) {
+            unsigned index = candidates[i];
+            uintptr_t virt = base + ((uintptr_t)index << memory::PAGE_SHIFT_4K);
+            uint32_t frame = vmo->_physical_blocks[index];
+            uint8_t* data = map_window(frame);
+            uint64_t checksum = checksum_block(data);
+            if(checksum != vmo->_ksm_checksums[index]) {
+                // Written to before it was protected, the next write fault makes it writable again
+                continue;
+            }
+
+            if(checksum == zero_checksum && vmo->absent_reads_zero(index) && is_zero_block(data)) {
+                vmo->_physical_blocks[index] = 0;
+                memory::map_virtual_memory_4k(get_zero_block(), virt, 1, map, memory::PAGE_USER | memory::TABLE_PRESENT);
+                unused[unused_count++] = frame;
+                stats.zero_pages++;
+                continue;
+            }
+
+            asm("cli"); // The fault handler releases merged blocks with interrupts off
+            acquire_lock(&merged_lock);
+            auto it = merged_blocks.find(checksum);
+            if(it == merged_blocks.end()) {
+                // First one, this block becomes the shared copy.  It is already mapped read only.
+                merged_blocks.insert(checksum, { frame, 1 });
+                merged_frames.insert(frame, checksum);
+                vmo->_physical_blocks[index] = frame | BLOCK_MERGED;
+                stats.shared_blocks++;
+                stats.sharing_pages++;
+            } else {
+                merged_block_t& block = it->template get<1>();
+                if(memcmp(data, map_window(block.frame, 1), memory::PAGE_SIZE_4K) == 0) {
+                    block.refs++;
+                    vmo->_physical_blocks[index] = block.frame | BLOCK_MERGED;
+                    memory::map_virtual_memory_4k((uintptr_t)block.frame << memory::PAGE_SHIFT_4K, virt, 1, map,
+                        memory::PAGE_USER | memory::TABLE_PRESENT);
+                    unused[unused_count++] = frame;
+                    stats.sharing_pages++;
+                }
+            }
+
+            release_lock(&merged_lock);
+            asm("sti");
+        }
+
+        if(!unused_count) {
+            return;
+        }
+
+        // Nobody can still be holding on to the old frames after this
+        memory::tlb_shootdown();
+        for(unsigned i = 0; i < unused_count; i++) {
+            memory::free_physical_block((uintptr_t)unused[i] << memory::PAGE_SHIFT_4K);
+        }
+    }
+
+    unsigned scanner::scan_object(physical_vm_object* vmo, uintptr_t base, page_map_t* map, unsigned& block_index, unsigned budget) {
+        unsigned block_count = vmo->_size >> memory::PAGE_SHIFT_4K;
+        if(!vmo->_ksm_checksums) {
+            vmo->_ksm_checksums = new uint64_t[block_count];
+            memset(vmo->_ksm_checksums, 0, sizeof(uint64_t) * block_count);
+        }
+
+        unsigned scanned = 0;
+        while(block_index < block_count && scanned < budget) {
+            unsigned candidates[MERGE_BATCH_SIZE];
+            unsigned candidate_count = 0;
+            for(; block_index < block_count && scanned < budget && candidate_count < MERGE_BATCH_SIZE; block_index++) {
+                uint32_t block = vmo->_physical_blocks[block_index];
+                if(!block || (block & BLOCK_FLAGS)) {
+                    continue;
+                }
+
+                scanned++;
+                uint64_t checksum = checksum_block(map_window(block));
+                bool stable = vmo->_ksm_checksums[block_index] == checksum;
+                vmo->_ksm_checksums[block_index] = checksum;
+                if(!stable) {
+                    // Still changing, don't bother protecting it yet
+                    continue;
+                }
+
+                count_checksum(checksum);
+                if(worth_merging(checksum)) {
+                    candidates[candidate_count++] = block_index;
+                }
+            }
+
+            if(candidate_count) {
+                merge(vmo, base, map, candidates, candidate_count);
+            }
+        }
+
+        return scanned;
+    }
+
+    bool scanner::scan_space(address_space* space, uintptr_t& address, unsigned budget, unsigned& scanned) {
+        scanned = 0;
+
+        kstd::lock l(space->_lock);
+        for(mapped_region& region : space->_regions) {
+            if(region.end() <= address) {
+                continue;
+            }
+
+            kstd::ref_counted<vm_object> vmo = region.vm_object();
+
+            // Only physical_vm_objects are anonymous.  Shared objects are visible
+            // through other page maps, so leave them alone.
+            if(!vmo || !vmo->is_anonymous() || vmo->is_shared() || vmo->use_count() > 1) {
+                address = region.end();
+                continue;
+            }
+
+            if(!region.lock().try_acquire_write()) {
+                // Busy, get it on the next pass
+                address = region.end();
+                continue;
+            }
+
+            unsigned block_index = (kstd::max(address, region.base()) - region.base()) >> memory::PAGE_SHIFT_4K;
+            scanned += scan_object(static_cast<physical_vm_object *>(vmo.get()), region.base(), space->get_page_map(),
+                block_index, budget - scanned);
+            region.lock().release_write();
+
+            address = region.base() + ((uintptr_t)block_index << memory::PAGE_SHIFT_4K);
+            if(scanned >= budget) {
+                // Pick up from here next time
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static void finish_full_scan(uint64_t pages, uint64_t seconds) {
+        static uint64_t reported_sharing = 0;
+        static uint64_t reported_zero = 0;
+
+        delete last_counts;
+        last_counts = current_counts;
+        current_counts = new count_map_t(frg::hash<uint64_t>{});
+
+        stats.full_scans++;
+        stats.pages_per_second = pages / kstd::max(seconds, (uint64_t)1);
+        if(stats.sharing_pages == reported_sharing && stats.zero_pages == reported_zero) {
+            // Nothing new to say
+            return;
+        }
+
+        reported_sharing = stats.sharing_pages;
+        reported_zero = stats.zero_pages;
+        uint64_t saved = stats.sharing_pages - stats.shared_blocks + stats.zero_pages;
+        log::info("[KSM] Scan %llu: %llu pages/s, %llu pages sharing %llu blocks, %llu zero pages reclaimed, %llu KiB saved",
+            stats.full_scans, stats.pages_per_second, stats.sharing_pages, stats.shared_blocks, stats.zero_pages,
+            saved * (memory::PAGE_SIZE_4K / 1024));
+    }
+
+    void scan() {
+        static pid_t pid = 0;
+        static uintptr_t address = 0;
+        static uint64_t pass_start = 0;
+        static uint64_t pass_pages = 0;
+
+        if(!window) {
+            window = (uint8_t *)memory::kernel_allocate_4k_pages(2);
+            zero_checksum = checksum_block(map_window(get_zero_block() >> memory::PAGE_SHIFT_4K));
+            pass_start = timer::get_system_uptime();
+        }
+
+        unsigned budget = PAGES_PER_SCAN;
+        while(budget) {
+            process_t* proc = scheduler::next_process(pid);
+            if(!proc) {
+                uint64_t now = timer::get_system_uptime();
+                finish_full_scan(pass_pages, now - pass_start);
+                pass_start = now;
+                pass_pages = 0;
+                pid = 0;
+                address = 0;
+                return;
+            }
+
+            if(proc->pid != pid) {
+                pid = proc->pid;
+                address = 0;
+            }
+
+            unsigned scanned;
+            bool done = scanner::scan_space(proc->address_space, address, budget, scanned);
+            scheduler::release_process(proc);
+            budget -= scanned;
+            pass_pages += scanned;
+            stats.pages_scanned += scanned;
+            if(done) {
+                pid++;
+                address = 0;
+            }
+        }
+    }
+}
@@ -0,0 +1,855 @@
+#include <mm/page_cache.h>
+#include <mm/shrinker.h>
+#include <fs/fs_node.h>
+#include <device.h>
+#include <physical_allocator.h>
+#include <paging.h>
+#include <scheduler.h>
+#include <frg/hash_map.hpp>
+#include <frg/std_compat.hpp>
+#include <kstring.h>
+#include <liballoc/liballoc.h>
+#include <kassert.h>
+#include <kmath.h>
+#include <ref_counted.hpp>
+#include <timer.h>
+#include <logging.h>
+#include <abi-bits/errno.h>
+
+namespace mm::page_cache {
+    struct key_hash {
+        unsigned int operator()(const cache_key_t& key) const {
+            uint64_t hash = key.volume;
+            hash = hash * 31 + key.object;
+            hash = hash * 31 + key.index;
+            return (unsigned int)(hash ^ (hash >> 32));
+        }
+    };
+
+    // Fills a whole page, returns 0 or a negative error
+    using fill_t = int(*)(void* source, uint64_t index, uint8_t* data);
+
+    using lookup_t = frg::hash_map<cache_key_t, page*, key_hash, frg::stl_allocator>;
+    using page_list_t = frg::intrusive_list<page, frg::locate_member<page, frg::default_list_hook<page>, &page::hook>>;
+    using dirty_list_t = frg::intrusive_list<page, frg::locate_member<page, frg::default_list_hook<page>, &page::dirty_hook>>;
+
+    static page* pages;
+    static uint8_t* window;
+    static size_t capacity;
+    static lookup_t* lookup;
+    static page_list_t clock;           // Everything cached, the hand is at the front
+    static page_list_t free_pages;
+    static page_list_t retired;         // Free, but another CPU could still have the old frame in its TLB
+    static dirty_list_t dirty_pages;    // Oldest first
+    static unsigned writing;            // Taken off dirty_pages and not written yet
+    static lock_t cache_lock {0};
+    static stats_t stats;
+
+    class cache_shrinker : public shrinker {
+    public:
+        size_t count_pages() override;
+        size_t shrink(size_t count) override;
+    };
+
+    // Gives the slot back, it can't be handed out again until after the next shootdown
+    static void release(page* p) {
+        memory::kernel_map_virtual_memory_4k(0, (uintptr_t)p->data, 1, 0);
+        memory::free_physical_block(p->phys);
+        p->phys = 0;
+        p->state = page_state::free;
+        retired.push_back(p);
+    }
+
+    static uint64_t now_ms() {
+        timeval now;
+        timer::get_system_uptime(&now);
+        return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    }
+
+    static void clean(page* p) {
+        dirty_pages.erase(dirty_pages.iterator_to(p));
+        p->dirty = 0;
+        stats.dirty--;
+    }
+
+    static uint8_t dirty_bits(uint32_t offset, uint32_t size) {
+        uint32_t first = offset / DIRTY_UNIT;
+        uint32_t last = (offset + size - 1) / DIRTY_UNIT;
+        return (uint8_t)(((1U << (last + 1)) - 1) & ~((1U << first) - 1));
+    }
+
+    static void uncache(page* p) {
+        clock.erase(clock.iterator_to(p));
+        lookup->remove(p->key);
+        p->cached = false;
+        stats.pages--;
+    }
+
+    // Async reads that have finished, waiting to have their pin dropped (which needs the lock)
+    static page* finished;
+
+    static void drop_finished() {
+        page* p = __atomic_exchange_n(&finished, nullptr, __ATOMIC_ACQUIRE);
+        while(p) {
+            page* next = p->next_finished;
+            if(p->io) {
+                free(p->io);
+                p->io = nullptr;
+            }
+
+            if(p->state == page_state::failed && p->cached) {
+                uncache(p);
+            }
+
+            if(!--p->pins && !p->cached) {
+                release(p);
+            }
+
+            p = next;
+        }
+    }
+
+    static size_t evict(size_t count) {
+        size_t evicted = 0;
+        size_t remaining = stats.pages * 2; // Everything gets a second chance at most
+        while(evicted < count && remaining-- && !clock.empty()) {
+            page* p = clock.pop_front();
+            if(p->pins || p->referenced || p->dirty) {
+                p->referenced = false;
+                clock.push_back(p);
+                continue;
+            }
+
+            lookup->remove(p->key);
+            p->cached = false;
+            stats.pages--;
+            release(p);
+            evicted++;
+        }
+
+        stats.evictions += evicted;
+        return evicted;
+    }
+
+    // A free slot for a new page, evicting to make one if needed.  Called with cache_lock held,
+    // which gets dropped for a while if a shootdown is needed.
+    static page* take_slot() {
+        if(free_pages.empty() && retired.empty()) {
+            evict(EVICT_BATCH);
+        }
+
+        if(free_pages.empty() && !retired.empty()) {
+            page_list_t flushed;
+            while(!retired.empty()) {
+                flushed.push_back(retired.pop_front());
+            }
+
+            release_lock(&cache_lock);
+            memory::tlb_shootdown();
+            acquire_lock(&cache_lock);
+
+            while(!flushed.empty()) {
+                free_pages.push_back(flushed.pop_front());
+            }
+        }
+
+        return free_pages.empty() ? nullptr : free_pages.pop_front();
+    }
+
+    static page* find_and_pin(const cache_key_t& key) {
+        auto found = lookup->find(key);
+        if(found == lookup->end()) {
+            return nullptr;
+        }
+
+        page* p = found->get<1>();
+        p->pins++;
+        p->referenced = true;
+        return p;
+    }
+
+    static page* wait_for(page* p) {
+        // Somebody else is still reading it in
+        while(p->state == page_state::loading) {
+            if(scheduler::get_current_thread()) {
+                scheduler::yield();
+            } else {
+                asm("pause");
+            }
+        }
+
+        if(p->state != page_state::valid) {
+            unpin(p);
+            return nullptr;
+        }
+
+        return p;
+    }
+
+    // The page for key, pinned.  If it wasn't cached it comes back loading and it's up to the
+    // caller to fill it (created is set).  nullptr if there was no room.
+    static page* find_or_create(const cache_key_t& key, bool& created) {
+        created = false;
+        if(!lookup) {
+            return nullptr;
+        }
+
+        acquire_lock(&cache_lock);
+        drop_finished();
+        if(page* p = find_and_pin(key)) {
+            release_lock(&cache_lock);
+            return p;
+        }
+
+        // Not holding the lock while allocating, the shrinker might need it
+        release_lock(&cache_lock);
+        uintptr_t phys = memory::allocate_physical_block();
+        acquire_lock(&cache_lock);
+
+        page* p = take_slot();
+        if(page* other = find_and_pin(key)) {
+            // Read in by someone else in the meantime
+            if(p) {
+                free_pages.push_front(p);
+            }
+
+            release_lock(&cache_lock);
+            memory::free_physical_block(phys);
+            return other;
+        }
+
+        if(!p) {
+            // Everything is pinned
+            release_lock(&cache_lock);
+            memory::free_physical_block(phys);
+            return nullptr;
+        }
+
+        p->key = key;
+        p->phys = phys;
+        p->pins = 1;
+        p->state = page_state::loading;
+        p->referenced = true;
+        p->cached = true;
+        p->dirty = 0;
+        p->writing = 0;
+        p->io = nullptr;
+        p->owner = nullptr;
+        memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)p->data, 1);
+        lookup->insert(key, p);
+        clock.push_back(p);
+        stats.pages++;
+        stats.misses++;
+        release_lock(&cache_lock);
+        created = true;
+        return p;
+    }
+
+    static void fail(page* p) {
+        acquire_lock(&cache_lock);
+        if(p->cached) {
+            // So the next one tries again
+            uncache(p);
+        }
+
+        p->state = page_state::failed;
+        release_lock(&cache_lock);
+        unpin(p);
+    }
+
+    static page* get(const cache_key_t& key, fill_t fill, void* source) {
+        bool created;
+        page* p = find_or_create(key, created);
+        if(!p) {
+            return nullptr;
+        }
+
+        if(!created) {
+            __atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+            return wait_for(p);
+        }
+
+        if(fill(source, key.index, p->data) < 0) {
+            fail(p);
+            return nullptr;
+        }
+
+        p->state = page_state::valid;
+        return p;
+    }
+
+    void unpin(page* p) {
+        kstd::lock l(cache_lock);
+        assert(p->pins);
+        if(!--p->pins && !p->cached) {
+            release(p);
+        }
+    }
+
+    page* grab_file_page(fs::fs_node* node, uint64_t index, bool& created) {
+        page* p = find_or_create({ (uint64_t)node->volume_id, (uint64_t)node->inode, index }, created);
+        if(!p || created) {
+            return p;
+        }
+
+        __atomic_add_fetch(&stats.hits, 1, __ATOMIC_RELAXED);
+        return wait_for(p);
+    }
+
+    void filled(page* p, int result) {
+        if(result < 0) {
+            fail(p);
+            return;
+        }
+
+        p->state = page_state::valid;
+    }
+
+    // Called with cache_lock held
+    static void set_dirty(page* p, uint8_t bits, fs::fs_node* owner) {
+        assert(p->pins);
+        if(!p->cached) {
+            // It was invalidated and goes anyway
+            return;
+        }
+
+        if(!p->dirty) {
+            p->owner = owner;
+            p->dirtied = now_ms();
+            if(owner) {
+                // Keeps the node around until its pages are written
+                owner->add_handle();
+            }
+
+            dirty_pages.push_back(p);
+            stats.dirty++;
+        }
+
+        p->dirty |= bits;
+    }
+
+    void mark_dirty(page* p, fs::fs_node* owner) {
+        assert(owner && p->key.volume != DEVICE_VOLUME);
+        kstd::lock l(cache_lock);
+        set_dirty(p, ALL_DIRTY, owner);
+    }
+
+    void mark_dirty(page* p, uint32_t offset, uint32_t size) {
+        assert(p->key.volume == DEVICE_VOLUME && size && offset + size <= memory::PAGE_SIZE_4K);
+        kstd::lock l(cache_lock);
+        set_dirty(p, dirty_bits(offset, size), nullptr);
+    }
+
+    void mark_clean(devices::partition_device* device, uint64_t offset, uint32_t size) {
+        uint32_t in_page = offset & (memory::PAGE_SIZE_4K - 1);
+        assert(size && in_page + size <= memory::PAGE_SIZE_4K);
+        if(!lookup) {
+            return;
+        }
+
+        kstd::lock l(cache_lock);
+        auto found = lookup->find({ DEVICE_VOLUME, (uint64_t)device, offset >> memory::PAGE_SHIFT_4K });
+        if(found == lookup->end()) {
+            return;
+        }
+
+        page* p = found->get<1>();
+        if(p->dirty && !(p->dirty &= ~dirty_bits(in_page, size))) {
+            dirty_pages.erase(dirty_pages.iterator_to(p));
+            stats.dirty--;
+        }
+    }
+
+    static int fill_file_page(void* source, uint64_t index, uint8_t* data) {
+        fs::fs_node* node = (fs::fs_node *)source;
+        size_t offset = index << memory::PAGE_SHIFT_4K;
+        ssize_t read = 0;
+        if(offset < node->size) {
+            read = node->read(offset, kstd::min((size_t)memory::PAGE_SIZE_4K, node->size - offset), data);
+            if(read < 0) {
+                return read;
+            }
+        }
+
+        memset(data + read, 0, memory::PAGE_SIZE_4K - read);
+        return 0;
+    }
+
+    static int fill_device_page(void* source, uint64_t index, uint8_t* data) {
+        devices::partition_device* device = (devices::partition_device *)source;
+        unsigned sector_size = device->parent()->block_size();
+        uint64_t lba = (index << memory::PAGE_SHIFT_4K) / sector_size;
+        if(lba >= device->block_count()) {
+            return -EINVAL;
+        }
+
+        uint32_t sectors = kstd::min((uint64_t)(memory::PAGE_SIZE_4K / sector_size), device->block_count() - lba);
+        int read = device->read_block(lba, sectors, data);
+        if(read < 0) {
+            return read;
+        }
+
+        memset(data + sectors * sector_size, 0, memory::PAGE_SIZE_4K - sectors * sector_size);
+        return 0;
+    }
+
+    page* get_file_page(fs::fs_node* node, uint64_t index) {
+        return get({ (uint64_t)node->volume_id, (uint64_t)node->inode, index }, fill_file_page, node);
+    }
+
+    page* get_device_page(devices::partition_device* device, uint64_t index) {
+        return get({ DEVICE_VOLUME, (uint64_t)device, index }, fill_device_page, device);
+    }
+
+    ssize_t read(fs::fs_node* node, size_t offset, size_t size, uint8_t* buffer) {
+        if(offset >= node->size) {
+            return 0;
+        }
+
+        size = kstd::min(size, node->size - offset);
+        size_t done = 0;
+        while(done < size) {
+            size_t position = offset + done;
+            page* p = get_file_page(node, position >> memory::PAGE_SHIFT_4K);
+            if(!p) {
+                // No room, or the read failed.  Either way the file itself has the last word.
+                ssize_t read = node->read(position, size - done, buffer + done);
+                if(read < 0) {
+                    return done ? done : read;
+                }
+
+                return done + read;
+            }
+
+            size_t page_offset = position & (memory::PAGE_SIZE_4K - 1);
+            size_t count = kstd::min((size_t)memory::PAGE_SIZE_4K - page_offset, size - done);
+            memcpy(buffer + done, p->data + page_offset, count);
+            unpin(p);
+            done += count;
+        }
+
+        return done;
+    }
+
+    static uint32_t max_window() {
+        return kstd::max(kstd::min(READAHEAD_MAX_PAGES, (uint32_t)(capacity / 8)), READAHEAD_MIN_PAGES);
+    }
+
+    static void start_reads(fs::fs_node* node, page** pages, unsigned count) {
+        if(!count || node->read_pages(pages, count) == 0) {
+            return;
+        }
+
+        // The filesystem can't do it in the background, so not much of a readahead
+        for(unsigned i = 0; i < count; i++) {
+            if(fill_file_page(node, pages[i]->key.index, pages[i]->data) < 0) {
+                fail(pages[i]);
+            } else {
+                pages[i]->state = page_state::valid;
+                unpin(pages[i]);
+            }
+        }
+    }
+
+    void prefetch(fs::fs_node* node, uint64_t first, uint64_t count) {
+        uint64_t file_pages = memory::PAGE_COUNT_4K(node->size);
+        if(first >= file_pages) {
+            return;
+        }
+
+        // Any more than this and it would be pushing out its own pages
+        uint64_t end = first + kstd::min(kstd::min(count, file_pages - first), (uint64_t)capacity / 2);
+        page* batch[READAHEAD_BATCH];
+        unsigned batched = 0;
+        for(uint64_t index = first; index < end; index++) {
+            if(memory::memory_low()) {
+                // Not worth pushing out something else for a guess
+                break;
+            }
+
+            bool created;
+            page* p = find_or_create({ (uint64_t)node->volume_id, (uint64_t)node->inode, index }, created);
+            if(!p) {
+                break;
+            }
+
+            if(!created) {
+                unpin(p);
+                continue;
+            }
+
+            batch[batched++] = p;
+            if(batched == READAHEAD_BATCH) {
+                start_reads(node, batch, batched);
+                batched = 0;
+            }
+        }
+
+        start_reads(node, batch, batched);
+    }
+
+    void readahead(fs::fs_node* node, readahead_t& state, size_t offset, size_t size) {
+        if(!lookup || !size || offset >= node->size || state.advice == access_advice::random) {
+            return;
+        }
+
+        size_t end = kstd::min(offset + size, node->size);
+        uint64_t first = offset >> memory::PAGE_SHIFT_4K;
+        uint64_t last = (end - 1) >> memory::PAGE_SHIFT_4K;
+        bool sequential = state.advice == access_advice::sequential || first == state.next;
+        state.next = end >> memory::PAGE_SHIFT_4K;
+        if(!sequential) {
+            // Looks random, only what was asked for
+            state.size = 0;
+            return;
+        }
+
+        if(!state.size || first < state.start || first >= state.start + state.size) {
+            // A new run, start with a small window around this read
+            uint32_t wanted = last - first + 1;
+            uint32_t initial = state.advice == access_advice::sequential ? READAHEAD_SEQUENTIAL_PAGES : READAHEAD_MIN_PAGES;
+            state.start = first;
+            state.size = kstd::min(kstd::max(wanted * 4, initial), kstd::max(max_window(), wanted));
+            state.async_size = state.size - wanted;
+            prefetch(node, state.start, state.size);
+        } else if(last >= state.start + state.size - state.async_size) {
+            // Caught up with the window, the next (bigger) one goes out before it's needed
+            state.start += state.size;
+            state.size = kstd::min(state.size * 2, max_window());
+            state.async_size = state.size;
+            prefetch(node, state.start, state.size);
+        }
+    }
+
+    void finish_read(page* p, int result) {
+        p->state = result < 0 ? page_state::failed : page_state::valid;
+
+        // Can't take the lock in here, so the pin gets dropped by whoever takes it next
+        page* head = __atomic_load_n(&finished, __ATOMIC_RELAXED);
+        do {
+            p->next_finished = head;
+        } while(!__atomic_compare_exchange_n(&finished, &head, p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    void invalidate(uint64_t volume, uint64_t object, uint64_t first, uint64_t last) {
+        if(!lookup) {
+            return;
+        }
+
+        kstd::lock l(cache_lock);
+        drop_finished();
+        auto it = clock.begin();
+        while(it != clock.end()) {
+            page* p = *it;
+            ++it;
+            if(p->key.volume != volume || p->key.object != object || p->key.index < first || p->key.index > last) {
+                continue;
+            }
+
+            if(p->dirty) {
+                clean(p);
+                if(p->owner) {
+                    p->owner->remove_handle();
+                }
+            }
+
+            uncache(p);
+            if(!p->pins) {
+                release(p);
+            }
+        }
+    }
+
+    void drop_clean(uint64_t volume, uint64_t object, uint64_t first, uint64_t last) {
+        if(!lookup) {
+            return;
+        }
+
+        kstd::lock l(cache_lock);
+        drop_finished();
+        auto it = clock.begin();
+        while(it != clock.end()) {
+            page* p = *it;
+            ++it;
+            if(p->key.volume != volume || p->key.object != object || p->key.index < first || p->key.index > last) {
+                continue;
+            }
+
+            if(p->pins || p->dirty || p->writing) {
+                continue;
+            }
+
+            uncache(p);
+            release(p);
+        }
+    }
+
+    static bool write_order(const page* l, const page* r) {
+        // Device pages (metadata) go last, after the data that needs it
+        if(l->key.volume != r->key.volume) {
+            return l->key.volume < r->key.volume;
+        }
+
+        if(l->key.object != r->key.object) {
+            return l->key.object < r->key.object;
+        }
+
+        return l->key.index < r->key.index;
+    }
+
+    // Takes up to a batch of pages dirtied before the given time (of node and the devices, or
+    // anyone's) off the dirty list, pinned and clean, sorted into the order they get written
+    static unsigned take_dirty(fs::fs_node* node, uint64_t before, page** batch) {
+        kstd::lock l(cache_lock);
+        drop_finished();
+        unsigned count = 0;
+        auto it = dirty_pages.begin();
+        while(it != dirty_pages.end() && count < WRITEBACK_BATCH) {
+            page* p = *it;
+            ++it;
+            if(p->dirtied >= before) {
+                break;
+            }
+
+            if(node && p->owner && p->owner != node) {
+                continue;
+            }
+
+            p->writing = p->dirty;
+            clean(p);
+            p->pins++;
+
+            // Insertion sort, pages tend to be dirtied in order anyway
+            unsigned pos = count++;
+            while(pos && write_order(p, batch[pos - 1])) {
+                batch[pos] = batch[pos - 1];
+                pos--;
+            }
+
+            batch[pos] = p;
+        }
+
+        writing += count;
+        return count;
+    }
+
+    static int write_device_pages(page** batch, unsigned count) {
+        devices::partition_device* device = (devices::partition_device *)batch[0]->key.object;
+        uint64_t sector_size = device->parent()->block_size();
+        constexpr unsigned MAX_PIECES = (memory::PAGE_SIZE_4K / DIRTY_UNIT + 1) / 2;
+        kstd::auto_free<storage::block_request> requests(count * MAX_PIECES);
+        unsigned request_count = 0;
+        for(unsigned i = 0; i < count; i++) {
+            // A request for every run of changed pieces, rounded out to whole sectors
+            page* p = batch[i];
+            uint64_t base = p->key.index << memory::PAGE_SHIFT_4K;
+            unsigned piece = 0;
+            while(piece < memory::PAGE_SIZE_4K / DIRTY_UNIT) {
+                if(!(p->writing & (1U << piece))) {
+                    piece++;
+                    continue;
+                }
+
+                unsigned end = piece;
+                while(end < memory::PAGE_SIZE_4K / DIRTY_UNIT && (p->writing & (1U << end))) {
+                    end++;
+                }
+
+                uint64_t lba = (base + piece * DIRTY_UNIT) / sector_size;
+                uint64_t end_lba = kstd::min((base + end * DIRTY_UNIT + sector_size - 1) / sector_size, device->block_count());
+                piece = end;
+                if(lba >= end_lba) {
+                    continue;
+                }
+
+                storage::block_request& request = requests[request_count++];
+                memset(&request, 0, sizeof(storage::block_request));
+                request.lba = lba;
+                request.count = end_lba - lba;
+                request.buffer = p->data + (lba * sector_size - base);
+                request.write = true;
+            }
+        }
+
+        return request_count ? device->execute(requests, request_count) : 0;
+    }
+
+    static void finish_writeback(page** batch, unsigned count, int result) {
+        kstd::lock l(cache_lock);
+        for(unsigned i = 0; i < count; i++) {
+            page* p = batch[i];
+            if(result < 0 && p->cached) {
+                // Try it again later
+                if(!p->dirty) {
+                    p->dirtied = now_ms();
+                    dirty_pages.push_back(p);
+                    stats.dirty++;
+                } else if(p->owner) {
+                    // Written to again in the meantime, which took another handle
+                    p->owner->remove_handle();
+                }
+
+                p->dirty |= p->writing;
+            } else {
+                if(p->owner) {
+                    p->owner->remove_handle();
+                }
+
+                if(result >= 0) {
+                    stats.written++;
+                }
+            }
+
+            p->writing = 0;
+            if(!--p->pins && !p->cached) {
+                release(p);
+            }
+        }
+
+        writing -= count;
+    }
+
+    // One file or device at a time, so the filesystem can put together big requests
+    static int write_batch(page** batch, unsigned count) {
+        int result = 0;
+        unsigned i = 0;
+        while(i < count) {
+            unsigned run = 1;
+            while(i + run < count && batch[i + run]->key.volume == batch[i]->key.volume 
+                && batch[i + run]->key.object == batch[i]->key.object) {
+                run++;
+            }
+
+            int e = batch[i]->key.volume == DEVICE_VOLUME 
+                ? write_device_pages(batch + i, run) 
+                : batch[i]->owner->write_pages(batch + i, run);
+            if(e < 0) {
+                log::warning("[page_cache] Writeback of %u page(s) failed: %d", run, e);
+                if(!result) {
+                    result = e;
+                }
+            }
+
+            finish_writeback(batch + i, run, e);
+            i += run;
+        }
+
+        return result;
+    }
+
+    static int writeback_before(fs::fs_node* node, uint64_t before) {
+        if(!lookup) {
+            return 0;
+        }
+
+        kstd::auto_free<page *> batch(WRITEBACK_BATCH);
+        while(unsigned count = take_dirty(node, before, batch)) {
+            if(int e = write_batch(batch, count)) {
+                // What failed is back on the list, no point going round again now
+                return e;
+            }
+        }
+
+        return 0;
+    }
+
+    int writeback(fs::fs_node* node) {
+        // Only what's dirty already, a busy writer could keep it going forever otherwise
+        return writeback_before(node, now_ms() + 1);
+    }
+
+    void balance_dirty() {
+        if(!lookup || stats.dirty <= capacity / DIRTY_SHARE) {
+            return;
+        }
+
+        // The oldest batch, which slows the writer down to about the speed of the disk
+        kstd::auto_free<page *> batch(WRITEBACK_BATCH);
+        if(unsigned count = take_dirty(nullptr, ~0ULL, batch)) {
+            write_batch(batch, count);
+        }
+    }
+
+    int sync(fs::fs_node* node) {
+        int result = writeback(node);
+
+        // Anything the flusher took before this started has to be on the disk too
+        while(__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+            scheduler::yield();
+        }
+
+        return result;
+    }
+
+    static void flusher() {
+        kstd::auto_free<page *> batch(WRITEBACK_BATCH);
+        while(true) {
+            while(true) {
+                // Whatever's been dirty too long, or the oldest while there's too much of it
+                uint64_t now = now_ms();
+                uint64_t before = now > DIRTY_EXPIRE_MS ? now - DIRTY_EXPIRE_MS : 0;
+                if(stats.dirty > capacity / DIRTY_BACKGROUND_SHARE) {
+                    before = ~0ULL;
+                }
+
+                unsigned count = take_dirty(nullptr, before, batch);
+                if(!count || write_batch(batch, count) < 0) {
+                    break;
+                }
+            }
+
+            scheduler::get_current_thread()->sleep(FLUSHER_INTERVAL_US);
+        }
+    }
+
+    void start_flusher() {
+        process_t* proc = scheduler::create_process((void *)flusher);
+        strncpy(proc->name, "Flusher", 8);
+    }
+
+    size_t cache_shrinker::count_pages() {
+        return stats.pages;
+    }
+
+    size_t cache_shrinker::shrink(size_t count) {
+        if(!acquire_test_lock(&cache_lock)) {
+            return 0;
+        }
+
+        drop_finished();
+        size_t evicted = evict(count);
+        release_lock(&cache_lock);
+        return evicted;
+    }
+
+    void initialize() {
+        // Blocks and pages are the same size
+        uint64_t ram_pages = memory::get_total_blocks();
+        capacity = kstd::min(kstd::max(ram_pages / RAM_SHARE, (uint64_t)MIN_PAGES), (uint64_t)MAX_PAGES);
+        window = (uint8_t *)memory::kernel_allocate_4k_pages(capacity);
+        pages = new page[capacity];
+        for(size_t i = 0; i < capacity; i++) {
+            pages[i].data = window + (i << memory::PAGE_SHIFT_4K);
+            pages[i].phys = 0;
+            pages[i].pins = 0;
+            pages[i].state = page_state::free;
+            pages[i].referenced = false;
+            pages[i].cached = false;
+            pages[i].dirty = 0;
+            pages[i].writing = 0;
+            pages[i].io = nullptr;
+            pages[i].owner = nullptr;
+            free_pages.push_back(&pages[i]);
+        }
+
+        stats.capacity = capacity;
+        lookup = new lookup_t(key_hash());
+        register_shrinker(new cache_shrinker());
+        log::info("[page_cache] Up to %llu pages", capacity);
+    }
+
+    stats_t get_stats() {
+        kstd::lock l(cache_lock);
+        return stats;
+    }
+}
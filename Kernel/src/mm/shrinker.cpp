@@ -0,0 +1,70 @@
+#include <mm/shrinker.h>
+#include <physical_allocator.h>
+#include <klist.hpp>
+#include <spinlock.h>
+#include <system.h>
+#include <kmath.h>
+
+extern lock_t alloc_lock; // liballoc_internal.cpp
+
+namespace mm {
+    static list<shrinker *> shrinkers;
+    static lock_t shrinkers_lock {0};
+
+    void register_shrinker(shrinker* s) {
+        acquire_lock(&shrinkers_lock);
+        shrinkers.add(s);
+        release_lock(&shrinkers_lock);
+    }
+
+    void unregister_shrinker(shrinker* s) {
+        acquire_lock(&shrinkers_lock);
+        for(unsigned i = 0; i < shrinkers.size(); i++) {
+            if(shrinkers[i] == s) {
+                shrinkers.remove_at(i);
+                break;
+            }
+        }
+
+        release_lock(&shrinkers_lock);
+    }
+
+    size_t shrink_caches() {
+        // Shrinkers give memory back through the kernel heap, which might be the very thing
+        // that is allocating right now (or could spin with interrupts off)
+        if(!check_interrupts() || alloc_lock) {
+            return 0;
+        }
+
+        if(!acquire_test_lock(&shrinkers_lock)) {
+            // Someone is already shrinking (or registering)
+            return 0;
+        }
+
+        uint64_t free_blocks = memory::get_free_blocks();
+        uint64_t target = memory::get_low_watermark() * 2;
+        if(free_blocks >= target) {
+            release_lock(&shrinkers_lock);
+            return 0;
+        }
+
+        size_t wanted = target - free_blocks;
+        size_t freeable = 0;
+        for(shrinker* s : shrinkers) {
+            freeable += s->count_pages();
+        }
+
+        size_t freed = 0;
+        if(freeable) {
+            for(shrinker* s : shrinkers) {
+                size_t share = (wanted * s->count_pages() + freeable - 1) / freeable;
+                if(share) {
+                    freed += s->shrink(kstd::min(share, wanted));
+                }
+            }
+        }
+
+        release_lock(&shrinkers_lock);
+        return freed;
+    }
+}
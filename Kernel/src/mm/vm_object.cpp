@@ -1,24 +1,66 @@
 #include <mm/vm_object.h>
+#include <mm/ksm.h>
+#include <mm/zswap.h>
 #include <kassert.h>
 #include <paging.h>
 #include <physical_allocator.h>
 #include <kstring.h>
 #include <cpu.h>
+#include <kmath.h>
+#include <logging.h>
+#include <fs/fs_node.h>
+#include <mm/page_cache.h>
+#include <abi-bits/errno.h>
 
 namespace mm {
+    static uintptr_t zero_block = 0;
+    static lock_t zero_block_lock {0};
+
+    uintptr_t get_zero_block() {
+        if(__builtin_expect(!zero_block, 0)) {
+            kstd::lock l(zero_block_lock);
+            if(!zero_block) {
+                uintptr_t phys = memory::allocate_zeroed_block();
+                if(!phys) {
+                    phys = memory::allocate_physical_block();
+                    void* mapping = memory::kernel_allocate_4k_pages(1);
+                    memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)mapping, 1);
+                    memset(mapping, 0, memory::PAGE_SIZE_4K);
+                    memory::kernel_free_4k_pages(mapping, 1);
+                }
+
+                zero_block = phys;
+            }
+        }
+
+        return zero_block;
+    }
+
     vm_object::vm_object(size_t size, bool anonymous, bool shared, bool cow)
         :_size(size)
         ,_anonymous(anonymous)
         ,_shared(shared)
         ,_cow(cow)
+        ,_sequential(false)
     {
         assert(!(size & (memory::PAGE_SIZE_4K - 1)));
     }
 
-    int vm_object::hit(uintptr_t, uintptr_t, page_map_t*) {
+    int vm_object::hit(uintptr_t, uintptr_t, page_map_t*, bool) {
         return 1; // Fatal page fault, kill process
     }
 
+    int vm_object::populate(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) {
+        uintptr_t end = kstd::min(offset + size, _size);
+        for(offset &= memory::PAGE_SIZE_4K_MASK; offset < end; offset += memory::PAGE_SIZE_4K) {
+            if(int status = hit(base, offset, map, false)) {
+                return status;
+            }
+        }
+
+        return 0;
+    }
+
     physical_vm_object::physical_vm_object(size_t size, bool anonymous, bool shared, bool cow)
         :vm_object(size, anonymous, shared, cow)
     {
@@ -28,15 +70,26 @@ namespace mm {
         if(anonymous) {
             memset(_physical_blocks, 0, sizeof(uint32_t) * block_count);
         } else {
-            void* mapping = memory::kernel_allocate_4k_pages(1);
+            void* mapping = nullptr;
             for(unsigned i = 0; i < block_count; i++) {
-                uintptr_t phys = memory::allocate_physical_block();
+                uintptr_t phys = memory::allocate_zeroed_block();
+                if(!phys) {
+                    // Pool ran dry, zero it ourselves
+                    phys = memory::allocate_physical_block();
+                    if(!mapping) {
+                        mapping = memory::kernel_allocate_4k_pages(1);
+                    }
+
+                    memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)mapping, 1);
+                    memset(mapping, 0, memory::PAGE_SIZE_4K);
+                }
+
                 _physical_blocks[i] = phys >> memory::PAGE_SHIFT_4K;
-                memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)mapping, 1);
-                memset(mapping, 0, memory::PAGE_SIZE_4K);
             }
 
-            memory::kernel_free_4k_pages(mapping, 1);
+            if(mapping) {
+                memory::kernel_free_4k_pages(mapping, 1);
+            }
         }
     }
 
@@ -44,15 +97,15 @@ namespace mm {
         uintptr_t virt = base;
         for(unsigned i = 0; i < (_size >> memory::PAGE_SHIFT_4K); i++) {
             uint64_t block = _physical_blocks[i];
-            if(block) {
+            if(block && !(block & BLOCK_SWAPPED)) {
                 uint32_t flags = memory::PAGE_USER | memory::TABLE_PRESENT;
-                if(!_cow) {
+                if(!_cow && !(block & BLOCK_MERGED)) {
                     flags |= memory::TABLE_WRITEABLE;
                 }
 
-                memory::map_virtual_memory_4k(block << memory::PAGE_SHIFT_4K, virt, 1, map, flags);
+                memory::map_virtual_memory_4k((block & BLOCK_FRAME_MASK) << memory::PAGE_SHIFT_4K, virt, 1, map, flags);
             } else {
-                // Not allocated, no write allowed
+                // Not allocated (or swapped out), no write allowed
                 memory::map_virtual_memory_4k(0, virt, 1, map, memory::PAGE_USER);
             }
 
@@ -63,28 +116,36 @@ namespace mm {
     vm_object* physical_vm_object::clone() {
         assert(!_shared);
         physical_vm_object* new_vmo = new physical_vm_object(_size, _anonymous, _shared, false);
+        copy_blocks_to(new_vmo);
+        new_vmo->add_use();
+
+        return new_vmo;
+    }
 
+    void physical_vm_object::copy_blocks_to(physical_vm_object* dest) const {
         // Temporary mapping to make our copy
         uint8_t* virt_buffer = (uint8_t *)memory::kernel_allocate_4k_pages(2);
         uint8_t* virt_dest_buffer = virt_buffer + memory::PAGE_SIZE_4K;
 
         for(unsigned i = 0; i < (_size >> memory::PAGE_SHIFT_4K); i++) {
-            uintptr_t block = _physical_blocks[i];
+            uint32_t block = _physical_blocks[i];
             if(block) {
                 uintptr_t new_block = memory::allocate_physical_block();
-                new_vmo->_physical_blocks[i] = new_block >> memory::PAGE_SHIFT_4K;
+                dest->_physical_blocks[i] = new_block >> memory::PAGE_SHIFT_4K;
 
-                memory::kernel_map_virtual_memory_4k(block << memory::PAGE_SHIFT_4K, (uintptr_t)virt_buffer, 1);
                 memory::kernel_map_virtual_memory_4k(new_block, (uintptr_t)virt_dest_buffer, 1);
+                if(block & BLOCK_SWAPPED) {
+                    // Straight out of the pool, ours stays where it is
+                    zswap::load(block & BLOCK_FRAME_MASK, virt_dest_buffer);
+                    continue;
+                }
+
+                memory::kernel_map_virtual_memory_4k((uintptr_t)(block & BLOCK_FRAME_MASK) << memory::PAGE_SHIFT_4K, (uintptr_t)virt_buffer, 1);
                 memcpy(virt_dest_buffer, virt_buffer, memory::PAGE_SIZE_4K);
             }
         }
 
         memory::kernel_free_4k_pages(virt_buffer, 2);
-
-        new_vmo->add_use();
-
-        return new_vmo;
     }
 
     size_t physical_vm_object::used_physical_memory() const {
@@ -94,7 +155,7 @@ namespace mm {
 
         unsigned block_count = 0;
         for(unsigned i = 0; i < _size >> memory::PAGE_SHIFT_4K; i++) {
-            if(_physical_blocks[i]) {
+            if(_physical_blocks[i] && !(_physical_blocks[i] & BLOCK_SWAPPED)) {
                 block_count++;
             }
         }
@@ -108,45 +169,197 @@ namespace mm {
         if(_physical_blocks) {
             for(unsigned i = 0; i < _size >> memory::PAGE_SHIFT_4K; i++) {
                 if(_physical_blocks[i]) {
-                    memory::free_physical_block((uintptr_t)_physical_blocks[i] << memory::PAGE_SHIFT_4K);
+                    free_block(i);
                 }
             }
 
             delete[] _physical_blocks;
         }
+
+        delete[] _ksm_checksums;
     }
 
-    int physical_vm_object::hit(uintptr_t base, uintptr_t offset, page_map_t* map) {
+    int physical_vm_object::hit(uintptr_t base, uintptr_t offset, page_map_t* map, bool write) {
         unsigned block_index = offset >> memory::PAGE_SHIFT_4K;
-        assert(block_index < (_size >> memory::PAGE_SHIFT_4K));
+        unsigned block_count = _size >> memory::PAGE_SHIFT_4K;
+        assert(block_index < block_count);
 
-        uint32_t& block = _physical_blocks[block_index];
-        if(block) {
+        if(_physical_blocks[block_index]) {
             // Already allocated by another object, just map for this one too
-            memory::map_virtual_memory_4k((uintptr_t)block << memory::PAGE_SHIFT_4K, base + offset, 1, map);
+            return map_block(base, block_index, map, write);
+        }
+
+        // Reads just get the zero block, the memory is only allocated once it is written
+        assert(_anonymous);
+        auto fault_in = write ? &physical_vm_object::allocate_block : &physical_vm_object::map_zero_block;
+        if((this->*fault_in)(base, block_index, map)) {
+            return 1;
+        }
+
+        // If this picks up where the last fault left off then someone is probably streaming
+        // through the region, so grow the number of pages mapped ahead of them
+        if(_sequential) {
+            _fault_around = FAULT_AROUND_SEQUENTIAL_PAGES;
+        } else if(block_index == _next_fault) {
+            _fault_around = kstd::min(kstd::max(_fault_around * 2, 1U), FAULT_AROUND_PAGES);
         } else {
-            // Allocate the physical memory as well
-            assert(_anonymous);
+            _fault_around = 0;
+        }
 
+        unsigned end = kstd::min(block_index + 1 + _fault_around, block_count);
+        unsigned next = block_index + 1;
+        while(next < end && !_physical_blocks[next] && !(this->*fault_in)(base, next, map)) {
+            next++;
+        }
+
+        _next_fault = next;
+        return 0;
+    }
+
+    int physical_vm_object::map_block(uintptr_t base, unsigned block_index, page_map_t* map, bool write) {
+        uintptr_t virt = base + ((uintptr_t)block_index << memory::PAGE_SHIFT_4K);
+        uint32_t& block = _physical_blocks[block_index];
+        if(block & BLOCK_SWAPPED) {
+            // Compressed out while memory was tight, bring it back
             uintptr_t phys = memory::allocate_physical_block();
             assert(phys < PHYS_BLOCK_MAX);
 
-            if(!phys) {
-                // Failed to allocate (out of memory?)
-                return 1;
+            void* mapping = memory::kernel_allocate_4k_pages(1);
+            memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)mapping, 1);
+            zswap::load(block & BLOCK_FRAME_MASK, mapping);
+            memory::kernel_free_4k_pages(mapping, 1);
+
+            zswap::release(block & BLOCK_FRAME_MASK);
+            block = phys >> memory::PAGE_SHIFT_4K;
+        } else if(block & BLOCK_MERGED) {
+            uintptr_t merged = (uintptr_t)(block & BLOCK_FRAME_MASK) << memory::PAGE_SHIFT_4K;
+            if(!write) {
+                memory::map_virtual_memory_4k(merged, virt, 1, map, memory::PAGE_USER | memory::TABLE_PRESENT);
+                return 0;
             }
 
+            // Somebody wants to write to a merged block, so it needs its own copy again
+            uintptr_t phys = memory::allocate_physical_block();
+            assert(phys < PHYS_BLOCK_MAX);
+
+            uint8_t* virt_buffer = (uint8_t *)memory::kernel_allocate_4k_pages(2);
+            uint8_t* virt_source_buffer = virt_buffer + memory::PAGE_SIZE_4K;
+            memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)virt_buffer, 1);
+            memory::kernel_map_virtual_memory_4k(merged, (uintptr_t)virt_source_buffer, 1);
+            memcpy(virt_buffer, virt_source_buffer, memory::PAGE_SIZE_4K);
+            memory::kernel_free_4k_pages(virt_buffer, 2);
+
             block = phys >> memory::PAGE_SHIFT_4K;
-            memory::map_virtual_memory_4k(phys, base + offset, 1, map);
-            if(get_cr3() == map->pml4_phys) {
-                // PML4 is already correctly loaded, zero the block directly
-                memset((void *)((base + offset) & ~(memory::PAGE_SIZE_4K - 1)), 0, memory::PAGE_SIZE_4K);
-            } else {
-                // Create temporary mapping to set the physical memory to zero
-                void* mapping = memory::kernel_allocate_4k_pages(1);
-                memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)mapping, 1);
-                memset(mapping, 0, memory::PAGE_SIZE_4K);
-                memory::kernel_free_4k_pages(mapping, 1);
+            ksm::release_block(merged);
+        }
+
+        memory::map_virtual_memory_4k((uintptr_t)block << memory::PAGE_SHIFT_4K, virt, 1, map);
+        return 0;
+    }
+
+    void physical_vm_object::free_block(unsigned block_index) {
+        uint32_t block = _physical_blocks[block_index];
+        if(block & BLOCK_SWAPPED) {
+            zswap::release(block & BLOCK_FRAME_MASK);
+        } else if(block & BLOCK_MERGED) {
+            ksm::release_block((uintptr_t)(block & BLOCK_FRAME_MASK) << memory::PAGE_SHIFT_4K);
+        } else {
+            memory::free_physical_block((uintptr_t)block << memory::PAGE_SHIFT_4K);
+        }
+
+        _physical_blocks[block_index] = 0;
+    }
+
+    int physical_vm_object::allocate_block(uintptr_t base, unsigned block_index, page_map_t* map) {
+        uintptr_t phys = memory::allocate_zeroed_block();
+        bool zeroed = phys;
+        if(!zeroed) {
+            phys = memory::allocate_physical_block();
+        }
+
+        assert(phys < PHYS_BLOCK_MAX);
+
+        if(!phys) {
+            // Failed to allocate (out of memory?)
+            return 1;
+        }
+
+        uintptr_t virt = base + ((uintptr_t)block_index << memory::PAGE_SHIFT_4K);
+        _physical_blocks[block_index] = phys >> memory::PAGE_SHIFT_4K;
+        memory::map_virtual_memory_4k(phys, virt, 1, map);
+        if(zeroed) {
+            // Nothing left to do, the idle loop already cleared it
+            return 0;
+        }
+
+        if(get_cr3() == map->pml4_phys) {
+            // PML4 is already correctly loaded, zero the block directly
+            memset((void *)virt, 0, memory::PAGE_SIZE_4K);
+        } else {
+            // Create temporary mapping to set the physical memory to zero
+            void* mapping = memory::kernel_allocate_4k_pages(1);
+            memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)mapping, 1);
+            memset(mapping, 0, memory::PAGE_SIZE_4K);
+            memory::kernel_free_4k_pages(mapping, 1);
+        }
+
+        return 0;
+    }
+
+    int physical_vm_object::map_zero_block(uintptr_t base, unsigned block_index, page_map_t* map) {
+        uintptr_t virt = base + ((uintptr_t)block_index << memory::PAGE_SHIFT_4K);
+        memory::map_virtual_memory_4k(get_zero_block(), virt, 1, map, memory::PAGE_USER | memory::TABLE_PRESENT);
+        return 0;
+    }
+
+    int physical_vm_object::populate(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) {
+        if(!_anonymous) {
+            // Already allocated and mapped up front
+            return 0;
+        }
+
+        unsigned end = memory::PAGE_COUNT_4K(kstd::min(offset + size, _size));
+        for(unsigned i = offset >> memory::PAGE_SHIFT_4K; i < end; i++) {
+            if(_physical_blocks[i]) {
+                map_block(base, i, map, false);
+            } else if(allocate_block(base, i, map)) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    int physical_vm_object::discard(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) {
+        if(!_anonymous) {
+            return -EINVAL;
+        }
+
+        if(_use_count > 1) {
+            // Someone else is still looking at these, and a copy on write fault would just
+            // bring them back for this mapping
+            return -EBUSY;
+        }
+
+        unsigned start = offset >> memory::PAGE_SHIFT_4K;
+        unsigned end = memory::PAGE_COUNT_4K(kstd::min(offset + size, _size));
+        bool unmapped = false;
+        for(unsigned i = start; i < end; i++) {
+            if(_physical_blocks[i]) {
+                memory::map_virtual_memory_4k(0, base + ((uintptr_t)i << memory::PAGE_SHIFT_4K), 1, map, memory::PAGE_USER);
+                unmapped = true;
+            }
+        }
+
+        if(!unmapped) {
+            return 0;
+        }
+
+        // Other CPUs running this process could still have the old frames cached
+        memory::tlb_shootdown();
+        for(unsigned i = start; i < end; i++) {
+            if(_physical_blocks[i]) {
+                free_block(i);
             }
         }
 
@@ -178,4 +391,357 @@ namespace mm {
             virt += memory::PAGE_SIZE_4K;
         }
     }
-}
\ No newline at end of file
+
+    // Each node keeps its own list of shared ranges, which holds a reference to each one
+    // until nothing maps it any more or the file changes under it
+    static lock_t file_vm_objects_lock {0};
+
+    kstd::ref_counted<vm_object> file_vm_object::get(fs::fs_node* node, off_t offset, size_t size) {
+        assert(!(offset & (memory::PAGE_SIZE_4K - 1)));
+
+        kstd::lock l(file_vm_objects_lock);
+        for(file_vm_object* vmo = node->file_mappings; vmo; vmo = vmo->_next_mapping) {
+            if(vmo->_offset == offset && vmo->_size == size) {
+                return vmo->_registered;
+            }
+        }
+
+        file_vm_object* vmo = new file_vm_object(node, offset, size);
+        vmo->_registered = kstd::ref_counted<vm_object>(vmo);
+        vmo->_next_mapping = node->file_mappings;
+        node->file_mappings = vmo;
+        return vmo->_registered;
+    }
+
+    void file_vm_object::forget(fs::fs_node* node) {
+        if(!node->file_mappings) {
+            return;
+        }
+
+        file_vm_object* stale;
+        {
+            kstd::lock l(file_vm_objects_lock);
+            stale = node->file_mappings;
+            node->file_mappings = nullptr;
+        }
+
+        // Nobody can find these any more, so the references are ours to drop (which can
+        // close the node, so not under the lock)
+        while(stale) {
+            file_vm_object* next = stale->_next_mapping;
+            stale->_next_mapping = nullptr;
+            kstd::ref_counted<vm_object> registered = std::move(stale->_registered);
+            stale = next;
+        }
+    }
+
+    // Takes it off the node's list, called with the registry lock held
+    kstd::ref_counted<vm_object> file_vm_object::unregister() {
+        for(file_vm_object** link = &_node->file_mappings; *link; link = &(*link)->_next_mapping) {
+            if(*link == this) {
+                *link = _next_mapping;
+                _next_mapping = nullptr;
+                return std::move(_registered);
+            }
+        }
+
+        // Already forgotten
+        return nullptr;
+    }
+
+    void file_vm_object::last_use_removed() {
+        kstd::ref_counted<vm_object> registered;
+        kstd::lock l(file_vm_objects_lock);
+        if(use_count() == 0) {
+            // Unless get() just handed it out again
+            registered = unregister();
+        }
+    }
+
+    file_vm_object::file_vm_object(fs::fs_node* node, off_t offset, size_t size)
+        :vm_object(size, false, true, false)
+        ,_node(node)
+        ,_volume_id(node->volume_id)
+        ,_inode(node->inode)
+        ,_offset(offset)
+    {
+        size_t block_count = memory::PAGE_COUNT_4K(size);
+        _physical_blocks = new uint32_t[block_count];
+        memset(_physical_blocks, 0, sizeof(uint32_t) * block_count);
+        if(node->uses_page_cache()) {
+            _cache_pages = new page_cache::page*[block_count];
+            memset(_cache_pages, 0, sizeof(page_cache::page*) * block_count);
+        }
+
+        // Keeps the node out of reach of the inode cache shrinker, and an unlinked file
+        // around until this goes
+        node->add_handle();
+    }
+
+    file_vm_object::~file_vm_object() {
+        for(unsigned i = 0; i < _size >> memory::PAGE_SHIFT_4K; i++) {
+            if(_cache_pages && _cache_pages[i]) {
+                // The frame belongs to the page cache
+                page_cache::unpin(_cache_pages[i]);
+            } else if(_physical_blocks[i] && _node_frames) {
+                // Or to the node itself
+                _node->unmap_page((_offset >> memory::PAGE_SHIFT_4K) + i);
+            } else if(_physical_blocks[i]) {
+                memory::free_physical_block((uintptr_t)_physical_blocks[i] << memory::PAGE_SHIFT_4K);
+            }
+        }
+
+        delete[] _physical_blocks;
+        delete[] _cache_pages;
+
+        // Last, this can be what frees the node
+        fs::close(_node);
+    }
+
+    uintptr_t file_vm_object::get_page(unsigned index) {
+        assert(index < (_size >> memory::PAGE_SHIFT_4K));
+        if(_physical_blocks[index]) {
+            return (uintptr_t)_physical_blocks[index] << memory::PAGE_SHIFT_4K;
+        }
+
+        if(_cache_pages) {
+            if(uintptr_t phys = get_cached_page(index)) {
+                return phys;
+            }
+
+            // Nothing in the cache could make room (or the read failed), so this page gets a
+            // frame of its own like it would without the cache
+        } else if(uintptr_t phys = get_node_page(index)) {
+            return phys;
+        } else if(_node_frames) {
+            return 0;
+        }
+
+        uintptr_t phys = memory::allocate_zeroed_block();
+        bool zeroed = phys;
+        if(!zeroed) {
+            phys = memory::allocate_physical_block();
+        }
+
+        assert(phys < PHYS_BLOCK_MAX);
+
+        void* mapping = memory::kernel_allocate_4k_pages(1);
+        memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)mapping, 1);
+        if(!zeroed) {
+            memset(mapping, 0, memory::PAGE_SIZE_4K);
+        }
+
+        size_t file_offset = _offset + ((size_t)index << memory::PAGE_SHIFT_4K);
+        if(file_offset < _node->size) {
+            // The disk drivers need interrupts to make progress
+            bool interrupts = check_interrupts();
+            asm("sti");
+            size_t count = kstd::min((size_t)memory::PAGE_SIZE_4K, _node->size - file_offset);
+            ssize_t read = fs::read(_node, file_offset, count, mapping);
+            if(!interrupts) {
+                asm("cli");
+            }
+
+            if(read < 0) {
+                log::warning("Failed to page in offset 0x%llx of inode %lld (%d)", file_offset, _inode, read);
+                memory::kernel_free_4k_pages(mapping, 1);
+                memory::free_physical_block(phys);
+                return 0;
+            }
+        }
+
+        memory::kernel_free_4k_pages(mapping, 1);
+
+        kstd::lock l(_lock);
+        if(_physical_blocks[index]) {
+            // Someone else faulted the same page in while we were reading
+            memory::free_physical_block(phys);
+            return (uintptr_t)_physical_blocks[index] << memory::PAGE_SHIFT_4K;
+        }
+
+        _physical_blocks[index] = phys >> memory::PAGE_SHIFT_4K;
+        return phys;
+    }
+
+    uintptr_t file_vm_object::get_cached_page(unsigned index) {
+        // Shares the frame fs::read copies from, and keeps it pinned for as long as this is around
+        bool interrupts = check_interrupts();
+        asm("sti");
+        page_cache::page* p = page_cache::get_file_page(_node, (_offset >> memory::PAGE_SHIFT_4K) + index);
+        if(!interrupts) {
+            asm("cli");
+        }
+
+        if(!p) {
+            return 0;
+        }
+
+        assert(p->phys < PHYS_BLOCK_MAX);
+
+        kstd::lock l(_lock);
+        if(_physical_blocks[index]) {
+            // Someone else faulted the same page in while we were reading
+            page_cache::unpin(p);
+            return (uintptr_t)_physical_blocks[index] << memory::PAGE_SHIFT_4K;
+        }
+
+        _cache_pages[index] = p;
+        _physical_blocks[index] = p->phys >> memory::PAGE_SHIFT_4K;
+        return p->phys;
+    }
+
+    uintptr_t file_vm_object::get_node_page(unsigned index) {
+        // Nodes that keep their data in memory anyway can hand over their own frame
+        uint64_t file_page = (_offset >> memory::PAGE_SHIFT_4K) + index;
+        uintptr_t phys;
+        int result = _node->map_page(file_page, phys);
+        if(result == -ENOSYS) {
+            return 0;
+        }
+
+        _node_frames = true;
+        if(result < 0) {
+            log::warning("Failed to map offset 0x%llx of inode %lld (%d)", 
+                file_page << memory::PAGE_SHIFT_4K, _inode, result);
+            return 0;
+        }
+
+        assert(phys < PHYS_BLOCK_MAX);
+
+        {
+            kstd::lock l(_lock);
+            if(!_physical_blocks[index]) {
+                _physical_blocks[index] = phys >> memory::PAGE_SHIFT_4K;
+                return phys;
+            }
+        }
+
+        // Someone else faulted the same page in while we were asking
+        _node->unmap_page(file_page);
+        return (uintptr_t)_physical_blocks[index] << memory::PAGE_SHIFT_4K;
+    }
+
+    int file_vm_object::hit(uintptr_t base, uintptr_t offset, page_map_t* map, bool write) {
+        if(write) {
+            // Nobody gets to write to the page cache
+            return 1;
+        }
+
+        uintptr_t phys = get_page(offset >> memory::PAGE_SHIFT_4K);
+        if(!phys) {
+            return 1;
+        }
+
+        memory::map_virtual_memory_4k(phys, (base + offset) & memory::PAGE_SIZE_4K_MASK, 1, map, 
+            memory::PAGE_USER | memory::TABLE_PRESENT);
+        return 0;
+    }
+
+    void file_vm_object::map_allocated_blocks(uintptr_t base, page_map_t* map) {
+        uintptr_t virt = base;
+        for(unsigned i = 0; i < (_size >> memory::PAGE_SHIFT_4K); i++) {
+            uint64_t block = _physical_blocks[i];
+            if(block) {
+                // Already read in by somebody else, so no need to fault
+                memory::map_virtual_memory_4k(block << memory::PAGE_SHIFT_4K, virt, 1, map, memory::PAGE_USER | memory::TABLE_PRESENT);
+            } else {
+                memory::map_virtual_memory_4k(0, virt, 1, map, memory::PAGE_USER);
+            }
+
+            virt += memory::PAGE_SIZE_4K;
+        }
+    }
+
+    vm_object* file_vm_object::clone() {
+        assert(!"Shared file VMO cannot be cloned");
+        __builtin_unreachable();
+    }
+
+    size_t file_vm_object::used_physical_memory() const {
+        unsigned block_count = 0;
+        for(unsigned i = 0; i < _size >> memory::PAGE_SHIFT_4K; i++) {
+            if(_physical_blocks[i]) {
+                block_count++;
+            }
+        }
+
+        return block_count << memory::PAGE_SHIFT_4K;
+    }
+
+    private_file_vm_object::private_file_vm_object(kstd::ref_counted<vm_object> backing, size_t file_size, size_t size)
+        :physical_vm_object(size, true, false, false)  // Private copies are as good as anonymous memory
+        ,_backing(backing)
+        ,_file_size(file_size)
+    {
+        assert(!file_size || (_backing && _backing->size() >= file_size));
+        if(_backing) {
+            _backing->add_use();
+        }
+    }
+
+    private_file_vm_object::~private_file_vm_object() {
+        if(_backing) {
+            _backing->remove_use();
+        }
+    }
+
+    int private_file_vm_object::hit(uintptr_t base, uintptr_t offset, page_map_t* map, bool write) {
+        unsigned block_index = offset >> memory::PAGE_SHIFT_4K;
+        assert(block_index < (_size >> memory::PAGE_SHIFT_4K));
+
+        uintptr_t virt = (base + offset) & memory::PAGE_SIZE_4K_MASK;
+        uint32_t& block = _physical_blocks[block_index];
+        if(block) {
+            return map_block(base, block_index, map, write);
+        }
+
+        size_t page_start = (size_t)block_index << memory::PAGE_SHIFT_4K;
+        size_t file_bytes = page_start < _file_size ? kstd::min((size_t)memory::PAGE_SIZE_4K, _file_size - page_start) : 0;
+        if(!write && file_bytes == memory::PAGE_SIZE_4K) {
+            // Share the file page until somebody writes to it
+            uintptr_t phys = backing()->get_page(block_index);
+            if(!phys) {
+                return 1;
+            }
+
+            memory::map_virtual_memory_4k(phys, virt, 1, map, memory::PAGE_USER | memory::TABLE_PRESENT);
+            return 0;
+        }
+
+        uintptr_t source = 0;
+        if(file_bytes && !(source = backing()->get_page(block_index))) {
+            return 1;
+        }
+
+        uintptr_t phys = memory::allocate_physical_block();
+        assert(phys < PHYS_BLOCK_MAX);
+
+        uint8_t* virt_buffer = (uint8_t *)memory::kernel_allocate_4k_pages(2);
+        uint8_t* virt_source_buffer = virt_buffer + memory::PAGE_SIZE_4K;
+        memory::kernel_map_virtual_memory_4k(phys, (uintptr_t)virt_buffer, 1);
+        if(file_bytes) {
+            memory::kernel_map_virtual_memory_4k(source, (uintptr_t)virt_source_buffer, 1);
+            memcpy(virt_buffer, virt_source_buffer, file_bytes);
+        }
+
+        memset(virt_buffer + file_bytes, 0, memory::PAGE_SIZE_4K - file_bytes);
+        memory::kernel_free_4k_pages(virt_buffer, 2);
+
+        block = phys >> memory::PAGE_SHIFT_4K;
+        memory::map_virtual_memory_4k(phys, virt, 1, map);
+        return 0;
+    }
+
+    int private_file_vm_object::populate(uintptr_t base, uintptr_t offset, size_t size, page_map_t* map) {
+        // Only read the file in, private copies still wait for a write
+        return vm_object::populate(base, offset, size, map);
+    }
+
+    vm_object* private_file_vm_object::clone() {
+        private_file_vm_object* new_vmo = new private_file_vm_object(_backing, _file_size, _size);
+        copy_blocks_to(new_vmo);
+        new_vmo->add_use();
+
+        return new_vmo;
+    }
+}
@@ -0,0 +1,288 @@
+#include <mm/vmem.h>
+#include <idt.h>
+#include <kstring.h>
+#include <kassert.h>
+
+namespace mm {
+    namespace {
+        // The page fault handler allocates with interrupts off, so these can never be held
+        // across a preemption or it would spin forever on the same CPU
+        class irq_lock {
+        public:
+            irq_lock(lock_t& lock)
+                :_irq(false)
+                ,_lock(lock)
+            {
+                acquire_lock(&_lock);
+            }
+
+            ~irq_lock() {
+                release_lock(&_lock);
+            }
+
+        private:
+            idt::with_interrupts _irq;
+            lock_t& _lock;
+        };
+    }
+
+    void vmem_arena::init(const char* name, uintptr_t base, size_t size, size_t quantum, populate_t populate) {
+        assert(quantum && !(quantum & (quantum - 1)));
+        assert(!(base & (quantum - 1)) && !(size & (quantum - 1)));
+
+        memset(this, 0, sizeof(vmem_arena));
+        _name = name;
+        _quantum = quantum;
+        _quantum_shift = __builtin_ctzll(quantum);
+        _populate = populate;
+
+        for(unsigned i = 0; i < BOOTSTRAP_TAGS; i++) {
+            release_tag(&_bootstrap_tags[i]);
+        }
+
+        segment* span = new_tag();
+        span->base = base;
+        span->size = size;
+        span->prev = span->next = nullptr;
+        span->free = true;
+        freelist_insert(span);
+        _free_size = size;
+    }
+
+    uintptr_t vmem_arena::alloc(size_t size) {
+        size = (size + _quantum - 1) & ~(_quantum - 1);
+        size_t quanta = size >> _quantum_shift;
+        if(!quanta) {
+            return 0;
+        }
+
+        if(quanta <= QCACHE_MAX) {
+            irq_lock l(_qcache_lock[quanta - 1]);
+            if(_qcache_count[quanta - 1]) {
+                return _qcache[quanta - 1][--_qcache_count[quanta - 1]];
+            }
+        }
+
+        refill_tags();
+        return alloc_segment(size);
+    }
+
+    void vmem_arena::free(uintptr_t addr, size_t size) {
+        size = (size + _quantum - 1) & ~(_quantum - 1);
+        size_t quanta = size >> _quantum_shift;
+        if(!quanta) {
+            return;
+        }
+
+        if(quanta <= QCACHE_MAX) {
+            irq_lock l(_qcache_lock[quanta - 1]);
+            if(_qcache_count[quanta - 1] < QCACHE_DEPTH) {
+                _qcache[quanta - 1][_qcache_count[quanta - 1]++] = addr;
+                return;
+            }
+        }
+
+        free_segment(addr, size);
+    }
+
+    vmem_arena::segment* vmem_arena::new_tag() {
+        // Running out of these means the reserve is too small for how deep refill_tags can recurse
+        assert(_spare_tags);
+
+        segment* seg = _spare_tags;
+        _spare_tags = seg->list_next;
+        _spare_tag_count--;
+        return seg;
+    }
+
+    void vmem_arena::release_tag(segment* seg) {
+        seg->list_next = _spare_tags;
+        _spare_tags = seg;
+        _spare_tag_count++;
+    }
+
+    void vmem_arena::refill_tags() {
+        // Any one allocation needs a tag at most, so only the first one to notice bothers.
+        // Populating might well end up back in here (the physical allocator can reclaim
+        // memory) and that just eats into the reserve.
+        if(_spare_tag_count >= TAG_RESERVE || !_populate || !acquire_test_lock(&_refill_lock)) {
+            return;
+        }
+
+        uintptr_t page = alloc_segment(_quantum);
+        if(page && _populate(page, _quantum)) {
+            irq_lock l(_lock);
+            segment* tags = (segment *)page;
+            for(size_t i = 0; i < _quantum / sizeof(segment); i++) {
+                release_tag(&tags[i]);
+            }
+        } else if(page) {
+            free_segment(page, _quantum);
+        }
+
+        release_lock(&_refill_lock);
+    }
+
+    unsigned vmem_arena::freelist_index(size_t size) const {
+        // Freelist n holds segments of [2^n, 2^(n + 1)) quanta
+        return 63 - __builtin_clzll(size >> _quantum_shift);
+    }
+
+    void vmem_arena::freelist_insert(segment* seg) {
+        unsigned index = freelist_index(seg->size);
+        seg->list_prev = nullptr;
+        seg->list_next = _freelists[index];
+        if(seg->list_next) {
+            seg->list_next->list_prev = seg;
+        }
+
+        _freelists[index] = seg;
+        _freelist_bitmap |= 1ULL << index;
+    }
+
+    void vmem_arena::freelist_remove(segment* seg) {
+        unsigned index = freelist_index(seg->size);
+        if(seg->list_prev) {
+            seg->list_prev->list_next = seg->list_next;
+        } else {
+            _freelists[index] = seg->list_next;
+        }
+
+        if(seg->list_next) {
+            seg->list_next->list_prev = seg->list_prev;
+        }
+
+        if(!_freelists[index]) {
+            _freelist_bitmap &= ~(1ULL << index);
+        }
+    }
+
+    vmem_arena::segment*& vmem_arena::hash_bucket(uintptr_t addr) {
+        uint64_t hash = ((addr >> _quantum_shift) * 0x9E3779B97F4A7C15ULL) >> 32;
+        return _hash[hash % HASH_BUCKETS];
+    }
+
+    void vmem_arena::hash_insert(segment* seg) {
+        segment*& bucket = hash_bucket(seg->base);
+        seg->list_prev = nullptr;
+        seg->list_next = bucket;
+        if(bucket) {
+            bucket->list_prev = seg;
+        }
+
+        bucket = seg;
+    }
+
+    vmem_arena::segment* vmem_arena::hash_remove(uintptr_t addr) {
+        segment*& bucket = hash_bucket(addr);
+        segment* seg = bucket;
+        while(seg && seg->base != addr) {
+            seg = seg->list_next;
+        }
+
+        if(!seg) {
+            return nullptr;
+        }
+
+        if(seg->list_prev) {
+            seg->list_prev->list_next = seg->list_next;
+        } else {
+            bucket = seg->list_next;
+        }
+
+        if(seg->list_next) {
+            seg->list_next->list_prev = seg->list_prev;
+        }
+
+        return seg;
+    }
+
+    uintptr_t vmem_arena::alloc_segment(size_t size) {
+        irq_lock l(_lock);
+
+        // Instant fit: the first segment on any list from the next power of two up is
+        // guaranteed to be big enough, so no searching
+        size_t quanta = size >> _quantum_shift;
+        unsigned index = freelist_index(size);
+        unsigned first = (quanta & (quanta - 1)) ? index + 1 : index;
+        uint64_t fits = first < FREELIST_COUNT ? _freelist_bitmap & (~0ULL << first) : 0;
+
+        segment* seg = nullptr;
+        if(fits) {
+            seg = _freelists[__builtin_ctzll(fits)];
+        } else if(first != index) {
+            // Nothing that certainly fits, but one on the same list might
+            for(segment* candidate = _freelists[index]; candidate; candidate = candidate->list_next) {
+                if(candidate->size >= size) {
+                    seg = candidate;
+                    break;
+                }
+            }
+        }
+
+        if(!seg) {
+            return 0;
+        }
+
+        freelist_remove(seg);
+        if(seg->size > size) {
+            segment* rest = new_tag();
+            rest->base = seg->base + size;
+            rest->size = seg->size - size;
+            rest->free = true;
+            rest->prev = seg;
+            rest->next = seg->next;
+            if(rest->next) {
+                rest->next->prev = rest;
+            }
+
+            seg->next = rest;
+            seg->size = size;
+            freelist_insert(rest);
+        }
+
+        seg->free = false;
+        hash_insert(seg);
+        _free_size -= size;
+        return seg->base;
+    }
+
+    void vmem_arena::free_segment(uintptr_t addr, size_t size) {
+        irq_lock l(_lock);
+
+        // Not something alloc handed out, or only part of it
+        segment* seg = hash_remove(addr);
+        assert(seg && seg->size == size);
+
+        seg->free = true;
+        _free_size += size;
+
+        // Coalesce with the neighbours, the boundary tags are what make this cheap
+        segment* next = seg->next;
+        if(next && next->free) {
+            freelist_remove(next);
+            seg->size += next->size;
+            seg->next = next->next;
+            if(seg->next) {
+                seg->next->prev = seg;
+            }
+
+            release_tag(next);
+        }
+
+        segment* prev = seg->prev;
+        if(prev && prev->free) {
+            freelist_remove(prev);
+            prev->size += seg->size;
+            prev->next = seg->next;
+            if(prev->next) {
+                prev->next->prev = prev;
+            }
+
+            release_tag(seg);
+            seg = prev;
+        }
+
+        freelist_insert(seg);
+    }
+}
@@ -0,0 +1,296 @@
+#include <mm/zswap.h>
+#include <mm/address_space.h>
+#include <mm/vm_object.h>
+#include <physical_allocator.h>
+#include <scheduler.h>
+#include <kstring.h>
+#include <kassert.h>
+#include <kmath.h>
+#include <logging.h>
+#include <lz4.h>
+
+namespace mm::zswap {
+    constexpr unsigned HANDLE_OFFSET_BITS = 8;
+    constexpr unsigned ENTRY_ALIGN = memory::PAGE_SIZE_4K >> HANDLE_OFFSET_BITS;
+
+    // Entries are packed one after another and a pool page is only given back once
+    // every entry in it has been released
+    typedef struct {
+        uint8_t* virt;      // Kept around once allocated, even while there is no frame
+        uint32_t frame;
+        uint16_t used;
+        uint16_t live;
+    } pool_page_t;
+
+    typedef struct {
+        uint16_t length;
+        uint8_t data[];
+    } pool_entry_t;
+
+    static pool_page_t pool[MAX_POOL_PAGES];
+    static int current_page = -1;
+    static lock_t pool_lock {0};
+
+    // Reclaim runs when the allocator is empty, so everything it needs is set aside here
+    static lz4::compress_state_t compress_state;
+    static uint8_t compress_buffer[MAX_COMPRESSED_SIZE];
+    static uint8_t* window;
+    static lock_t reclaim_lock {0};
+
+    static stats_t stats;
+
+    static void lock_pool() {
+        // The reclaimer shoots down TLBs while holding this, and we could have interrupts off
+        while(!acquire_test_lock(&pool_lock)) {
+            memory::tlb_shootdown_poll();
+            asm("pause");
+        }
+    }
+
+    static pool_entry_t* entry_for(uint32_t handle) {
+        pool_page_t& page = pool[handle >> HANDLE_OFFSET_BITS];
+        assert(page.frame && page.live);
+        return (pool_entry_t *)(page.virt + (handle & ((1U << HANDLE_OFFSET_BITS) - 1)) * ENTRY_ALIGN);
+    }
+
+    // Returns the handle or -1 if it doesn't fit.  If a new pool page is needed then spare_frame
+    // (a frame whose contents are no longer needed) is used for it and set to 0.
+    static int64_t store(const uint8_t* data, size_t length, uint32_t& spare_frame) {
+        size_t needed = (sizeof(pool_entry_t) + length + ENTRY_ALIGN - 1) & ~(size_t)(ENTRY_ALIGN - 1);
+        if(current_page < 0 || pool[current_page].used + needed > memory::PAGE_SIZE_4K) {
+            int free_page = -1;
+            for(unsigned i = 0; i < MAX_POOL_PAGES; i++) {
+                if(!pool[i].frame) {
+                    free_page = i;
+                    break;
+                }
+            }
+
+            if(free_page < 0 || !spare_frame) {
+                return -1;
+            }
+
+            pool_page_t& page = pool[free_page];
+            if(!page.virt) {
+                page.virt = (uint8_t *)memory::kernel_allocate_4k_pages(1);
+            }
+
+            memory::kernel_map_virtual_memory_4k((uintptr_t)spare_frame << memory::PAGE_SHIFT_4K, (uintptr_t)page.virt, 1);
+            page.frame = spare_frame;
+            page.used = page.live = 0;
+            spare_frame = 0;
+            current_page = free_page;
+            stats.pool_pages++;
+        }
+
+        pool_page_t& page = pool[current_page];
+        uint32_t handle = ((uint32_t)current_page << HANDLE_OFFSET_BITS) | (page.used / ENTRY_ALIGN);
+        pool_entry_t* entry = (pool_entry_t *)(page.virt + page.used);
+        entry->length = length;
+        memcpy(entry->data, data, length);
+
+        page.used += needed;
+        page.live++;
+        stats.stored_pages++;
+        stats.compressed_bytes += length;
+        return handle;
+    }
+
+    void load(uint32_t handle, void* dest) {
+        lock_pool();
+        pool_entry_t* entry = entry_for(handle);
+        ssize_t length = lz4::decompress_block(entry->data, entry->length, dest, memory::PAGE_SIZE_4K);
+        release_lock(&pool_lock);
+
+        assert(length == memory::PAGE_SIZE_4K);
+    }
+
+    void release(uint32_t handle) {
+        lock_pool();
+        pool_entry_t* entry = entry_for(handle);
+        stats.stored_pages--;
+        stats.compressed_bytes -= entry->length;
+
+        pool_page_t& page = pool[handle >> HANDLE_OFFSET_BITS];
+        if(--page.live) {
+            release_lock(&pool_lock);
+            return;
+        }
+
+        if(current_page == (int)(handle >> HANDLE_OFFSET_BITS)) {
+            // Still filling this one, just start over
+            page.used = 0;
+            release_lock(&pool_lock);
+            return;
+        }
+
+        uint32_t frame = page.frame;
+        page.frame = 0;
+        stats.pool_pages--;
+        release_lock(&pool_lock);
+
+        memory::free_physical_block((uintptr_t)frame << memory::PAGE_SHIFT_4K);
+    }
+
+    stats_t get_stats() {
+        return stats;
+    }
+
+    unsigned reclaimer::evict(physical_vm_object* vmo, uintptr_t base, page_map_t* map, const unsigned* candidates, unsigned count) {
+        // Unmap first so nothing can change while it is being compressed
+        for(unsigned i = 0; i < count; i++) {
+            memory::map_virtual_memory_4k(0, base + ((uintptr_t)candidates[i] << memory::PAGE_SHIFT_4K), 1, map, memory::PAGE_USER);
+        }
+
+        memory::tlb_shootdown();
+
+        unsigned freed = 0;
+        for(unsigned i = 0; i < count; i++) {
+            unsigned index = candidates[i];
+            uintptr_t virt = base + ((uintptr_t)index << memory::PAGE_SHIFT_4K);
+            uint32_t frame = vmo->_physical_blocks[index];
+
+            memory::kernel_map_virtual_memory_4k((uintptr_t)frame << memory::PAGE_SHIFT_4K, (uintptr_t)window, 1);
+            size_t length = lz4::compress_block(window, memory::PAGE_SIZE_4K, compress_buffer, sizeof(compress_buffer), &compress_state);
+
+            int64_t handle = -1;
+            uint32_t spare_frame = frame;
+            if(length) {
+                lock_pool();
+                handle = store(compress_buffer, length, spare_frame);
+                release_lock(&pool_lock);
+            }
+
+            if(handle < 0) {
+                // Doesn't compress (or the pool is full), leave it be
+                memory::map_virtual_memory_4k((uintptr_t)frame << memory::PAGE_SHIFT_4K, virt, 1, map);
+                stats.rejected++;
+                continue;
+            }
+
+            vmo->_physical_blocks[index] = (uint32_t)handle | BLOCK_SWAPPED;
+            if(spare_frame) {
+                // Otherwise the frame became a pool page
+                memory::free_physical_block((uintptr_t)spare_frame << memory::PAGE_SHIFT_4K);
+                freed++;
+            }
+        }
+
+        return freed;
+    }
+
+    bool reclaimer::reclaim_space(address_space* space, uintptr_t& address, unsigned& freed, unsigned& scanned) {
+        if(!acquire_test_lock(&space->_lock)) {
+            // Whoever is allocating might be holding it, try the next one
+            return true;
+        }
+
+        for(mapped_region& region : space->_regions) {
+            if(region.end() <= address) {
+                continue;
+            }
+
+            kstd::ref_counted<vm_object> vmo_ref = region.vm_object();
+            if(!vmo_ref || !vmo_ref->is_anonymous() || vmo_ref->is_shared() || vmo_ref->is_copy_on_write()
+                || vmo_ref->use_count() > 1) {
+                address = region.end();
+                continue;
+            }
+
+            if(!region.lock().try_acquire_write()) {
+                // Busy (maybe faulting in the very page that needs the memory)
+                address = region.end();
+                continue;
+            }
+
+            physical_vm_object* vmo = static_cast<physical_vm_object *>(vmo_ref.get());
+            page_map_t* map = space->get_page_map();
+            unsigned block_count = vmo->_size >> memory::PAGE_SHIFT_4K;
+            unsigned index = (kstd::max(address, region.base()) - region.base()) >> memory::PAGE_SHIFT_4K;
+            unsigned candidates[RECLAIM_BATCH];
+            unsigned candidate_count = 0;
+            for(; index < block_count && freed + candidate_count < RECLAIM_BATCH && scanned < RECLAIM_SCAN_LIMIT; index++) {
+                uint32_t block = vmo->_physical_blocks[index];
+                if(!block || (block & BLOCK_FLAGS)) {
+                    continue;
+                }
+
+                scanned++;
+
+                // Clock style second chance, anything touched since the last pass stays.
+                // Clearing the bit without a flush can miss a few accesses, good enough for this.
+                page_t* entry = memory::get_page_entry(region.base() + ((uintptr_t)index << memory::PAGE_SHIFT_4K), map);
+                if(entry && (*entry & memory::PAGE_ACCESSED)) {
+                    *entry &= ~(uint64_t)memory::PAGE_ACCESSED;
+                    continue;
+                }
+
+                candidates[candidate_count++] = index;
+            }
+
+            if(candidate_count) {
+                freed += evict(vmo, region.base(), map, candidates, candidate_count);
+            }
+
+            region.lock().release_write();
+            address = region.base() + ((uintptr_t)index << memory::PAGE_SHIFT_4K);
+            if(freed >= RECLAIM_BATCH || scanned >= RECLAIM_SCAN_LIMIT) {
+                release_lock(&space->_lock);
+                return false;
+            }
+        }
+
+        release_lock(&space->_lock);
+        return true;
+    }
+
+    bool reclaim() {
+        static pid_t pid = 0;
+        static uintptr_t address = 0;
+
+        if(!acquire_test_lock(&reclaim_lock)) {
+            // Somebody else is already at it, wait for them and then try the allocation again
+            while(reclaim_lock) {
+                memory::tlb_shootdown_poll();
+                asm("pause");
+            }
+
+            return true;
+        }
+
+        if(!window) {
+            log::warning("[ZSWAP] Out of physical memory, compressing anonymous pages");
+            window = (uint8_t *)memory::kernel_allocate_4k_pages(1);
+        }
+
+        unsigned freed = 0;
+        unsigned scanned = 0;
+        unsigned wraps = 0;
+
+        // Twice round everything at most, the first time only clears accessed bits
+        while(freed < RECLAIM_BATCH && scanned < RECLAIM_SCAN_LIMIT && wraps < 2) {
+            process_t* proc = scheduler::next_process(pid, false);
+            if(!proc) {
+                pid = 0;
+                address = 0;
+                wraps++;
+                continue;
+            }
+
+            if(proc->pid != pid) {
+                pid = proc->pid;
+                address = 0;
+            }
+
+            bool done = reclaimer::reclaim_space(proc->address_space, address, freed, scanned);
+            scheduler::release_process(proc);
+            if(done) {
+                pid++;
+                address = 0;
+            }
+        }
+
+        release_lock(&reclaim_lock);
+        return freed;
+    }
+}
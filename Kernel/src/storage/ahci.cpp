@@ -15,13 +15,13 @@ namespace ahci {
     constexpr uint32_t SATA_SIG_SEMB    = 0xC33C0101;
     constexpr uint32_t SATA_SIG_PM      = 0x96690101;
 
-    list<ahci_controller> controllers;
+    list<ahci_controller *> controllers;   // Pointers, the interrupt handler holds on to them
 
     int initialize() {
         int i = 0;
         const pci_device_t* device_info = (pci_device_t *)pci::get_generic_device(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, i);
         while(device_info) {
-            controllers.add(ahci_controller(device_info));
+            controllers.add(new ahci_controller(device_info));
             device_info = device_info = (pci_device_t *)pci::get_generic_device(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, ++i);
         }
 
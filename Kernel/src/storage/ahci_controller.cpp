@@ -4,6 +4,10 @@
 #include <timer.h>
 #include <kstring.h>
 #include <physical_allocator.h>
+#include <apic.h>
+#include <idt.h>
+#include <cpu.h>
+#include <logging.h>
 
 namespace ahci {
     constexpr uint32_t AHCI_INTERNAL_VER_0_95   = 0x000905;
@@ -95,6 +99,7 @@ namespace ahci {
         _abar = (ahci_hba_mem_t *)memory::get_io_mapping((uintptr_t)device->bar[5]);
 
         take_controller_ownership(_abar);
+        bool interrupts = setup_interrupts(device);
 
         uint32_t pi = _abar->port_implemented;
         int idx = 0;
@@ -106,7 +111,12 @@ namespace ahci {
             uint8_t slot_count = command_slot_count();
             if(register_achi_disk(&_abar->ports[i], idx, slot_count)) {
                 idx++;
-                _ports.add(new ahci_port(idx, &_abar->ports[i], _abar, slot_count));
+                ahci_port* port = new ahci_port(idx, &_abar->ports[i], _abar, slot_count);
+                _ports.add(port);
+                if(interrupts) {
+                    _port_map[i] = port;
+                    port->enable_interrupts();
+                }
             }
         }
 
@@ -114,6 +124,49 @@ namespace ahci {
         memset(_command_pages, 0, sizeof(page_entry) * 32);
     }
     
+    bool ahci_controller::setup_interrupts(const pci_device_t* device) {
+        uint8_t vector = idt::allocate_interrupt_vector();
+        if(!vector) {
+            log::warning("[ahci] Out of interrupt vectors, polling instead");
+            return false;
+        }
+
+        idt::register_interrupt_handler(vector, interrupt_handler, this);
+        if(pci::enable_msi(device, vector, get_cpu_local()->id)) {
+            log::info("[ahci] Using MSI (vector 0x%x)", vector);
+        } else if(device->interrupt_line != 0xFF) {
+            // No _PRT routing yet, so this trusts the firmware's interrupt line to be the GSI
+            apic::io::map_pci_irq(device->interrupt_line, vector);
+            log::info("[ahci] Using IRQ %u (vector 0x%x)", device->interrupt_line, vector);
+        } else {
+            log::warning("[ahci] No MSI and no interrupt line, polling instead");
+            return false;
+        }
+
+        // Ports get switched on one by one as they are registered
+        _abar->global_host_control |= ahci::GHC_IE_FLAG;
+        return true;
+    }
+
+    void ahci_controller::interrupt_handler(void* data, register_context* regs) {
+        ahci_controller* controller = (ahci_controller *)data;
+        uint32_t status = controller->_abar->interrupt_status;
+        for(int i = 0; i < 32; i++) {
+            if(!(status & (1U << i))) {
+                continue;
+            }
+
+            if(controller->_port_map[i]) {
+                controller->_port_map[i]->handle_interrupt();
+            } else {
+                controller->_abar->ports[i].interrupt_status = 0xffffffff;
+            }
+        }
+
+        // The port status has to be cleared first, otherwise this just gets set again
+        controller->_abar->interrupt_status = status;
+    }
+
     ahci_controller::~ahci_controller() {
         for(int i = 0; i < 32; i++) {
             if(_command_pages[i].phys) {
@@ -160,7 +213,8 @@ namespace ahci {
         // Now whatever we write to the memory we just created, can be directly
         // processed by the drive via the controller.
 
-        // Not going to use interrupts quite yet, that's for another day...
+        // Interrupts stay off until the port is registered with the controller's
+        // handler, identify just polls
         port->interrupt_status = 0xffffffff; // Some are read only, controller doesn't seem to mind us trying though
         port->interrupt_enable = 0;
 
@@ -3,24 +3,30 @@
 #include <stddef.h>
 #include <abi-bits/errno.h>
 #include <kstring.h>
+#include <kmath.h>
 #include <timer.h>
 #include <logging.h>
 #include <paging.h>
 #include <physical_allocator.h>
 #include <liballoc/liballoc.h>
+#include <scheduler.h>
+#include <idt.h>
+#include <lock.h>
 
 namespace ahci {
-    extern int find_cmdslot(ahci_hba_port_t* port, int slot_count);
-
-    achi_hba_cmd_header_t* ahci_port::prepare_cmd_header(int slot, uint64_t sector_count) {
+    hba_cmd_tbl_t* ahci_port::prepare_command(int slot, uint16_t prdt_entries, bool write) {
         achi_hba_cmd_header_t* cmd_header = _command_base + slot;
         
         memset(cmd_header, 0, sizeof(achi_hba_cmd_header_t));
         cmd_header->command_fis_length = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
-        cmd_header->prdt_entries = (uint16_t)((sector_count-1)>>4) + 1;
-        cmd_header->command_table_base = _registers->cmd_list_base + sizeof(achi_hba_cmd_header_t) * 32;
-
-        return cmd_header;
+        cmd_header->write = write;
+        cmd_header->prdt_entries = prdt_entries;
+        cmd_header->command_table_base = _command_tables[slot].phys;
+
+        // The PRDT is filled in separately, every entry gets written in full
+        hba_cmd_tbl_t* cmd_tbl = (hba_cmd_tbl_t *)_command_tables[slot].virt;
+        memset(cmd_tbl, 0, sizeof(hba_cmd_tbl_t));
+        return cmd_tbl;
     }
 
     static void prepare_cmd_fis(hba_cmd_tbl_t* cmd_tbl, uint8_t command, uint64_t start, uint64_t count) {
@@ -38,180 +44,329 @@ namespace ahci {
         cmd_fis->lba5 = (uint8_t)(start >> 40);
     }
 
-    static void prepare_prdt_entries(hba_cmd_tbl_t* cmd_tbl, uint64_t buf, uint16_t entry_count, uint64_t sector_count) {
-        int last_entry = entry_count - 1;
-        for(int i = 0; i < last_entry; i++) {
-            cmd_tbl->prdt_entries[i].db_addr = buf;
-            cmd_tbl->prdt_entries[i].byte_count = 0x1fff;
-            buf += 0x2000;
-            sector_count -= 16;
+    static void prepare_ncq_fis(hba_cmd_tbl_t* cmd_tbl, uint8_t command, uint64_t start, uint64_t count, uint8_t tag) {
+        // Same as above except the sector count moves to the feature registers and
+        // the count register holds the tag instead
+        prepare_cmd_fis(cmd_tbl, command, start, 0);
+        fis_reg_h2d_t* cmd_fis = (fis_reg_h2d_t *)(cmd_tbl->command_fis);
+        cmd_fis->feature_low = (uint8_t)count;
+        cmd_fis->feature_high = (uint8_t)(count >> 8);
+        cmd_fis->count = (uint16_t)tag << 3;
+    }
+
+    // Adds PRDT entries for the physical pages behind buffer, merging the ones that happen to
+    // be contiguous (with the entry before too, so merged segments can share one).  Returns
+    // false if the buffer isn't mapped kernel memory or there aren't enough entries.
+    static bool add_prdt_entries(hba_prdt_entry_t* prdt, uint16_t& entry_count, uintptr_t buffer, uint64_t bytes) {
+        uint64_t done = 0;
+        while(done < bytes) {
+            uintptr_t virt = buffer + done;
+            uint64_t phys = memory::virtual_to_physical_addr(virt);
+            if(!phys) {
+                return false;
+            }
+
+            uint32_t len = (uint32_t)kstd::min((uint64_t)memory::PAGE_SIZE_4K - (virt & (memory::PAGE_SIZE_4K - 1)), bytes - done);
+            hba_prdt_entry_t* last = entry_count ? &prdt[entry_count - 1] : nullptr;
+            if(last && last->db_addr + last->byte_count + 1 == phys && last->byte_count + 1 + len <= MAX_PRD_BYTES) {
+                last->byte_count += len;
+            } else if(entry_count < MAX_PRDT_ENTRIES) {
+                prdt[entry_count] = {};
+                prdt[entry_count].db_addr = phys;
+                prdt[entry_count].byte_count = len - 1;
+                entry_count++;
+            } else {
+                return false;
+            }
+
+            done += len;
         }
 
-        cmd_tbl->prdt_entries[last_entry].db_addr = buf;
-        cmd_tbl->prdt_entries[last_entry].byte_count = (sector_count<<9)-1;
+        return true;
     }
 
-    static int issue_ahci_command(ahci_hba_port_t* port, uint8_t slot) {
-        int spin = 0;
-        while((port->task_file_data & (ahci::PXTFD_STS_BUSY_FLAG | ahci::PXTFD_STS_DRQ_FLAG)) && spin < 1000000) {
-            spin++;
-        }
-        
-        if(spin == 1000000) {
-            return -1;
-        }
+    constexpr uint32_t ERROR_INTERRUPTS = ahci::PXIS_TFES_FLAG | ahci::PXIS_HBFS_FLAG | ahci::PXIS_HBDS_FLAG
+        | ahci::PXIS_IFS_FLAG;
 
-        port->command_issue = (1 << slot);
-        while(port->command_issue & (1 << slot)) {
-            timer::wait(1);
-        }
+    // The ones that mean a command finished, one way or another
+    constexpr uint32_t PORT_INTERRUPTS = ahci::PXIS_DHRS_FLAG | ahci::PXIS_PSS_FLAG | ahci::PXIS_DSS_FLAG
+        | ahci::PXIS_SBDS_FLAG | ERROR_INTERRUPTS;
 
-        if(spin == 1000000 || port->interrupt_status & ahci::PXIS_TFES_FLAG) {
-            hba_received_fis_t* received = (hba_received_fis_t*)port->fis_base;
-            return -1;
-        }
+    void ahci_port::enable_interrupts() {
+        idt::with_interrupts intr(false);
+        kstd::lock l(_irq_lock);
 
-        return 0;
+        _registers->interrupt_status = 0xffffffff;
+        _registers->interrupt_enable = PORT_INTERRUPTS;
+        _irq_enabled = true;
     }
 
-    ahci_port::ahci_port(int num, ahci_hba_port_t* port, ahci_hba_mem_t* mem, uint8_t slot_count)
-        :_registers(port)
-        ,_slot_count(slot_count)
-        ,_command_base((achi_hba_cmd_header_t *)memory::get_io_mapping(port->cmd_list_base))
-        ,_fis((hba_received_fis_t *)memory::get_io_mapping(port->fis_base))
-    {
-        _device_name = "SATA Hard Disk";
+    void ahci_port::handle_interrupt() {
+        storage::block_request* finished[32];
+        int results[32];
+        unsigned finished_count = 0;
+        {
+            kstd::lock l(_irq_lock);
+
+            uint32_t status = _registers->interrupt_status;
+            _registers->interrupt_status = status;
+
+            // Queued commands leave PxCI once the device has them, and PxSACT once they're done
+            uint32_t done = _pending & ~(_registers->command_issue | _registers->sata_active);
+            if(status & ERROR_INTERRUPTS) {
+                // The port stops on an error and there's no finding out which queued command it
+                // was without READ LOG EXT, so fail everything outstanding and start over
+                _failed |= _pending;
+                done = _pending;
+                restart();
+            }
 
-        for(int i = 0; i < 8; i++) {
-            _buffers[i] = {
-                .phys = memory::allocate_physical_block(),
-                .virt = memory::kernel_allocate_4k_pages(1)
-            };
-            
-            memory::kernel_map_virtual_memory_4k(_buffers[i].phys, (uint64_t)_buffers[i].virt, 1);
+            _pending &= ~done;
+            _slots_in_use &= ~done;
+            _flushing = _flushing && (_pending & 1);
+            for(int slot = 0; done; slot++, done >>= 1) {
+                if((done & 1) && _requests[slot]) {
+                    finished[finished_count] = _requests[slot];
+                    results[finished_count++] = (_failed & (1U << slot)) ? -EIO : 0;
+                    _requests[slot] = nullptr;
+                    _failed &= ~(1U << slot);
+                }
+            }
         }
 
-        switch(gpt::parse(this)) {
-            case 0:
-                log::error("[ahci] disk has corrupted or non-existent GPT.  MBR disks are not supported.");
-                break;
-            case -1:
-                log::error("[ahci] Error while parsing GPT");
-                break;
-            default:
-                break;
+        // Outside the lock, completing starts the next request straight away
+        for(unsigned i = 0; i < finished_count; i++) {
+            _queue.complete(finished[i], results[i]);
         }
+    }
 
-        log::info("[ahci] Found %d partitions!", _partitions.size());
-        initialize_partitions();
+    void ahci_port::poll_requests() {
+        idt::with_interrupts intr(false);
+        handle_interrupt();
     }
 
-    ahci_port::~ahci_port() {
-        for(int i = 0; i < 8; i++) {
-            memory::kernel_free_4k_pages(_buffers[i].virt, 1);
-            memory::free_physical_block(_buffers[i].phys);
+    void ahci_port::restart() {
+        // Clearing ST throws away whatever is left in PxCI and PxSACT
+        _registers->command &= ~ahci::PXCMD_ST_FLAG;
+        int spin = 0;
+        while((_registers->command & ahci::PXCMD_CR_FLAG) && spin < 1000000) {
+            spin++;
         }
+
+        _registers->sata_error = 0xffffffff;
+        _registers->interrupt_status = 0xffffffff;
+        _registers->command |= ahci::PXCMD_ST_FLAG;
     }
 
-    int ahci_port::acquire_buffer() {
-        if(!_buffer_semaphore.wait()) {
-            return -EINTR;
+    bool ahci_port::wait_idle() {
+        int spin = 0;
+        while((_registers->task_file_data & (ahci::PXTFD_STS_BUSY_FLAG | ahci::PXTFD_STS_DRQ_FLAG)) && spin < 1000000) {
+            spin++;
         }
 
-        for(int i = 0; i < 8; i++) {
-            if(acquire_test_lock(&_buf_locks[i])) {
-                return i;
+        return spin < 1000000;
+    }
+
+    void ahci_port::release_slot(int slot) {
+        idt::with_interrupts intr(false);
+        kstd::lock l(_irq_lock);
+        _slots_in_use &= ~(1U << slot);
+    }
+
+    int ahci_port::start_request(storage::block_request* request) {
+        // NCQ tags are the slot numbers, so they have to stay under the queue depth too
+        int slot = -1;
+        {
+            idt::with_interrupts intr(false);
+            kstd::lock l(_irq_lock);
+            if(request->flush) {
+                // Not a queued command, so it waits for everything else to finish
+                if(!_slots_in_use) {
+                    _slots_in_use = 1;
+                    _flushing = true;
+                    slot = 0;
+                }
+            } else if(!_flushing) {
+                for(int i = 0; i < _queue_depth; i++) {
+                    if(!(_slots_in_use & (1U << i))) {
+                        _slots_in_use |= 1U << i;
+                        slot = i;
+                        break;
+                    }
+                }
             }
         }
 
-        _buffer_semaphore.signal();
-        return -1;
-    }
+        if(slot < 0) {
+            return -EAGAIN;
+        }
 
-    void ahci_port::release_buffer(int index) {
-        assert(index < 8);
+        if(request->flush) {
+            return start_flush(request);
+        }
 
-        release_lock(&_buf_locks[index]);
-        _buffer_semaphore.signal();
-    }
+        // The queue keeps merged requests within what one command table holds
+        hba_cmd_tbl_t* cmd_tbl = (hba_cmd_tbl_t *)_command_tables[slot].virt;
+        uint16_t entries = 0;
+        for(storage::block_request* segment = request; segment; segment = segment->next_segment) {
+            if(!add_prdt_entries(cmd_tbl->prdt_entries, entries, (uintptr_t)segment->buffer, (uint64_t)segment->count * _block_size)) {
+                release_slot(slot);
+                return -EFAULT;
+            }
+        }
+
+        prepare_command(slot, entries, request->write);
+        if(_ncq) {
+            prepare_ncq_fis(cmd_tbl, request->write ? ahci::IDE_COMMAND_WRITE_FPDMA : ahci::IDE_COMMAND_READ_FPDMA,
+                request->lba, request->total_count, slot);
+        } else {
+            // The device stays busy between queued commands, only wait for it otherwise
+            if(!wait_idle()) {
+                release_slot(slot);
+                return -EIO;
+            }
 
-    int ahci_port::read_disk_block(uint64_t lba, uint32_t count, void* buffer) {
-        _registers->interrupt_status = -1;
-        int slot = find_cmdslot(_registers, _slot_count);
-        if(slot == -1) {
-            return -EBUSY;
+            prepare_cmd_fis(cmd_tbl, request->write ? ahci::IDE_COMMAND_DMA_WRITE_EX : ahci::IDE_COMMAND_DMA_READ_EX,
+                request->lba, request->total_count);
         }
 
-        int buffer_idx = acquire_buffer();
-        if(buffer_idx == -EINTR) {
-            return EINTR;
+        uint32_t bit = 1U << slot;
+        idt::with_interrupts intr(false);
+        kstd::lock l(_irq_lock);
+        _requests[slot] = request;
+        _failed &= ~bit;
+        _pending |= bit;
+        if(_ncq) {
+            _registers->sata_active = bit;
         }
 
-        if(buffer_idx < 0 || buffer_idx > 7) {
-            return 4;
+        _registers->command_issue = bit;
+        return 0;
+    }
+
+    int ahci_port::start_flush(storage::block_request* request) {
+        if(!wait_idle()) {
+            idt::with_interrupts intr(false);
+            kstd::lock l(_irq_lock);
+            _slots_in_use = 0;
+            _flushing = false;
+            return -EIO;
         }
 
-        uintptr_t phys = _buffers[buffer_idx].phys;
-        uint32_t max_sectors = memory::PAGE_SIZE_4K / _block_size;
+        hba_cmd_tbl_t* cmd_tbl = prepare_command(0, 0, false);
+        prepare_cmd_fis(cmd_tbl, ahci::IDE_COMMAND_FLUSH_EX, 0, 0);
+
+        idt::with_interrupts intr(false);
+        kstd::lock l(_irq_lock);
+        _requests[0] = request;
+        _failed &= ~1U;
+        _pending |= 1;
+        _registers->command_issue = 1;
+        return 0;
+    }
 
-        auto do_read = [&](uint32_t to_read) {
-            achi_hba_cmd_header_t* cmd_header = prepare_cmd_header(slot, to_read);
-            hba_cmd_tbl_t* cmd_tbl = (hba_cmd_tbl_t *)memory::get_io_mapping(cmd_header->command_table_base);
-            memset(cmd_tbl, 0, sizeof(hba_cmd_tbl_t) + sizeof(hba_prdt_entry_t) * cmd_header->prdt_entries);
+    void ahci_port::identify() {
+        // Only here to find out about NCQ, so if anything fails just go without
+        constexpr unsigned IDENTIFY_QUEUE_DEPTH = 75;
+        constexpr unsigned IDENTIFY_SATA_CAPABILITIES = 76;
+        constexpr uint16_t SATA_CAP_NCQ = 1 << 8;
 
-            prepare_prdt_entries(cmd_tbl, phys, cmd_header->prdt_entries, to_read);
+        if(!(_hba->capabilities & ahci::CAP_SNCQ_FLAG) || !wait_idle()) {
+            return;
+        }
 
-            prepare_cmd_fis(cmd_tbl, ahci::IDE_COMMAND_DMA_READ_EX, lba, to_read);
-            return issue_ahci_command(_registers, slot);
+        page_entry buffer = {
+            .phys = memory::allocate_physical_block(),
+            .virt = memory::kernel_allocate_4k_pages(1)
         };
 
-        uint32_t remaining = count;
-        uint8_t* b = (uint8_t *)buffer;
-        while(remaining >= max_sectors) {
-            // Don't read more than the buffer can take
-            if(int e = do_read(max_sectors) != 0) {
-                release_buffer(buffer_idx);
-                return e;
+        memory::kernel_map_virtual_memory_4k(buffer.phys, (uint64_t)buffer.virt, 1);
+
+        // Nothing else is using the port yet, so slot 0 is free and this can just poll
+        hba_cmd_tbl_t* cmd_tbl = prepare_command(0, 1, false);
+        cmd_tbl->prdt_entries[0] = {};
+        cmd_tbl->prdt_entries[0].db_addr = buffer.phys;
+        cmd_tbl->prdt_entries[0].byte_count = 511;
+        prepare_cmd_fis(cmd_tbl, ahci::IDE_COMMAND_IDENTIFY, 0, 0);
+        ((fis_reg_h2d_t *)cmd_tbl->command_fis)->device = 0;
+
+        bool failed;
+        {
+            idt::with_interrupts intr(false);
+            {
+                kstd::lock l(_irq_lock);
+                _slots_in_use |= 1;
+                _failed &= ~1U;
+                _pending |= 1;
+                _registers->command_issue = 1;
             }
 
-            memcpy(b, _buffers[buffer_idx].virt, max_sectors * _block_size);
-            b += max_sectors * _block_size;
-            lba += max_sectors;
-            remaining -= max_sectors;
+            while(_pending & 1) {
+                handle_interrupt();
+            }
+
+            kstd::lock l(_irq_lock);
+            failed = _failed & 1;
+            _failed &= ~1U;
         }
 
-        if(remaining) {
-            if(int e = do_read(remaining) != 0) {
-                release_buffer(buffer_idx);
-                return e;
-            }
+        const uint16_t* id = (const uint16_t *)buffer.virt;
+        uint16_t sata_caps = id[IDENTIFY_SATA_CAPABILITIES];
+        uint8_t depth = (id[IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1;
+        memory::kernel_free_4k_pages(buffer.virt, 1);
+        memory::free_physical_block(buffer.phys);
 
-            memcpy(b, _buffers[buffer_idx].virt, remaining * _block_size);
+        if(failed || sata_caps == 0xFFFF || !(sata_caps & SATA_CAP_NCQ) || depth < 2) {
+            return;
         }
 
-        release_buffer(buffer_idx);
-        return count;
+        _ncq = true;
+        _queue_depth = depth < _slot_count ? depth : _slot_count;
+        log::info("[ahci] NCQ enabled, queue depth %u", _queue_depth);
     }
 
-    int ahci_port::write_disk_block(uint64_t lba, uint32_t count, void* buffer) {
-        _registers->interrupt_status = -1;
-        int slot = find_cmdslot(_registers, _slot_count);
-        if(slot == -1) {
-            return -EBUSY;
+    ahci_port::ahci_port(int num, ahci_hba_port_t* port, ahci_hba_mem_t* mem, uint8_t slot_count)
+        :_registers(port)
+        ,_hba(mem)
+        ,_command_base((achi_hba_cmd_header_t *)memory::get_io_mapping(port->cmd_list_base))
+        ,_fis((hba_received_fis_t *)memory::get_io_mapping(port->fis_base))
+        ,_slot_count(slot_count)
+    {
+        _device_name = "SATA Hard Disk";
+
+        for(int i = 0; i < _slot_count; i += COMMAND_TABLES_PER_PAGE) {
+            uint64_t phys = memory::allocate_physical_block();
+            uint8_t* virt = (uint8_t *)memory::kernel_allocate_4k_pages(1);
+            memory::kernel_map_virtual_memory_4k(phys, (uint64_t)virt, 1);
+            for(int j = 0; j < COMMAND_TABLES_PER_PAGE && i + j < _slot_count; j++) {
+                _command_tables[i + j] = {
+                    .phys = phys + j * COMMAND_TABLE_SIZE,
+                    .virt = virt + j * COMMAND_TABLE_SIZE
+                };
+            }
         }
 
-        achi_hba_cmd_header_t* cmd_header = prepare_cmd_header(slot, count);
-        hba_cmd_tbl_t* cmd_tbl = (hba_cmd_tbl_t *)cmd_header->command_table_base;
-        memset(cmd_tbl, 0, sizeof(hba_cmd_tbl_t) + sizeof(hba_prdt_entry_t) * cmd_header->prdt_entries);
-        
-        uint64_t phys = memory::virtual_to_physical_addr((uint64_t)buffer) + sizeof(boundary_tag);
-        prepare_prdt_entries(cmd_tbl, phys, cmd_header->prdt_entries, count);
+        identify();
 
-        prepare_cmd_fis(cmd_tbl, ahci::IDE_COMMAND_DMA_WRITE_EX, lba, count);
-        if(issue_ahci_command(_registers, slot) == 0) {
-            return count;
+        switch(gpt::parse(this)) {
+            case 0:
+                log::error("[ahci] disk has corrupted or non-existent GPT.  MBR disks are not supported.");
+                break;
+            case -1:
+                log::error("[ahci] Error while parsing GPT");
+                break;
+            default:
+                break;
         }
 
-        return -1;
+        log::info("[ahci] Found %d partitions!", _partitions.size());
+        initialize_partitions();
+    }
+
+    ahci_port::~ahci_port() {
+        for(int i = 0; i < _slot_count; i += COMMAND_TABLES_PER_PAGE) {
+            memory::kernel_free_4k_pages(_command_tables[i].virt, 1);
+            memory::free_physical_block(_command_tables[i].phys);
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,355 @@
+#include <storage/block_queue.h>
+#include <device.h>
+#include <abi-bits/errno.h>
+#include <liballoc/liballoc.h>
+#include <scheduler.h>
+#include <paging.h>
+#include <kstring.h>
+#include <kassert.h>
+#include <kmath.h>
+#include <timer.h>
+#include <idt.h>
+#include <lock.h>
+
+namespace storage {
+    // How long a synchronous transfer sleeps before checking the device by hand, in case the
+    // interrupt got lost
+    constexpr long SYNC_WAIT_US = 100000;
+
+    struct sync_wait {
+        request_blocker blocker;
+        unsigned outstanding;
+        volatile int result;
+    };
+
+    static void sync_done(block_request* request, int result) {
+        sync_wait* wait = (sync_wait *)request->data;
+        if(result < 0) {
+            wait->result = result;
+        }
+
+        if(__atomic_sub_fetch(&wait->outstanding, 1, __ATOMIC_ACQ_REL) == 0) {
+            wait->blocker.complete();
+        }
+    }
+
+    static uint64_t now_ms() {
+        timeval now;
+        timer::get_system_uptime(&now);
+        return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    }
+
+    static uint32_t pages_spanned(const block_request* request, unsigned block_size) {
+        uintptr_t start = (uintptr_t)request->buffer;
+        uintptr_t end = start + (size_t)request->count * block_size;
+        return ((end + memory::PAGE_SIZE_4K - 1) >> memory::PAGE_SHIFT_4K) - (start >> memory::PAGE_SHIFT_4K);
+    }
+
+    // Kernel memory that's mapped and word aligned, which is what the drivers can DMA into
+    static bool dma_capable(const uint8_t* buffer, size_t bytes) {
+        uintptr_t addr = (uintptr_t)buffer;
+        if(addr & 1) {
+            return false;
+        }
+
+        for(uintptr_t page = addr & ~(memory::PAGE_SIZE_4K - 1); page < addr + bytes; page += memory::PAGE_SIZE_4K) {
+            if(!memory::virtual_to_physical_addr(page)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    block_queue::block_queue(devices::disk_device* device)
+        :_device(device)
+    {
+
+    }
+
+    void block_queue::submit(block_request* request) {
+        assert(request->count || request->flush);
+
+        request->next_segment = nullptr;
+        request->last_segment = request;
+        request->total_count = request->count;
+        request->total_pages = request->flush ? 0 : pages_spanned(request, _device->block_size());
+        request->deadline = now_ms() + (request->write ? WRITE_DEADLINE_MS : READ_DEADLINE_MS);
+
+        {
+            idt::with_interrupts intr(false);
+            kstd::lock l(_lock);
+            _stats.submitted++;
+            if(!request->flush && try_merge(request)) {
+                _stats.merged++;
+            } else {
+                insert_sorted(request);
+                _fifo.push_back(request);
+            }
+        }
+
+        run();
+    }
+
+    bool block_queue::try_merge(block_request* request) {
+        uint32_t max_sectors = _device->max_request_sectors();
+        unsigned max_segments = _device->max_request_segments();
+        for(block_request* head : _sorted) {
+            if(head == _dispatching || head->flush || head->write != request->write
+                || head->total_count + request->count > max_sectors
+                || head->total_pages + request->total_pages > max_segments) {
+                continue;
+            }
+
+            if(head->lba + head->total_count == request->lba) {
+                // Goes on the end, the head keeps its place and its (earlier) deadline
+                head->last_segment->next_segment = request;
+                head->last_segment = request;
+                head->total_count += request->count;
+                head->total_pages += request->total_pages;
+                return true;
+            }
+
+            if(request->lba + request->count == head->lba) {
+                // Goes on the front, so it takes over from the head in both lists
+                request->next_segment = head;
+                request->last_segment = head->last_segment;
+                request->total_count += head->total_count;
+                request->total_pages += head->total_pages;
+                request->deadline = kstd::min(request->deadline, head->deadline);
+                _sorted.insert(_sorted.iterator_to(head), request);
+                _sorted.erase(_sorted.iterator_to(head));
+                _fifo.insert(_fifo.iterator_to(head), request);
+                _fifo.erase(_fifo.iterator_to(head));
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void block_queue::insert_sorted(block_request* request) {
+        for(auto it = _sorted.begin(); it != _sorted.end(); ++it) {
+            if((*it)->lba > request->lba) {
+                _sorted.insert(it, request);
+                return;
+            }
+        }
+
+        _sorted.push_back(request);
+    }
+
+    void block_queue::remove(block_request* request) {
+        _sorted.erase(_sorted.iterator_to(request));
+        _fifo.erase(_fifo.iterator_to(request));
+    }
+
+    block_request* block_queue::pick() {
+        if(_fifo.empty()) {
+            return nullptr;
+        }
+
+        // Something has waited too long, it goes next wherever it is
+        block_request* oldest = _fifo.front();
+        if(oldest->deadline <= now_ms()) {
+            return oldest;
+        }
+
+        // Otherwise the next one up from where the last one finished, wrapping back to the start
+        for(block_request* request : _sorted) {
+            if(request->lba >= _position) {
+                return request;
+            }
+        }
+
+        return _sorted.front();
+    }
+
+    void block_queue::run() {
+        // Interrupts stay off throughout so a completion on this CPU can't come back in here
+        idt::with_interrupts intr(false);
+        acquire_lock(&_lock);
+        if(_running) {
+            // Whoever is running it goes round again
+            _rerun = true;
+            release_lock(&_lock);
+            return;
+        }
+
+        _running = true;
+        while(block_request* request = _plugged ? nullptr : pick()) {
+            _dispatching = request;
+            _rerun = false;
+            release_lock(&_lock);
+
+            int result = _device->start_request(request);
+
+            acquire_lock(&_lock);
+            _dispatching = nullptr;
+            if(result == -EAGAIN) {
+                // The device is full, the next completion starts it again (unless it already has)
+                if(!_rerun) {
+                    break;
+                }
+
+                continue;
+            }
+
+            remove(request);
+            _position = request->lba + request->total_count;
+            _stats.dispatched++;
+            if(result < 0) {
+                release_lock(&_lock);
+                complete(request, result);
+                acquire_lock(&_lock);
+            }
+        }
+
+        _running = false;
+        release_lock(&_lock);
+    }
+
+    void block_queue::complete(block_request* request, int result) {
+        block_request* segment = request;
+        while(segment) {
+            // done is allowed to free it
+            block_request* next = segment->next_segment;
+            segment->done(segment, result);
+            segment = next;
+        }
+
+        run();
+    }
+
+    void block_queue::plug() {
+        idt::with_interrupts intr(false);
+        kstd::lock l(_lock);
+        _plugged++;
+    }
+
+    void block_queue::unplug() {
+        {
+            idt::with_interrupts intr(false);
+            kstd::lock l(_lock);
+            assert(_plugged);
+            if(--_plugged) {
+                return;
+            }
+        }
+
+        run();
+    }
+
+    int block_queue::execute(block_request* requests, unsigned count) {
+        sync_wait wait;
+        wait.outstanding = count;
+        wait.result = 0;
+        {
+            plug_guard plug(*this);
+            for(unsigned i = 0; i < count; i++) {
+                requests[i].done = sync_done;
+                requests[i].data = &wait;
+                submit(&requests[i]);
+            }
+        }
+
+        // Sleeping needs a thread to put to sleep and an interrupt to wake it, otherwise
+        // (early boot, or with interrupts off) just poll
+        threading::thread* current = scheduler::get_current_thread();
+        bool sleep = current && check_interrupts() && _device->completes_by_interrupt();
+        while(!wait.blocker.completed()) {
+            if(sleep) {
+                long timeout = SYNC_WAIT_US;
+                (void)current->block(&wait.blocker, timeout);
+                if(wait.blocker.completed()) {
+                    break;
+                }
+            }
+
+            _device->poll_requests();
+        }
+
+        return wait.result;
+    }
+
+    int block_queue::flush() {
+        block_request request {};
+        request.flush = true;
+        return execute(&request, 1);
+    }
+
+    int block_queue::transfer_direct(uint64_t lba, uint32_t count, uint8_t* buffer, bool write) {
+        unsigned block_size = _device->block_size();
+        uint32_t max_sectors = _device->max_request_sectors();
+        size_t max_bytes = (size_t)_device->max_request_segments() << memory::PAGE_SHIFT_4K;
+        block_request requests[SYNC_BATCH];
+        uint32_t done = 0;
+        while(done < count) {
+            // Split up so each one fits in a command even if every page is its own segment
+            unsigned batch = 0;
+            while(done < count && batch < SYNC_BATCH) {
+                uint8_t* b = buffer + (size_t)done * block_size;
+                size_t fits = max_bytes - ((uintptr_t)b & (memory::PAGE_SIZE_4K - 1));
+                uint32_t sectors = kstd::min(kstd::min(count - done, max_sectors), (uint32_t)(fits / block_size));
+                assert(sectors);
+
+                requests[batch] = {};
+                requests[batch].lba = lba + done;
+                requests[batch].count = sectors;
+                requests[batch].buffer = b;
+                requests[batch].write = write;
+                batch++;
+                done += sectors;
+            }
+
+            int result = execute(requests, batch);
+            if(result < 0) {
+                return result;
+            }
+        }
+
+        return count;
+    }
+
+    int block_queue::transfer(uint64_t lba, uint32_t count, void* buffer, bool write) {
+        unsigned block_size = _device->block_size();
+        uint8_t* b = (uint8_t *)buffer;
+        if(dma_capable(b, (size_t)count * block_size)) {
+            return transfer_direct(lba, count, b, write);
+        }
+
+        // User memory or an odd address, go through kernel memory a piece at a time
+        uint32_t bounce_count = kstd::min(count, (uint32_t)(BOUNCE_SIZE / block_size));
+        uint8_t* bounce = (uint8_t *)malloc((size_t)bounce_count * block_size);
+        if(!bounce) {
+            return -ENOMEM;
+        }
+
+        int result = 0;
+        for(uint32_t done = 0; done < count; done += bounce_count) {
+            uint32_t sectors = kstd::min(count - done, bounce_count);
+            uint8_t* piece = b + (size_t)done * block_size;
+            if(write) {
+                memcpy(bounce, piece, (size_t)sectors * block_size);
+            }
+
+            result = transfer_direct(lba + done, sectors, bounce, write);
+            if(result < 0) {
+                break;
+            }
+
+            if(!write) {
+                memcpy(piece, bounce, (size_t)sectors * block_size);
+            }
+        }
+
+        free(bounce);
+        return result < 0 ? result : count;
+    }
+
+    block_queue::stats_t block_queue::get_stats() {
+        idt::with_interrupts intr(false);
+        kstd::lock l(_lock);
+        return _stats;
+    }
+}
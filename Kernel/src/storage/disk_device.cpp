@@ -74,15 +74,29 @@ namespace devices {
         return 0;
     }
 
+    int disk_device::read_disk_block(uint64_t lba, uint32_t count, void* buffer) {
+        return _queue.transfer(lba, count, buffer, false);
+    }
+
+    int disk_device::write_disk_block(uint64_t lba, uint32_t count, void* buffer) {
+        return _queue.transfer(lba, count, buffer, true);
+    }
+
     ssize_t disk_device::read(size_t offset, size_t size, uint8_t* buf) {
-        if(offset & _block_size) {
+        if((offset | size) % _block_size) {
             return -EINVAL;
         }
 
-        return read_disk_block(offset / _block_size, size, buf) != 0 ? -EIO : size;
+        int result = read_disk_block(offset / _block_size, size / _block_size, buf);
+        return result < 0 ? result : size;
     }
 
     ssize_t disk_device::write(size_t offset, size_t size, uint8_t* buf) {
-        return -ENOSYS;
+        if((offset | size) % _block_size) {
+            return -EINVAL;
+        }
+
+        int result = write_disk_block(offset / _block_size, size / _block_size, buf);
+        return result < 0 ? result : size;
     }
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <debug.h>
 #include <logging.h>
 #include <kmath.h>
+#include <abi-bits/errno.h>
+#include <mm/page_cache.h>
 
 namespace devices {
     partition_device::partition_device(uint64_t start_lba, uint64_t end_lba, disk_device* device, guid_t type)
@@ -23,6 +25,7 @@ namespace devices {
     }
 
     partition_device::~partition_device() {
+        mm::page_cache::invalidate(mm::page_cache::DEVICE_VOLUME, (uint64_t)this);
         if(_name) {
             free(_name);
         }
@@ -42,23 +45,53 @@ namespace devices {
         return buffer;
     }
 
-    int partition_device::read_block(uint64_t lba, uint32_t count, void* buffer) {
-        if(lba * _parent->_block_size + count > (_end_lba - _start_lba) * _parent->_block_size) {
+    bool partition_device::in_range(uint64_t lba, uint32_t count) const {
+        if(lba + count > block_count()) {
             log::debug(debug_level_partitions, debug::LEVEL_NORMAL, 
-                "[partition_device]: read_block: LBA %d out of parition range!", lba + count / _parent->_block_size);
-            return 2;
+                "[partition_device]: LBA %llu out of partition range!", lba + count);
+            return false;
+        }
+
+        return true;
+    }
+
+    int partition_device::read_block(uint64_t lba, uint32_t count, void* buffer) {
+        if(!in_range(lba, count)) {
+            return -EINVAL;
         }
 
         return _parent->read_disk_block(lba + _start_lba, count, buffer);
     }
 
     int partition_device::write_block(uint64_t lba, uint32_t count, void* buffer) {
-        if(lba * _parent->_block_size + count > (_end_lba - _start_lba) * _parent->_block_size) {
-            log::debug(debug_level_partitions, debug::LEVEL_NORMAL, 
-                "[partition_device]: read_block: LBA %d out of parition range!", lba + count / _parent->_block_size);
-            return 2;
+        if(!in_range(lba, count)) {
+            return -EINVAL;
         }
 
         return _parent->write_disk_block(lba + _start_lba, count, buffer);
     }
+
+    void partition_device::submit(storage::block_request* request) {
+        if(!in_range(request->lba, request->count)) {
+            request->done(request, -EINVAL);
+            return;
+        }
+
+        request->lba += _start_lba;
+        _parent->submit(request);
+    }
+
+    int partition_device::execute(storage::block_request* requests, unsigned count) {
+        for(unsigned i = 0; i < count; i++) {
+            if(!in_range(requests[i].lba, requests[i].count)) {
+                return -EINVAL;
+            }
+        }
+
+        for(unsigned i = 0; i < count; i++) {
+            requests[i].lba += _start_lba;
+        }
+
+        return _parent->queue().execute(requests, count);
+    }
 }
@@ -23,4 +23,8 @@ cp -L $BORRRDEX_SYSROOT/system/lib/libc.so* \
 nm Kernel/build/kernel.elf > Initrd/kernel.map
 
 cd Initrd/
-tar -cf ../initrd.tar *
\ No newline at end of file
+tar -cf ../initrd.tar *
+cd ..
+
+# Independent blocks (the default) so the kernel can unpack any of them on its own, 64K each
+lz4 -9 -f -B4 --content-size initrd.tar initrd.tar.lz4
\ No newline at end of file
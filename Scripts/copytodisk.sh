@@ -18,7 +18,7 @@ if [[ "$1" != "nomount" ]]; then
     sudo chmod -R 777 /mnt/borrrdex
 fi
 
-cp initrd.tar /mnt/borrrdex/borrrdex/initrd.tar
+cp initrd.tar.lz4 /mnt/borrrdex/borrrdex/initrd.tar.lz4
 cp Kernel/build/kernel.elf /mnt/borrrdex/borrrdex/kernel.elf
 cp -ru $HOME/.local/share/borrrdex/sysroot/system/* /mnt/borrrdex
 cp -ru Base/* /mnt/borrrdex